@@ -0,0 +1,56 @@
+#ifndef BSDF_H
+#define BSDF_H
+
+#include "material.h"
+#include "primitive.h"
+
+typedef enum {
+    BSDF_NONE,         // Emitters: nothing is scattered
+    BSDF_LAMBERTIAN,
+    BSDF_MIRROR,       // Smooth metal
+    BSDF_GGX,          // Rough metal
+    BSDF_DIELECTRIC
+} BsdfType;
+
+// Scattering at one hit point, with the material resolved once: blended
+// parameters are baked in and the type is the one active at this point.
+// All directions are unit vectors pointing away from the surface; wo is the
+// direction back along the incoming ray.
+typedef struct {
+    BsdfType type;
+    Vec3 albedo;
+    Vec3 normal;       // Shading normal, on the side the ray came from
+    float alpha;       // GGX roughness
+    float eta;         // Dielectric: incident over transmitted IOR
+} BSDF;
+
+// Resolve mat at the hit point
+BSDF material_bsdf(const Material* mat, const HitRecord* rec);
+
+// True for BSDFs made of delta lobes only, which eval and pdf cannot see
+static inline bool bsdf_is_delta(const BSDF* bsdf) {
+    return bsdf->type == BSDF_MIRROR || bsdf->type == BSDF_DIELECTRIC;
+}
+
+// BSDF value f(wo, wi), without the cosine; zero for delta lobes
+Vec3 bsdf_eval(const BSDF* bsdf, Vec3 wo, Vec3 wi);
+
+// Solid-angle pdf with which bsdf_sample draws wi; zero for delta lobes
+float bsdf_pdf(const BSDF* bsdf, Vec3 wo, Vec3 wi);
+
+// Draw wi from the 2D sample (u1, u2), with uc choosing between lobes, and
+// return the sample weight f cos / pdf (the attenuation) and the pdf, which
+// is zero for delta lobes. False if the sample is absorbed.
+bool bsdf_sample(const BSDF* bsdf, Vec3 wo, float uc, float u1, float u2,
+                 Vec3* wi, Vec3* weight, float* pdf);
+
+// GGX microfacet reflection about the unit normal n with roughness alpha.
+// ggx_eval returns the BRDF and ggx_pdf the solid-angle pdf with which
+// ggx_sample draws wi (visible normal sampling). ggx_sample also returns the
+// sample weight f cos / pdf and fails if wi lands below the surface.
+float ggx_eval(Vec3 n, Vec3 wo, Vec3 wi, float alpha);
+float ggx_pdf(Vec3 n, Vec3 wo, Vec3 wi, float alpha);
+bool ggx_sample(Vec3 n, Vec3 wo, float alpha, float u1, float u2,
+                Vec3* wi, float* weight, float* pdf);
+
+#endif // BSDF_H
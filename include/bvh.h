@@ -16,29 +16,55 @@ typedef struct BVHNode {
         struct {
             uint32_t first_prim_idx;
             uint32_t prim_count;
+            // Leaf contents are sorted by primitive type: spheres first,
+            // then triangles, then mesh triangles (the remainder), so
+            // kernels can walk each range without a switch
+            uint32_t sphere_count;
+            uint32_t triangle_count;
         };
     };
     bool is_leaf;
 } BVHNode;
 
 // BVH acceleration structure
-typedef struct {
+typedef struct BVH {
     BVHNode* root;
     Primitive* primitives;
     uint32_t prim_count;
     BVHNode* nodes;
     uint32_t node_count;
     uint32_t* indices;  // Primitive indices for reordering
+    uint32_t type_mask; // Bitmask of PrimitiveTypes present (1u << type)
+    const AABB* prim_bounds;  // Bounds per primitive, only set during construction
 } BVH;
 
+// Traversal kernel signature (see bvh_select_kernel). Mesh hits come back
+// partial; see hit_record_finalize.
+typedef bool (*BVHHitFn)(const BVH* bvh, const Ray* ray, float t_min, float t_max,
+                         HitRecord* rec);
+
 // BVH construction
 BVH* bvh_create(Primitive* primitives, uint32_t count);
+// BVH over bare boxes: primitives stays NULL, leaves are untyped and indices
+// gives the order their ranges refer to
+BVH* bvh_create_bounds(const AABB* bounds, uint32_t count);
 void bvh_destroy(BVH* bvh);
 
-// BVH traversal
+// BVH traversal (mixed primitive types)
 bool bvh_hit(const BVH* bvh, const Ray* ray, float t_min, float t_max,
              HitRecord* rec);
 
+// Specialized traversal for scenes made of a single primitive type
+bool bvh_hit_spheres(const BVH* bvh, const Ray* ray, float t_min, float t_max,
+                     HitRecord* rec);
+bool bvh_hit_triangles(const BVH* bvh, const Ray* ray, float t_min, float t_max,
+                       HitRecord* rec);
+bool bvh_hit_meshes(const BVH* bvh, const Ray* ray, float t_min, float t_max,
+                    HitRecord* rec);
+
+// Pick the cheapest traversal kernel for the primitive types in the BVH
+BVHHitFn bvh_select_kernel(const BVH* bvh);
+
 // Build BVH recursively
 BVHNode* bvh_build_recursive(BVH* bvh, uint32_t* prim_indices,
                             uint32_t start, uint32_t end, uint32_t* node_idx);
@@ -50,8 +50,10 @@ static inline Camera camera_create(
     return cam;
 }
 
-static inline Ray camera_get_ray(const Camera* cam, float s, float t, RNG* rng) {
-    Vec3 rd = vec3_scale(rng_in_unit_disk(rng), cam->lens_radius);
+// Ray through film position (s, t); (lens_u1, lens_u2) picks the point on the lens
+static inline Ray camera_get_ray(const Camera* cam, float s, float t,
+                                 float lens_u1, float lens_u2) {
+    Vec3 rd = vec3_scale(warp_concentric_disk(lens_u1, lens_u2), cam->lens_radius);
     Vec3 offset = vec3_add(vec3_scale(cam->u, rd.x), vec3_scale(cam->v, rd.y));
 
     Vec3 ray_origin = vec3_add(cam->origin, offset);
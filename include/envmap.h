@@ -0,0 +1,38 @@
+#ifndef ENVMAP_H
+#define ENVMAP_H
+
+#include "vec3.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// HDR environment map in lat-long layout: u = phi / 2pi around +y,
+// v = theta / pi from +y (row 0 is straight up). Directions are importance
+// sampled from a piecewise-constant 2D distribution over the pixels,
+// weighted by luminance and sin(theta).
+typedef struct {
+    Vec3* pixels;            // width * height linear radiance
+    uint32_t width;
+    uint32_t height;
+    float* marginal_cdf;     // height + 1 entries, over rows
+    float* conditional_cdf;  // height * (width + 1) entries, per row
+    float* func;             // Unnormalized pdf per pixel: luminance * sin(theta)
+    float func_integral;     // Mean of func (pdf over [0,1]^2 is func / func_integral)
+} EnvMap;
+
+// Build from linear RGB pixels (copied), rows top to bottom
+EnvMap* envmap_create(const Vec3* pixels, uint32_t width, uint32_t height);
+// Load a Radiance .hdr (RGBE) or .pfm file; NULL on failure
+EnvMap* envmap_load(const char* path);
+void envmap_destroy(EnvMap* env);
+
+// Radiance arriving from direction dir (need not be normalized)
+Vec3 envmap_lookup(const EnvMap* env, Vec3 dir);
+
+// Solid-angle pdf of envmap_sample returning direction dir
+float envmap_pdf(const EnvMap* env, Vec3 dir);
+
+// Map two uniform numbers to a direction; false if the map is black there
+bool envmap_sample(const EnvMap* env, float u1, float u2, Vec3* dir, Vec3* radiance,
+                   float* pdf);
+
+#endif // ENVMAP_H
@@ -17,8 +17,20 @@ typedef struct {
     GtkWidget* height_spin;
     GtkWidget* samples_spin;
     GtkWidget* depth_spin;
+    GtkWidget* budget_spin;
     GtkWidget* threads_spin;
+    GtkWidget* nee_check;
+    GtkWidget* guiding_check;
+    GtkWidget* cache_check;
+    GtkWidget* adaptive_check;
+    GtkWidget* denoise_check;
+    GtkWidget* raster_check;
+    GtkWidget* ooc_check;
+    GtkWidget* photons_spin;
     GtkWidget* scene_combo;
+    GtkWidget* sampler_combo;
+    GtkWidget* env_chooser;
+    GtkWidget* obj_chooser;
     GtkWidget* render_button;
     GtkWidget* save_button;
     GtkWidget* progress_bar;
@@ -34,8 +46,7 @@ typedef struct {
     Image* render_image;
     GdkPixbuf* display_pixbuf;
 
-    // Threading
-    pthread_t render_thread;
+    // Threading (renders run as jobs on the shared pool, see pool.h)
     pthread_mutex_t render_mutex;
     volatile bool is_rendering;
     volatile bool cancel_render;
@@ -57,8 +68,8 @@ void on_save_clicked(GtkButton* button, gpointer user_data);
 void on_scene_changed(GtkComboBox* combo, gpointer user_data);
 void on_window_destroy(GtkWidget* widget, gpointer user_data);
 
-// Rendering thread
-void* render_thread_func(void* user_data);
+// Rendering job
+void render_job(void* user_data);
 gboolean update_progress(gpointer user_data);
 void render_progress_callback(float progress);
 
@@ -0,0 +1,83 @@
+#ifndef GUIDING_H
+#define GUIDING_H
+
+#include "primitive.h"
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Online path guiding with a spatial-directional tree (SD-tree).
+// A binary tree over the scene bounds partitions space; each spatial leaf
+// holds a quadtree over directions that approximates the incident radiance
+// there. Directions map to the unit square by cylindrical coordinates
+// (cos theta, phi), which preserves area, so a quadtree cell's share of
+// energy is directly its share of solid angle pdf.
+//
+// Rendering runs in passes of 1, 2, 4, ... samples per pixel. Every pass
+// records into the "building" trees and samples from the "sampling" trees
+// learned in the previous pass; between passes guide_refine splits busy
+// spatial leaves and reshapes the quadtrees around the recorded energy.
+
+#define GUIDE_BSDF_FRACTION 0.5f        // Share of samples still drawn from the BSDF
+#define GUIDE_SPATIAL_THRESHOLD 4000    // Split a leaf after c * sqrt(2^pass) samples
+#define GUIDE_DTREE_SPLIT 0.01f         // Subdivide quadrants above this energy share
+#define GUIDE_DTREE_MAX_DEPTH 16
+#define GUIDE_STREE_MAX_DEPTH 24
+
+typedef struct {
+    _Atomic float sum[4];  // Energy recorded in each quadrant (whole subtree)
+    uint32_t child[4];   // Child node per quadrant, 0 = leaf quadrant
+} DTreeNode;
+
+// Directional quadtree, root is nodes[0]
+typedef struct {
+    DTreeNode* nodes;
+    uint32_t node_count;
+    uint32_t node_capacity;
+} DTree;
+
+typedef struct {
+    DTree sampling;          // Learned in the previous pass (read-only)
+    DTree building;          // Recorded into during the current pass
+    atomic_uint sample_count;  // Records in the current pass
+} GuideLeaf;
+
+typedef struct {
+    uint32_t axis;           // Split axis of an interior node
+    uint32_t child[2];
+    uint32_t leaf;           // Index into leaves, UINT32_MAX for interior nodes
+} STreeNode;
+
+typedef struct {
+    AABB bounds;             // Cube around the scene
+    STreeNode* nodes;
+    uint32_t node_count;
+    GuideLeaf* leaves;
+    uint32_t leaf_count;
+} Guide;
+
+Guide* guide_create(AABB scene_bounds);
+void guide_destroy(Guide* guide);
+
+// Spatial leaf containing point p
+GuideLeaf* guide_lookup(const Guide* guide, Vec3 p);
+
+// Record a radiance estimate (luminance / sampling pdf) arriving from dir at
+// a point inside leaf. Thread-safe.
+void guide_record(GuideLeaf* leaf, Vec3 dir, float value);
+
+// Learn from the pass just finished (pass counts from 0). Not thread-safe.
+void guide_refine(Guide* guide, uint32_t pass);
+
+// True if the tree learned anything to sample from
+static inline bool dtree_usable(const DTree* tree) {
+    const DTreeNode* root = &tree->nodes[0];
+    return root->sum[0] + root->sum[1] + root->sum[2] + root->sum[3] > 0.0f;
+}
+
+// Solid-angle pdf of dtree_sample producing dir
+float dtree_pdf(const DTree* tree, Vec3 dir);
+
+// Sample a direction from the learned distribution
+Vec3 dtree_sample(const DTree* tree, float u1, float u2, float* pdf);
+
+#endif // GUIDING_H
@@ -0,0 +1,89 @@
+#ifndef LIGHT_H
+#define LIGHT_H
+
+#include "primitive.h"
+#include "random.h"
+#include <stdint.h>
+
+// Emissive primitive registered for direct light sampling
+typedef struct {
+    const Primitive* prim;
+    float area;
+    uint32_t node;       // Leaf of the light tree holding this light
+} Light;
+
+// Light tree node. Every emitter is two-sided, so orientation is bounded by a
+// double cone: directions within theta_o of +axis or -axis. theta_e (the
+// spread of emission around a normal) is pi/2 for all our area emitters.
+typedef struct {
+    AABB bounds;
+    Vec3 axis;
+    float theta_o;
+    float cos_theta_o, sin_theta_o;
+    float power;         // Summed emitted power of the subtree
+    uint32_t parent;     // UINT32_MAX for the root
+    uint32_t right;      // Interior: right child (left child is this + 1)
+    uint32_t light;      // Leaf: index into lights, UINT32_MAX for interior
+} LightNode;
+
+// All emitters of a scene organized in a light BVH. Lights are picked by a
+// stochastic descent that chooses each child in proportion to its estimated
+// contribution to the shading point, so the cost is logarithmic in the
+// number of lights.
+typedef struct {
+    Light* lights;
+    uint32_t count;
+    LightNode* nodes;
+    uint32_t node_count;
+    const Primitive* primitives;  // Primitive array the lights were built from
+    uint32_t prim_count;
+    uint32_t* prim_light;         // Light index per primitive, UINT32_MAX if none
+} LightList;
+
+// Point sampled on an emitter
+typedef struct {
+    Vec3 point;
+    Vec3 normal;         // Outward surface normal at point
+    Vec3 emission;
+    float pdf_area;      // Selection probability times 1 / area
+    bool one_sided;      // Only visible from outside the normal (closed emitters)
+} LightSample;
+
+// Emitters the list can sample: compact meshes are never emissive
+// (scene_add_mesh stores emissive meshes as triangles)
+static inline bool primitive_is_light(const Primitive* prim) {
+    return prim->material.type == MATERIAL_EMISSIVE && prim->type != PRIMITIVE_MESH;
+}
+
+// Build the light list from the emissive primitives of a scene.
+// Primitives must not move afterwards (build after the BVH reorders them).
+LightList* light_list_build(const Primitive* primitives, uint32_t count);
+void light_list_destroy(LightList* lights);
+
+// Pick a light for shading point p with normal n (zero vector = no normal,
+// e.g. inside a medium) and a uniform point on it. u_select picks the light,
+// (u1, u2) the point.
+bool light_list_sample(const LightList* lights, Vec3 p, Vec3 n, float u_select,
+                       float u1, float u2, LightSample* sample);
+
+// Pick a light in proportion to its emitted power and a uniform point on it
+// (the whole surface, spheres included), for shooting light paths
+bool light_list_sample_emission(const LightList* lights, float u_select, float u1, float u2,
+                                LightSample* sample);
+
+// Area-measure pdf of light_list_sample_emission producing a point on prim.
+// Returns 0 if prim is NULL or not one of the lights.
+float light_list_emission_pdf_area(const LightList* lights, const Primitive* prim);
+
+// Area-measure pdf of light_list_sample(p, n) producing a point on prim.
+// Returns 0 if prim is NULL or not one of the lights.
+float light_list_pdf_area(const LightList* lights, const Primitive* prim, Vec3 p, Vec3 n);
+
+// Power heuristic (beta = 2) for multiple importance sampling
+static inline float mis_power_heuristic(float pdf_a, float pdf_b) {
+    float a2 = pdf_a * pdf_a;
+    float b2 = pdf_b * pdf_b;
+    return a2 + b2 > 0.0f ? a2 / (a2 + b2) : 0.0f;
+}
+
+#endif // LIGHT_H
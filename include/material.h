@@ -23,7 +23,7 @@ typedef enum {
 typedef struct {
     MaterialType type;
     Vec3 albedo;
-    float roughness;  // For metal
+    float roughness;  // For metal: GGX alpha = roughness^2, mirror below METAL_MIN_ROUGHNESS
     float ior;        // Index of refraction for dielectric
     Vec3 emission;    // For emissive materials
 
@@ -147,7 +147,16 @@ static inline float schlick(float cosine, float ref_idx) {
     return r0 + (1.0f - r0) * powf(1.0f - cosine, 5.0f);
 }
 
-// Material scattering
+// Metals rougher than this reflect through the GGX microfacet model
+#define METAL_MIN_ROUGHNESS 0.01f
+
+// GGX alpha of a metal, squared so that roughness is perceptually linear
+static inline float metal_alpha(float roughness) {
+    return roughness * roughness;
+}
+
+// Sample a scattered ray; false if the ray is absorbed. Integrators that
+// also evaluate the material resolve it once with material_bsdf (bsdf.h).
 bool material_scatter(const Material* mat, const Ray* ray_in,
                      const HitRecord* rec, Vec3* attenuation,
                      Ray* scattered, RNG* rng);
@@ -0,0 +1,79 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include "vec3.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// Quantized vertex position: 16-bit offsets inside the mesh bounding box
+typedef struct {
+    uint16_t x, y, z;
+} QuantizedPosition;
+
+struct BVHNode;
+
+// Compact triangle mesh for imported geometry.
+// Each vertex costs 6 bytes of position plus 4 bytes of octahedron-encoded
+// normal, and each face 12 bytes of indices plus its share of the mesh's own
+// BVH, instead of a full Primitive per face. The scene holds one Primitive
+// per mesh, so all faces share its material.
+typedef struct Mesh {
+    Vec3 origin;                   // Bounding box minimum
+    Vec3 scale;                    // Bounding box extent / 65535
+    QuantizedPosition* positions;
+    uint32_t* normals;             // Octahedral normals (NULL = flat shading)
+    uint32_t* indices;             // Three vertex indices per triangle, in BVH leaf order
+    uint32_t vertex_count;
+    uint32_t tri_count;
+    struct BVHNode* nodes;         // Face BVH; leaves are ranges of triangles
+    uint32_t node_count;
+} Mesh;
+
+// Mesh construction (quantizes the input, which can be freed afterwards, and
+// builds the face BVH, reordering the triangles). Returns NULL for an empty mesh.
+Mesh* mesh_create(const Vec3* positions, const Vec3* normals, uint32_t vertex_count,
+                  const uint32_t* indices, uint32_t tri_count);
+void mesh_destroy(Mesh* mesh);
+
+// Octahedral normal encoding (16 bits per component)
+static inline uint32_t oct_encode(Vec3 n) {
+    float inv = 1.0f / (fabsf(n.x) + fabsf(n.y) + fabsf(n.z));
+    float u = n.x * inv;
+    float v = n.y * inv;
+
+    // Fold the lower hemisphere over the diagonals
+    if (n.z < 0.0f) {
+        float fu = (1.0f - fabsf(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+        float fv = (1.0f - fabsf(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+        u = fu;
+        v = fv;
+    }
+
+    uint32_t qu = (uint32_t)(fminf(fmaxf(u * 0.5f + 0.5f, 0.0f), 1.0f) * 65535.0f + 0.5f);
+    uint32_t qv = (uint32_t)(fminf(fmaxf(v * 0.5f + 0.5f, 0.0f), 1.0f) * 65535.0f + 0.5f);
+    return qu | (qv << 16);
+}
+
+static inline Vec3 oct_decode(uint32_t encoded) {
+    float u = (encoded & 0xFFFF) * (2.0f / 65535.0f) - 1.0f;
+    float v = (encoded >> 16) * (2.0f / 65535.0f) - 1.0f;
+    Vec3 n = vec3_create(u, v, 1.0f - fabsf(u) - fabsf(v));
+
+    // Unfold the lower hemisphere
+    float t = fmaxf(-n.z, 0.0f);
+    n.x += n.x >= 0.0f ? -t : t;
+    n.y += n.y >= 0.0f ? -t : t;
+    return vec3_normalize(n);
+}
+
+// Decode a quantized vertex position
+static inline Vec3 mesh_position(const Mesh* mesh, uint32_t vertex) {
+    const QuantizedPosition* q = &mesh->positions[vertex];
+    return vec3_create(
+        mesh->origin.x + q->x * mesh->scale.x,
+        mesh->origin.y + q->y * mesh->scale.y,
+        mesh->origin.z + q->z * mesh->scale.z
+    );
+}
+
+#endif // MESH_H
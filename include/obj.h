@@ -0,0 +1,23 @@
+#ifndef OBJ_H
+#define OBJ_H
+
+#include "vec3.h"
+#include <stdint.h>
+
+// Triangulated geometry of a Wavefront .obj file. Only positions (v),
+// normals (vn) and faces (f) are read; polygons are split into fans.
+// A vertex is a distinct (position, normal) pair of the file, so the arrays
+// can go to scene_add_mesh as they are.
+typedef struct {
+    Vec3* positions;
+    Vec3* normals;        // Per vertex, NULL if the file has none
+    uint32_t vertex_count;
+    uint32_t* indices;    // Three vertex indices per triangle
+    uint32_t tri_count;
+} ObjMesh;
+
+// Load an .obj file; NULL (with a message) on failure
+ObjMesh* obj_load(const char* path);
+void obj_destroy(ObjMesh* obj);
+
+#endif // OBJ_H
@@ -0,0 +1,127 @@
+#ifndef OOC_H
+#define OOC_H
+
+#include "bvh.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// Out-of-core geometry store.
+// Primitives are partitioned into spatially coherent chunks (Morton order),
+// each chunk gets its own bottom-level BVH, and both are written to a file.
+// A top-level BVH over the chunk bounds stays in memory; chunks are paged in
+// through a fixed-size LRU cache when traversal reaches them.
+
+// Per-chunk directory entry (always resident)
+typedef struct {
+    AABB bounds;
+    uint64_t file_offset;
+    uint32_t prim_count;
+    uint32_t node_count;
+    uint32_t type_mask;
+} OOCChunkInfo;
+
+// Set in a slot's pin_count while the thread that claimed it reads a chunk in
+#define OOC_SLOT_LOADING 0x80000000u
+
+// Cache slot holding one paged-in chunk. Resident chunks are pinned without
+// the store lock: a thread bumps pin_count and keeps the pin if the slot is
+// not loading and still holds its chunk. Only an unpinned slot is claimed
+// for loading (pin_count 0 -> OOC_SLOT_LOADING), under the store lock.
+typedef struct {
+    BVH bvh;                 // Bottom-level BVH (points into the slot buffers)
+    BVHHitFn hit_fn;
+    uint32_t* material_ids;  // Index into OOCStore.materials per primitive
+    atomic_int chunk_idx;    // -1 if the slot is empty
+    atomic_uint pin_count;   // Threads traversing this chunk, plus OOC_SLOT_LOADING
+    atomic_uint_least64_t last_used;
+} OOCCacheSlot;
+
+// Cache counters
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t read_errors;    // Chunks that could not be read; their geometry is missing
+} OOCStats;
+
+typedef struct {
+    FILE* file;
+    char* path;
+
+    OOCChunkInfo* chunks;
+    uint32_t chunk_count;
+    uint32_t max_chunk_prims;
+    uint32_t max_chunk_nodes;
+
+    // Top-level BVH over one proxy primitive per chunk
+    BVH* top;
+    Primitive* top_proxies;
+
+    // Deduplicated materials, resident so hit records stay valid after eviction
+    Material* materials;
+    uint32_t material_count;
+
+    // LRU chunk cache
+    OOCCacheSlot* slots;
+    uint32_t slot_count;
+    atomic_int* chunk_slot;  // Slot per chunk, -1 if not resident
+    atomic_uint_least64_t clock;  // Advances once per miss
+    atomic_uint_least64_t hits, misses, evictions, read_errors;
+
+    // Guards claiming and filling slots; never held during file reads
+    pthread_mutex_t lock;
+    pthread_cond_t changed;  // A slot finished loading or was unpinned
+    atomic_uint waiters;     // Threads looking for a slot under the lock
+} OOCStore;
+
+// Streams primitives into a new chunk file as they are added, so geometry
+// never has to be in memory as a whole. Up to OOC_WRITER_WINDOW chunks are
+// staged and sorted along a Morton curve over their own bounds before they
+// are written; primitives added close together (the faces of a mesh, say)
+// end up in tight chunks.
+#define OOC_WRITER_WINDOW 8
+
+typedef struct {
+    OOCStore* store;         // Opened for reading by ooc_writer_finish
+    uint32_t chunk_size;
+    uint32_t cache_chunks;
+    Primitive* staged;       // chunk_size * OOC_WRITER_WINDOW primitives
+    uint32_t staged_count;
+    Primitive* chunk_prims;  // One chunk, in leaf order while it is written
+    uint32_t chunk_capacity;
+    uint32_t material_capacity;
+    bool failed;             // A write failed; ooc_writer_finish returns NULL
+} OOCWriter;
+
+// Start a chunk file at path. chunk_size is the number of primitives per
+// chunk, cache_chunks the number of chunks the finished store keeps in
+// memory. Returns NULL on failure.
+OOCWriter* ooc_writer_create(const char* path, uint32_t chunk_size, uint32_t cache_chunks);
+void ooc_writer_add(OOCWriter* writer, const Primitive* prim);
+// Write what is staged and open the store; the writer is freed either way.
+// Returns NULL (with a message) if a write failed or nothing was added.
+OOCStore* ooc_writer_finish(OOCWriter* writer);
+// Discard an unfinished chunk file
+void ooc_writer_destroy(OOCWriter* writer);
+
+// Write primitives to a chunk file at path and open it for streaming.
+// Same as feeding them to an OOCWriter, but sorted along one Morton curve
+// over all of them first. Returns NULL on failure.
+OOCStore* ooc_store_create(const Primitive* primitives, uint32_t count, const char* path,
+                           uint32_t chunk_size, uint32_t cache_chunks);
+// Close the store and remove its chunk file
+void ooc_store_destroy(OOCStore* store);
+
+// Closest-hit traversal (thread-safe). If every cache slot is pinned the
+// calling thread waits for one. A chunk that cannot be read is reported on
+// stderr and counted in OOCStats.read_errors.
+bool ooc_store_hit(OOCStore* store, const Ray* ray, float t_min, float t_max,
+                   HitRecord* rec);
+
+// Read and reset the cache counters
+void ooc_store_get_stats(OOCStore* store, OOCStats* stats);
+void ooc_store_reset_stats(OOCStore* store);
+
+#endif // OOC_H
@@ -0,0 +1,40 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include "bvh.h"
+
+// Coherent ray packets for primary rays.
+// A packet holds the camera rays of a PACKET_TILE x PACKET_TILE pixel tile in
+// SoA form and traverses the BVH together: nodes are first culled against
+// the whole packet with interval arithmetic, then tested per lane with
+// vectorized slab tests. Subtrees reached by only a few lanes are finished
+// with single-ray traversal.
+
+#define PACKET_TILE 4
+#define PACKET_SIZE (PACKET_TILE * PACKET_TILE)
+
+// Subtrees hit by at most this many lanes fall back to single-ray traversal
+#define PACKET_FALLBACK_LANES 2
+
+typedef struct {
+    float ox[PACKET_SIZE], oy[PACKET_SIZE], oz[PACKET_SIZE];
+    float dx[PACKET_SIZE], dy[PACKET_SIZE], dz[PACKET_SIZE];
+    float inv_dx[PACKET_SIZE], inv_dy[PACKET_SIZE], inv_dz[PACKET_SIZE];
+    float t_max[PACKET_SIZE];        // Closest hit so far per lane
+    int active[PACKET_SIZE];         // Lanes outside the image are inactive
+
+    // Packet-wide bounds used for interval culling
+    float o_min[3], o_max[3];
+    float inv_min[3], inv_max[3];
+} RayPacket;
+
+// Fill a packet from individual rays. Returns false if the directions do not
+// share a sign on every axis; such packets should be traced ray by ray.
+bool packet_init(RayPacket* packet, const Ray rays[PACKET_SIZE],
+                 const bool active[PACKET_SIZE]);
+
+// Closest hit for every active lane. hit[lane] tells whether recs[lane] is valid.
+void packet_trace(const BVH* bvh, RayPacket* packet, float t_min,
+                  HitRecord recs[PACKET_SIZE], bool hit[PACKET_SIZE]);
+
+#endif // PACKET_H
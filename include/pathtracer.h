@@ -5,9 +5,17 @@
 #include "ray.h"
 #include "primitive.h"
 #include "material.h"
+#include "bsdf.h"
 #include "camera.h"
 #include "bvh.h"
+#include "ooc.h"
+#include "light.h"
+#include "envmap.h"
+#include "guiding.h"
+#include "radcache.h"
+#include "photon.h"
 #include "random.h"
+#include "sampler.h"
 #include <stdint.h>
 
 // Scene structure
@@ -15,10 +23,26 @@ typedef struct {
     Primitive* primitives;
     uint32_t prim_count;
     uint32_t prim_capacity;
+    Mesh** meshes;        // Quantized meshes owned by the scene
+    uint32_t mesh_count;
     BVH* bvh;
+    BVHHitFn bvh_hit_fn;  // Traversal kernel chosen by scene_build_bvh
+    OOCStore* ooc;        // Out-of-core geometry; primitives/bvh keep only the emitters
+    OOCWriter* ooc_writer;  // Chunk file being streamed, see scene_begin_out_of_core
+    LightList* lights;    // Emissive primitives, built by scene_build_bvh
+    EnvMap* environment;  // HDR background; ambient_light is used if NULL
+    PhotonMap* caustics;  // Caustic photons for trace_path, see scene_build_caustics
     Vec3 ambient_light;
 } Scene;
 
+// Integrator used by render_parallel
+typedef enum {
+    INTEGRATOR_PATH,       // Depth-first path tracing, one sample at a time
+    INTEGRATOR_WAVEFRONT,  // Batched path tracing, one stage at a time
+    INTEGRATOR_RESTIR,     // Direct lighting with reservoir resampling (preview)
+    INTEGRATOR_BDPT        // Bidirectional path tracing
+} IntegratorType;
+
 // Render settings
 typedef struct {
     uint32_t width;
@@ -26,16 +50,54 @@ typedef struct {
     uint32_t samples_per_pixel;
     uint32_t max_depth;
     bool use_bvh;
-    bool use_nee;  // Next event estimation
+    bool use_nee;  // Next event estimation: sample lights directly (MIS with BSDF)
+    bool use_packets;  // Trace camera rays in coherent packets (see packet.h)
+    // Rasterize camera-ray visibility of triangles instead of casting (raster.h);
+    // pinhole cameras only, other cameras fall back to ray casting
+    bool use_raster;
+    bool use_guiding;  // Learn incident light online and guide diffuse bounces (guiding.h)
+    // Radiance cache (radcache.h): > 0 ends paths at the first diffuse hit
+    // after this many diffuse bounces with cached radiance (biased preview)
+    uint32_t radiance_cache;
+    // Threads a render runs on, the calling thread included; they come from
+    // the shared pool (pool.h), which also runs the BVH build and denoiser
     uint32_t num_threads;
+    // Edge of the square tiles the path tracer hands to threads, visited in
+    // Hilbert order (tiles.h); 0 = RENDER_TILE_SIZE
+    uint32_t tile_size;
+    IntegratorType integrator;
+    SamplerType sampler;  // Sample values of the path integrator (sampler.h)
+    // Picks the random numbers. Every sample draws them from a stream keyed
+    // by (seed, pixel, sample index), so the image is a pure function of the
+    // scene and these settings, whatever the thread count or schedule. Path
+    // guiding and time budgets are the exceptions: what the guide learns
+    // depends on the order threads record into it, and how many passes fit
+    // depends on the clock.
+    uint32_t seed;
+    // Adaptive sampling (adaptive.c): > 0 keeps refining pixels whose relative
+    // error is above this, in passes of samples_per_pixel samples
+    float adaptive_threshold;
+    uint32_t max_samples_per_pixel;  // Adaptive sampling cap
+    struct Image* sample_map;  // If not NULL, receives adaptive sample counts (1 = most)
+    // Progressive termination (adaptive.c, path integrator only): passes of
+    // samples_per_pixel run until time_budget seconds are spent or the mean
+    // pixel error drops to target_error, whichever comes first (0 = not used);
+    // max_samples_per_pixel still caps them if set
+    float time_budget;
+    float target_error;
+    bool denoise;  // Filter the finished image guided by first-hit features (denoise.c)
     volatile bool* cancel_flag;  // Pointer to cancel flag for early termination
 } RenderSettings;
 
 // Image buffer
-typedef struct {
+typedef struct Image {
     Vec3* pixels;
     uint32_t width;
     uint32_t height;
+    // First-hit features for denoising (render_features); NULL until written
+    Vec3* albedo;
+    Vec3* normal;
+    float* depth;  // Distance along the camera ray
 } Image;
 
 // Scene functions
@@ -43,18 +105,172 @@ Scene* scene_create(void);
 void scene_destroy(Scene* scene);
 void scene_add_sphere(Scene* scene, Vec3 center, float radius, Material mat);
 void scene_add_triangle(Scene* scene, Vec3 v0, Vec3 v1, Vec3 v2, Material mat);
+// Add an indexed triangle mesh. With compact = true it is stored quantized
+// with its own face BVH as a single primitive (see mesh.h); otherwise, and
+// always for emissive materials, every face becomes a plain triangle.
+// normals may be NULL for flat shading.
+void scene_add_mesh(Scene* scene, const Vec3* positions, const Vec3* normals,
+                    uint32_t vertex_count, const uint32_t* indices, uint32_t tri_count,
+                    Material mat, bool compact);
 void scene_build_bvh(Scene* scene);
+// Move all primitives into an out-of-core chunk file at path and render from
+// a bounded cache of cache_chunks chunks of chunk_size primitives each.
+// Emitters stay in memory (with their own BVH) so lights can still be
+// sampled. Builds everything scene_build_bvh would; returns false (and
+// leaves the scene unchanged) on failure.
+bool scene_build_out_of_core(Scene* scene, const char* path, uint32_t chunk_size,
+                             uint32_t cache_chunks);
+// Stream geometry to an out-of-core chunk file at path as it is added, so it
+// never has to fit in memory: the primitives added so far and every later
+// scene_add_* call go to an OOCWriter, and scene_build_bvh finishes the file
+// and renders from it. Emitters are kept in memory as with
+// scene_build_out_of_core. Returns false (scene unchanged) on failure.
+bool scene_begin_out_of_core(Scene* scene, const char* path, uint32_t chunk_size,
+                             uint32_t cache_chunks);
+// Light the scene with a lat-long HDR environment map (.hdr or .pfm) instead
+// of the constant ambient_light. Returns false (scene unchanged) on failure.
+bool scene_load_environment(Scene* scene, const char* path);
+// Add the triangles of a Wavefront .obj file through scene_add_mesh, scaled
+// so the longest side is size and standing centered on base. Returns false
+// (scene unchanged) on failure.
+bool scene_load_obj(Scene* scene, const char* path, Vec3 base, float size, Material mat,
+                    bool compact);
+// Shoot photon_count photons from the emitters through specular chains and
+// keep the ones landing on diffuse surfaces (photon.c). trace_path then takes
+// caustics from their density instead of from light hit after specular
+// bounces. Needs the light list, so call it after scene_build_bvh.
+// radius <= 0 picks the gather radius automatically.
+bool scene_build_caustics(Scene* scene, uint32_t photon_count, float radius);
 
 // Image functions
 Image* image_create(uint32_t width, uint32_t height);
 void image_destroy(Image* img);
 void image_save_bmp(const Image* img, const char* filename);
 
+// Closest-hit query against the scene (BVH, out-of-core store or brute force)
+bool scene_hit(const Scene* scene, const Ray* ray, float t_min, float t_max,
+               HitRecord* rec);
+
+// Radiance arriving from direction dir when a ray leaves the scene
+static inline Vec3 scene_background(const Scene* scene, Vec3 dir) {
+    return scene->environment ? envmap_lookup(scene->environment, dir) : scene->ambient_light;
+}
+
+// True if next event estimation has something to sample
+static inline bool scene_has_direct_lights(const Scene* scene) {
+    return (scene->lights && scene->lights->count > 0) || scene->environment;
+}
+
+// Sample values one path bounce consumes, all in [0, 1)
+#define PATH_BOUNCE_DIMENSIONS 8
+typedef struct {
+    float light_select;
+    float light[2];
+    float env[2];
+    float lobe;
+    float bsdf[2];
+} BounceSamples;
+
+// Next event estimation at a hit with a non-delta BSDF, seen from wo: one
+// emitter sample and one environment sample, each with a shadow ray and
+// MIS-weighted against sampling the BSDF.
+// The result still has to be multiplied by the path throughput.
+Vec3 sample_direct_light(const Scene* scene, const HitRecord* rec, const BSDF* bsdf, Vec3 wo,
+                         const BounceSamples* u);
+
+// MIS weight of an emitter found by a BSDF-sampled ray. bsdf_pdf is the
+// solid-angle pdf of the bounce that produced ray (0 = not light-sampled) and
+// prev_normal the shading normal where that bounce happened.
+float emitter_mis_weight(const Scene* scene, const Ray* ray, const HitRecord* rec,
+                         float bsdf_pdf, Vec3 prev_normal);
+
+// MIS weight of the environment seen by a BSDF-sampled ray (see above)
+float environment_mis_weight(const Scene* scene, const Ray* ray, float bsdf_pdf);
+
 // Path tracing functions
 Vec3 trace_ray(const Scene* scene, const Ray* ray, RNG* rng,
                uint32_t depth, uint32_t max_depth);
+// Jittered camera ray through pixel (i, j) of a width x height image, from
+// the first four dimensions of the current sample
+Ray primary_ray(const Camera* camera, uint32_t width, uint32_t height,
+                uint32_t i, uint32_t j, Sampler* sampler);
+// Path tracer behind trace_ray. If primary is not NULL it is the already-known
+// closest hit of ray, reached through primary_ray with the current sample of
+// sampler. With a guide, diffuse bounces sample from it as well as
+// the BSDF and the radiance found along the path is recorded into it. With a
+// radiance cache, diffuse vertices record into it and paths deep enough end
+// in it. The number of bounces is returned through path_length if not NULL.
+Vec3 trace_path(const Scene* scene, const Ray* ray, const HitRecord* primary,
+                Sampler* sampler, uint32_t depth, uint32_t max_depth, bool use_nee,
+                Guide* guide, RadianceCache* cache, uint32_t* path_length);
 void render_parallel(const Scene* scene, const Camera* camera,
                     const RenderSettings* settings, Image* output);
+void render_wavefront(const Scene* scene, const Camera* camera,
+                      const RenderSettings* settings, Image* output);
+// One progressive pass per sample; direct light at diffuse camera hits comes
+// from per-pixel reservoirs reused across neighbours and passes (restir.c)
+void render_restir(const Scene* scene, const Camera* camera,
+                   const RenderSettings* settings, Image* output);
+// Camera and light subpaths joined at every vertex pair with MIS (bdpt.c)
+void render_bdpt(const Scene* scene, const Camera* camera,
+                 const RenderSettings* settings, Image* output);
+// Progressive path tracing that spends extra samples only where the pixel
+// error is above adaptive_threshold and stops at time_budget or target_error
+// (adaptive.c)
+void render_adaptive(const Scene* scene, const Camera* camera,
+                     const RenderSettings* settings, Image* output);
+// Path tracing in passes of doubling sample counts, each guided by what the
+// previous ones learned (guiding.c)
+void render_guided(const Scene* scene, const Camera* camera,
+                   const RenderSettings* settings, Image* output);
+// Path tracing with first hits from rasterized visibility buffers, one per
+// tile and sample (raster.c)
+void render_raster(const Scene* scene, const Camera* camera,
+                   const RenderSettings* settings, Image* output);
+// Path tracing in passes of doubling sample counts that end paths in a
+// radiance cache filled by the previous ones (radcache.c, biased preview)
+void render_cached(const Scene* scene, const Camera* camera,
+                   const RenderSettings* settings, Image* output);
+// Albedo, normal and depth of the first non-specular hit through every pixel
+// into the feature buffers of output, allocating them if needed (denoise.c)
+void render_features(const Scene* scene, const Camera* camera,
+                     const RenderSettings* settings, Image* output);
+// Edge-avoiding a-trous filter of image->pixels guided by its feature
+// buffers. Returns false (image unchanged) if they are missing.
+bool denoise_image(Image* image);
+
+// Russian roulette: after RUSSIAN_ROULETTE_DEPTH bounces a path survives with
+// probability proportional to its throughput; survivors are reweighted. u is
+// uniform in [0, 1). Returns false if the path was terminated.
+#define RUSSIAN_ROULETTE_DEPTH 3
+static inline bool path_russian_roulette(Vec3* throughput, float u) {
+    float survival_probability = fminf(
+        fmaxf(throughput->x, fmaxf(throughput->y, throughput->z)), 0.95f);
+    if (u >= survival_probability) {
+        return false;
+    }
+    *throughput = vec3_div(*throughput, survival_probability);
+    return true;
+}
+
+// What the last render_parallel call achieved. error is the mean relative
+// standard error of the pixels, -1 if the integrator does not estimate it.
+typedef struct {
+    float samples_per_pixel;   // Average over the image
+    float error;
+    uint32_t passes;
+    double seconds;
+} RenderStats;
+void render_get_stats(RenderStats* stats);
+// Called by progressive integrators once they know what they achieved
+void render_report_stats(float samples_per_pixel, float error, uint32_t passes);
+
+// Path length statistics: histogram[n] counts camera paths that ended after
+// n bounces during the last render_parallel call (last bin is open-ended)
+#define PATH_LENGTH_BINS 128
+void render_get_path_histogram(uint64_t histogram[PATH_LENGTH_BINS]);
+// Merge a thread-local histogram into the render totals (thread-safe)
+void render_merge_path_histogram(const uint64_t histogram[PATH_LENGTH_BINS]);
 
 // Utility functions
 Vec3 aces_tonemap(Vec3 color);
@@ -62,5 +278,8 @@ Vec3 aces_tonemap(Vec3 color);
 // Progress callback
 typedef void (*progress_callback_t)(float progress);
 void set_progress_callback(progress_callback_t callback);
+progress_callback_t get_progress_callback(void);
+// Call the progress callback, if any; calls from render threads are serialized
+void render_progress(float progress);
 
 #endif // PATHTRACER_H
\ No newline at end of file
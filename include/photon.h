@@ -0,0 +1,41 @@
+#ifndef PHOTON_H
+#define PHOTON_H
+
+#include "vec3.h"
+#include <stdint.h>
+
+// Caustic photon map. Photons are shot from the emitters, follow chains of
+// specular (dielectric/metal) bounces and are stored where they first land on
+// a diffuse surface. They live in a hashed uniform grid whose cells are twice
+// the gather radius wide, sorted by bucket, so a lookup visits at most eight
+// contiguous runs of photons.
+
+#define PHOTON_MAX_DEPTH 16       // Specular bounces before a photon is dropped
+#define PHOTON_GATHER_COUNT 40    // Photons per gather disc aimed for by the auto radius
+
+typedef struct {
+    Vec3 position;
+    Vec3 direction;      // Direction of travel when the photon landed
+    Vec3 power;          // Flux carried (already divided by the photons shot)
+} Photon;
+
+typedef struct {
+    Photon* photons;     // Sorted by bucket
+    uint32_t count;
+    uint32_t* bucket_start;  // table_size + 1 offsets into photons
+    uint32_t table_size;     // Power of two
+    float radius;        // Gather radius
+    float inv_cell_size;
+} PhotonMap;
+
+// Build the hashed grid over photons (the map takes ownership of the array).
+// radius <= 0 picks one from the photon count and spread.
+PhotonMap* photon_map_create(Photon* photons, uint32_t count, float radius);
+void photon_map_destroy(PhotonMap* map);
+
+// Density estimate of the flux arriving at p on the side of normal n:
+// sum of photon power within the gather radius over the disc area. Multiply
+// by the BRDF to get reflected radiance.
+Vec3 photon_map_estimate(const PhotonMap* map, Vec3 p, Vec3 n);
+
+#endif // PHOTON_H
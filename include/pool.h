@@ -0,0 +1,101 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// Persistent work-stealing thread pool. Its workers live as long as the
+// process and serve every parallel stage: BVH builds, the renderers,
+// denoising and tone mapping, and the GUI's render jobs themselves.
+//
+// Every worker owns one deque per priority. A worker pushes and pops the
+// tasks it submits at the back of its own deques (newest first, while they
+// are hot in its caches); idle workers steal from the front of the others'
+// (oldest first, usually the biggest pieces of work). Threads outside the
+// pool submit into a shared injection queue. Whoever looks for work takes the
+// most urgent priority found anywhere first. A thread waiting for a group of
+// tasks runs tasks itself until the group is done, so tasks may submit and
+// wait for more tasks without tying up a worker; it only takes tasks as
+// urgent as the group's, so the GUI thread waiting for a display update never
+// ends up running a whole render job.
+//
+// Parallel loops use pool_run, which runs a function on several threads at
+// once (the caller among them), like an OpenMP parallel region, and share out
+// their iterations through a PoolRange.
+
+typedef enum {
+    POOL_PRIORITY_HIGH,     // Latency-bound: display updates, BVH builds
+    POOL_PRIORITY_NORMAL,   // Rendering
+    POOL_PRIORITY_LOW,      // Whole render jobs, background work
+    POOL_PRIORITIES
+} PoolPriority;
+
+typedef void (*PoolTaskFn)(void* arg);
+
+// Tasks that can be waited for together
+typedef struct {
+    atomic_uint pending;
+    PoolPriority priority;  // Least urgent work a thread waiting for the group helps with
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} PoolGroup;
+
+typedef struct ThreadPool ThreadPool;
+
+// Pool of thread_count workers (0 = one per online CPU)
+ThreadPool* pool_create(uint32_t thread_count);
+// Finish the queued tasks and join the workers
+void pool_destroy(ThreadPool* pool);
+// Pool shared by the whole renderer, created on first use
+ThreadPool* pool_default(void);
+uint32_t pool_thread_count(const ThreadPool* pool);
+// Seconds on a monotonic clock, for timing stages (like omp_get_wtime)
+double pool_wtime(void);
+
+void pool_group_init(PoolGroup* group, PoolPriority priority);
+void pool_group_destroy(PoolGroup* group);
+
+// Queue fn(arg). group may be NULL for tasks nobody waits for.
+void pool_submit(ThreadPool* pool, PoolGroup* group, PoolPriority priority,
+                 PoolTaskFn fn, void* arg);
+// Run queued tasks until every task of group has finished
+void pool_wait(ThreadPool* pool, PoolGroup* group);
+
+// Run fn(arg, rank) on up to thread_count threads, the caller being rank 0,
+// and return when all of them have. Ranks are 0 .. count - 1.
+void pool_run(ThreadPool* pool, uint32_t thread_count, PoolPriority priority,
+              void (*fn)(void* arg, uint32_t rank), void* arg);
+
+// Loop iterations [0, count) handed out grain at a time to whoever asks
+// (the equivalent of OpenMP's schedule(dynamic, grain))
+typedef struct {
+    atomic_uint next;
+    uint32_t count;
+    uint32_t grain;
+} PoolRange;
+
+static inline void pool_range_init(PoolRange* range, uint32_t count, uint32_t grain) {
+    atomic_init(&range->next, 0);
+    range->count = count;
+    range->grain = grain > 0 ? grain : 1;
+}
+
+// Next chunk [*begin, *end); false once the loop is exhausted
+static inline bool pool_range_next(PoolRange* range, uint32_t* begin, uint32_t* end) {
+    uint32_t b = atomic_fetch_add_explicit(&range->next, range->grain, memory_order_relaxed);
+    if (b >= range->count) {
+        return false;
+    }
+    *begin = b;
+    *end = range->count - b < range->grain ? range->count : b + range->grain;
+    return true;
+}
+
+// fn(arg, begin, end) over chunks of [0, count) on up to thread_count threads
+void pool_parallel_for(ThreadPool* pool, uint32_t thread_count, PoolPriority priority,
+                       uint32_t count, uint32_t grain,
+                       void (*fn)(void* arg, uint32_t begin, uint32_t end), void* arg);
+
+#endif // POOL_H
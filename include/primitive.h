@@ -4,9 +4,12 @@
 #include "vec3.h"
 #include "ray.h"
 #include "material.h"
+#include "mesh.h"
 #include <stdbool.h>
 #include <float.h>
 
+struct Primitive;
+
 // Hit record stores intersection information
 typedef struct HitRecord {
     Vec3 point;
@@ -14,6 +17,15 @@ typedef struct HitRecord {
     float t;
     bool front_face;
     const Material* material;
+    // Primitive that was hit, for looking emitters up in the light list.
+    // NULL for out-of-core hits, whose primitive is not resident.
+    const struct Primitive* prim;
+    // Mesh hits: only t, the triangle and its barycentrics are written while
+    // traversal is still looking for a closer hit; point and normals follow
+    // in hit_record_finalize. NULL for every other primitive.
+    const Mesh* mesh;
+    uint32_t tri_idx;
+    float u, v;
 } HitRecord;
 
 // Axis-aligned bounding box
@@ -42,11 +54,12 @@ typedef struct {
 } Triangle;
 
 // Generic primitive
-typedef struct {
+typedef struct Primitive {
     PrimitiveType type;
     union {
         Sphere sphere;
         Triangle triangle;
+        const Mesh* mesh;   // Quantized mesh, traversed through its own BVH
     };
     Material material;
     AABB bounds;
@@ -166,6 +179,33 @@ static inline AABB triangle_bounds(const Triangle* t) {
 bool triangle_hit(const Triangle* triangle, const Ray* ray, float t_min, float t_max,
                   HitRecord* rec);
 
+// Mesh functions
+static inline AABB mesh_bounds(const Mesh* mesh) {
+    Vec3 epsilon = vec3_create(0.0001f, 0.0001f, 0.0001f);
+    return (AABB){
+        vec3_sub(mesh->origin, epsilon),
+        vec3_add(vec3_add(mesh->origin, vec3_scale(mesh->scale, 65535.0f)), epsilon)
+    };
+}
+
+// Closest triangle of a mesh through its face BVH (partial record, see HitRecord)
+bool mesh_hit(const Mesh* mesh, const Ray* ray, float t_min, float t_max, HitRecord* rec);
+// One triangle of a mesh (partial record)
+bool mesh_face_hit(const Mesh* mesh, uint32_t tri_idx, const Ray* ray, float t_min, float t_max,
+                   HitRecord* rec);
+// Point and normals of a mesh hit: positions are dequantized and vertex
+// normals decoded and interpolated, once for the hit that won
+void mesh_hit_finalize(HitRecord* rec, const Ray* ray);
+
+// Complete rec once the closest hit along ray is known. Every closest-hit
+// query (scene_hit, packet_trace, raster_primary_hit) calls this before
+// returning; BVH kernels and primitive_hit leave it to them.
+static inline void hit_record_finalize(HitRecord* rec, const Ray* ray) {
+    if (rec->mesh) {
+        mesh_hit_finalize(rec, ray);
+    }
+}
+
 // Primitive creation
 static inline Primitive primitive_sphere(Vec3 center, float radius, Material mat) {
     Primitive p;
@@ -185,6 +225,15 @@ static inline Primitive primitive_triangle(Vec3 v0, Vec3 v1, Vec3 v2, Material m
     return p;
 }
 
+static inline Primitive primitive_mesh(const Mesh* mesh, Material mat) {
+    Primitive p;
+    p.type = PRIMITIVE_MESH;
+    p.mesh = mesh;
+    p.material = mat;
+    p.bounds = mesh_bounds(mesh);
+    return p;
+}
+
 // Generic primitive hit test
 bool primitive_hit(const Primitive* prim, const Ray* ray, float t_min, float t_max,
                    HitRecord* rec);
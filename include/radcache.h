@@ -0,0 +1,69 @@
+#ifndef RADCACHE_H
+#define RADCACHE_H
+
+#include "vec3.h"
+#include "camera.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+// Radiance cache for diffuse interreflection (preview quality).
+// A hash table of cells keyed by quantized position and normal stores the
+// radiance leaving diffuse surfaces, divided by their albedo so textured
+// and differently colored surfaces can share a cell. Cells grow with the
+// distance from the camera, so one covers about the same number of pixels
+// wherever it is (Binder et al., "Massively Parallel Path Space Filtering",
+// 2019). Every diffuse vertex of every path records what it saw; paths that
+// reach a diffuse surface after RenderSettings.radiance_cache diffuse
+// bounces end there with the cell's mean instead of tracing on. The cache
+// blurs indirect light over a cell and lags behind by a pass, so images are
+// biased, but the bias is confined to indirect light.
+//
+// Rendering runs in passes of 1, 2, 4, ... samples per pixel. Queries read
+// the means frozen at the end of the previous pass; records add into fixed
+// point sums, which do not depend on the order threads add them in, so the
+// image does not depend on the thread count unless the table overflows.
+
+#define RADIANCE_CACHE_SIZE (1u << 18)      // Entries, a power of two
+#define RADIANCE_CACHE_PROBES 16            // Slots tried per key (linear probing)
+#define RADIANCE_CACHE_CELL_PIXELS 4.0f     // Cell width in pixels at its distance
+#define RADIANCE_CACHE_NORMAL_BINS 4        // Octahedral normal bins per axis
+#define RADIANCE_CACHE_MIN_SAMPLES 8        // Records before a cell answers queries
+#define RADIANCE_CACHE_MAX_VALUE 32.0f      // Records are clamped to this (fireflies)
+#define RADIANCE_CACHE_FIXED_POINT 65536.0f // Scale of the fixed point sums
+
+typedef struct {
+    atomic_uint_least64_t key;     // 0 = empty
+    atomic_uint_least64_t sum[3];  // Fixed point sums of all records so far
+    atomic_uint count;
+    uint32_t frozen_count;  // Records behind radiance
+    Vec3 radiance;          // Mean as of the last pass (read by queries)
+} RadianceCacheEntry;
+
+typedef struct {
+    RadianceCacheEntry* entries;
+    Vec3 origin;            // Camera position
+    float pixel_angle;      // Width of a pixel at unit distance
+    uint32_t diffuse_depth; // Diffuse bounces before paths end in the cache
+    atomic_uint dropped;    // Records lost to a full probe sequence
+} RadianceCache;
+
+// Empty cache for camera rendering an image width pixels wide, answering
+// paths after diffuse_depth diffuse bounces
+RadianceCache* radiance_cache_create(const Camera* camera, uint32_t width,
+                                     uint32_t diffuse_depth);
+void radiance_cache_destroy(RadianceCache* cache);
+
+// Record the radiance leaving p (normal n) divided by the albedo there.
+// Thread-safe.
+void radiance_cache_record(RadianceCache* cache, Vec3 p, Vec3 n, Vec3 value);
+
+// Cached radiance over albedo at p (normal n), jittered by u within a cell
+// to hide cell boundaries. Returns false if the cell has too few records.
+bool radiance_cache_lookup(const RadianceCache* cache, Vec3 p, Vec3 n,
+                           float u1, float u2, float u3, Vec3* value);
+
+// Publish the records of the pass just finished to lookups. Not thread-safe.
+void radiance_cache_update(RadianceCache* cache);
+
+#endif // RADCACHE_H
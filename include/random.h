@@ -22,6 +22,17 @@ static inline void rng_init(RNG* rng, uint64_t seed) {
     rng->inc = (seed << 1u) | 1u;
 }
 
+// Seed of the stream named by key (SplitMix64 finalizer). Nearby keys give
+// unrelated streams, so streams can be tied to pixels, samples and passes
+// rather than to threads, and a render does not depend on how its work was
+// shared out. The map is a bijection: distinct keys, distinct seeds.
+static inline uint64_t rng_stream_seed(uint64_t key) {
+    uint64_t z = key + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
 // Generate random uint32
 static inline uint32_t rng_uint32(RNG* rng) {
     uint64_t oldstate = rng->state;
@@ -41,34 +52,76 @@ static inline float rng_float_range(RNG* rng, float min, float max) {
     return min + (max - min) * rng_float(rng);
 }
 
-// Generate random vector in unit sphere
-static inline Vec3 rng_in_unit_sphere(RNG* rng) {
-    while (1) {
-        Vec3 p = vec3_create(
-            rng_float_range(rng, -1.0f, 1.0f),
-            rng_float_range(rng, -1.0f, 1.0f),
-            rng_float_range(rng, -1.0f, 1.0f)
-        );
-        if (vec3_length_squared(p) < 1.0f)
-            return p;
-    }
+// Closed-form warps of a 2D sample (u1, u2) in [0, 1)^2, so stratified and
+// low-discrepancy points keep their structure after mapping
+
+// Uniform direction on the unit sphere
+static inline Vec3 warp_uniform_sphere(float u1, float u2) {
+    float z = 1.0f - 2.0f * u1;
+    float r = sqrtf(fmaxf(0.0f, 1.0f - z * z));
+    float phi = 2.0f * (float)M_PI * u2;
+    return vec3_create(r * cosf(phi), r * sinf(phi), z);
+}
+
+// Concentric (Shirley-Chiu) map to the unit disk in the xy plane. The
+// octant choice is a select rather than a branch.
+static inline Vec3 warp_concentric_disk(float u1, float u2) {
+    float a = 2.0f * u1 - 1.0f;
+    float b = 2.0f * u2 - 1.0f;
+    bool major_a = fabsf(a) > fabsf(b);
+    float r = major_a ? a : b;
+    float ratio = (major_a ? b : a) / (r != 0.0f ? r : 1.0f);
+    float phi = major_a ? (float)M_PI / 4.0f * ratio
+                        : (float)M_PI / 2.0f - (float)M_PI / 4.0f * ratio;
+    return vec3_create(r * cosf(phi), r * sinf(phi), 0.0f);
+}
+
+// Cosine-weighted direction in the hemisphere around the unit normal n
+// (Malley's method: a disk point lifted onto the hemisphere). The pdf is
+// cos / pi.
+static inline Vec3 warp_cosine_hemisphere(Vec3 n, float u1, float u2) {
+    Vec3 d = warp_concentric_disk(u1, u2);
+    float z = sqrtf(fmaxf(0.0f, 1.0f - d.x * d.x - d.y * d.y));
+    Vec3 t, b;
+    vec3_onb(n, &t, &b);
+    return vec3_add(vec3_add(vec3_scale(t, d.x), vec3_scale(b, d.y)), vec3_scale(n, z));
 }
 
-// Generate random unit vector
-static inline Vec3 rng_unit_vector(RNG* rng) {
-    return vec3_normalize(rng_in_unit_sphere(rng));
+// Batch generator: RNG_BATCH_LANES xoshiro128+ streams stepped in lockstep.
+// The state is stored lane by lane in 32-bit words, so the step is a handful
+// of vector instructions and one call yields a float for every lane. Lanes
+// are seeded one by one, so each can belong to a different path.
+#define RNG_BATCH_LANES 8
+typedef struct {
+    uint32_t s0[RNG_BATCH_LANES];
+    uint32_t s1[RNG_BATCH_LANES];
+    uint32_t s2[RNG_BATCH_LANES];
+    uint32_t s3[RNG_BATCH_LANES];
+} RNGBatch;
+
+// Start lane on the stream named by key
+static inline void rng_batch_seed(RNGBatch* rng, uint32_t lane, uint64_t key) {
+    uint64_t lo = rng_stream_seed(key);
+    uint64_t hi = rng_stream_seed(lo);
+    rng->s0[lane] = (uint32_t)lo | ((lo | hi) == 0);  // The all-zero state is a fixed point
+    rng->s1[lane] = (uint32_t)(lo >> 32);
+    rng->s2[lane] = (uint32_t)hi;
+    rng->s3[lane] = (uint32_t)(hi >> 32);
 }
 
-// Generate random vector in unit disk (for DOF)
-static inline Vec3 rng_in_unit_disk(RNG* rng) {
-    while (1) {
-        Vec3 p = vec3_create(
-            rng_float_range(rng, -1.0f, 1.0f),
-            rng_float_range(rng, -1.0f, 1.0f),
-            0.0f
-        );
-        if (vec3_length_squared(p) < 1.0f)
-            return p;
+// Next float in [0, 1) of every lane
+static inline void rng_batch_floats(RNGBatch* rng, float out[RNG_BATCH_LANES]) {
+    for (uint32_t l = 0; l < RNG_BATCH_LANES; l++) {
+        uint32_t result = rng->s0[l] + rng->s3[l];
+        uint32_t t = rng->s1[l] << 9;
+        rng->s2[l] ^= rng->s0[l];
+        rng->s3[l] ^= rng->s1[l];
+        rng->s1[l] ^= rng->s2[l];
+        rng->s0[l] ^= rng->s3[l];
+        rng->s2[l] ^= t;
+        rng->s3[l] = (rng->s3[l] << 11) | (rng->s3[l] >> 21);
+        // The top bits; the lowest bits of xoshiro128+ are weak
+        out[l] = (result >> 8) * (1.0f / 16777216.0f);
     }
 }
 
@@ -0,0 +1,76 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include "pathtracer.h"
+
+// Rasterized primary visibility for pinhole cameras.
+// A pinhole camera ray leaves the camera origin along d(s, t), which is
+// linear in the film position (s, t). Each triangle is set up once as three
+// edge functions, the triple products of d with the triangle's edges as
+// seen from the origin. They are linear in (s, t) as well, and divided by
+// their sum they are the barycentrics of the point the ray hits (homogeneous
+// rasterization, Olano and Greer 1997). Coverage, barycentrics and depth of
+// any film position then take a few multiply-adds, with no clipping and no
+// BVH traversal, and agree with ray casting up to rounding. Triangles are
+// binned into RASTER_TILE x RASTER_TILE pixel tiles, and a tile is
+// rasterized at one film position per pixel (the jittered sample).
+
+#define RASTER_TILE 16
+#define RASTER_NO_HIT UINT32_MAX
+
+// Scenes with more primitives that are not triangles than this are not
+// rasterized; the rest are intersected per pixel against the rasterized depth
+#define RASTER_MAX_CAST_PRIMITIVES 16
+
+// Visibility buffer entry: the closest triangle at one film position
+typedef struct {
+    uint32_t prim;    // Index into scene->primitives, RASTER_NO_HIT if none
+    uint32_t face;    // Triangle of a mesh primitive
+    float b1, b2;     // Barycentric weights of the second and third vertex
+    float depth;      // Distance from the camera along the ray
+} RasterSample;
+
+typedef struct {
+    Vec3 e0, e1, e2;  // Edge functions as (constant, s, t) coefficients
+    float volume;     // Triple product of the vertices; depth scale
+    uint32_t prim;
+    uint32_t face;    // Triangle of a mesh primitive
+    uint32_t x0, y0, x1, y1;  // Pixels the triangle may cover, inclusive
+} RasterTriangle;
+
+typedef struct {
+    const Scene* scene;
+    Vec3 origin;
+    Vec3 film_base, film_s, film_t;  // d(s, t) = film_base + s * film_s + t * film_t
+    uint32_t width, height;
+    uint32_t tiles_x, tiles_y;
+    RasterTriangle* triangles;
+    uint32_t triangle_count;
+    uint32_t* bin_start;  // Triangles of tile k: bins[bin_start[k] .. bin_start[k + 1])
+    uint32_t* bins;
+    uint32_t* cast;       // Primitives intersected by ray instead
+    uint32_t cast_count;
+} Rasterizer;
+
+// True if primary visibility of scene through camera can be rasterized:
+// a pinhole camera, in-memory geometry, triangles and few other primitives
+bool raster_supported(const Scene* scene, const Camera* camera);
+
+// Set up and bin the triangles of scene for a width x height image. Returns
+// NULL (with a message) if the scene is not supported.
+Rasterizer* rasterizer_create(const Scene* scene, const Camera* camera,
+                              uint32_t width, uint32_t height);
+void rasterizer_destroy(Rasterizer* raster);
+
+// Visibility of tile at the film positions (film_s[k], film_t[k]) of its
+// pixels, k = row * RASTER_TILE + column, into vis
+void raster_tile(const Rasterizer* raster, uint32_t tile, const float* film_s,
+                 const float* film_t, RasterSample* vis);
+
+// Closest hit of the camera ray through a rasterized film position:
+// the rasterized triangle, intersected exactly, or a nearer cast primitive.
+// Returns false for a miss.
+bool raster_primary_hit(const Rasterizer* raster, const Ray* ray, const RasterSample* sample,
+                        HitRecord* rec);
+
+#endif // RASTER_H
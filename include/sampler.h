@@ -0,0 +1,92 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "random.h"
+#include <stdint.h>
+
+// Sample generators for the path integrators
+typedef enum {
+    SAMPLER_INDEPENDENT,  // Uncorrelated values
+    SAMPLER_STRATIFIED,   // Jittered strata, shuffled per pixel and dimension
+    SAMPLER_SOBOL         // Owen-scrambled Sobol (0,2)-sequence, padded per dimension
+} SamplerType;
+
+// Source of the sample values of one camera path. Values are indexed by
+// pixel, sample index within the pixel and dimension; the dimension advances
+// with every value taken, so an integrator that always draws in the same
+// order gets the same kind of value from the same dimension on every sample.
+// Every value is a pure function of (seed, pixel, sample, dimension):
+// stratified and Sobol values are hashed from it and spread each dimension
+// evenly over the samples of a pixel, independent ones are a counter-based
+// hash. rng, restarted by sampler_start on a stream of its own for the
+// sample, serves decisions that gain nothing from stratification (Russian
+// roulette and the like). Which thread takes which sample therefore never
+// changes the image.
+typedef struct {
+    SamplerType type;
+    uint32_t samples_per_pixel;  // Strata per dimension for SAMPLER_STRATIFIED
+    uint32_t seed;
+    uint64_t stream_base;        // Stream of seed, keyed by pixel and sample
+    uint32_t pixel;
+    uint32_t pixel_seed;         // Hash of seed and pixel
+    uint32_t sample_index;
+    uint64_t sample_key;         // Stream of this pixel and sample
+    uint32_t dimension;
+    RNG rng;
+} Sampler;
+
+// Set up a sampler for a render with the given seed
+void sampler_init(Sampler* sampler, SamplerType type, uint32_t samples_per_pixel,
+                  uint32_t seed);
+
+// Independent sampler keyed from rng, for callers that only have a stream
+static inline Sampler sampler_independent(RNG* rng) {
+    Sampler sampler = {0};
+    sampler.type = SAMPLER_INDEPENDENT;
+    sampler.samples_per_pixel = 1;
+    uint32_t hi = rng_uint32(rng);
+    uint32_t lo = rng_uint32(rng);
+    sampler.sample_key = (uint64_t)hi << 32 | lo;
+    rng_init(&sampler.rng, rng_stream_seed(~sampler.sample_key));
+    return sampler;
+}
+
+// Independent value at the current dimension
+static inline float sampler_independent_value(const Sampler* sampler, uint32_t offset) {
+    uint64_t z = rng_stream_seed(sampler->sample_key + sampler->dimension + offset);
+    return (uint32_t)(z >> 40) * (1.0f / 16777216.0f);
+}
+
+// Begin sample sample_index of pixel, at dimension 0
+void sampler_start(Sampler* sampler, uint32_t pixel, uint32_t sample_index);
+
+// Jump to dimension, so later values line up across samples that took
+// different branches
+static inline void sampler_set_dimension(Sampler* sampler, uint32_t dimension) {
+    sampler->dimension = dimension;
+}
+
+// Stratified and Sobol values at the current dimension (sampler.c)
+float sampler_hashed_1d(const Sampler* sampler);
+void sampler_hashed_2d(const Sampler* sampler, float* u1, float* u2);
+
+// Next value in [0, 1)
+static inline float sampler_1d(Sampler* sampler) {
+    float u = sampler->type == SAMPLER_INDEPENDENT ? sampler_independent_value(sampler, 0)
+                                                   : sampler_hashed_1d(sampler);
+    sampler->dimension++;
+    return u;
+}
+
+// Next 2D point in [0, 1)^2 (two dimensions)
+static inline void sampler_2d(Sampler* sampler, float* u1, float* u2) {
+    if (sampler->type == SAMPLER_INDEPENDENT) {
+        *u1 = sampler_independent_value(sampler, 0);
+        *u2 = sampler_independent_value(sampler, 1);
+    } else {
+        sampler_hashed_2d(sampler, u1, u2);
+    }
+    sampler->dimension += 2;
+}
+
+#endif // SAMPLER_H
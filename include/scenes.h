@@ -10,5 +10,7 @@ Scene* create_glass_spheres(void);  // Glass spheres with different materials
 Scene* create_metal_spheres(void);  // Metal spheres showcase with reflections
 Scene* create_studio_lighting(void);  // Studio lighting scene with glass and metal materials
 Scene* create_material_blend(void);  // Material blending showcase with gradient materials
+Scene* create_mesh_stage(void);  // Ground and area light only, for loaded meshes
+Scene* create_mesh_showcase(void);  // Compact smooth-shaded mesh on the mesh stage
 
 #endif // SCENES_H
\ No newline at end of file
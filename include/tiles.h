@@ -0,0 +1,32 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include <stdint.h>
+
+// Pixel visiting order for tiled rendering. The image is cut into square
+// tiles (partial at the right and bottom edges); tiles are visited along a
+// Hilbert curve, and so are the pixels inside each tile. Consecutive work
+// units and consecutive rays within one stay close together on screen, and
+// so in the BVH, which keeps the nodes and primitives a thread touches in
+// its caches. The curves are generated on a power-of-two grid covering the
+// tiles (or the tile) and cells outside the image are skipped, so any image
+// and tile size works.
+
+#define RENDER_TILE_SIZE 16  // Default tile edge in pixels
+
+typedef struct {
+    uint32_t* pixels;      // Pixel indices (j * width + i), tile by tile
+    uint32_t* tile_start;  // Pixels of tile k: pixels[tile_start[k] .. tile_start[k + 1])
+    uint32_t tile_count;
+} TileOrder;
+
+// Visiting order of a width x height image in tile_size x tile_size tiles
+// (0 = RENDER_TILE_SIZE). Returns NULL (with a message) if out of memory.
+TileOrder* tile_order_create(uint32_t width, uint32_t height, uint32_t tile_size);
+void tile_order_destroy(TileOrder* order);
+
+// Cell (x, y) at distance d along the Hilbert curve through an n x n grid,
+// n a power of two
+void hilbert_point(uint32_t n, uint32_t d, uint32_t* x, uint32_t* y);
+
+#endif // TILES_H
@@ -85,5 +85,16 @@ static inline Vec3 vec3_lerp(Vec3 a, Vec3 b, float t) {
     return vec3_add(vec3_scale(a, 1.0f - t), vec3_scale(b, t));
 }
 
+// Tangent t and bitangent b completing unit vector n to an orthonormal basis,
+// without branches (Duff et al., "Building an Orthonormal Basis, Revisited",
+// 2017)
+static inline void vec3_onb(Vec3 n, Vec3* t, Vec3* b) {
+    float sign = copysignf(1.0f, n.z);
+    float a = -1.0f / (sign + n.z);
+    float c = n.x * n.y * a;
+    *t = vec3_create(1.0f + sign * n.x * n.x * a, sign * c, -sign * n.x);
+    *b = vec3_create(c, sign + n.y * n.y * a, -n.y);
+}
+
 
 #endif // VEC3_H
\ No newline at end of file
@@ -0,0 +1,277 @@
+#include "pathtracer.h"
+#include "pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+
+// Adaptive sampling. A base pass gives every pixel samples_per_pixel samples;
+// each further pass gives the same number again, but only to pixels that are
+// still noisy. Every pixel keeps a Welford accumulator of its sample
+// luminance, from which the relative standard error of its mean follows. A
+// pixel stays active while the largest error in its 3x3 neighbourhood is
+// above adaptive_threshold and it has fewer than max_samples_per_pixel
+// samples; looking at the neighbours keeps a pixel that happened to miss a
+// rare bright path from stopping next to one that found it.
+//
+// The same passes serve progressive rendering: with a time budget or a target
+// error (the mean of the pixel errors) passes continue until one is met. A
+// pass that would not fit in the remaining time, judged by the previous one,
+// is not started, and every pixel is divided by its own sample count, so the
+// image is always complete and normalized.
+
+// Luminance below which errors are measured in absolute terms, so near-black
+// pixels are not refined forever
+#define ADAPTIVE_MIN_LUMINANCE 0.05f
+#define ADAPTIVE_SELECT_GRAIN 4096  // Pixels per task when selecting the next pass
+
+typedef struct {
+    Vec3 sum;
+    float mean;          // Running mean of sample luminance
+    float m2;            // Sum of squared deviations from the mean
+    uint32_t count;
+} AdaptivePixel;
+
+static inline float adaptive_luminance(Vec3 c) {
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+// Welford update with one sample
+static inline void adaptive_add(AdaptivePixel* px, Vec3 color) {
+    float x = adaptive_luminance(color);
+    px->count++;
+    px->sum = vec3_add(px->sum, color);
+    float delta = x - px->mean;
+    px->mean += delta / px->count;
+    px->m2 += delta * (x - px->mean);
+}
+
+// Standard error of the pixel mean relative to the mean
+static inline float adaptive_error(const AdaptivePixel* px) {
+    if (px->count < 2) {
+        return px->count == 0 ? 0.0f : 1.0f;
+    }
+    float variance = px->m2 / (px->count - 1);
+    float std_error = sqrtf(variance / px->count);
+    return std_error / fmaxf(px->mean, ADAPTIVE_MIN_LUMINANCE);
+}
+
+typedef struct {
+    const AdaptivePixel* pixels;
+    float* errors;
+    uint8_t* active;
+    uint32_t width, height;
+    float threshold;
+    uint32_t max_spp;
+    atomic_uint active_count;
+} AdaptiveSelect;
+
+static void adaptive_errors(void* arg, uint32_t begin, uint32_t end) {
+    AdaptiveSelect* sel = (AdaptiveSelect*)arg;
+    for (uint32_t p = begin; p < end; p++) {
+        sel->errors[p] = adaptive_error(&sel->pixels[p]);
+    }
+}
+
+static void adaptive_mark(void* arg, uint32_t begin, uint32_t end) {
+    AdaptiveSelect* sel = (AdaptiveSelect*)arg;
+    int32_t width = (int32_t)sel->width;
+    int32_t height = (int32_t)sel->height;
+    uint32_t active_count = 0;
+
+    for (uint32_t p = begin; p < end; p++) {
+        int32_t i = (int32_t)p % width;
+        int32_t j = (int32_t)p / width;
+        float error = 0.0f;
+        for (int32_t dj = -1; dj <= 1; dj++) {
+            for (int32_t di = -1; di <= 1; di++) {
+                int32_t x = i + di;
+                int32_t y = j + dj;
+                if (x >= 0 && y >= 0 && x < width && y < height) {
+                    error = fmaxf(error, sel->errors[y * width + x]);
+                }
+            }
+        }
+        sel->active[p] = error > sel->threshold && sel->pixels[p].count < sel->max_spp;
+        active_count += sel->active[p];
+    }
+
+    atomic_fetch_add(&sel->active_count, active_count);
+}
+
+// Mark the pixels that need another pass, on threads threads; returns how
+// many there are and the mean pixel error through mean_error
+static uint32_t adaptive_select(const AdaptivePixel* pixels, float* errors, uint8_t* active,
+                                uint32_t width, uint32_t height, float threshold,
+                                uint32_t max_spp, uint32_t threads, float* mean_error) {
+    uint32_t total_pixels = width * height;
+    AdaptiveSelect sel = { pixels, errors, active, width, height, threshold, max_spp, 0 };
+
+    pool_parallel_for(pool_default(), threads, POOL_PRIORITY_NORMAL, total_pixels,
+                      ADAPTIVE_SELECT_GRAIN, adaptive_errors, &sel);
+
+    // Summed in pixel order, so the stopping decision does not depend on the
+    // thread count
+    double error_sum = 0.0;
+    for (uint32_t p = 0; p < total_pixels; p++) {
+        error_sum += errors[p];
+    }
+    *mean_error = (float)(error_sum / total_pixels);
+
+    pool_parallel_for(pool_default(), threads, POOL_PRIORITY_NORMAL, total_pixels,
+                      ADAPTIVE_SELECT_GRAIN, adaptive_mark, &sel);
+    return atomic_load(&sel.active_count);
+}
+
+// One pass of render_adaptive over the active pixels
+typedef struct {
+    const Scene* scene;
+    const Camera* camera;
+    const RenderSettings* settings;
+    AdaptivePixel* pixels;
+    const uint8_t* active;
+    uint32_t width, height;
+    uint32_t base_spp, max_spp;
+    PoolRange pixel_range;
+} AdaptivePass;
+
+static void render_adaptive_thread(void* arg, uint32_t rank) {
+    (void)rank;
+    AdaptivePass* r = (AdaptivePass*)arg;
+    const Scene* scene = r->scene;
+    const Camera* camera = r->camera;
+    const RenderSettings* settings = r->settings;
+    AdaptivePixel* pixels = r->pixels;
+    const uint8_t* active = r->active;
+    uint32_t width = r->width;
+    uint32_t height = r->height;
+    uint32_t base_spp = r->base_spp;
+    uint32_t max_spp = r->max_spp;
+
+    Sampler sampler;
+    sampler_init(&sampler, settings->sampler, base_spp, settings->seed);
+    uint64_t path_histogram[PATH_LENGTH_BINS] = {0};
+
+    uint32_t begin, end;
+    while (pool_range_next(&r->pixel_range, &begin, &end)) {
+        for (uint32_t p = begin; p < end; p++) {
+            if (!active[p] || (settings->cancel_flag && *settings->cancel_flag)) {
+                continue;
+            }
+
+            uint32_t i = p % width;
+            uint32_t j = p / width;
+            uint32_t count = max_spp - pixels[p].count < base_spp ?
+                             max_spp - pixels[p].count : base_spp;
+
+            for (uint32_t s = 0; s < count; s++) {
+                // Sample indices continue across passes
+                sampler_start(&sampler, p, pixels[p].count);
+                Ray ray = primary_ray(camera, width, height, i, j, &sampler);
+
+                uint32_t path_length;
+                Vec3 color = trace_path(scene, &ray, NULL, &sampler, 0, settings->max_depth,
+                                        settings->use_nee, NULL, NULL, &path_length);
+                adaptive_add(&pixels[p], color);
+                path_histogram[path_length < PATH_LENGTH_BINS ? path_length
+                                                              : PATH_LENGTH_BINS - 1]++;
+            }
+        }
+    }
+
+    render_merge_path_histogram(path_histogram);
+}
+
+void render_adaptive(const Scene* scene, const Camera* camera,
+                     const RenderSettings* settings, Image* output) {
+    uint32_t width = output->width;
+    uint32_t height = output->height;
+    uint32_t total_pixels = width * height;
+    uint32_t base_spp = settings->samples_per_pixel > 0 ? settings->samples_per_pixel : 1;
+    uint32_t max_spp = settings->max_samples_per_pixel > base_spp ?
+                       settings->max_samples_per_pixel : base_spp;
+    bool timed = settings->time_budget > 0.0f;
+    if ((timed || settings->target_error > 0.0f) && settings->max_samples_per_pixel == 0) {
+        max_spp = UINT32_MAX;  // Only the clock or the error stops the render
+    }
+
+    AdaptivePixel* pixels = (AdaptivePixel*)calloc(total_pixels, sizeof(AdaptivePixel));
+    float* errors = (float*)malloc(total_pixels * sizeof(float));
+    uint8_t* active = (uint8_t*)malloc(total_pixels);
+    memset(active, 1, total_pixels);
+    progress_callback_t progress = get_progress_callback();
+    uint32_t passes = max_spp / base_spp + (max_spp % base_spp != 0);
+    uint32_t passes_done = 0;
+    float mean_error = 0.0f;
+    double start = pool_wtime();
+    double last_pass = 0.0;
+
+    for (uint32_t pass = 0; pass < passes; pass++) {
+        if (settings->cancel_flag && *settings->cancel_flag) {
+            break;
+        }
+        double pass_start = pool_wtime();
+        if (pass > 0 && timed && pass_start - start + last_pass > settings->time_budget) {
+            break;
+        }
+
+        AdaptivePass r = { scene, camera, settings, pixels, active, width, height,
+                           base_spp, max_spp, { 0 } };
+        pool_range_init(&r.pixel_range, total_pixels, 16);
+        pool_run(pool_default(), settings->num_threads, POOL_PRIORITY_NORMAL,
+                 render_adaptive_thread, &r);
+
+        passes_done++;
+        uint32_t active_count = adaptive_select(pixels, errors, active, width, height,
+                                                settings->adaptive_threshold, max_spp,
+                                                settings->num_threads, &mean_error);
+        double now = pool_wtime();
+        last_pass = now - pass_start;
+
+        if (progress) {
+            // Whichever limit is closest decides how far along the render is
+            float done = (float)(pass + 1) / passes;
+            if (timed) {
+                done = fmaxf(done, (float)((now - start) / settings->time_budget));
+            }
+            if (settings->target_error > 0.0f && mean_error > 0.0f) {
+                // Error falls with the square root of the sample count
+                float ratio = settings->target_error / mean_error;
+                done = fmaxf(done, ratio * ratio);
+            }
+            progress(fminf(done, 1.0f));
+        }
+        if (active_count == 0 ||
+            (settings->target_error > 0.0f && mean_error <= settings->target_error)) {
+            break;
+        }
+    }
+
+    uint64_t samples = 0;
+    for (uint32_t p = 0; p < total_pixels; p++) {
+        samples += pixels[p].count;
+    }
+    render_report_stats((float)samples / total_pixels, mean_error, passes_done);
+
+    for (uint32_t p = 0; p < total_pixels; p++) {
+        output->pixels[p] = pixels[p].count > 0 ?
+                            vec3_div(pixels[p].sum, (float)pixels[p].count) :
+                            vec3_create(0, 0, 0);
+    }
+
+    // Debug view: samples taken per pixel as a fraction of the largest count
+    Image* map = settings->sample_map;
+    if (map && map->width == width && map->height == height) {
+        uint32_t most = 1;
+        for (uint32_t p = 0; p < total_pixels; p++) {
+            most = pixels[p].count > most ? pixels[p].count : most;
+        }
+        for (uint32_t p = 0; p < total_pixels; p++) {
+            float f = (float)pixels[p].count / most;
+            map->pixels[p] = vec3_create(f, f, f);
+        }
+    }
+
+    free(active);
+    free(errors);
+    free(pixels);
+}
@@ -0,0 +1,622 @@
+#include "pathtracer.h"
+#include "pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+// Bidirectional path tracing. Every sample traces a camera subpath and a light
+// subpath (started from an emitter picked by power) and joins every pair of
+// their vertices: s light vertices with t camera vertices. t = 1 connects a
+// light vertex straight to the camera and splats into whatever pixel it lands
+// in; s = 1 samples a fresh point on an emitter (next event estimation);
+// s = 0 is the camera path hitting an emitter by itself. All strategies are
+// combined with power-heuristic MIS weights computed from the forward and
+// reverse area pdfs stored on the vertices.
+//
+// Vertices with a non-delta BSDF (diffuse and rough metal) can be connected;
+// mirrors and dielectrics are specular and only sampled. Light tracing (t = 1) needs a pinhole camera; with depth of field
+// that strategy is left out of the MIS weights. Radiance from the background
+// is only reachable by camera paths and is added unweighted.
+
+#define BDPT_MAX_VERTICES 32
+
+typedef enum {
+    BDPT_CAMERA,
+    BDPT_LIGHT,      // Light subpath origin on an emitter
+    BDPT_SURFACE
+} BdptVertexType;
+
+typedef struct {
+    Vec3 point;
+    Vec3 normal;         // Facing the side the path arrived from (emitting side for lights)
+    Vec3 beta;           // Subpath throughput up to this vertex
+    BSDF bsdf;           // Surfaces
+    Vec3 emission;       // Emitters (light origins and emitters hit by camera paths)
+    const Primitive* prim;   // Emitters
+    float pdf_fwd;       // Area pdf of being sampled by its own subpath
+    float pdf_rev;       // Area pdf of being sampled from the other end
+    BdptVertexType type;
+    bool delta;          // Specular bounce (or a camera that cannot be connected to)
+    bool emitter;
+    bool one_sided;      // Emitter radiates from the front only (spheres)
+} BdptVertex;
+
+// Film geometry for projecting points back onto the image (t = 1)
+typedef struct {
+    Vec3 origin;
+    Vec3 forward;        // -w
+    Vec3 lower_left_corner;
+    Vec3 horizontal;
+    Vec3 vertical;
+    float film_distance;
+    float film_area;     // Area covered by the pixel grid on the film plane
+    uint32_t width;
+    uint32_t height;
+    bool pinhole;
+} BdptCamera;
+
+static BdptCamera bdpt_camera_create(const Camera* camera, uint32_t width, uint32_t height) {
+    BdptCamera c;
+    c.origin = camera->origin;
+    c.forward = vec3_scale(camera->w, -1.0f);
+    c.lower_left_corner = camera->lower_left_corner;
+    c.horizontal = camera->horizontal;
+    c.vertical = camera->vertical;
+    c.film_distance = vec3_dot(vec3_sub(camera->lower_left_corner, camera->origin), c.forward);
+    // primary rays map pixel i to (i + jitter) / (width - 1), so the pixel
+    // grid spans width / (width - 1) of the horizontal extent
+    c.film_area = vec3_length(camera->horizontal) * width / (float)(width - 1) *
+                  vec3_length(camera->vertical) * height / (float)(height - 1);
+    c.width = width;
+    c.height = height;
+    c.pinhole = camera->lens_radius <= 0.0f;
+    return c;
+}
+
+// Pixel hit by the camera ray towards p; false if p is off the image
+static bool bdpt_camera_raster(const BdptCamera* c, Vec3 dir, uint32_t* pixel) {
+    float along = vec3_dot(dir, c->forward);
+    if (along <= 0.0f) {
+        return false;
+    }
+    Vec3 on_film = vec3_sub(vec3_add(c->origin, vec3_scale(dir, c->film_distance / along)),
+                            c->lower_left_corner);
+    float s = vec3_dot(on_film, c->horizontal) / vec3_length_squared(c->horizontal);
+    float t = vec3_dot(on_film, c->vertical) / vec3_length_squared(c->vertical);
+    float x = s * (c->width - 1);
+    float y = (1.0f - t) * (c->height - 1);
+    if (!(x >= 0.0f && x < (float)c->width && y >= 0.0f && y < (float)c->height)) {
+        return false;
+    }
+    *pixel = (uint32_t)y * c->width + (uint32_t)x;
+    return true;
+}
+
+// Solid-angle pdf of a camera ray in direction dir (uniform over the film)
+static float bdpt_camera_pdf_dir(const BdptCamera* c, Vec3 dir) {
+    uint32_t pixel;
+    if (!bdpt_camera_raster(c, dir, &pixel)) {
+        return 0.0f;
+    }
+    float cos_theta = vec3_dot(vec3_normalize(dir), c->forward);
+    float d = c->film_distance;
+    return d * d / (c->film_area * cos_theta * cos_theta * cos_theta);
+}
+
+// Solid-angle pdf at from towards to, converted to area measure at to
+static float bdpt_convert_density(float pdf, const BdptVertex* from, const BdptVertex* to) {
+    Vec3 d = vec3_sub(to->point, from->point);
+    float dist2 = vec3_length_squared(d);
+    if (dist2 <= 0.0f) {
+        return 0.0f;
+    }
+    if (to->type != BDPT_CAMERA) {
+        pdf *= fabsf(vec3_dot(to->normal, d)) / sqrtf(dist2);
+    }
+    return pdf / dist2;
+}
+
+// Radiance an emitter vertex sends towards point
+static Vec3 bdpt_emitted(const BdptVertex* v, Vec3 point) {
+    if (v->one_sided && vec3_dot(v->normal, vec3_sub(point, v->point)) <= 0.0f) {
+        return vec3_create(0, 0, 0);
+    }
+    return v->emission;
+}
+
+// Solid-angle pdf of an emitter emitting towards point: cosine-weighted
+// around the front (one-sided) or around a randomly chosen side
+static float bdpt_light_pdf_dir(const BdptVertex* v, Vec3 point) {
+    float cosine = vec3_dot(v->normal, vec3_normalize(vec3_sub(point, v->point)));
+    if (v->one_sided) {
+        return cosine > 0.0f ? cosine / (float)M_PI : 0.0f;
+    }
+    return fabsf(cosine) / (2.0f * (float)M_PI);
+}
+
+static inline Vec3 bdpt_dir(const BdptVertex* v, Vec3 to) {
+    return vec3_normalize(vec3_sub(to, v->point));
+}
+
+// BSDF at a surface vertex between the directions to a and b
+static Vec3 bdpt_f(const BdptVertex* v, Vec3 a, Vec3 b) {
+    return bsdf_eval(&v->bsdf, bdpt_dir(v, a), bdpt_dir(v, b));
+}
+
+// Area pdf at next of v sampling the direction towards next, having arrived
+// from prev (unused for the camera and light origins)
+static float bdpt_pdf(const BdptCamera* cam, const BdptVertex* prev, const BdptVertex* v,
+                      const BdptVertex* next) {
+    float pdf;
+    switch (v->type) {
+        case BDPT_CAMERA:
+            pdf = bdpt_camera_pdf_dir(cam, vec3_sub(next->point, v->point));
+            break;
+        case BDPT_LIGHT:
+            pdf = bdpt_light_pdf_dir(v, next->point);
+            break;
+        default: {
+            if (v->delta || v->emitter) {
+                return 0.0f;
+            }
+            pdf = bsdf_pdf(&v->bsdf, bdpt_dir(v, prev->point), bdpt_dir(v, next->point));
+            break;
+        }
+    }
+    return bdpt_convert_density(pdf, v, next);
+}
+
+static inline float bdpt_ratio(float num, float den) {
+    num = num != 0.0f ? num : 1.0f;
+    den = den != 0.0f ? den : 1.0f;
+    float r = num / den;
+    return r * r;
+}
+
+// Power-heuristic weight of strategy (s, t) relative to every other way of
+// sampling the same path. The connection changes the reverse pdfs of the
+// vertices next to it, so they are patched for the computation and restored.
+static float bdpt_mis_weight(const Scene* scene, const BdptCamera* cam,
+                             BdptVertex* light, uint32_t s, BdptVertex* camera, uint32_t t) {
+    if (s + t == 2) {
+        return 1.0f;
+    }
+
+    BdptVertex* qs = s > 0 ? &light[s - 1] : NULL;
+    BdptVertex* pt = &camera[t - 1];
+    BdptVertex* qs_minus = s > 1 ? &light[s - 2] : NULL;
+    BdptVertex* pt_minus = t > 1 ? &camera[t - 2] : NULL;
+
+    float pt_rev = pt->pdf_rev;
+    bool pt_delta = pt->delta;
+    float pt_minus_rev = pt_minus ? pt_minus->pdf_rev : 0.0f;
+    float qs_rev = qs ? qs->pdf_rev : 0.0f;
+    bool qs_delta = qs ? qs->delta : false;
+    float qs_minus_rev = qs_minus ? qs_minus->pdf_rev : 0.0f;
+
+    pt->delta = false;
+    if (s > 0) {
+        pt->pdf_rev = bdpt_pdf(cam, qs_minus, qs, pt);
+    } else {
+        // Emitters outside the light list cannot start a light path
+        pt->pdf_rev = scene->lights ? light_list_emission_pdf_area(scene->lights, pt->prim) : 0.0f;
+    }
+    if (pt_minus) {
+        if (s > 0) {
+            pt_minus->pdf_rev = bdpt_pdf(cam, qs, pt, pt_minus);
+        } else {
+            pt_minus->pdf_rev = bdpt_convert_density(bdpt_light_pdf_dir(pt, pt_minus->point),
+                                                     pt, pt_minus);
+        }
+    }
+    if (qs) {
+        qs->delta = false;
+        qs->pdf_rev = bdpt_pdf(cam, pt_minus, pt, qs);
+    }
+    if (qs_minus) {
+        qs_minus->pdf_rev = bdpt_pdf(cam, pt, qs, qs_minus);
+    }
+
+    float sum = 0.0f;
+    float r = 1.0f;
+    for (uint32_t i = t - 1; i > 0; i--) {
+        r *= bdpt_ratio(camera[i].pdf_rev, camera[i].pdf_fwd);
+        if (!camera[i].delta && !camera[i - 1].delta) {
+            sum += r;
+        }
+    }
+    r = 1.0f;
+    for (int32_t i = (int32_t)s - 1; i >= 0; i--) {
+        r *= bdpt_ratio(light[i].pdf_rev, light[i].pdf_fwd);
+        bool delta_before = i > 0 ? light[i - 1].delta : false;
+        if (!light[i].delta && !delta_before) {
+            sum += r;
+        }
+    }
+
+    pt->pdf_rev = pt_rev;
+    pt->delta = pt_delta;
+    if (pt_minus) pt_minus->pdf_rev = pt_minus_rev;
+    if (qs) {
+        qs->pdf_rev = qs_rev;
+        qs->delta = qs_delta;
+    }
+    if (qs_minus) qs_minus->pdf_rev = qs_minus_rev;
+
+    return 1.0f / (1.0f + sum);
+}
+
+// Shadow ray between two vertices. The end is trimmed by a fixed epsilon
+// rather than a fraction of the distance: emitters can sit just below other
+// surfaces (the Cornell Box light is 0.01 under the ceiling).
+static bool bdpt_visible(const Scene* scene, Vec3 a, Vec3 b) {
+    Vec3 d = vec3_sub(b, a);
+    float dist = vec3_length(d);
+    Ray shadow = ray_create(a, vec3_div(d, dist));
+    HitRecord occluder;
+    return !scene_hit(scene, &shadow, 0.001f, dist - 0.001f, &occluder);
+}
+
+// Extend path (whose first vertex is filled in) by following ray.
+// pdf_dir is the solid-angle pdf of ray at path[0]. Camera paths also collect
+// the background they escape to. Returns the vertex count.
+static uint32_t bdpt_random_walk(const Scene* scene, Ray ray, float pdf_dir, RNG* rng,
+                                 uint32_t max_vertices, bool from_camera,
+                                 BdptVertex* path, Vec3* escaped) {
+    uint32_t count = 1;
+    float pdf_fwd = pdf_dir;
+    Vec3 beta = path[0].beta;
+    Vec3 survival_scale = vec3_create(1, 1, 1);
+
+    while (count < max_vertices) {
+        HitRecord rec;
+        if (!scene_hit(scene, &ray, 0.001f, FLT_MAX, &rec)) {
+            if (from_camera) {
+                *escaped = vec3_mul(beta, scene_background(scene, ray.direction));
+            }
+            break;
+        }
+
+        // Light paths end on emitters (they reflect nothing)
+        bool emissive = rec.material->type == MATERIAL_EMISSIVE;
+        if (emissive && !from_camera) {
+            break;
+        }
+
+        BdptVertex* prev = &path[count - 1];
+        BdptVertex* v = &path[count++];
+        memset(v, 0, sizeof(BdptVertex));
+        v->type = BDPT_SURFACE;
+        v->point = rec.point;
+        v->normal = rec.normal;
+        v->beta = beta;
+        v->pdf_fwd = bdpt_convert_density(pdf_fwd, prev, v);
+
+        if (emissive) {
+            v->emitter = true;
+            v->emission = rec.material->emission;
+            v->prim = rec.prim;
+            v->one_sided = v->prim && v->prim->type == PRIMITIVE_SPHERE;
+            break;
+        }
+
+        Vec3 attenuation, wi;
+        Vec3 wo = vec3_scale(vec3_normalize(ray.direction), -1.0f);
+        v->bsdf = material_bsdf(rec.material, &rec);
+        v->delta = bsdf_is_delta(&v->bsdf);
+        float uc = rng_float(rng);
+        float u1 = rng_float(rng);
+        float u2 = rng_float(rng);
+        if (!bsdf_sample(&v->bsdf, wo, uc, u1, u2, &wi, &attenuation, &pdf_fwd)) {
+            break;
+        }
+        float pdf_rev = bsdf_pdf(&v->bsdf, wi, wo);
+
+        beta = vec3_mul(beta, attenuation);
+        prev->pdf_rev = bdpt_convert_density(pdf_rev, v, prev);
+        ray = ray_create(rec.point, wi);
+
+        // Russian roulette on the attenuation gathered so far
+        survival_scale = vec3_mul(survival_scale, attenuation);
+        if (count > RUSSIAN_ROULETTE_DEPTH) {
+            float q = fminf(fmaxf(survival_scale.x, fmaxf(survival_scale.y, survival_scale.z)),
+                            0.95f);
+            if (rng_float(rng) >= q) {
+                break;
+            }
+            beta = vec3_div(beta, q);
+            survival_scale = vec3_div(survival_scale, q);
+        }
+    }
+    return count;
+}
+
+static uint32_t bdpt_camera_subpath(const Scene* scene, const BdptCamera* cam, Ray ray,
+                                    RNG* rng, uint32_t max_vertices, BdptVertex* path,
+                                    Vec3* escaped) {
+    memset(&path[0], 0, sizeof(BdptVertex));
+    path[0].type = BDPT_CAMERA;
+    path[0].point = ray.origin;
+    path[0].normal = cam->forward;
+    path[0].beta = vec3_create(1, 1, 1);
+    path[0].delta = !cam->pinhole;
+    float pdf_dir = bdpt_camera_pdf_dir(cam, ray.direction);
+    return bdpt_random_walk(scene, ray, pdf_dir, rng, max_vertices, true, path, escaped);
+}
+
+static uint32_t bdpt_light_subpath(const Scene* scene, RNG* rng, uint32_t max_vertices,
+                                   BdptVertex* path) {
+    LightSample ls;
+    if (max_vertices == 0 || !light_list_sample_emission(scene->lights, rng_float(rng),
+                                                          rng_float(rng), rng_float(rng), &ls)) {
+        return 0;
+    }
+
+    // Cosine-weighted emission; two-sided emitters pick a side at random
+    Vec3 normal = ls.normal;
+    if (!ls.one_sided && rng_float(rng) < 0.5f) {
+        normal = vec3_scale(normal, -1.0f);
+    }
+    float u1 = rng_float(rng);
+    float u2 = rng_float(rng);
+    Vec3 dir = warp_cosine_hemisphere(normal, u1, u2);
+
+    BdptVertex* v = &path[0];
+    memset(v, 0, sizeof(BdptVertex));
+    v->type = BDPT_LIGHT;
+    v->point = ls.point;
+    v->normal = normal;
+    v->emission = ls.emission;
+    v->one_sided = ls.one_sided;
+    v->pdf_fwd = ls.pdf_area;
+
+    // Throughput after leaving the emitter: Le * cos / (pdf_area * pdf_dir)
+    float pdf_dir = bdpt_light_pdf_dir(v, vec3_add(ls.point, dir));
+    v->beta = vec3_scale(ls.emission, vec3_dot(normal, dir) / (ls.pdf_area * pdf_dir));
+
+    Ray ray = ray_create(ls.point, dir);
+    return bdpt_random_walk(scene, ray, pdf_dir, rng, max_vertices, false, path, NULL);
+}
+
+// Contribution of strategy (s, t), already MIS-weighted. t = 1 results go to
+// *pixel instead of the sample's own pixel.
+static Vec3 bdpt_connect(const Scene* scene, const BdptCamera* cam, BdptVertex* light,
+                         uint32_t s, BdptVertex* camera, uint32_t t, RNG* rng,
+                         uint32_t* pixel) {
+    Vec3 zero = vec3_create(0, 0, 0);
+    BdptVertex* pt = &camera[t - 1];
+    Vec3 L;
+
+    if (s == 0) {
+        // Camera path found an emitter on its own
+        if (!pt->emitter) return zero;
+        L = vec3_mul(pt->beta, bdpt_emitted(pt, camera[t - 2].point));
+    } else if (t == 1) {
+        // Light tracing: join a light vertex to the pinhole
+        BdptVertex* qs = &light[s - 1];
+        if (!cam->pinhole || qs->type != BDPT_SURFACE || qs->delta) return zero;
+        Vec3 to_camera = vec3_sub(cam->origin, qs->point);
+        if (!bdpt_camera_raster(cam, vec3_scale(to_camera, -1.0f), pixel)) return zero;
+
+        Vec3 f = bdpt_f(qs, light[s - 2].point, cam->origin);
+        if (f.x + f.y + f.z <= 0.0f) return zero;
+
+        float dist2 = vec3_length_squared(to_camera);
+        Vec3 dir = vec3_div(to_camera, sqrtf(dist2));
+        float cos_surface = fabsf(vec3_dot(qs->normal, dir));
+        float cos_film = -vec3_dot(dir, cam->forward);
+        float d = cam->film_distance;
+        // Camera importance for a film of film_area at film_distance
+        float importance = d * d / (cam->film_area * cos_film * cos_film * cos_film * dist2);
+        L = vec3_scale(vec3_mul(qs->beta, f), cos_surface * importance);
+        if (!bdpt_visible(scene, qs->point, cam->origin)) return zero;
+    } else if (s == 1) {
+        // Sample a fresh point on an emitter for the camera vertex
+        if (pt->type != BDPT_SURFACE || pt->delta || pt->emitter) return zero;
+        LightSample ls;
+        if (!light_list_sample_emission(scene->lights, rng_float(rng), rng_float(rng),
+                                        rng_float(rng), &ls)) return zero;
+
+        BdptVertex sampled;
+        memset(&sampled, 0, sizeof(sampled));
+        sampled.type = BDPT_LIGHT;
+        sampled.point = ls.point;
+        sampled.normal = ls.normal;
+        sampled.emission = ls.emission;
+        sampled.one_sided = ls.one_sided;
+        sampled.pdf_fwd = ls.pdf_area;
+        sampled.beta = vec3_div(ls.emission, ls.pdf_area);
+
+        Vec3 f = bdpt_f(pt, camera[t - 2].point, ls.point);
+        Vec3 Le = bdpt_emitted(&sampled, pt->point);
+        if (f.x + f.y + f.z <= 0.0f || Le.x + Le.y + Le.z <= 0.0f) return zero;
+
+        Vec3 d = vec3_sub(ls.point, pt->point);
+        float dist2 = vec3_length_squared(d);
+        float g = fabsf(vec3_dot(pt->normal, d)) * fabsf(vec3_dot(ls.normal, d)) /
+                  (dist2 * dist2);
+        L = vec3_scale(vec3_mul(vec3_mul(pt->beta, f), Le), g / ls.pdf_area);
+        if (!bdpt_visible(scene, pt->point, ls.point)) return zero;
+
+        // Weight as if the sampled point were the light subpath's origin
+        BdptVertex saved = light[0];
+        light[0] = sampled;
+        float w = bdpt_mis_weight(scene, cam, light, 1, camera, t);
+        light[0] = saved;
+        return vec3_scale(L, w);
+    } else {
+        // Join two surface vertices
+        BdptVertex* qs = &light[s - 1];
+        if (qs->type != BDPT_SURFACE || qs->delta || pt->type != BDPT_SURFACE ||
+            pt->delta || pt->emitter) {
+            return zero;
+        }
+        Vec3 fq = bdpt_f(qs, light[s - 2].point, pt->point);
+        Vec3 fp = bdpt_f(pt, camera[t - 2].point, qs->point);
+        if (fq.x + fq.y + fq.z <= 0.0f || fp.x + fp.y + fp.z <= 0.0f) return zero;
+
+        Vec3 d = vec3_sub(qs->point, pt->point);
+        float dist2 = vec3_length_squared(d);
+        float g = fabsf(vec3_dot(pt->normal, d)) * fabsf(vec3_dot(qs->normal, d)) /
+                  (dist2 * dist2);
+        L = vec3_scale(vec3_mul(vec3_mul(qs->beta, fq), vec3_mul(fp, pt->beta)), g);
+        if (!bdpt_visible(scene, pt->point, qs->point)) return zero;
+    }
+
+    if (L.x + L.y + L.z <= 0.0f) return zero;
+    return vec3_scale(L, bdpt_mis_weight(scene, cam, light, s, camera, t));
+}
+
+// Splats are summed in fixed point: integer addition does not depend on the
+// order threads land in a pixel, so the image stays reproducible. The step is
+// far below anything a display or tone map resolves.
+#define BDPT_SPLAT_SCALE 16777216.0  // 2^24
+
+static inline void bdpt_splat(atomic_int_least64_t* splat, float value) {
+    int64_t fixed = (int64_t)llrint(value * BDPT_SPLAT_SCALE);
+    atomic_fetch_add_explicit(splat, fixed, memory_order_relaxed);
+}
+
+typedef struct {
+    const Scene* scene;
+    const Camera* camera;
+    const RenderSettings* settings;
+    Image* output;
+    const BdptCamera* cam;
+    atomic_int_least64_t* splats;
+    uint64_t stream_base;
+    progress_callback_t progress;
+    uint32_t max_camera, max_light;
+    bool have_lights;
+    atomic_uint pixels_done;
+    PoolRange pixels;
+} BdptRender;
+
+static void render_bdpt_thread(void* arg, uint32_t rank) {
+    (void)rank;
+    BdptRender* r = (BdptRender*)arg;
+    const Scene* scene = r->scene;
+    const Camera* camera = r->camera;
+    const RenderSettings* settings = r->settings;
+    Image* output = r->output;
+    const BdptCamera* cam = r->cam;
+    atomic_int_least64_t* splats = r->splats;
+    progress_callback_t progress = r->progress;
+    uint32_t width = output->width;
+    uint32_t height = output->height;
+    uint32_t total_pixels = width * height;
+    uint32_t spp = settings->samples_per_pixel;
+    uint32_t max_camera = r->max_camera;
+    uint32_t max_light = r->max_light;
+    bool have_lights = r->have_lights;
+
+    BdptVertex camera_path[BDPT_MAX_VERTICES];
+    BdptVertex light_path[BDPT_MAX_VERTICES];
+    uint64_t path_histogram[PATH_LENGTH_BINS] = {0};
+
+    uint32_t begin, end;
+    while (pool_range_next(&r->pixels, &begin, &end)) {
+        for (uint32_t p = begin; p < end; p++) {
+            if (settings->cancel_flag && *settings->cancel_flag) {
+                continue;
+            }
+
+            // One stream per pixel, for all of its samples
+            RNG rng;
+            rng_init(&rng, rng_stream_seed(r->stream_base ^ p));
+            uint32_t i = p % width;
+            uint32_t j = p / width;
+            Vec3 color = vec3_create(0, 0, 0);
+
+            for (uint32_t sample = 0; sample < spp && settings->max_depth > 0; sample++) {
+                float u = (i + rng_float(&rng)) / (float)(width - 1);
+                float v = 1.0f - (j + rng_float(&rng)) / (float)(height - 1);
+                Ray ray = camera_get_ray(camera, u, v, rng_float(&rng), rng_float(&rng));
+
+                Vec3 escaped = vec3_create(0, 0, 0);
+                uint32_t t_count = bdpt_camera_subpath(scene, cam, ray, &rng, max_camera,
+                                                       camera_path, &escaped);
+                uint32_t s_count = have_lights ?
+                                   bdpt_light_subpath(scene, &rng, max_light, light_path) : 0;
+                color = vec3_add(color, escaped);
+
+                for (uint32_t t = 1; t <= t_count; t++) {
+                    for (uint32_t s = 0; s <= s_count; s++) {
+                        int32_t depth = (int32_t)(s + t) - 2;
+                        if ((s == 1 && t == 1) || depth < 0 || depth > (int32_t)settings->max_depth) {
+                            continue;
+                        }
+                        if (s == 1 && !have_lights) {
+                            continue;
+                        }
+
+                        uint32_t target = p;
+                        Vec3 L = bdpt_connect(scene, cam, light_path, s, camera_path, t,
+                                              &rng, &target);
+                        if (t == 1) {
+                            if (L.x + L.y + L.z > 0.0f) {
+                                bdpt_splat(&splats[3 * target], L.x);
+                                bdpt_splat(&splats[3 * target + 1], L.y);
+                                bdpt_splat(&splats[3 * target + 2], L.z);
+                            }
+                        } else {
+                            color = vec3_add(color, L);
+                        }
+                    }
+                }
+
+                uint32_t length = t_count - 1;
+                path_histogram[length < PATH_LENGTH_BINS ? length : PATH_LENGTH_BINS - 1]++;
+            }
+
+            output->pixels[p] = color;
+
+            if (progress) {
+                uint32_t current_done = atomic_fetch_add(&r->pixels_done, 1) + 1;
+                if (current_done % 1000 == 0) {
+                    render_progress((float)current_done / total_pixels);
+                }
+            }
+        }
+    }
+
+    render_merge_path_histogram(path_histogram);
+}
+
+void render_bdpt(const Scene* scene, const Camera* camera,
+                 const RenderSettings* settings, Image* output) {
+    uint32_t width = output->width;
+    uint32_t height = output->height;
+    uint32_t total_pixels = width * height;
+    uint32_t spp = settings->samples_per_pixel;
+    BdptCamera cam = bdpt_camera_create(camera, width, height);
+
+    // Longest subpaths for max_depth bounces: s + t - 2 <= max_depth
+    uint32_t max_camera = settings->max_depth + 2 < BDPT_MAX_VERTICES ?
+                          settings->max_depth + 2 : BDPT_MAX_VERTICES;
+    uint32_t max_light = settings->max_depth + 1 < BDPT_MAX_VERTICES ?
+                         settings->max_depth + 1 : BDPT_MAX_VERTICES;
+    bool have_lights = scene->lights && scene->lights->count > 0;
+
+    // Light tracing lands anywhere on the image
+    atomic_int_least64_t* splats = (atomic_int_least64_t*)calloc(3 * (size_t)total_pixels,
+                                                                 sizeof(atomic_int_least64_t));
+    uint64_t stream_base = rng_stream_seed(settings->seed);
+    progress_callback_t progress = get_progress_callback();
+
+    BdptRender r = { scene, camera, settings, output, &cam, splats, stream_base, progress,
+                     max_camera, max_light, have_lights, 0, { 0 } };
+    pool_range_init(&r.pixels, total_pixels, 16);
+    pool_run(pool_default(), settings->num_threads, POOL_PRIORITY_NORMAL,
+             render_bdpt_thread, &r);
+
+    // Camera strategies and splats are both sums over spp samples per pixel
+    for (uint32_t p = 0; p < total_pixels; p++) {
+        Vec3 splat = vec3_create((float)(splats[3 * p] / BDPT_SPLAT_SCALE),
+                                 (float)(splats[3 * p + 1] / BDPT_SPLAT_SCALE),
+                                 (float)(splats[3 * p + 2] / BDPT_SPLAT_SCALE));
+        output->pixels[p] = vec3_div(vec3_add(output->pixels[p], splat), (float)spp);
+    }
+    free(splats);
+}
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pathtracer.h"
+#include "scenes.h"
+#include "pool.h"
+
+// Tile size benchmark: renders each scene with the path tracer at several
+// tile sizes and prints the best of a few runs. The images are identical
+// whatever the tile size; only the order rays are traced in changes.
+
+#define BENCH_WIDTH 640
+#define BENCH_HEIGHT 360
+#define BENCH_SAMPLES 8
+#define BENCH_RUNS 3
+
+typedef struct {
+    const char* name;
+    Scene* (*create)(void);
+    Vec3 lookfrom, lookat;
+    float vfov, aperture, focus_dist;
+} BenchScene;
+
+int main(int argc, char** argv) {
+    const BenchScene scenes[] = {
+        { "Cornell Box", create_cornell_box, vec3_create(278, 278, -800),
+          vec3_create(278, 278, 0), 40.0f, 0.0f, 10.0f },
+        { "Random Spheres", create_random_spheres, vec3_create(13, 2, 3),
+          vec3_create(0, 0.5f, 0), 20.0f, 0.1f, 10.0f },
+    };
+    const uint32_t tile_sizes[] = { 4, 8, 16, 32, 64 };
+    uint32_t threads = argc > 1 ? (uint32_t)atoi(argv[1]) : pool_thread_count(pool_default()) + 1;
+
+    printf("Tile size benchmark: %ux%u, %u spp, %u threads, best of %u runs\n",
+           BENCH_WIDTH, BENCH_HEIGHT, BENCH_SAMPLES, threads, BENCH_RUNS);
+
+    for (size_t sc = 0; sc < sizeof(scenes) / sizeof(scenes[0]); sc++) {
+        Scene* scene = scenes[sc].create();
+        scene_build_bvh(scene);
+        Camera camera = camera_create(scenes[sc].lookfrom, scenes[sc].lookat,
+                                      vec3_create(0, 1, 0), scenes[sc].vfov,
+                                      (float)BENCH_WIDTH / BENCH_HEIGHT,
+                                      scenes[sc].aperture, scenes[sc].focus_dist);
+        Image* image = image_create(BENCH_WIDTH, BENCH_HEIGHT);
+
+        RenderSettings settings;
+        memset(&settings, 0, sizeof(settings));
+        settings.width = BENCH_WIDTH;
+        settings.height = BENCH_HEIGHT;
+        settings.samples_per_pixel = BENCH_SAMPLES;
+        settings.max_depth = 50;
+        settings.use_bvh = true;
+        settings.use_nee = true;
+        settings.num_threads = threads;
+
+        printf("\n%s\n", scenes[sc].name);
+        for (size_t t = 0; t < sizeof(tile_sizes) / sizeof(tile_sizes[0]); t++) {
+            settings.tile_size = tile_sizes[t];
+            double best = 1e30;
+            for (uint32_t run = 0; run < BENCH_RUNS; run++) {
+                double start = pool_wtime();
+                render_parallel(scene, &camera, &settings, image);
+                double seconds = pool_wtime() - start;
+                best = seconds < best ? seconds : best;
+            }
+            double paths = (double)BENCH_WIDTH * BENCH_HEIGHT * BENCH_SAMPLES;
+            printf("  tile %2ux%-2u  %8.1f ms  %6.2f Mpaths/s\n", tile_sizes[t], tile_sizes[t],
+                   best * 1000.0, paths / best * 1e-6);
+        }
+
+        image_destroy(image);
+        scene_destroy(scene);
+    }
+    return 0;
+}
@@ -0,0 +1,222 @@
+#include "bsdf.h"
+#include <math.h>
+
+// Blend factor in [0, 1] of a blended material at the hit point
+static float material_blend_factor(const Material* mat, const HitRecord* rec) {
+    float blend_factor = 0.0f;
+
+    switch (mat->blend_mode) {
+        case BLEND_VERTICAL:
+            blend_factor = rec->point.y;
+            break;
+        case BLEND_HORIZONTAL:
+            blend_factor = rec->point.x;
+            break;
+        case BLEND_RADIAL:
+            // Distance from the Y axis
+            blend_factor = sqrtf(rec->point.x * rec->point.x +
+                                 rec->point.z * rec->point.z);
+            break;
+    }
+
+    blend_factor = (blend_factor - mat->blend_min) / (mat->blend_max - mat->blend_min);
+    return fminf(fmaxf(blend_factor, 0.0f), 1.0f);
+}
+
+BSDF material_bsdf(const Material* mat, const HitRecord* rec) {
+    MaterialType type = mat->type;
+    Vec3 albedo = mat->albedo;
+    float roughness = mat->roughness;
+    float ior = mat->ior;
+
+    // Blends take the type of whichever side is nearer and lerp the rest
+    if (type == MATERIAL_BLEND) {
+        float blend_factor = material_blend_factor(mat, rec);
+        type = (blend_factor < 0.5f) ? mat->blend_type1 : mat->blend_type2;
+        albedo = vec3_lerp(mat->albedo, mat->albedo2, blend_factor);
+        roughness = mat->roughness + blend_factor * (mat->roughness2 - mat->roughness);
+        ior = mat->ior + blend_factor * (mat->ior2 - mat->ior);
+    }
+
+    BSDF bsdf = {
+        .type = BSDF_NONE,
+        .albedo = albedo,
+        .normal = rec->normal,
+        .alpha = 0.0f,
+        .eta = 1.0f
+    };
+    switch (type) {
+        case MATERIAL_LAMBERTIAN:
+            bsdf.type = BSDF_LAMBERTIAN;
+            break;
+        case MATERIAL_METAL:
+            if (roughness < METAL_MIN_ROUGHNESS) {
+                bsdf.type = BSDF_MIRROR;
+            } else {
+                bsdf.type = BSDF_GGX;
+                bsdf.alpha = metal_alpha(roughness);
+            }
+            break;
+        case MATERIAL_DIELECTRIC:
+            // Glass does not absorb
+            bsdf.type = BSDF_DIELECTRIC;
+            bsdf.albedo = vec3_create(1.0f, 1.0f, 1.0f);
+            bsdf.eta = rec->front_face ? (1.0f / ior) : ior;
+            break;
+        default:
+            break;
+    }
+    return bsdf;
+}
+
+// GGX normal distribution for a microfacet with cosine cos_m to the normal
+static inline float ggx_d(float cos_m, float alpha) {
+    float a2 = alpha * alpha;
+    float k = cos_m * cos_m * (a2 - 1.0f) + 1.0f;
+    return a2 / ((float)M_PI * k * k);
+}
+
+// Smith Lambda for a direction with cosine cos_w to the normal
+static inline float ggx_lambda(float cos_w, float alpha) {
+    float cos2 = cos_w * cos_w;
+    float tan2 = fmaxf(1.0f - cos2, 0.0f) / cos2;
+    return 0.5f * (sqrtf(1.0f + alpha * alpha * tan2) - 1.0f);
+}
+
+float ggx_eval(Vec3 n, Vec3 wo, Vec3 wi, float alpha) {
+    float cos_o = vec3_dot(n, wo);
+    float cos_i = vec3_dot(n, wi);
+    if (cos_o <= 0.0f || cos_i <= 0.0f) {
+        return 0.0f;
+    }
+    Vec3 m = vec3_normalize(vec3_add(wo, wi));
+    float g2 = 1.0f / (1.0f + ggx_lambda(cos_o, alpha) + ggx_lambda(cos_i, alpha));
+    return ggx_d(vec3_dot(n, m), alpha) * g2 / (4.0f * cos_o * cos_i);
+}
+
+float ggx_pdf(Vec3 n, Vec3 wo, Vec3 wi, float alpha) {
+    float cos_o = vec3_dot(n, wo);
+    if (cos_o <= 0.0f || vec3_dot(n, wi) <= 0.0f) {
+        return 0.0f;
+    }
+    // Visible normal density D_wo(m) = G1(wo) D(m) (wo.m) / cos_o, times the
+    // reflection Jacobian 1 / (4 wo.m)
+    Vec3 m = vec3_normalize(vec3_add(wo, wi));
+    float g1 = 1.0f / (1.0f + ggx_lambda(cos_o, alpha));
+    return g1 * ggx_d(vec3_dot(n, m), alpha) / (4.0f * cos_o);
+}
+
+bool ggx_sample(Vec3 n, Vec3 wo, float alpha, float u1, float u2,
+                Vec3* wi, float* weight, float* pdf) {
+    Vec3 t, b;
+    vec3_onb(n, &t, &b);
+    Vec3 o = vec3_create(vec3_dot(wo, t), vec3_dot(wo, b), vec3_dot(wo, n));
+    if (o.z <= 0.0f) {
+        return false;
+    }
+
+    // Heitz 2018: sample the projected disk of the hemisphere configuration
+    // obtained by stretching wo, then unstretch the normal
+    Vec3 vh = vec3_normalize(vec3_create(alpha * o.x, alpha * o.y, o.z));
+    float len2 = vh.x * vh.x + vh.y * vh.y;
+    Vec3 t1 = len2 > 0.0f ? vec3_scale(vec3_create(-vh.y, vh.x, 0.0f), 1.0f / sqrtf(len2))
+                          : vec3_create(1.0f, 0.0f, 0.0f);
+    Vec3 t2 = vec3_cross(vh, t1);
+    float r = sqrtf(u1);
+    float phi = 2.0f * (float)M_PI * u2;
+    float p1 = r * cosf(phi);
+    float p2 = r * sinf(phi);
+    float s = 0.5f * (1.0f + vh.z);
+    p2 = (1.0f - s) * sqrtf(1.0f - p1 * p1) + s * p2;
+    Vec3 nh = vec3_add(vec3_add(vec3_scale(t1, p1), vec3_scale(t2, p2)),
+                       vec3_scale(vh, sqrtf(fmaxf(0.0f, 1.0f - p1 * p1 - p2 * p2))));
+    Vec3 m = vec3_normalize(vec3_create(alpha * nh.x, alpha * nh.y, fmaxf(nh.z, 1e-6f)));
+
+    // Reflect wo about the microfacet normal, back in world space
+    Vec3 i = vec3_sub(vec3_scale(m, 2.0f * vec3_dot(o, m)), o);
+    if (i.z <= 0.0f) {
+        return false;
+    }
+    *wi = vec3_add(vec3_add(vec3_scale(t, i.x), vec3_scale(b, i.y)), vec3_scale(n, i.z));
+
+    // f cos / pdf reduces to G2 / G1(wo)
+    float lambda_o = ggx_lambda(o.z, alpha);
+    float lambda_i = ggx_lambda(i.z, alpha);
+    *weight = (1.0f + lambda_o) / (1.0f + lambda_o + lambda_i);
+    *pdf = ggx_d(m.z, alpha) / (4.0f * o.z * (1.0f + lambda_o));
+    return true;
+}
+
+Vec3 bsdf_eval(const BSDF* bsdf, Vec3 wo, Vec3 wi) {
+    switch (bsdf->type) {
+        case BSDF_LAMBERTIAN:
+            if (vec3_dot(bsdf->normal, wo) <= 0.0f || vec3_dot(bsdf->normal, wi) <= 0.0f) {
+                return vec3_create(0, 0, 0);
+            }
+            return vec3_scale(bsdf->albedo, 1.0f / (float)M_PI);
+        case BSDF_GGX:
+            return vec3_scale(bsdf->albedo, ggx_eval(bsdf->normal, wo, wi, bsdf->alpha));
+        default:
+            return vec3_create(0, 0, 0);
+    }
+}
+
+float bsdf_pdf(const BSDF* bsdf, Vec3 wo, Vec3 wi) {
+    switch (bsdf->type) {
+        case BSDF_LAMBERTIAN: {
+            float cosine = vec3_dot(bsdf->normal, wi);
+            return cosine > 0.0f ? cosine / (float)M_PI : 0.0f;
+        }
+        case BSDF_GGX:
+            return ggx_pdf(bsdf->normal, wo, wi, bsdf->alpha);
+        default:
+            return 0.0f;
+    }
+}
+
+bool bsdf_sample(const BSDF* bsdf, Vec3 wo, float uc, float u1, float u2,
+                 Vec3* wi, Vec3* weight, float* pdf) {
+    *pdf = 0.0f;
+    *weight = bsdf->albedo;
+
+    switch (bsdf->type) {
+        case BSDF_LAMBERTIAN: {
+            *wi = warp_cosine_hemisphere(bsdf->normal, u1, u2);
+            *pdf = fmaxf(vec3_dot(bsdf->normal, *wi), 0.0f) / (float)M_PI;
+            return true;
+        }
+
+        case BSDF_MIRROR:
+            *wi = vec3_reflect(vec3_scale(wo, -1.0f), bsdf->normal);
+            return true;
+
+        case BSDF_GGX: {
+            float w;
+            if (!ggx_sample(bsdf->normal, wo, bsdf->alpha, u1, u2, wi, &w, pdf)) {
+                return false;
+            }
+            *weight = vec3_scale(bsdf->albedo, w);
+            return true;
+        }
+
+        case BSDF_DIELECTRIC: {
+            Vec3 unit_direction = vec3_scale(wo, -1.0f);
+            float cos_theta = fminf(vec3_dot(wo, bsdf->normal), 1.0f);
+            float sin_theta = sqrtf(fmaxf(0.0f, 1.0f - cos_theta * cos_theta));
+
+            // Total internal reflection, otherwise reflect with the Schlick
+            // Fresnel probability
+            bool cannot_refract = bsdf->eta * sin_theta > 1.0f;
+            if (cannot_refract || schlick(cos_theta, bsdf->eta) > uc) {
+                *wi = vec3_reflect(unit_direction, bsdf->normal);
+            } else if (!vec3_refract(unit_direction, bsdf->normal, bsdf->eta, wi)) {
+                *wi = vec3_reflect(unit_direction, bsdf->normal);
+            }
+            *wi = vec3_normalize(*wi);
+            return true;
+        }
+
+        default:
+            return false;
+    }
+}
@@ -1,4 +1,5 @@
 #include "bvh.h"
+#include "pool.h"
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
@@ -6,17 +7,18 @@
 // Comparison function for qsort
 typedef struct {
     uint32_t axis;
-    const Primitive* primitives;
+    const AABB* bounds;
 } SortContext;
 
-static SortContext sort_ctx;
+// Per thread, as subtrees are built in parallel
+static _Thread_local SortContext sort_ctx;
 
 static int compare_primitives(const void* a, const void* b) {
     uint32_t idx_a = *(const uint32_t*)a;
     uint32_t idx_b = *(const uint32_t*)b;
 
-    Vec3 center_a = aabb_center(sort_ctx.primitives[idx_a].bounds);
-    Vec3 center_b = aabb_center(sort_ctx.primitives[idx_b].bounds);
+    Vec3 center_a = aabb_center(sort_ctx.bounds[idx_a]);
+    Vec3 center_b = aabb_center(sort_ctx.bounds[idx_b]);
 
     float val_a = ((float*)&center_a)[sort_ctx.axis];
     float val_b = ((float*)&center_b)[sort_ctx.axis];
@@ -36,7 +38,7 @@ SplitCandidate bvh_find_best_split(const BVH* bvh, uint32_t* prim_indices,
         // Compute bounds for this subset
         AABB bounds = aabb_empty();
         for (uint32_t i = start; i < end; i++) {
-            bounds = aabb_union(bounds, bvh->primitives[prim_indices[i]].bounds);
+            bounds = aabb_union(bounds, bvh->prim_bounds[prim_indices[i]]);
         }
 
         float axis_min = ((float*)&bounds.min)[axis];
@@ -55,17 +57,17 @@ SplitCandidate bvh_find_best_split(const BVH* bvh, uint32_t* prim_indices,
 
         // Fill bins
         for (uint32_t i = start; i < end; i++) {
-            Vec3 center = aabb_center(bvh->primitives[prim_indices[i]].bounds);
+            Vec3 center = aabb_center(bvh->prim_bounds[prim_indices[i]]);
             float pos = ((float*)&center)[axis];
             uint32_t bin_idx = (uint32_t)((pos - axis_min) / bin_width);
             if (bin_idx >= num_bins) bin_idx = num_bins - 1;
 
             bins[bin_idx].count++;
             if (bins[bin_idx].count == 1) {
-                bins[bin_idx].bounds = bvh->primitives[prim_indices[i]].bounds;
+                bins[bin_idx].bounds = bvh->prim_bounds[prim_indices[i]];
             } else {
                 bins[bin_idx].bounds = aabb_union(bins[bin_idx].bounds,
-                                                  bvh->primitives[prim_indices[i]].bounds);
+                                                  bvh->prim_bounds[prim_indices[i]]);
             }
         }
 
@@ -114,7 +116,7 @@ SplitCandidate bvh_find_best_split(const BVH* bvh, uint32_t* prim_indices,
                 // Partition primitives
                 uint32_t left_idx = start;
                 for (uint32_t i = start; i < end; i++) {
-                    Vec3 center = aabb_center(bvh->primitives[prim_indices[i]].bounds);
+                    Vec3 center = aabb_center(bvh->prim_bounds[prim_indices[i]]);
                     float pos = ((float*)&center)[axis];
                     if (pos < split_pos) {
                         uint32_t temp = prim_indices[left_idx];
@@ -132,26 +134,57 @@ SplitCandidate bvh_find_best_split(const BVH* bvh, uint32_t* prim_indices,
     return best;
 }
 
-// Build BVH recursively
-BVHNode* bvh_build_recursive(BVH* bvh, uint32_t* prim_indices,
-                            uint32_t start, uint32_t end, uint32_t* node_idx) {
-    // Allocate new node
-    BVHNode* node = &bvh->nodes[(*node_idx)++];
+// Turn node into a leaf and group its primitives by type
+// (spheres, then triangles, then mesh triangles)
+static void bvh_make_leaf(BVH* bvh, BVHNode* node, uint32_t* prim_indices,
+                          uint32_t start, uint32_t end) {
+    node->is_leaf = true;
+    node->first_prim_idx = start;
+    node->prim_count = end - start;
+    node->sphere_count = 0;
+    node->triangle_count = 0;
+    if (!bvh->primitives) {
+        return;  // Bare bounds (bvh_create_bounds) have no type
+    }
 
+    // In-place partition: move spheres to the front, then triangles after
+    // them; whatever is left over are mesh triangles
+    uint32_t front = start;
+    for (uint32_t pass = 0; pass < 2; pass++) {
+        PrimitiveType type = pass == 0 ? PRIMITIVE_SPHERE : PRIMITIVE_TRIANGLE;
+        uint32_t range_start = front;
+        for (uint32_t i = front; i < end; i++) {
+            if (bvh->primitives[prim_indices[i]].type == type) {
+                uint32_t temp = prim_indices[front];
+                prim_indices[front] = prim_indices[i];
+                prim_indices[i] = temp;
+                front++;
+            }
+        }
+        if (pass == 0) {
+            node->sphere_count = front - range_start;
+        } else {
+            node->triangle_count = front - range_start;
+        }
+    }
+}
+
+// Bound a node over prim_indices[start, end) and either make it a leaf
+// (returning 0) or choose where its primitives split into two children
+static uint32_t bvh_split_node(BVH* bvh, BVHNode* node, uint32_t* prim_indices,
+                               uint32_t start, uint32_t end) {
     // Compute bounding box for all primitives in this node
     node->bounds = aabb_empty();
     for (uint32_t i = start; i < end; i++) {
-        node->bounds = aabb_union(node->bounds, bvh->primitives[prim_indices[i]].bounds);
+        node->bounds = aabb_union(node->bounds, bvh->prim_bounds[prim_indices[i]]);
     }
 
     uint32_t prim_count = end - start;
 
     // Create leaf node if primitive count is small enough
     if (prim_count <= 2) {
-        node->is_leaf = true;
-        node->first_prim_idx = start;
-        node->prim_count = prim_count;
-        return node;
+        bvh_make_leaf(bvh, node, prim_indices, start, end);
+        return 0;
     }
 
     // Find best split using SAH
@@ -166,49 +199,152 @@ BVHNode* bvh_build_recursive(BVH* bvh, uint32_t* prim_indices,
         else if (extent.z > extent.x) longest_axis = 2;
         
         sort_ctx.axis = longest_axis;
-        sort_ctx.primitives = bvh->primitives;
+        sort_ctx.bounds = bvh->prim_bounds;
         qsort(&prim_indices[start], prim_count, sizeof(uint32_t), compare_primitives);
         
         split.split_pos = start + prim_count / 2;
         
         // If still invalid, create leaf
         if (split.split_pos <= start || split.split_pos >= end) {
-            node->is_leaf = true;
-            node->first_prim_idx = start;
-            node->prim_count = prim_count;
-            return node;
+            bvh_make_leaf(bvh, node, prim_indices, start, end);
+            return 0;
         }
     }
     
     // Create internal node
     node->is_leaf = false;
-    
+    return split.split_pos;
+}
+
+// Build BVH recursively
+BVHNode* bvh_build_recursive(BVH* bvh, uint32_t* prim_indices,
+                            uint32_t start, uint32_t end, uint32_t* node_idx) {
+    // Allocate new node
+    BVHNode* node = &bvh->nodes[(*node_idx)++];
+
+    uint32_t split_pos = bvh_split_node(bvh, node, prim_indices, start, end);
+    if (split_pos == 0) {
+        return node;
+    }
+
     // Recursively build left and right subtrees
-    node->left = bvh_build_recursive(bvh, prim_indices, start, split.split_pos, node_idx);
-    node->right = bvh_build_recursive(bvh, prim_indices, split.split_pos, end, node_idx);
+    node->left = bvh_build_recursive(bvh, prim_indices, start, split_pos, node_idx);
+    node->right = bvh_build_recursive(bvh, prim_indices, split_pos, end, node_idx);
 
     return node;
 }
 
-// Create BVH
-BVH* bvh_create(Primitive* primitives, uint32_t count) {
-    BVH* bvh = (BVH*)calloc(1, sizeof(BVH));
-    bvh->primitives = primitives;
-    bvh->prim_count = count;
+// Parallel build. A subtree over n primitives has at most 2n - 1 nodes, so
+// every subtree gets its slots up front: the left child of the node in slot k
+// goes to k + 1 and the right child to k + 1 + 2 * n_left - 1. Subtrees then
+// build independently (each only reorders its own range of indices), the big
+// ones as pool tasks, into a scratch array with gaps, which bvh_compact copies
+// out in depth-first order. The result is the tree bvh_build_recursive makes.
+#define BVH_PARALLEL_MIN_PRIMS 4096  // Smallest subtree built as a task of its own
+
+typedef struct {
+    BVH* bvh;
+    BVHNode* slots;
+    PoolGroup group;
+} BVHBuild;
+
+typedef struct {
+    BVHBuild* build;
+    uint32_t start, end;
+    uint32_t slot;
+} BVHBuildTask;
+
+static void bvh_build_subtree(BVHBuild* build, uint32_t start, uint32_t end, uint32_t slot);
+
+static void bvh_build_task(void* arg) {
+    BVHBuildTask task = *(BVHBuildTask*)arg;
+    free(arg);
+    bvh_build_subtree(task.build, task.start, task.end, task.slot);
+}
+
+static void bvh_build_subtree(BVHBuild* build, uint32_t start, uint32_t end, uint32_t slot) {
+    BVHNode* node = &build->slots[slot];
+    uint32_t split_pos = bvh_split_node(build->bvh, node, build->bvh->indices, start, end);
+    if (split_pos == 0) {
+        return;
+    }
+
+    uint32_t left_slot = slot + 1;
+    uint32_t right_slot = left_slot + 2 * (split_pos - start) - 1;
+    node->left = &build->slots[left_slot];
+    node->right = &build->slots[right_slot];
+
+    // Hand the left subtree to another thread if it is worth a task
+    if (split_pos - start >= BVH_PARALLEL_MIN_PRIMS) {
+        BVHBuildTask* task = (BVHBuildTask*)malloc(sizeof(BVHBuildTask));
+        task->build = build;
+        task->start = start;
+        task->end = split_pos;
+        task->slot = left_slot;
+        pool_submit(pool_default(), &build->group, POOL_PRIORITY_HIGH, bvh_build_task, task);
+    } else {
+        bvh_build_subtree(build, start, split_pos, left_slot);
+    }
+    bvh_build_subtree(build, split_pos, end, right_slot);
+}
+
+// Copy the subtree at src into bvh->nodes in depth-first order
+static BVHNode* bvh_compact(BVH* bvh, const BVHNode* src, uint32_t* node_idx) {
+    BVHNode* node = &bvh->nodes[(*node_idx)++];
+    *node = *src;
+    if (!src->is_leaf) {
+        node->left = bvh_compact(bvh, src->left, node_idx);
+        node->right = bvh_compact(bvh, src->right, node_idx);
+    }
+    return node;
+}
+
+// Build the tree over bvh->prim_bounds, in parallel on the shared pool when
+// it is big enough
+static void bvh_build(BVH* bvh) {
+    uint32_t count = bvh->prim_count;
 
     // Allocate nodes (worst case: 2N-1 nodes)
     bvh->nodes = (BVHNode*)calloc(2 * count - 1, sizeof(BVHNode));
     bvh->indices = (uint32_t*)malloc(count * sizeof(uint32_t));
-
-    // Initialize indices
     for (uint32_t i = 0; i < count; i++) {
         bvh->indices[i] = i;
     }
 
-    // Build tree
     uint32_t node_idx = 0;
-    bvh->root = bvh_build_recursive(bvh, bvh->indices, 0, count, &node_idx);
+    BVHBuild build;
+    build.slots = count >= 2 * BVH_PARALLEL_MIN_PRIMS ?
+                  (BVHNode*)calloc(2 * count - 1, sizeof(BVHNode)) : NULL;
+    if (build.slots) {
+        build.bvh = bvh;
+        pool_group_init(&build.group, POOL_PRIORITY_HIGH);
+        bvh_build_subtree(&build, 0, count, 0);
+        pool_wait(pool_default(), &build.group);
+        pool_group_destroy(&build.group);
+        bvh->root = bvh_compact(bvh, &build.slots[0], &node_idx);
+        free(build.slots);
+    } else {
+        bvh->root = bvh_build_recursive(bvh, bvh->indices, 0, count, &node_idx);
+    }
     bvh->node_count = node_idx;
+}
+
+// Create BVH
+BVH* bvh_create(Primitive* primitives, uint32_t count) {
+    BVH* bvh = (BVH*)calloc(1, sizeof(BVH));
+    bvh->primitives = primitives;
+    bvh->prim_count = count;
+
+    // Gather the bounds the build reads and record which primitive types are present
+    AABB* bounds = (AABB*)malloc(count * sizeof(AABB));
+    for (uint32_t i = 0; i < count; i++) {
+        bounds[i] = primitives[i].bounds;
+        bvh->type_mask |= 1u << primitives[i].type;
+    }
+    bvh->prim_bounds = bounds;
+    bvh_build(bvh);
+    bvh->prim_bounds = NULL;
+    free(bounds);
 
     // Reorder primitives according to indices
     Primitive* reordered = (Primitive*)malloc(count * sizeof(Primitive));
@@ -221,6 +357,15 @@ BVH* bvh_create(Primitive* primitives, uint32_t count) {
     return bvh;
 }
 
+BVH* bvh_create_bounds(const AABB* bounds, uint32_t count) {
+    BVH* bvh = (BVH*)calloc(1, sizeof(BVH));
+    bvh->prim_count = count;
+    bvh->prim_bounds = bounds;
+    bvh_build(bvh);
+    bvh->prim_bounds = NULL;
+    return bvh;
+}
+
 // Destroy BVH
 void bvh_destroy(BVH* bvh) {
     if (bvh) {
@@ -230,51 +375,94 @@ void bvh_destroy(BVH* bvh) {
     }
 }
 
-// BVH traversal (iterative for performance)
-bool bvh_hit(const BVH* bvh, const Ray* ray, float t_min, float t_max,
-             HitRecord* rec) {
-    // Stack for iterative traversal
-    BVHNode* stack[64];
-    int stack_ptr = 0;
+// Test one type range of a leaf; the primitive type is known at compile time,
+// so there is no per-primitive switch in the inner loop. shape names the
+// primitive's geometry as passed to hit_fn.
+#define BVH_TEST_RANGE(hit_fn, shape, first, count)                           \
+    for (uint32_t i = (first); i < (first) + (count); i++) {                  \
+        const Primitive* prim = &bvh->primitives[i];                          \
+        if (hit_fn(shape, ray, t_min, closest_so_far, rec)) {                 \
+            rec->material = &prim->material;                                  \
+            rec->prim = prim;                                                 \
+            hit_anything = true;                                              \
+            closest_so_far = rec->t;                                          \
+        }                                                                     \
+    }
 
-    bool hit_anything = false;
-    float closest_so_far = t_max;
+#define BVH_LEAF_SPHERES(node) \
+    BVH_TEST_RANGE(sphere_hit, &prim->sphere, (node)->first_prim_idx, (node)->sphere_count)
+
+#define BVH_LEAF_TRIANGLES(node) \
+    BVH_TEST_RANGE(triangle_hit, &prim->triangle, \
+                   (node)->first_prim_idx + (node)->sphere_count, (node)->triangle_count)
+
+#define BVH_LEAF_MESHES(node)                                                 \
+    BVH_TEST_RANGE(mesh_hit, prim->mesh,                                      \
+                   (node)->first_prim_idx + (node)->sphere_count + (node)->triangle_count, \
+                   (node)->prim_count - (node)->sphere_count - (node)->triangle_count)
+
+#define BVH_LEAF_MIXED(node) \
+    BVH_LEAF_SPHERES(node)   \
+    BVH_LEAF_TRIANGLES(node) \
+    BVH_LEAF_MESHES(node)
+
+// BVH traversal (iterative for performance), generated once per leaf kernel
+#define BVH_DEFINE_TRAVERSAL(name, LEAF_TEST)                                 \
+bool name(const BVH* bvh, const Ray* ray, float t_min, float t_max,           \
+          HitRecord* rec) {                                                   \
+    /* Stack for iterative traversal */                                       \
+    BVHNode* stack[64];                                                       \
+    int stack_ptr = 0;                                                        \
+                                                                              \
+    bool hit_anything = false;                                                \
+    float closest_so_far = t_max;                                             \
+                                                                              \
+    /* Start with root node */                                                \
+    if (bvh->root) {                                                          \
+        stack[stack_ptr++] = bvh->root;                                       \
+    }                                                                         \
+                                                                              \
+    /* Traverse the BVH tree */                                               \
+    while (stack_ptr > 0) {                                                   \
+        /* Pop node from stack */                                             \
+        BVHNode* node = stack[--stack_ptr];                                   \
+                                                                              \
+        /* Test AABB intersection */                                          \
+        if (!aabb_hit(&node->bounds, ray, t_min, closest_so_far)) {           \
+            continue;                                                         \
+        }                                                                     \
+                                                                              \
+        if (node->is_leaf) {                                                  \
+            LEAF_TEST(node)                                                   \
+        } else {                                                              \
+            /* Internal node - push children to stack */                      \
+            if (node->left) {                                                 \
+                stack[stack_ptr++] = node->left;                              \
+            }                                                                 \
+            if (node->right) {                                                \
+                stack[stack_ptr++] = node->right;                             \
+            }                                                                 \
+        }                                                                     \
+    }                                                                         \
+                                                                              \
+    return hit_anything;                                                      \
+}
 
-    // Start with root node
-    if (bvh->root) {
-        stack[stack_ptr++] = bvh->root;
-    }
+BVH_DEFINE_TRAVERSAL(bvh_hit, BVH_LEAF_MIXED)
+BVH_DEFINE_TRAVERSAL(bvh_hit_spheres, BVH_LEAF_SPHERES)
+BVH_DEFINE_TRAVERSAL(bvh_hit_triangles, BVH_LEAF_TRIANGLES)
+BVH_DEFINE_TRAVERSAL(bvh_hit_meshes, BVH_LEAF_MESHES)
 
-    // Traverse the BVH tree
-    while (stack_ptr > 0) {
-        // Pop node from stack
-        BVHNode* node = stack[--stack_ptr];
-        
-        // Test AABB intersection
-        if (!aabb_hit(&node->bounds, ray, t_min, closest_so_far)) {
-            continue;
-        }
-        
-        if (node->is_leaf) {
-            // Test all primitives in this leaf node
-            for (uint32_t i = 0; i < node->prim_count; i++) {
-                uint32_t prim_idx = node->first_prim_idx + i;
-                if (primitive_hit(&bvh->primitives[prim_idx], ray, t_min, closest_so_far, rec)) {
-                    hit_anything = true;
-                    closest_so_far = rec->t;
-                }
-            }
-        } else {
-            // Internal node - push children to stack
-            // Push in order to visit closer child first (if possible)
-            if (node->left) {
-                stack[stack_ptr++] = node->left;
-            }
-            if (node->right) {
-                stack[stack_ptr++] = node->right;
-            }
-        }
+// Pick the traversal kernel once per build
+BVHHitFn bvh_select_kernel(const BVH* bvh) {
+    if (bvh->type_mask == (1u << PRIMITIVE_SPHERE)) {
+        return bvh_hit_spheres;
     }
-
-    return hit_anything;
-}
\ No newline at end of file
+    if (bvh->type_mask == (1u << PRIMITIVE_TRIANGLE)) {
+        return bvh_hit_triangles;
+    }
+    if (bvh->type_mask == (1u << PRIMITIVE_MESH)) {
+        return bvh_hit_meshes;
+    }
+    return bvh_hit;
+}
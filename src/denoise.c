@@ -0,0 +1,326 @@
+#include "pathtracer.h"
+#include "bsdf.h"
+#include "pool.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <float.h>
+
+// Denoising. A feature pass traces camera rays only and records, per pixel,
+// the albedo, shading normal and distance of the first surface that is not a
+// perfect mirror or glass (so reflections and refractions keep their edges),
+// averaged over the pixel footprint like the image itself. The filter is the
+// edge-avoiding a-trous wavelet transform (Dammertz et al., "Edge-Avoiding
+// A-Trous Wavelet Transform for fast Global Illumination Filtering", 2010):
+// a 5x5 B3-spline kernel applied DENOISE_ITERATIONS times with its taps
+// spread 1, 2, 4, ... pixels apart, every tap weighted by how similar its
+// features are to the center and by how far its color is from the center's,
+// measured against the local noise level. It runs on the image divided by the
+// albedo, so texture and material edges come back sharp when the albedo is
+// multiplied in again.
+
+#define DENOISE_FEATURE_SAMPLES 16   // Camera rays per pixel for the features, at most
+#define DENOISE_SPECULAR_DEPTH 4     // Mirror and glass bounces followed for the features
+#define DENOISE_ITERATIONS 4
+#define DENOISE_ROWS 8               // Image rows per task of the filter steps
+#define DENOISE_MISS_DEPTH 1e10f     // Distance recorded for rays that leave the scene
+#define DENOISE_MIN_ALBEDO 0.01f
+
+// Edge-stopping parameters: tolerated color difference in standard
+// deviations of the local noise, albedo difference, normal exponent and
+// relative distance per pixel of tap spacing
+#define DENOISE_SIGMA_COLOR 2.0f
+#define DENOISE_SIGMA_ALBEDO 0.1f
+#define DENOISE_NORMAL_POWER 6       // Weight is dot(n_p, n_q)^(2^power)
+#define DENOISE_SIGMA_DEPTH 0.02f
+
+static const float denoise_kernel[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+static inline Vec3 vec3_clamp01(Vec3 v) {
+    return vec3_create(fminf(fmaxf(v.x, 0.0f), 1.0f), fminf(fmaxf(v.y, 0.0f), 1.0f),
+                       fminf(fmaxf(v.z, 0.0f), 1.0f));
+}
+
+// Features of one camera ray
+static void trace_features(const Scene* scene, Ray ray, Sampler* sampler,
+                           Vec3* albedo, Vec3* normal, float* depth) {
+    Vec3 throughput = vec3_create(1, 1, 1);
+    float distance = 0.0f;
+
+    for (uint32_t bounce = 0; bounce <= DENOISE_SPECULAR_DEPTH; bounce++) {
+        HitRecord rec;
+        if (!scene_hit(scene, &ray, 0.001f, FLT_MAX, &rec)) {
+            *albedo = vec3_mul(throughput, vec3_clamp01(scene_background(scene, ray.direction)));
+            *normal = vec3_create(0, 0, 0);
+            *depth = DENOISE_MISS_DEPTH;
+            return;
+        }
+        distance += rec.t * vec3_length(ray.direction);
+
+        BSDF bsdf = material_bsdf(rec.material, &rec);
+        Vec3 wo = vec3_scale(vec3_normalize(ray.direction), -1.0f);
+        Vec3 wi, weight;
+        float pdf;
+        float uc = sampler_1d(sampler);
+        float u1, u2;
+        sampler_2d(sampler, &u1, &u2);
+        if (!bsdf_is_delta(&bsdf) || bounce == DENOISE_SPECULAR_DEPTH ||
+            !bsdf_sample(&bsdf, wo, uc, u1, u2, &wi, &weight, &pdf)) {
+            Vec3 a = bsdf.type == BSDF_NONE ? vec3_clamp01(rec.material->emission) : bsdf.albedo;
+            *albedo = vec3_mul(throughput, a);
+            *normal = rec.normal;
+            *depth = distance;
+            return;
+        }
+        throughput = vec3_mul(throughput, weight);
+        ray = ray_create(rec.point, wi);
+    }
+}
+
+static void image_create_features(Image* image) {
+    uint32_t total_pixels = image->width * image->height;
+    if (!image->albedo) {
+        image->albedo = (Vec3*)calloc(total_pixels, sizeof(Vec3));
+    }
+    if (!image->normal) {
+        image->normal = (Vec3*)calloc(total_pixels, sizeof(Vec3));
+    }
+    if (!image->depth) {
+        image->depth = (float*)calloc(total_pixels, sizeof(float));
+    }
+}
+
+typedef struct {
+    const Scene* scene;
+    const Camera* camera;
+    const RenderSettings* settings;
+    Image* output;
+    uint32_t samples;
+    PoolRange pixels;
+} FeatureRender;
+
+static void render_features_thread(void* arg, uint32_t rank) {
+    (void)rank;
+    FeatureRender* r = (FeatureRender*)arg;
+    const Scene* scene = r->scene;
+    const Camera* camera = r->camera;
+    const RenderSettings* settings = r->settings;
+    Image* output = r->output;
+    uint32_t width = output->width;
+    uint32_t height = output->height;
+    uint32_t samples = r->samples;
+
+    Sampler sampler;
+    sampler_init(&sampler, settings->sampler, samples, settings->seed);
+
+    uint32_t begin, end;
+    while (pool_range_next(&r->pixels, &begin, &end)) {
+        for (uint32_t p = begin; p < end; p++) {
+            Vec3 albedo = vec3_create(0, 0, 0);
+            Vec3 normal = vec3_create(0, 0, 0);
+            float depth = 0.0f;
+
+            for (uint32_t s = 0; s < samples; s++) {
+                sampler_start(&sampler, p, s);
+                Ray ray = primary_ray(camera, width, height, p % width, p / width, &sampler);
+                Vec3 a, n;
+                float d;
+                trace_features(scene, ray, &sampler, &a, &n, &d);
+                albedo = vec3_add(albedo, a);
+                normal = vec3_add(normal, n);
+                depth += d;
+            }
+
+            output->albedo[p] = vec3_div(albedo, (float)samples);
+            float length = vec3_length(normal);
+            output->normal[p] = length > 0.0f ? vec3_div(normal, length) : normal;
+            output->depth[p] = depth / samples;
+        }
+    }
+}
+
+void render_features(const Scene* scene, const Camera* camera,
+                     const RenderSettings* settings, Image* output) {
+    uint32_t width = output->width;
+    uint32_t height = output->height;
+    uint32_t spp = settings->samples_per_pixel > 0 ? settings->samples_per_pixel : 1;
+    uint32_t samples = spp < DENOISE_FEATURE_SAMPLES ? spp : DENOISE_FEATURE_SAMPLES;
+
+    image_create_features(output);
+
+    FeatureRender r = { scene, camera, settings, output, samples, { 0 } };
+    pool_range_init(&r.pixels, width * height, 16);
+    pool_run(pool_default(), settings->num_threads, POOL_PRIORITY_NORMAL,
+             render_features_thread, &r);
+}
+
+// Luminance under a tone curve, so bright and dark regions are judged alike
+static inline float denoise_luminance(Vec3 c) {
+    float l = 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+    return l / (1.0f + l);
+}
+
+// Rows [begin, end) of one denoising step; every step reads src and writes
+// the other buffers, so its rows can be done in any order
+typedef struct {
+    Image* image;
+    const Vec3* src;
+    float* deviation;
+    Vec3* dst;
+    uint32_t step;
+} DenoiseJob;
+
+// Standard deviation of luminance over the 3x3 neighbourhood of every pixel,
+// the noise level the color weights are measured against (as in Schied et
+// al., "Spatiotemporal Variance-Guided Filtering", 2017)
+static void denoise_deviation(void* arg, uint32_t begin, uint32_t end) {
+    const DenoiseJob* job = (const DenoiseJob*)arg;
+    const Vec3* src = job->src;
+    float* deviation = job->deviation;
+    int32_t width = (int32_t)job->image->width;
+    int32_t height = (int32_t)job->image->height;
+
+    for (int32_t y = (int32_t)begin; y < (int32_t)end; y++) {
+        for (int32_t x = 0; x < width; x++) {
+            float sum = 0.0f, sum2 = 0.0f;
+            uint32_t n = 0;
+            for (int32_t qy = y - 1; qy <= y + 1; qy++) {
+                for (int32_t qx = x - 1; qx <= x + 1; qx++) {
+                    if (qx < 0 || qy < 0 || qx >= width || qy >= height) continue;
+                    float l = denoise_luminance(src[qy * width + qx]);
+                    sum += l;
+                    sum2 += l * l;
+                    n++;
+                }
+            }
+            float mean = sum / n;
+            deviation[y * width + x] = sqrtf(fmaxf(sum2 / n - mean * mean, 0.0f));
+        }
+    }
+}
+
+// One a-trous pass with taps step pixels apart, from src into dst
+static void denoise_pass(void* arg, uint32_t begin, uint32_t end) {
+    const DenoiseJob* job = (const DenoiseJob*)arg;
+    const Image* image = job->image;
+    const Vec3* src = job->src;
+    const float* deviation = job->deviation;
+    Vec3* dst = job->dst;
+    uint32_t step = job->step;
+    int32_t width = (int32_t)image->width;
+    int32_t height = (int32_t)image->height;
+    float inv_albedo = 1.0f / (DENOISE_SIGMA_ALBEDO * DENOISE_SIGMA_ALBEDO);
+
+    for (int32_t y = (int32_t)begin; y < (int32_t)end; y++) {
+        for (int32_t x = 0; x < width; x++) {
+            int32_t p = y * width + x;
+            float luminance_p = denoise_luminance(src[p]);
+            float inv_color = 1.0f / (DENOISE_SIGMA_COLOR * deviation[p] + 1e-4f);
+            Vec3 albedo_p = image->albedo[p];
+            Vec3 normal_p = image->normal[p];
+            float depth_p = image->depth[p];
+            float inv_depth = 1.0f / (DENOISE_SIGMA_DEPTH * step * fmaxf(depth_p, 1e-3f));
+
+            Vec3 sum = vec3_create(0, 0, 0);
+            float weight_sum = 0.0f;
+            for (int32_t dy = -2; dy <= 2; dy++) {
+                int32_t qy = y + dy * (int32_t)step;
+                if (qy < 0 || qy >= height) continue;
+                for (int32_t dx = -2; dx <= 2; dx++) {
+                    int32_t qx = x + dx * (int32_t)step;
+                    if (qx < 0 || qx >= width) continue;
+                    int32_t q = qy * width + qx;
+
+                    float dl = fabsf(denoise_luminance(src[q]) - luminance_p);
+                    Vec3 da = vec3_sub(image->albedo[q], albedo_p);
+                    float cos_n = fmaxf(vec3_dot(image->normal[q], normal_p), 0.0f);
+                    for (int k = 0; k < DENOISE_NORMAL_POWER; k++) {
+                        cos_n *= cos_n;
+                    }
+                    // Background pixels have no normal; compare them by depth alone
+                    float w_normal = vec3_length_squared(normal_p) > 0.0f ? cos_n : 1.0f;
+                    float w = denoise_kernel[abs(dx)] * denoise_kernel[abs(dy)] * w_normal *
+                              expf(-dl * inv_color -
+                                   vec3_length_squared(da) * inv_albedo -
+                                   fabsf(image->depth[q] - depth_p) * inv_depth);
+                    sum = vec3_add(sum, vec3_scale(src[q], w));
+                    weight_sum += w;
+                }
+            }
+            // The center tap alone keeps weight_sum above zero
+            dst[p] = weight_sum > 0.0f ? vec3_div(sum, weight_sum) : src[p];
+        }
+    }
+}
+
+static void denoise_divide_albedo(void* arg, uint32_t begin, uint32_t end) {
+    const DenoiseJob* job = (const DenoiseJob*)arg;
+    const Image* image = job->image;
+    for (uint32_t p = begin * image->width; p < end * image->width; p++) {
+        Vec3 albedo = image->albedo[p];
+        job->dst[p] = vec3_create(job->src[p].x / fmaxf(albedo.x, DENOISE_MIN_ALBEDO),
+                                  job->src[p].y / fmaxf(albedo.y, DENOISE_MIN_ALBEDO),
+                                  job->src[p].z / fmaxf(albedo.z, DENOISE_MIN_ALBEDO));
+    }
+}
+
+static void denoise_multiply_albedo(void* arg, uint32_t begin, uint32_t end) {
+    const DenoiseJob* job = (const DenoiseJob*)arg;
+    const Image* image = job->image;
+    for (uint32_t p = begin * image->width; p < end * image->width; p++) {
+        Vec3 albedo = image->albedo[p];
+        job->dst[p] = vec3_create(job->src[p].x * fmaxf(albedo.x, DENOISE_MIN_ALBEDO),
+                                  job->src[p].y * fmaxf(albedo.y, DENOISE_MIN_ALBEDO),
+                                  job->src[p].z * fmaxf(albedo.z, DENOISE_MIN_ALBEDO));
+    }
+}
+
+bool denoise_image(Image* image) {
+    if (!image->albedo || !image->normal || !image->depth) {
+        fprintf(stderr, "denoise_image: no feature buffers, run render_features first\n");
+        return false;
+    }
+
+    uint32_t total_pixels = image->width * image->height;
+    Vec3* a = (Vec3*)malloc(total_pixels * sizeof(Vec3));
+    Vec3* b = (Vec3*)malloc(total_pixels * sizeof(Vec3));
+    float* deviation = (float*)malloc(total_pixels * sizeof(float));
+    if (!a || !b || !deviation) {
+        fprintf(stderr, "denoise_image: out of memory\n");
+        free(a);
+        free(b);
+        free(deviation);
+        return false;
+    }
+
+    // Every step runs on the whole pool, DENOISE_ROWS rows per task
+    ThreadPool* pool = pool_default();
+    uint32_t threads = pool_thread_count(pool) + 1;
+    DenoiseJob job = { image, image->pixels, deviation, a, 0 };
+
+    // Divide out the albedo
+    pool_parallel_for(pool, threads, POOL_PRIORITY_NORMAL, image->height, DENOISE_ROWS,
+                      denoise_divide_albedo, &job);
+
+    for (uint32_t i = 0; i < DENOISE_ITERATIONS; i++) {
+        job.src = a;
+        pool_parallel_for(pool, threads, POOL_PRIORITY_NORMAL, image->height, DENOISE_ROWS,
+                          denoise_deviation, &job);
+        job.dst = b;
+        job.step = 1u << i;
+        pool_parallel_for(pool, threads, POOL_PRIORITY_NORMAL, image->height, DENOISE_ROWS,
+                          denoise_pass, &job);
+        Vec3* t = a;
+        a = b;
+        b = t;
+    }
+
+    job.src = a;
+    job.dst = image->pixels;
+    pool_parallel_for(pool, threads, POOL_PRIORITY_NORMAL, image->height, DENOISE_ROWS,
+                      denoise_multiply_albedo, &job);
+
+    free(a);
+    free(b);
+    free(deviation);
+    return true;
+}
@@ -0,0 +1,294 @@
+#include "envmap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Largest width or height accepted from a file. Keeps width * height and
+// the CDF tables within 32-bit pixel indices.
+#define ENVMAP_MAX_SIZE 32768
+
+static inline float env_luminance(Vec3 c) {
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+// Index of the CDF interval [cdf[i], cdf[i + 1]) containing u
+static uint32_t cdf_find(const float* cdf, uint32_t count, float u) {
+    uint32_t lo = 0, hi = count - 1;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi + 1) / 2;
+        if (cdf[mid] <= u) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+// Build a normalized CDF of count values; returns their mean. A function
+// that is zero everywhere gets a uniform CDF.
+static float cdf_build(const float* f, uint32_t count, float* cdf) {
+    cdf[0] = 0.0f;
+    for (uint32_t i = 0; i < count; i++) {
+        cdf[i + 1] = cdf[i] + f[i] / count;
+    }
+    float integral = cdf[count];
+    for (uint32_t i = 1; i <= count; i++) {
+        cdf[i] = integral > 0.0f ? cdf[i] / integral : (float)i / count;
+    }
+    return integral;
+}
+
+EnvMap* envmap_create(const Vec3* pixels, uint32_t width, uint32_t height) {
+    EnvMap* env = (EnvMap*)calloc(1, sizeof(EnvMap));
+    env->width = width;
+    env->height = height;
+    size_t count = (size_t)width * height;
+    env->pixels = (Vec3*)malloc(count * sizeof(Vec3));
+    memcpy(env->pixels, pixels, count * sizeof(Vec3));
+
+    env->func = (float*)malloc(count * sizeof(float));
+    env->conditional_cdf = (float*)malloc((size_t)height * (width + 1) * sizeof(float));
+    env->marginal_cdf = (float*)malloc(((size_t)height + 1) * sizeof(float));
+    float* row_integrals = (float*)malloc(height * sizeof(float));
+
+    // sin(theta) compensates for the stretching of rows near the poles
+    for (uint32_t y = 0; y < height; y++) {
+        float sin_theta = sinf((float)M_PI * (y + 0.5f) / height);
+        for (uint32_t x = 0; x < width; x++) {
+            env->func[y * width + x] = env_luminance(pixels[y * width + x]) * sin_theta;
+        }
+        row_integrals[y] = cdf_build(&env->func[y * width], width,
+                                     &env->conditional_cdf[y * (width + 1)]);
+    }
+    env->func_integral = cdf_build(row_integrals, height, env->marginal_cdf);
+
+    free(row_integrals);
+    return env;
+}
+
+void envmap_destroy(EnvMap* env) {
+    if (env) {
+        free(env->pixels);
+        free(env->func);
+        free(env->conditional_cdf);
+        free(env->marginal_cdf);
+        free(env);
+    }
+}
+
+// Portable float map: "PF" header, width/height, scale (negative = little
+// endian), then RGB float rows from bottom to top
+static Vec3* load_pfm(FILE* f, uint32_t* width, uint32_t* height) {
+    char magic[3] = {0};
+    float scale;
+    if (fscanf(f, "%2s %u %u %f", magic, width, height, &scale) != 4 ||
+        strcmp(magic, "PF") != 0 || *width == 0 || *height == 0 ||
+        *width > ENVMAP_MAX_SIZE || *height > ENVMAP_MAX_SIZE) {
+        return NULL;
+    }
+    fgetc(f);  // Single whitespace before the raster
+
+    size_t count = (size_t)*width * *height;
+    float* raw = (float*)malloc(count * 3 * sizeof(float));
+    if (!raw) {
+        fprintf(stderr, "Out of memory for a %ux%u environment map\n", *width, *height);
+        return NULL;
+    }
+    if (fread(raw, sizeof(float), count * 3, f) != count * 3) {
+        free(raw);
+        return NULL;
+    }
+
+    // Only little-endian hosts are supported, like the rest of the file I/O
+    if (scale > 0.0f) {
+        free(raw);
+        return NULL;
+    }
+
+    Vec3* pixels = (Vec3*)malloc(count * sizeof(Vec3));
+    if (!pixels) {
+        fprintf(stderr, "Out of memory for a %ux%u environment map\n", *width, *height);
+        free(raw);
+        return NULL;
+    }
+    for (uint32_t y = 0; y < *height; y++) {
+        const float* row = &raw[(size_t)(*height - 1 - y) * *width * 3];
+        for (uint32_t x = 0; x < *width; x++) {
+            pixels[y * *width + x] = vec3_create(row[3 * x], row[3 * x + 1], row[3 * x + 2]);
+        }
+    }
+    free(raw);
+    return pixels;
+}
+
+// One RGBE scanline, flat or new-style run-length encoded
+static bool read_rgbe_scanline(FILE* f, unsigned char* rgbe, uint32_t width) {
+    int c0 = fgetc(f), c1 = fgetc(f), c2 = fgetc(f), c3 = fgetc(f);
+    if (c3 == EOF) {
+        return false;
+    }
+
+    if (width < 8 || width > 0x7fff || c0 != 2 || c1 != 2 || (c2 & 0x80)) {
+        // Flat scanline
+        rgbe[0] = (unsigned char)c0; rgbe[1] = (unsigned char)c1;
+        rgbe[2] = (unsigned char)c2; rgbe[3] = (unsigned char)c3;
+        return fread(rgbe + 4, 4, width - 1, f) == width - 1;
+    }
+    if ((uint32_t)((c2 << 8) | c3) != width) {
+        return false;
+    }
+
+    // Each channel is stored separately as runs and literal spans
+    for (int ch = 0; ch < 4; ch++) {
+        uint32_t x = 0;
+        while (x < width) {
+            int count = fgetc(f);
+            if (count == EOF) return false;
+            if (count > 128) {
+                count -= 128;
+                int value = fgetc(f);
+                if (value == EOF || x + count > width) return false;
+                for (int k = 0; k < count; k++) rgbe[4 * x++ + ch] = (unsigned char)value;
+            } else {
+                if (count == 0 || x + count > width) return false;
+                for (int k = 0; k < count; k++) {
+                    int value = fgetc(f);
+                    if (value == EOF) return false;
+                    rgbe[4 * x++ + ch] = (unsigned char)value;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Radiance RGBE (.hdr) with the standard "-Y height +X width" orientation
+static Vec3* load_hdr(FILE* f, uint32_t* width, uint32_t* height) {
+    char line[256];
+    bool rgbe_format = false;
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '\n') break;
+        if (strncmp(line, "FORMAT=32-bit_rle_rgbe", 22) == 0) rgbe_format = true;
+    }
+    if (!rgbe_format || fscanf(f, "-Y %u +X %u", height, width) != 2 ||
+        *width == 0 || *height == 0 || *width > ENVMAP_MAX_SIZE || *height > ENVMAP_MAX_SIZE) {
+        return NULL;
+    }
+    fgetc(f);  // Newline after the resolution string
+
+    Vec3* pixels = (Vec3*)malloc((size_t)*width * *height * sizeof(Vec3));
+    unsigned char* rgbe = (unsigned char*)malloc((size_t)*width * 4);
+    if (!pixels || !rgbe) {
+        fprintf(stderr, "Out of memory for a %ux%u environment map\n", *width, *height);
+        free(rgbe);
+        free(pixels);
+        return NULL;
+    }
+    for (uint32_t y = 0; y < *height; y++) {
+        if (!read_rgbe_scanline(f, rgbe, *width)) {
+            free(rgbe);
+            free(pixels);
+            return NULL;
+        }
+        for (uint32_t x = 0; x < *width; x++) {
+            const unsigned char* p = &rgbe[4 * x];
+            float scale = p[3] ? ldexpf(1.0f, (int)p[3] - 136) : 0.0f;
+            pixels[y * *width + x] = vec3_create(p[0] * scale, p[1] * scale, p[2] * scale);
+        }
+    }
+    free(rgbe);
+    return pixels;
+}
+
+EnvMap* envmap_load(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Failed to open environment map: %s\n", path);
+        return NULL;
+    }
+
+    const char* ext = strrchr(path, '.');
+    uint32_t width = 0, height = 0;
+    Vec3* pixels = NULL;
+    if (ext && strcmp(ext, ".pfm") == 0) {
+        pixels = load_pfm(f, &width, &height);
+    } else {
+        pixels = load_hdr(f, &width, &height);
+    }
+    fclose(f);
+
+    if (!pixels) {
+        fprintf(stderr, "Unsupported or corrupt environment map: %s\n", path);
+        return NULL;
+    }
+
+    EnvMap* env = envmap_create(pixels, width, height);
+    free(pixels);
+    return env;
+}
+
+// Pixel containing direction dir, and sin(theta) of dir
+static uint32_t envmap_pixel(const EnvMap* env, Vec3 dir, float* sin_theta) {
+    Vec3 d = vec3_normalize(dir);
+    float cos_theta = d.y < -1.0f ? -1.0f : (d.y > 1.0f ? 1.0f : d.y);
+    float phi = atan2f(d.z, d.x);
+    if (phi < 0.0f) phi += 2.0f * (float)M_PI;
+
+    float u = phi / (2.0f * (float)M_PI);
+    float v = acosf(cos_theta) / (float)M_PI;
+    uint32_t x = (uint32_t)(u * env->width);
+    uint32_t y = (uint32_t)(v * env->height);
+    if (x >= env->width) x = env->width - 1;
+    if (y >= env->height) y = env->height - 1;
+
+    *sin_theta = sqrtf(fmaxf(0.0f, 1.0f - cos_theta * cos_theta));
+    return y * env->width + x;
+}
+
+Vec3 envmap_lookup(const EnvMap* env, Vec3 dir) {
+    float sin_theta;
+    return env->pixels[envmap_pixel(env, dir, &sin_theta)];
+}
+
+float envmap_pdf(const EnvMap* env, Vec3 dir) {
+    float sin_theta;
+    uint32_t idx = envmap_pixel(env, dir, &sin_theta);
+    if (sin_theta <= 0.0f || env->func_integral <= 0.0f) {
+        return 0.0f;
+    }
+    // Jacobian of the lat-long mapping: dA(u, v) = dw / (2 pi^2 sin(theta))
+    return env->func[idx] / env->func_integral / (2.0f * (float)M_PI * (float)M_PI * sin_theta);
+}
+
+bool envmap_sample(const EnvMap* env, float u1, float u2, Vec3* dir, Vec3* radiance,
+                   float* pdf) {
+    if (env->func_integral <= 0.0f) {
+        return false;
+    }
+
+    // Row from the marginal distribution, then column within the row
+    uint32_t y = cdf_find(env->marginal_cdf, env->height, u1);
+    float dy = env->marginal_cdf[y + 1] - env->marginal_cdf[y];
+    float v = (y + (dy > 0.0f ? (u1 - env->marginal_cdf[y]) / dy : 0.5f)) / env->height;
+
+    const float* row_cdf = &env->conditional_cdf[y * (env->width + 1)];
+    uint32_t x = cdf_find(row_cdf, env->width, u2);
+    float dx = row_cdf[x + 1] - row_cdf[x];
+    float u = (x + (dx > 0.0f ? (u2 - row_cdf[x]) / dx : 0.5f)) / env->width;
+
+    float theta = v * (float)M_PI;
+    float phi = u * 2.0f * (float)M_PI;
+    float sin_theta = sinf(theta);
+    float func = env->func[y * env->width + x];
+    if (sin_theta <= 0.0f || func <= 0.0f) {
+        return false;
+    }
+
+    *dir = vec3_create(sin_theta * cosf(phi), cosf(theta), sin_theta * sinf(phi));
+    *radiance = env->pixels[y * env->width + x];
+    *pdf = func / env->func_integral / (2.0f * (float)M_PI * (float)M_PI * sin_theta);
+    return true;
+}
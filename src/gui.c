@@ -1,11 +1,16 @@
 #include "gui.h"
 #include "scenes.h"
+#include "pool.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <sys/time.h>
 
+// Out-of-core geometry: primitives per chunk and chunks kept in memory
+#define GUI_OOC_CHUNK_SIZE 4096
+#define GUI_OOC_CACHE_CHUNKS 16
+
 // Global app pointer for callbacks
 static GuiApp* g_app = NULL;
 
@@ -94,9 +99,29 @@ GuiApp* gui_app_create(void) {
     gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(app->scene_combo), "Metal Spheres");
     gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(app->scene_combo), "Studio Lighting");
     gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(app->scene_combo), "Material Blending");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(app->scene_combo), "Mesh Showcase");
     gtk_combo_box_set_active(GTK_COMBO_BOX(app->scene_combo), 0);
     gtk_grid_attach(GTK_GRID(control_grid), app->scene_combo, 1, row++, 1, 1);
 
+    // Optional HDR environment map (replaces the scene's ambient light)
+    gtk_grid_attach(GTK_GRID(control_grid), gtk_label_new("Environment:"), 0, row, 1, 1);
+    app->env_chooser = gtk_file_chooser_button_new("Environment Map", GTK_FILE_CHOOSER_ACTION_OPEN);
+    GtkFileFilter* env_filter = gtk_file_filter_new();
+    gtk_file_filter_set_name(env_filter, "HDR images (*.hdr, *.pfm)");
+    gtk_file_filter_add_pattern(env_filter, "*.hdr");
+    gtk_file_filter_add_pattern(env_filter, "*.pfm");
+    gtk_file_chooser_add_filter(GTK_FILE_CHOOSER(app->env_chooser), env_filter);
+    gtk_grid_attach(GTK_GRID(control_grid), app->env_chooser, 1, row++, 1, 1);
+
+    // Optional .obj model, shown on the Mesh Showcase stage instead of the torus
+    gtk_grid_attach(GTK_GRID(control_grid), gtk_label_new("Mesh (OBJ):"), 0, row, 1, 1);
+    app->obj_chooser = gtk_file_chooser_button_new("Mesh", GTK_FILE_CHOOSER_ACTION_OPEN);
+    GtkFileFilter* obj_filter = gtk_file_filter_new();
+    gtk_file_filter_set_name(obj_filter, "Wavefront meshes (*.obj)");
+    gtk_file_filter_add_pattern(obj_filter, "*.obj");
+    gtk_file_chooser_add_filter(GTK_FILE_CHOOSER(app->obj_chooser), obj_filter);
+    gtk_grid_attach(GTK_GRID(control_grid), app->obj_chooser, 1, row++, 1, 1);
+
     // Resolution controls
     gtk_grid_attach(GTK_GRID(control_grid), gtk_label_new("Width:"), 0, row, 1, 1);
     app->width_spin = gtk_spin_button_new_with_range(100, 1920, 10);
@@ -114,6 +139,21 @@ GuiApp* gui_app_create(void) {
     gtk_spin_button_set_value(GTK_SPIN_BUTTON(app->samples_spin), 100);
     gtk_grid_attach(GTK_GRID(control_grid), app->samples_spin, 1, row++, 1, 1);
 
+    // Seconds to render for; samples per pixel is then only a cap (0 = off)
+    gtk_grid_attach(GTK_GRID(control_grid), gtk_label_new("Time Budget (s):"), 0, row, 1, 1);
+    app->budget_spin = gtk_spin_button_new_with_range(0, 3600, 1);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(app->budget_spin), 0);
+    gtk_grid_attach(GTK_GRID(control_grid), app->budget_spin, 1, row++, 1, 1);
+
+    // Order matches SamplerType
+    gtk_grid_attach(GTK_GRID(control_grid), gtk_label_new("Sampler:"), 0, row, 1, 1);
+    app->sampler_combo = gtk_combo_box_text_new();
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(app->sampler_combo), "Independent");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(app->sampler_combo), "Stratified");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(app->sampler_combo), "Sobol");
+    gtk_combo_box_set_active(GTK_COMBO_BOX(app->sampler_combo), SAMPLER_SOBOL);
+    gtk_grid_attach(GTK_GRID(control_grid), app->sampler_combo, 1, row++, 1, 1);
+
     gtk_grid_attach(GTK_GRID(control_grid), gtk_label_new("Max Depth:"), 0, row, 1, 1);
     app->depth_spin = gtk_spin_button_new_with_range(1, 100, 1);
     gtk_spin_button_set_value(GTK_SPIN_BUTTON(app->depth_spin), 50);
@@ -124,6 +164,36 @@ GuiApp* gui_app_create(void) {
     gtk_spin_button_set_value(GTK_SPIN_BUTTON(app->threads_spin), 8);
     gtk_grid_attach(GTK_GRID(control_grid), app->threads_spin, 1, row++, 1, 1);
 
+    gtk_grid_attach(GTK_GRID(control_grid), gtk_label_new("Caustic Photons (k):"), 0, row, 1, 1);
+    app->photons_spin = gtk_spin_button_new_with_range(0, 4000, 100);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(app->photons_spin), 0);
+    gtk_grid_attach(GTK_GRID(control_grid), app->photons_spin, 1, row++, 1, 1);
+
+    app->nee_check = gtk_check_button_new_with_label("Next Event Estimation");
+    gtk_grid_attach(GTK_GRID(control_grid), app->nee_check, 0, row++, 2, 1);
+
+    app->guiding_check = gtk_check_button_new_with_label("Path Guiding");
+    gtk_grid_attach(GTK_GRID(control_grid), app->guiding_check, 0, row++, 2, 1);
+
+    // Ends paths after the first diffuse bounce; faster but biased
+    app->cache_check = gtk_check_button_new_with_label("Radiance Cache (Preview)");
+    gtk_grid_attach(GTK_GRID(control_grid), app->cache_check, 0, row++, 2, 1);
+
+    // Samples per pixel becomes the cap; noisy pixels get up to that many
+    app->adaptive_check = gtk_check_button_new_with_label("Adaptive Sampling");
+    gtk_grid_attach(GTK_GRID(control_grid), app->adaptive_check, 0, row++, 2, 1);
+
+    app->denoise_check = gtk_check_button_new_with_label("Denoise");
+    gtk_grid_attach(GTK_GRID(control_grid), app->denoise_check, 0, row++, 2, 1);
+
+    // Ignored (ray cast) when the camera has depth of field
+    app->raster_check = gtk_check_button_new_with_label("Rasterize Primary Rays");
+    gtk_grid_attach(GTK_GRID(control_grid), app->raster_check, 0, row++, 2, 1);
+
+    // Streams geometry to a temporary chunk file and pages it back in
+    app->ooc_check = gtk_check_button_new_with_label("Out-of-Core Geometry");
+    gtk_grid_attach(GTK_GRID(control_grid), app->ooc_check, 0, row++, 2, 1);
+
     // Separator
     gtk_grid_attach(GTK_GRID(control_grid), gtk_separator_new(GTK_ORIENTATION_HORIZONTAL), 0, row++, 2, 1);
 
@@ -208,18 +278,20 @@ void gui_app_run(GuiApp* app) {
     gtk_main();
 }
 
-// Convert Image to GdkPixbuf for display
-GdkPixbuf* image_to_pixbuf(const Image* img) {
-    if (!img || !img->pixels) return NULL;
-
-    GdkPixbuf* pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8,
-                                        img->width, img->height);
-    if (!pixbuf) return NULL;
-
-    guchar* pixels = gdk_pixbuf_get_pixels(pixbuf);
-    int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
-
-    for (uint32_t y = 0; y < img->height; y++) {
+// Tone map rows [begin, end) into the pixbuf
+typedef struct {
+    const Image* img;
+    guchar* pixels;
+    int rowstride;
+} PixbufConvert;
+
+static void pixbuf_convert_rows(void* arg, uint32_t begin, uint32_t end) {
+    const PixbufConvert* c = (const PixbufConvert*)arg;
+    const Image* img = c->img;
+    guchar* pixels = c->pixels;
+    int rowstride = c->rowstride;
+
+    for (uint32_t y = begin; y < end; y++) {
         for (uint32_t x = 0; x < img->width; x++) {
             Vec3 color = img->pixels[y * img->width + x];
 
@@ -238,6 +310,22 @@ GdkPixbuf* image_to_pixbuf(const Image* img) {
             p[2] = (guchar)(color.z * 255.99f);
         }
     }
+}
+
+// Convert Image to GdkPixbuf for display
+GdkPixbuf* image_to_pixbuf(const Image* img) {
+    if (!img || !img->pixels) return NULL;
+
+    GdkPixbuf* pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8,
+                                        img->width, img->height);
+    if (!pixbuf) return NULL;
+
+    // Display updates go ahead of rendering work on the shared pool
+    PixbufConvert convert = { img, gdk_pixbuf_get_pixels(pixbuf),
+                              gdk_pixbuf_get_rowstride(pixbuf) };
+    ThreadPool* pool = pool_default();
+    pool_parallel_for(pool, pool_thread_count(pool) + 1, POOL_PRIORITY_HIGH, img->height, 8,
+                      pixbuf_convert_rows, &convert);
 
     return pixbuf;
 }
@@ -270,6 +358,8 @@ static Scene* create_scene(const char* name) {
         return create_studio_lighting();
     } else if (strcmp(name, "Material Blending") == 0) {
         return create_material_blend();
+    } else if (strcmp(name, "Mesh Showcase") == 0) {
+        return create_mesh_showcase();
     }
 
     return create_cornell_box();
@@ -324,6 +414,13 @@ static Camera* create_camera_for_scene(const char* name, float aspect) {
             vec3_create(0, 1, 0),
             45.0f, aspect, 0.1f, 12.0f
         );
+    } else if (strcmp(name, "Mesh Showcase") == 0) {
+        *cam = camera_create(
+            vec3_create(0, 1.5f, 5),
+            vec3_create(0, 0.8f, 0),
+            vec3_create(0, 1, 0),
+            40.0f, aspect, 0.0f, 5.0f
+        );
     } else {
         // Default camera for any future scenes
         *cam = camera_create(
@@ -337,8 +434,8 @@ static Camera* create_camera_for_scene(const char* name, float aspect) {
     return cam;
 }
 
-// Rendering thread function
-void* render_thread_func(void* user_data) {
+// Render job, run as a task on the shared thread pool
+void render_job(void* user_data) {
     GuiApp* app = (GuiApp*)user_data;
 
     // Get settings from GUI
@@ -387,16 +484,22 @@ void* render_thread_func(void* user_data) {
         snprintf(data->status_text, sizeof(data->status_text),
                  "Render cancelled after %.2f seconds", render_time);
     } else {
-        snprintf(data->status_text, sizeof(data->status_text),
-                 "Render complete: %.2f seconds (%.2f Mrays/s)",
-                 render_time,
-                 (settings.width * settings.height * settings.samples_per_pixel) / (render_time * 1e6));
+        RenderStats stats;
+        render_get_stats(&stats);
+        if (stats.error >= 0.0f) {
+            snprintf(data->status_text, sizeof(data->status_text),
+                     "Render complete: %.2f seconds (%.1f spp, %.1f%% error)",
+                     render_time, stats.samples_per_pixel, stats.error * 100.0f);
+        } else {
+            snprintf(data->status_text, sizeof(data->status_text),
+                     "Render complete: %.2f seconds (%.2f Mrays/s)",
+                     render_time,
+                     (settings.width * settings.height * stats.samples_per_pixel) / (render_time * 1e6));
+        }
     }
 
     // Schedule GUI update on main thread
     g_idle_add(render_complete_update_gui, data);
-
-    return NULL;
 }
 
 // Update progress callback for GTK
@@ -449,6 +552,27 @@ void on_render_clicked(GtkButton* button, gpointer user_data) {
     app->settings.samples_per_pixel = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(app->samples_spin));
     app->settings.max_depth = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(app->depth_spin));
     app->settings.num_threads = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(app->threads_spin));
+    app->settings.use_nee = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(app->nee_check));
+    app->settings.use_guiding = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(app->guiding_check));
+    app->settings.radiance_cache =
+        gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(app->cache_check)) ? 1 : 0;
+    app->settings.denoise = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(app->denoise_check));
+    app->settings.use_raster = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(app->raster_check));
+    app->settings.sampler = (SamplerType)gtk_combo_box_get_active(GTK_COMBO_BOX(app->sampler_combo));
+    app->settings.time_budget = (float)gtk_spin_button_get_value(GTK_SPIN_BUTTON(app->budget_spin));
+    app->settings.adaptive_threshold = 0.0f;
+    bool adaptive = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(app->adaptive_check));
+    if (adaptive || app->settings.time_budget > 0.0f) {
+        uint32_t max_spp = app->settings.samples_per_pixel;
+        app->settings.adaptive_threshold = adaptive ? 0.05f : 0.0f;
+        app->settings.max_samples_per_pixel = max_spp;
+        // Base pass of 1/16 of the cap, but at least 4 samples
+        uint32_t base_spp = max_spp / 16;
+        if (base_spp < 4) {
+            base_spp = max_spp < 4 ? max_spp : 4;
+        }
+        app->settings.samples_per_pixel = base_spp;
+    }
 
     // Get scene name
     const char* scene_name = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(app->scene_combo));
@@ -456,12 +580,47 @@ void on_render_clicked(GtkButton* button, gpointer user_data) {
 
     // Create scene and camera
     if (app->scene) scene_destroy(app->scene);
-    app->scene = create_scene(scene_name);
+    gchar* obj_path = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(app->obj_chooser));
+    bool use_obj = obj_path && strcmp(scene_name, "Mesh Showcase") == 0;
+    app->scene = use_obj ? create_mesh_stage() : create_scene(scene_name);
+
+    // From here on added geometry goes straight to the chunk file
+    bool ooc = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(app->ooc_check));
+    if (ooc) {
+        gchar* chunk_path = g_build_filename(g_get_tmp_dir(), "pathtracer_geometry.chunks", NULL);
+        ooc = scene_begin_out_of_core(app->scene, chunk_path, GUI_OOC_CHUNK_SIZE,
+                                      GUI_OOC_CACHE_CHUNKS);
+        g_free(chunk_path);
+    }
+
+    if (use_obj) {
+        // Out of core, the faces themselves go to the chunk file as triangles
+        Material clay = material_lambertian(vec3_create(0.7f, 0.7f, 0.7f));
+        if (!scene_load_obj(app->scene, obj_path, vec3_create(0, 0, 0), 2.0f, clay, !ooc)) {
+            fprintf(stderr, "Showing the mesh stage without %s\n", obj_path);
+        }
+    }
+    g_free(obj_path);
+
+    gchar* env_path = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(app->env_chooser));
+    if (env_path) {
+        if (!scene_load_environment(app->scene, env_path)) {
+            fprintf(stderr, "Using ambient light instead of %s\n", env_path);
+        }
+        g_free(env_path);
+    }
 
     // Build BVH
-    gtk_label_set_text(GTK_LABEL(app->status_label), "Building BVH...");
+    gtk_label_set_text(GTK_LABEL(app->status_label),
+                       ooc ? "Writing geometry chunks..." : "Building BVH...");
     scene_build_bvh(app->scene);
 
+    uint32_t photons = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(app->photons_spin));
+    if (photons > 0) {
+        gtk_label_set_text(GTK_LABEL(app->status_label), "Tracing caustic photons...");
+        scene_build_caustics(app->scene, photons * 1000, 0.0f);
+    }
+
     // Create camera
     if (app->camera) free(app->camera);
     float aspect = (float)app->settings.width / app->settings.height;
@@ -479,9 +638,9 @@ void on_render_clicked(GtkButton* button, gpointer user_data) {
     gtk_label_set_text(GTK_LABEL(app->status_label), "Rendering...");
     gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(app->progress_bar), 0.0);
 
-    // Start render thread
-    pthread_create(&app->render_thread, NULL, render_thread_func, app);
-    pthread_detach(app->render_thread);
+    // Queue the render behind any display updates; its own parallel work
+    // runs on the same pool
+    pool_submit(pool_default(), NULL, POOL_PRIORITY_LOW, render_job, app);
 
     // Start progress update timer
     g_timeout_add(100, update_progress, app);
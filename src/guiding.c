@@ -0,0 +1,442 @@
+#include "pathtracer.h"
+#include "guiding.h"
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// Cylindrical mapping between directions and the unit square:
+// x = (cos theta + 1) / 2, y = phi / 2pi. It preserves area, so the
+// solid-angle pdf is the square pdf divided by 4pi.
+static inline Vec3 square_to_direction(float x, float y) {
+    float cos_theta = 2.0f * x - 1.0f;
+    float sin_theta = sqrtf(fmaxf(0.0f, 1.0f - cos_theta * cos_theta));
+    float phi = 2.0f * (float)M_PI * y;
+    return vec3_create(sin_theta * cosf(phi), sin_theta * sinf(phi), cos_theta);
+}
+
+static inline void direction_to_square(Vec3 dir, float* x, float* y) {
+    float cos_theta = fminf(fmaxf(dir.z, -1.0f), 1.0f);
+    float phi = atan2f(dir.y, dir.x);
+    if (phi < 0.0f) {
+        phi += 2.0f * (float)M_PI;
+    }
+    *x = fminf((cos_theta + 1.0f) * 0.5f, 0.99999994f);
+    *y = fminf(phi / (2.0f * (float)M_PI), 0.99999994f);
+}
+
+// Quadrant of (x, y) within the current node; rescales both into it
+static inline uint32_t square_quadrant(float* x, float* y) {
+    uint32_t qx = *x >= 0.5f;
+    uint32_t qy = *y >= 0.5f;
+    *x = *x * 2.0f - (float)qx;
+    *y = *y * 2.0f - (float)qy;
+    return qx | qy << 1;
+}
+
+static inline float node_total(const DTreeNode* node) {
+    return node->sum[0] + node->sum[1] + node->sum[2] + node->sum[3];
+}
+
+static void dtree_init(DTree* tree) {
+    tree->node_capacity = 16;
+    tree->nodes = (DTreeNode*)calloc(tree->node_capacity, sizeof(DTreeNode));
+    tree->node_count = 1;
+}
+
+static void dtree_free(DTree* tree) {
+    free(tree->nodes);
+    tree->nodes = NULL;
+    tree->node_count = tree->node_capacity = 0;
+}
+
+static void dtree_copy(DTree* dst, const DTree* src) {
+    dst->node_capacity = src->node_capacity;
+    dst->node_count = src->node_count;
+    dst->nodes = (DTreeNode*)malloc(dst->node_capacity * sizeof(DTreeNode));
+    memcpy(dst->nodes, src->nodes, src->node_count * sizeof(DTreeNode));
+}
+
+// Append a zeroed node, returns its index
+static uint32_t dtree_push(DTree* tree) {
+    if (tree->node_count >= tree->node_capacity) {
+        tree->node_capacity *= 2;
+        tree->nodes = (DTreeNode*)realloc(tree->nodes, tree->node_capacity * sizeof(DTreeNode));
+    }
+    memset(&tree->nodes[tree->node_count], 0, sizeof(DTreeNode));
+    return tree->node_count++;
+}
+
+// Rebuild the structure below a node of dst whose quadrants carry the
+// energies e (taken from src_node of src, or spread evenly where src was a
+// leaf). Quadrants above GUIDE_DTREE_SPLIT of the total energy are split,
+// everything else becomes a leaf. Sums in dst stay zero.
+static void dtree_refine_node(DTree* dst, uint32_t dst_node, const DTree* src,
+                              uint32_t src_node, const float e[4], float total,
+                              uint32_t depth) {
+    for (uint32_t q = 0; q < 4; q++) {
+        if (depth >= GUIDE_DTREE_MAX_DEPTH || e[q] <= GUIDE_DTREE_SPLIT * total) {
+            continue;
+        }
+
+        uint32_t src_child = src_node != UINT32_MAX ? src->nodes[src_node].child[q] : 0;
+        float child_e[4];
+        for (uint32_t c = 0; c < 4; c++) {
+            child_e[c] = src_child ? src->nodes[src_child].sum[c] : e[q] * 0.25f;
+        }
+
+        uint32_t child = dtree_push(dst);
+        dst->nodes[dst_node].child[q] = child;
+        dtree_refine_node(dst, child, src, src_child ? src_child : UINT32_MAX,
+                          child_e, total, depth + 1);
+    }
+}
+
+float dtree_pdf(const DTree* tree, Vec3 dir) {
+    float x, y;
+    direction_to_square(dir, &x, &y);
+
+    float pdf = 1.0f / (4.0f * (float)M_PI);
+    uint32_t node = 0;
+    for (;;) {
+        const DTreeNode* n = &tree->nodes[node];
+        float total = node_total(n);
+        if (total <= 0.0f) {
+            return 0.0f;
+        }
+        uint32_t q = square_quadrant(&x, &y);
+        pdf *= 4.0f * n->sum[q] / total;
+        if (pdf <= 0.0f || !n->child[q]) {
+            return pdf;
+        }
+        node = n->child[q];
+    }
+}
+
+Vec3 dtree_sample(const DTree* tree, float u1, float u2, float* pdf) {
+    float x0 = 0.0f, y0 = 0.0f, size = 1.0f;
+    float p = 1.0f;
+    uint32_t node = 0;
+
+    for (;;) {
+        const DTreeNode* n = &tree->nodes[node];
+        float total = node_total(n);
+
+        // Pick the column from u1, then the quadrant within it from u2,
+        // reusing the remainders for the next level
+        float left = n->sum[0] + n->sum[2];
+        uint32_t qx = u1 * total >= left;
+        u1 = qx ? (u1 * total - left) / (total - left) : u1 * total / left;
+
+        float a = n->sum[qx];
+        float b = n->sum[qx + 2];
+        uint32_t qy = u2 * (a + b) >= a;
+        u2 = qy ? (u2 * (a + b) - a) / b : u2 * (a + b) / a;
+
+        uint32_t q = qx | qy << 1;
+        p *= 4.0f * n->sum[q] / total;
+        size *= 0.5f;
+        x0 += qx * size;
+        y0 += qy * size;
+
+        if (!n->child[q]) {
+            break;
+        }
+        node = n->child[q];
+    }
+
+    u1 = fminf(fmaxf(u1, 0.0f), 1.0f);
+    u2 = fminf(fmaxf(u2, 0.0f), 1.0f);
+    *pdf = p / (4.0f * (float)M_PI);
+    return square_to_direction(x0 + u1 * size, y0 + u2 * size);
+}
+
+Guide* guide_create(AABB scene_bounds) {
+    Guide* guide = (Guide*)calloc(1, sizeof(Guide));
+
+    // Cube around the scene so spatial splits stay roughly isotropic
+    Vec3 extent = vec3_sub(scene_bounds.max, scene_bounds.min);
+    float size = fmaxf(extent.x, fmaxf(extent.y, extent.z)) * 1.01f + 1e-3f;
+    Vec3 center = aabb_center(scene_bounds);
+    Vec3 half = vec3_create(size * 0.5f, size * 0.5f, size * 0.5f);
+    guide->bounds.min = vec3_sub(center, half);
+    guide->bounds.max = vec3_add(center, half);
+
+    guide->nodes = (STreeNode*)malloc(sizeof(STreeNode));
+    guide->nodes[0].axis = 0;
+    guide->nodes[0].child[0] = guide->nodes[0].child[1] = 0;
+    guide->nodes[0].leaf = 0;
+    guide->node_count = 1;
+
+    guide->leaves = (GuideLeaf*)calloc(1, sizeof(GuideLeaf));
+    dtree_init(&guide->leaves[0].sampling);
+    dtree_init(&guide->leaves[0].building);
+    guide->leaf_count = 1;
+    return guide;
+}
+
+void guide_destroy(Guide* guide) {
+    if (!guide) return;
+    for (uint32_t i = 0; i < guide->leaf_count; i++) {
+        dtree_free(&guide->leaves[i].sampling);
+        dtree_free(&guide->leaves[i].building);
+    }
+    free(guide->leaves);
+    free(guide->nodes);
+    free(guide);
+}
+
+GuideLeaf* guide_lookup(const Guide* guide, Vec3 p) {
+    Vec3 extent = vec3_sub(guide->bounds.max, guide->bounds.min);
+    float c[3] = {
+        (p.x - guide->bounds.min.x) / extent.x,
+        (p.y - guide->bounds.min.y) / extent.y,
+        (p.z - guide->bounds.min.z) / extent.z
+    };
+
+    uint32_t node = 0;
+    while (guide->nodes[node].leaf == UINT32_MAX) {
+        const STreeNode* n = &guide->nodes[node];
+        float* v = &c[n->axis];
+        if (*v < 0.5f) {
+            *v *= 2.0f;
+            node = n->child[0];
+        } else {
+            *v = *v * 2.0f - 1.0f;
+            node = n->child[1];
+        }
+    }
+    return &guide->leaves[guide->nodes[node].leaf];
+}
+
+// C11 has no fetch_add for floating types (and += on an _Atomic float pulls
+// in libatomic for its floating-point exception handling)
+static inline void atomic_add_float(_Atomic float* sum, float value) {
+    float old = atomic_load_explicit(sum, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(sum, &old, old + value, memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+    }
+}
+
+void guide_record(GuideLeaf* leaf, Vec3 dir, float value) {
+    atomic_fetch_add_explicit(&leaf->sample_count, 1, memory_order_relaxed);
+
+    if (!(value > 0.0f) || isinf(value)) {
+        return;
+    }
+
+    float x, y;
+    direction_to_square(dir, &x, &y);
+
+    DTree* tree = &leaf->building;
+    uint32_t node = 0;
+    for (;;) {
+        uint32_t q = square_quadrant(&x, &y);
+        atomic_add_float(&tree->nodes[node].sum[q], value);
+        if (!tree->nodes[node].child[q]) {
+            break;
+        }
+        node = tree->nodes[node].child[q];
+    }
+}
+
+// Split every spatial leaf below node in two, along the axis cycling with
+// depth, while it holds more than threshold samples; both halves start from
+// copies of the parent's directional trees
+static void stree_split(Guide* guide, uint32_t node, uint32_t depth, uint32_t threshold) {
+    uint32_t leaf = guide->nodes[node].leaf;
+    if (leaf == UINT32_MAX) {
+        uint32_t left = guide->nodes[node].child[0];
+        uint32_t right = guide->nodes[node].child[1];
+        stree_split(guide, left, depth + 1, threshold);
+        stree_split(guide, right, depth + 1, threshold);
+        return;
+    }
+    if (guide->leaves[leaf].sample_count <= threshold || depth >= GUIDE_STREE_MAX_DEPTH) {
+        return;
+    }
+
+    uint32_t other = guide->leaf_count++;
+    guide->leaves = (GuideLeaf*)realloc(guide->leaves, guide->leaf_count * sizeof(GuideLeaf));
+    GuideLeaf* src = &guide->leaves[leaf];
+    GuideLeaf* dst = &guide->leaves[other];
+    src->sample_count /= 2;
+    dst->sample_count = src->sample_count;
+    dtree_copy(&dst->sampling, &src->sampling);
+    dtree_copy(&dst->building, &src->building);
+
+    uint32_t first = guide->node_count;
+    guide->node_count += 2;
+    guide->nodes = (STreeNode*)realloc(guide->nodes, guide->node_count * sizeof(STreeNode));
+    for (uint32_t c = 0; c < 2; c++) {
+        guide->nodes[first + c].axis = 0;
+        guide->nodes[first + c].child[0] = guide->nodes[first + c].child[1] = 0;
+        guide->nodes[first + c].leaf = c == 0 ? leaf : other;
+    }
+
+    guide->nodes[node].axis = depth % 3;
+    guide->nodes[node].child[0] = first;
+    guide->nodes[node].child[1] = first + 1;
+    guide->nodes[node].leaf = UINT32_MAX;
+
+    stree_split(guide, first, depth + 1, threshold);
+    stree_split(guide, first + 1, depth + 1, threshold);
+}
+
+void guide_refine(Guide* guide, uint32_t pass) {
+    // Spatial: the threshold grows with the square root of the pass size so
+    // later, larger passes do not fragment the tree
+    uint32_t threshold = (uint32_t)(GUIDE_SPATIAL_THRESHOLD * sqrtf(ldexpf(1.0f, (int)pass)));
+    stree_split(guide, 0, 0, threshold);
+
+    // Directional: what was recorded becomes the sampling distribution and
+    // the next pass records into a tree refined around its energy
+    for (uint32_t i = 0; i < guide->leaf_count; i++) {
+        GuideLeaf* leaf = &guide->leaves[i];
+        DTree* recorded = &leaf->building;
+
+        if (!dtree_usable(recorded)) {
+            // Nothing arrived here: keep the old distribution and structure
+            leaf->sample_count = 0;
+            continue;
+        }
+
+        DTree refined;
+        dtree_init(&refined);
+        float e[4];
+        for (uint32_t q = 0; q < 4; q++) {
+            e[q] = recorded->nodes[0].sum[q];
+        }
+        dtree_refine_node(&refined, 0, recorded, 0, e, node_total(&recorded->nodes[0]), 1);
+
+        dtree_free(&leaf->sampling);
+        leaf->sampling = *recorded;
+        leaf->building = refined;
+        leaf->sample_count = 0;
+    }
+}
+
+// Bounds of everything guide_lookup will be asked about
+static AABB scene_bounds(const Scene* scene) {
+    if (scene->ooc) {
+        // Plus the emitters kept in memory
+        AABB bounds = scene->ooc->top->root->bounds;
+        return scene->bvh ? aabb_union(bounds, scene->bvh->root->bounds) : bounds;
+    }
+    if (scene->bvh) {
+        return scene->bvh->root->bounds;
+    }
+    AABB bounds = aabb_empty();
+    for (uint32_t i = 0; i < scene->prim_count; i++) {
+        bounds = aabb_union(bounds, scene->primitives[i].bounds);
+    }
+    return bounds;
+}
+
+// One pass of render_guided: count more samples for every pixel
+typedef struct {
+    const Scene* scene;
+    const Camera* camera;
+    const RenderSettings* settings;
+    Guide* guide;
+    Vec3* sums;
+    uint32_t width, height;
+    uint32_t samples_done;
+    uint32_t count;
+    PoolRange pixels;
+} GuidedPass;
+
+static void render_guided_thread(void* arg, uint32_t rank) {
+    (void)rank;
+    GuidedPass* r = (GuidedPass*)arg;
+    const Scene* scene = r->scene;
+    const Camera* camera = r->camera;
+    const RenderSettings* settings = r->settings;
+    Guide* guide = r->guide;
+    Vec3* sums = r->sums;
+    uint32_t width = r->width;
+    uint32_t height = r->height;
+    uint32_t spp = settings->samples_per_pixel;
+    uint32_t samples_done = r->samples_done;
+    uint32_t count = r->count;
+
+    Sampler sampler;
+    sampler_init(&sampler, settings->sampler, spp, settings->seed);
+    uint64_t path_histogram[PATH_LENGTH_BINS] = {0};
+
+    uint32_t begin, end;
+    while (pool_range_next(&r->pixels, &begin, &end)) {
+        for (uint32_t p = begin; p < end; p++) {
+            if (settings->cancel_flag && *settings->cancel_flag) {
+                continue;
+            }
+
+            uint32_t i = p % width;
+            uint32_t j = p / width;
+
+            for (uint32_t s = 0; s < count; s++) {
+                sampler_start(&sampler, p, samples_done + s);
+                Ray ray = primary_ray(camera, width, height, i, j, &sampler);
+
+                uint32_t path_length;
+                Vec3 color = trace_path(scene, &ray, NULL, &sampler, 0, settings->max_depth,
+                                        settings->use_nee, guide, NULL, &path_length);
+                sums[p] = vec3_add(sums[p], color);
+                path_histogram[path_length < PATH_LENGTH_BINS ? path_length
+                                                              : PATH_LENGTH_BINS - 1]++;
+            }
+        }
+    }
+
+    render_merge_path_histogram(path_histogram);
+}
+
+// Passes of 1, 2, 4, ... samples per pixel (the last one takes whatever is
+// left of samples_per_pixel). Each pass is an unbiased estimate on its own,
+// so the image is the plain average over all samples of all passes.
+void render_guided(const Scene* scene, const Camera* camera,
+                   const RenderSettings* settings, Image* output) {
+    uint32_t width = output->width;
+    uint32_t height = output->height;
+    uint32_t total_pixels = width * height;
+    uint32_t spp = settings->samples_per_pixel;
+
+    Guide* guide = guide_create(scene_bounds(scene));
+    Vec3* sums = (Vec3*)calloc(total_pixels, sizeof(Vec3));
+    progress_callback_t progress = get_progress_callback();
+    uint32_t samples_done = 0;
+    uint32_t pass_samples = 1;
+
+    for (uint32_t pass = 0; samples_done < spp; pass++) {
+        if (settings->cancel_flag && *settings->cancel_flag) {
+            break;
+        }
+
+        uint32_t count = spp - samples_done < pass_samples ? spp - samples_done : pass_samples;
+
+        GuidedPass r = { scene, camera, settings, guide, sums, width, height,
+                         samples_done, count, { 0 } };
+        pool_range_init(&r.pixels, total_pixels, 16);
+        pool_run(pool_default(), settings->num_threads, POOL_PRIORITY_NORMAL,
+                 render_guided_thread, &r);
+
+        samples_done += count;
+        if (samples_done < spp) {
+            guide_refine(guide, pass);
+        }
+        pass_samples *= 2;
+
+        if (progress) {
+            progress((float)samples_done / spp);
+        }
+    }
+
+    float inv = samples_done > 0 ? 1.0f / samples_done : 0.0f;
+    for (uint32_t p = 0; p < total_pixels; p++) {
+        output->pixels[p] = vec3_scale(sums[p], inv);
+    }
+
+    free(sums);
+    guide_destroy(guide);
+}
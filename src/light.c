@@ -0,0 +1,394 @@
+#include "light.h"
+#include <stdlib.h>
+
+// Surface area of a primitive
+static float primitive_area(const Primitive* prim) {
+    switch (prim->type) {
+        case PRIMITIVE_SPHERE:
+            return 4.0f * (float)M_PI * prim->sphere.radius * prim->sphere.radius;
+        case PRIMITIVE_TRIANGLE: {
+            const Triangle* t = &prim->triangle;
+            return 0.5f * vec3_length(vec3_cross(vec3_sub(t->v1, t->v0), vec3_sub(t->v2, t->v0)));
+        }
+        default:
+            return 0.0f;
+    }
+}
+
+// Geometric normal of a triangle primitive
+static Vec3 primitive_face_normal(const Primitive* prim) {
+    const Triangle* t = &prim->triangle;
+    return vec3_normalize(vec3_cross(vec3_sub(t->v1, t->v0), vec3_sub(t->v2, t->v0)));
+}
+
+static inline float clamp_unit(float x) {
+    return x < -1.0f ? -1.0f : (x > 1.0f ? 1.0f : x);
+}
+
+// Smallest double cone containing double cones a and b
+static void cone_union(Vec3 axis_a, float theta_a, Vec3 axis_b, float theta_b,
+                       Vec3* axis, float* theta) {
+    // Either direction of a double cone axis is valid; pick the closer one
+    if (vec3_dot(axis_a, axis_b) < 0.0f) {
+        axis_b = vec3_scale(axis_b, -1.0f);
+    }
+    if (theta_b > theta_a) {
+        Vec3 tmp_axis = axis_a; axis_a = axis_b; axis_b = tmp_axis;
+        float tmp_theta = theta_a; theta_a = theta_b; theta_b = tmp_theta;
+    }
+
+    float theta_d = acosf(clamp_unit(vec3_dot(axis_a, axis_b)));
+    if (theta_d + theta_b <= theta_a) {
+        *axis = axis_a;
+        *theta = theta_a;
+        return;
+    }
+
+    float theta_o = 0.5f * (theta_a + theta_d + theta_b);
+    if (theta_o >= 0.5f * (float)M_PI) {
+        // A double cone of half-angle pi/2 already covers every direction
+        *axis = axis_a;
+        *theta = 0.5f * (float)M_PI;
+        return;
+    }
+
+    // Rotate axis_a towards axis_b by theta_o - theta_a
+    float theta_r = theta_o - theta_a;
+    Vec3 ortho = vec3_normalize(vec3_sub(axis_b, vec3_scale(axis_a, cosf(theta_d))));
+    *axis = vec3_normalize(vec3_add(vec3_scale(axis_a, cosf(theta_r)),
+                                    vec3_scale(ortho, sinf(theta_r))));
+    *theta = theta_o;
+}
+
+// cos(max(0, a - b)) from the cosines and sines of a and b
+static inline float cos_sub_clamped(float cos_a, float sin_a, float cos_b, float sin_b) {
+    return cos_a > cos_b ? 1.0f : cos_a * cos_b + sin_a * sin_b;
+}
+
+// sin from cos for angles in [0, pi]
+static inline float sin_from_cos(float c) {
+    float s2 = 1.0f - c * c;
+    return s2 > 0.0f ? sqrtf(s2) : 0.0f;
+}
+
+// Estimated contribution of a light tree node to shading point p with
+// normal n. Conservative: it is zero only if no light below can reach p.
+// Works on cosines only so that the per-level cost stays free of trig calls.
+static float light_node_importance(const LightNode* node, Vec3 p, Vec3 n) {
+    Vec3 center = aabb_center(node->bounds);
+    Vec3 to_p = vec3_sub(p, center);
+    float d2 = vec3_length_squared(to_p);
+    float r2 = 0.25f * vec3_length_squared(vec3_sub(node->bounds.max, node->bounds.min));
+
+    if (d2 <= r2) {
+        // Inside the bounds: every direction is possible
+        return node->power / (r2 > 0.0f ? r2 : 1.0f);
+    }
+
+    Vec3 dir = vec3_scale(to_p, 1.0f / sqrtf(d2));
+
+    // Half-angle theta_u subtended by the bounds, seen from p
+    float sin_u = sqrtf(r2 / d2);
+    float cos_u = sin_from_cos(sin_u);
+
+    // Emitter orientation: angle outside the normal cone, less theta_u
+    float cos_w = fabsf(vec3_dot(node->axis, dir));
+    float sin_w = sin_from_cos(cos_w);
+    float cos_x = cos_sub_clamped(cos_w, sin_w, node->cos_theta_o, node->sin_theta_o);
+    float cos_emit = cos_sub_clamped(cos_x, sin_from_cos(cos_x), cos_u, sin_u);
+    if (cos_emit <= 0.0f) {
+        return 0.0f;  // Outside theta_e = pi/2
+    }
+
+    // Receiver orientation: the bounds must be above the shading hemisphere
+    float cos_recv = 1.0f;
+    if (vec3_length_squared(n) > 0.0f) {
+        float cos_i = -vec3_dot(n, dir);
+        cos_recv = cos_sub_clamped(cos_i, sin_from_cos(cos_i), cos_u, sin_u);
+        if (cos_recv <= 0.0f) {
+            return 0.0f;
+        }
+    }
+
+    return node->power * cos_emit * cos_recv / d2;
+}
+
+typedef struct {
+    float key;
+    uint32_t light;
+} LightSortEntry;
+
+static int light_sort_compare(const void* a, const void* b) {
+    float ka = ((const LightSortEntry*)a)->key;
+    float kb = ((const LightSortEntry*)b)->key;
+    return (ka > kb) - (ka < kb);
+}
+
+// Build the subtree over entries [begin, end) and return its node index.
+// Lights are split at the median centroid along the widest axis.
+static uint32_t light_tree_build(LightList* list, LightSortEntry* entries,
+                                 uint32_t begin, uint32_t end, uint32_t parent) {
+    uint32_t idx = list->node_count++;
+    LightNode* node = &list->nodes[idx];
+    node->parent = parent;
+
+    if (end - begin == 1) {
+        uint32_t l = entries[begin].light;
+        const Primitive* prim = list->lights[l].prim;
+        Vec3 e = prim->material.emission;
+
+        node->bounds = prim->bounds;
+        node->power = (e.x + e.y + e.z) / 3.0f * list->lights[l].area;
+        if (prim->type == PRIMITIVE_SPHERE) {
+            node->axis = vec3_create(0, 1, 0);
+            node->theta_o = 0.5f * (float)M_PI;
+        } else {
+            node->axis = primitive_face_normal(prim);
+            node->theta_o = 0.0f;
+        }
+        node->cos_theta_o = cosf(node->theta_o);
+        node->sin_theta_o = sinf(node->theta_o);
+        node->right = UINT32_MAX;
+        node->light = l;
+        list->lights[l].node = idx;
+        return idx;
+    }
+
+    AABB centroid_bounds = aabb_empty();
+    for (uint32_t i = begin; i < end; i++) {
+        const Primitive* prim = list->lights[entries[i].light].prim;
+        centroid_bounds = aabb_expand(centroid_bounds, aabb_center(prim->bounds));
+    }
+    Vec3 extent = vec3_sub(centroid_bounds.max, centroid_bounds.min);
+    int axis = 0;
+    if (extent.y > extent.x) axis = 1;
+    if (extent.z > (axis == 0 ? extent.x : extent.y)) axis = 2;
+
+    for (uint32_t i = begin; i < end; i++) {
+        Vec3 c = aabb_center(list->lights[entries[i].light].prim->bounds);
+        entries[i].key = axis == 0 ? c.x : (axis == 1 ? c.y : c.z);
+    }
+    qsort(entries + begin, end - begin, sizeof(LightSortEntry), light_sort_compare);
+
+    uint32_t mid = begin + (end - begin) / 2;
+    uint32_t left = light_tree_build(list, entries, begin, mid, idx);
+    uint32_t right = light_tree_build(list, entries, mid, end, idx);
+
+    // Children are built, node pointer is still valid (nodes never move)
+    const LightNode* l = &list->nodes[left];
+    const LightNode* r = &list->nodes[right];
+    node->bounds = aabb_union(l->bounds, r->bounds);
+    node->power = l->power + r->power;
+    cone_union(l->axis, l->theta_o, r->axis, r->theta_o, &node->axis, &node->theta_o);
+    node->cos_theta_o = cosf(node->theta_o);
+    node->sin_theta_o = sinf(node->theta_o);
+    node->right = right;
+    node->light = UINT32_MAX;
+    return idx;
+}
+
+LightList* light_list_build(const Primitive* primitives, uint32_t count) {
+    LightList* list = (LightList*)calloc(1, sizeof(LightList));
+    list->primitives = primitives;
+    list->prim_count = count;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (primitive_is_light(&primitives[i])) list->count++;
+    }
+    if (list->count == 0) {
+        return list;
+    }
+
+    list->lights = (Light*)malloc(list->count * sizeof(Light));
+    list->prim_light = (uint32_t*)malloc(count * sizeof(uint32_t));
+    LightSortEntry* entries = (LightSortEntry*)malloc(list->count * sizeof(LightSortEntry));
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        list->prim_light[i] = UINT32_MAX;
+        if (!primitive_is_light(&primitives[i])) continue;
+        list->lights[n].prim = &primitives[i];
+        list->lights[n].area = primitive_area(&primitives[i]);
+        list->prim_light[i] = n;
+        entries[n].light = n;
+        n++;
+    }
+
+    // A binary tree with one light per leaf has 2n - 1 nodes
+    list->nodes = (LightNode*)malloc((2 * n - 1) * sizeof(LightNode));
+    light_tree_build(list, entries, 0, n, UINT32_MAX);
+
+    free(entries);
+    return list;
+}
+
+void light_list_destroy(LightList* lights) {
+    if (lights) {
+        free(lights->lights);
+        free(lights->nodes);
+        free(lights->prim_light);
+        free(lights);
+    }
+}
+
+// Area light_list_sample draws points from (half of a sphere, see below)
+static inline float light_sampled_area(const Light* light) {
+    return light->prim->type == PRIMITIVE_SPHERE ? 0.5f * light->area : light->area;
+}
+
+// Uniform point on a triangle
+static void sample_triangle(Vec3 v0, Vec3 v1, Vec3 v2, float u1, float u2,
+                            LightSample* sample) {
+    float su = sqrtf(u1);
+    float b0 = 1.0f - su;
+    float b1 = u2 * su;
+    sample->point = vec3_add(vec3_add(vec3_scale(v0, b0), vec3_scale(v1, b1)),
+                             vec3_scale(v2, 1.0f - b0 - b1));
+    sample->normal = vec3_normalize(vec3_cross(vec3_sub(v1, v0), vec3_sub(v2, v0)));
+}
+
+// Uniform point on an emitter. For spheres only the hemisphere facing *facing
+// is used (the whole sphere if facing is NULL). pdf_area is left to the caller.
+static bool sample_light_point(const Primitive* prim, const Vec3* facing, float u1, float u2,
+                               LightSample* sample) {
+    switch (prim->type) {
+        case PRIMITIVE_SPHERE: {
+            // Only the hemisphere facing the shading point can be visible from it
+            Vec3 dir = warp_uniform_sphere(u1, u2);
+            if (facing && vec3_dot(dir, vec3_sub(*facing, prim->sphere.center)) < 0.0f) {
+                dir = vec3_scale(dir, -1.0f);
+            }
+            sample->point = vec3_add(prim->sphere.center, vec3_scale(dir, prim->sphere.radius));
+            sample->normal = dir;
+            break;
+        }
+        case PRIMITIVE_TRIANGLE:
+            sample_triangle(prim->triangle.v0, prim->triangle.v1, prim->triangle.v2, u1, u2, sample);
+            break;
+        default:
+            return false;
+    }
+
+    sample->emission = prim->material.emission;
+    sample->one_sided = prim->type == PRIMITIVE_SPHERE;
+    return true;
+}
+
+// Take the branch u falls into and rescale u to [0, 1) within it, so a single
+// sample value serves every level of the tree
+static inline bool light_choose_left(float* u, float p_left) {
+    if (*u < p_left) {
+        *u = fminf(*u / p_left, 0x1.fffffep-1f);
+        return true;
+    }
+    *u = fminf((*u - p_left) / (1.0f - p_left), 0x1.fffffep-1f);
+    return false;
+}
+
+bool light_list_sample(const LightList* lights, Vec3 p, Vec3 n, float u_select,
+                       float u1, float u2, LightSample* sample) {
+    if (lights->count == 0) {
+        return false;
+    }
+
+    // Stochastic descent, choosing children by estimated contribution
+    uint32_t node = 0;
+    float prob = 1.0f;
+    while (lights->nodes[node].light == UINT32_MAX) {
+        uint32_t left = node + 1;
+        uint32_t right = lights->nodes[node].right;
+        float importance_left = light_node_importance(&lights->nodes[left], p, n);
+        float importance_right = light_node_importance(&lights->nodes[right], p, n);
+        float total = importance_left + importance_right;
+        if (total <= 0.0f) {
+            return false;
+        }
+
+        float p_left = importance_left / total;
+        if (light_choose_left(&u_select, p_left)) {
+            node = left;
+            prob *= p_left;
+        } else {
+            node = right;
+            prob *= 1.0f - p_left;
+        }
+    }
+
+    const Light* light = &lights->lights[lights->nodes[node].light];
+    if (!sample_light_point(light->prim, &p, u1, u2, sample)) {
+        return false;
+    }
+    sample->pdf_area = prob / light_sampled_area(light);
+    return prob > 0.0f;
+}
+
+bool light_list_sample_emission(const LightList* lights, float u_select, float u1, float u2,
+                                LightSample* sample) {
+    if (lights->count == 0 || lights->nodes[0].power <= 0.0f) {
+        return false;
+    }
+
+    // Descend by subtree power only
+    uint32_t node = 0;
+    float prob = 1.0f;
+    while (lights->nodes[node].light == UINT32_MAX) {
+        uint32_t left = node + 1;
+        uint32_t right = lights->nodes[node].right;
+        float p_left = lights->nodes[left].power / lights->nodes[node].power;
+        if (light_choose_left(&u_select, p_left)) {
+            node = left;
+            prob *= p_left;
+        } else {
+            node = right;
+            prob *= 1.0f - p_left;
+        }
+    }
+
+    const Light* light = &lights->lights[lights->nodes[node].light];
+    if (!sample_light_point(light->prim, NULL, u1, u2, sample)) {
+        return false;
+    }
+    sample->pdf_area = prob / light->area;
+    return prob > 0.0f;
+}
+
+float light_list_emission_pdf_area(const LightList* lights, const Primitive* prim) {
+    if (!prim || prim < lights->primitives || prim >= lights->primitives + lights->prim_count) {
+        return 0.0f;
+    }
+    uint32_t l = lights->prim_light[prim - lights->primitives];
+    if (l == UINT32_MAX || lights->nodes[0].power <= 0.0f) {
+        return 0.0f;
+    }
+    const Light* light = &lights->lights[l];
+    return lights->nodes[light->node].power / lights->nodes[0].power / light->area;
+}
+
+float light_list_pdf_area(const LightList* lights, const Primitive* prim, Vec3 p, Vec3 n) {
+    if (!prim || prim < lights->primitives || prim >= lights->primitives + lights->prim_count) {
+        return 0.0f;
+    }
+    uint32_t l = lights->prim_light[prim - lights->primitives];
+    if (l == UINT32_MAX) {
+        return 0.0f;
+    }
+
+    // Walk up to the root, multiplying the branch probabilities
+    float prob = 1.0f;
+    uint32_t node = lights->lights[l].node;
+    while (lights->nodes[node].parent != UINT32_MAX) {
+        uint32_t parent = lights->nodes[node].parent;
+        uint32_t left = parent + 1;
+        uint32_t right = lights->nodes[parent].right;
+        float importance_left = light_node_importance(&lights->nodes[left], p, n);
+        float importance_right = light_node_importance(&lights->nodes[right], p, n);
+        float total = importance_left + importance_right;
+        if (total <= 0.0f) {
+            return 0.0f;
+        }
+        prob *= (node == left ? importance_left : importance_right) / total;
+        node = parent;
+    }
+
+    return prob / light_sampled_area(&lights->lights[l]);
+}
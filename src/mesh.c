@@ -0,0 +1,98 @@
+#include "mesh.h"
+#include "bvh.h"
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+
+// Quantize one coordinate into the [0, 65535] range of the mesh box
+static uint16_t quantize(float value, float origin, float scale) {
+    if (scale <= 0.0f) return 0;
+    float q = (value - origin) / scale + 0.5f;
+    q = fminf(fmaxf(q, 0.0f), 65535.0f);
+    return (uint16_t)q;
+}
+
+// Build the face BVH over the quantized triangles and store the faces in
+// leaf order, so leaves refer to contiguous ranges of mesh->indices
+static void mesh_build_bvh(Mesh* mesh, const uint32_t* indices) {
+    AABB* bounds = (AABB*)malloc(mesh->tri_count * sizeof(AABB));
+    for (uint32_t i = 0; i < mesh->tri_count; i++) {
+        const uint32_t* idx = &indices[3 * i];
+        Triangle tri = {mesh_position(mesh, idx[0]), mesh_position(mesh, idx[1]),
+                        mesh_position(mesh, idx[2]), vec3_create(0, 0, 0)};
+        bounds[i] = triangle_bounds(&tri);
+    }
+    BVH* bvh = bvh_create_bounds(bounds, mesh->tri_count);
+    free(bounds);
+
+    mesh->indices = (uint32_t*)malloc(3 * mesh->tri_count * sizeof(uint32_t));
+    for (uint32_t i = 0; i < mesh->tri_count; i++) {
+        memcpy(&mesh->indices[3 * i], &indices[3 * bvh->indices[i]], 3 * sizeof(uint32_t));
+    }
+
+    // Keep only the nodes in use; child pointers move with them
+    mesh->node_count = bvh->node_count;
+    mesh->nodes = (BVHNode*)malloc(bvh->node_count * sizeof(BVHNode));
+    memcpy(mesh->nodes, bvh->nodes, bvh->node_count * sizeof(BVHNode));
+    for (uint32_t i = 0; i < bvh->node_count; i++) {
+        if (!mesh->nodes[i].is_leaf) {
+            mesh->nodes[i].left = &mesh->nodes[bvh->nodes[i].left - bvh->nodes];
+            mesh->nodes[i].right = &mesh->nodes[bvh->nodes[i].right - bvh->nodes];
+        }
+    }
+    bvh_destroy(bvh);
+}
+
+// Create a quantized mesh
+Mesh* mesh_create(const Vec3* positions, const Vec3* normals, uint32_t vertex_count,
+                  const uint32_t* indices, uint32_t tri_count) {
+    if (vertex_count == 0 || tri_count == 0) {
+        return NULL;
+    }
+
+    Mesh* mesh = (Mesh*)calloc(1, sizeof(Mesh));
+    mesh->vertex_count = vertex_count;
+    mesh->tri_count = tri_count;
+
+    // Compute mesh bounds
+    Vec3 bmin = vec3_create(FLT_MAX, FLT_MAX, FLT_MAX);
+    Vec3 bmax = vec3_create(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for (uint32_t i = 0; i < vertex_count; i++) {
+        bmin = vec3_create(fminf(bmin.x, positions[i].x), fminf(bmin.y, positions[i].y),
+                           fminf(bmin.z, positions[i].z));
+        bmax = vec3_create(fmaxf(bmax.x, positions[i].x), fmaxf(bmax.y, positions[i].y),
+                           fmaxf(bmax.z, positions[i].z));
+    }
+
+    mesh->origin = bmin;
+    mesh->scale = vec3_scale(vec3_sub(bmax, bmin), 1.0f / 65535.0f);
+
+    // Quantize positions
+    mesh->positions = (QuantizedPosition*)malloc(vertex_count * sizeof(QuantizedPosition));
+    for (uint32_t i = 0; i < vertex_count; i++) {
+        mesh->positions[i].x = quantize(positions[i].x, bmin.x, mesh->scale.x);
+        mesh->positions[i].y = quantize(positions[i].y, bmin.y, mesh->scale.y);
+        mesh->positions[i].z = quantize(positions[i].z, bmin.z, mesh->scale.z);
+    }
+
+    // Encode normals
+    if (normals) {
+        mesh->normals = (uint32_t*)malloc(vertex_count * sizeof(uint32_t));
+        for (uint32_t i = 0; i < vertex_count; i++) {
+            mesh->normals[i] = oct_encode(vec3_normalize(normals[i]));
+        }
+    }
+
+    mesh_build_bvh(mesh, indices);
+    return mesh;
+}
+
+void mesh_destroy(Mesh* mesh) {
+    if (mesh) {
+        free(mesh->positions);
+        free(mesh->normals);
+        free(mesh->indices);
+        free(mesh->nodes);
+        free(mesh);
+    }
+}
@@ -0,0 +1,239 @@
+#include "obj.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#define OBJ_LINE_MAX 4096
+#define OBJ_NO_NORMAL UINT32_MAX
+
+typedef struct {
+    // As listed in the file
+    Vec3* positions;
+    uint32_t position_count, position_capacity;
+    Vec3* normals;
+    uint32_t normal_count, normal_capacity;
+
+    // Vertices: the distinct (position, normal) pairs faces refer to
+    uint32_t* vertex_position;
+    uint32_t* vertex_normal;
+    uint32_t vertex_count, vertex_capacity;
+
+    // Open-addressing map from position << 32 | normal to vertex
+    uint64_t* map_keys;      // UINT64_MAX = empty slot
+    uint32_t* map_vertices;
+    uint32_t map_capacity;   // Power of two, at least twice vertex_count
+
+    uint32_t* indices;
+    uint32_t index_count, index_capacity;
+} ObjLoader;
+
+// Make room for one more element of size bytes
+static void* obj_grow(void* data, uint32_t* capacity, uint32_t count, size_t size) {
+    if (count < *capacity) {
+        return data;
+    }
+    *capacity = *capacity ? *capacity * 2 : 1024;
+    return realloc(data, *capacity * size);
+}
+
+static inline uint32_t obj_hash(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (uint32_t)key;
+}
+
+static void obj_map_resize(ObjLoader* obj, uint32_t capacity) {
+    uint64_t* keys = (uint64_t*)malloc(capacity * sizeof(uint64_t));
+    uint32_t* vertices = (uint32_t*)malloc(capacity * sizeof(uint32_t));
+    memset(keys, 0xFF, capacity * sizeof(uint64_t));
+
+    for (uint32_t i = 0; i < obj->map_capacity; i++) {
+        if (obj->map_keys[i] == UINT64_MAX) continue;
+        uint32_t slot = obj_hash(obj->map_keys[i]) & (capacity - 1);
+        while (keys[slot] != UINT64_MAX) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        keys[slot] = obj->map_keys[i];
+        vertices[slot] = obj->map_vertices[i];
+    }
+
+    free(obj->map_keys);
+    free(obj->map_vertices);
+    obj->map_keys = keys;
+    obj->map_vertices = vertices;
+    obj->map_capacity = capacity;
+}
+
+// Vertex for a (position, normal) pair, created on first use
+static uint32_t obj_vertex(ObjLoader* obj, uint32_t position, uint32_t normal) {
+    if (2 * (obj->vertex_count + 1) > obj->map_capacity) {
+        obj_map_resize(obj, obj->map_capacity ? obj->map_capacity * 2 : 4096);
+    }
+
+    uint64_t key = (uint64_t)position << 32 | normal;
+    uint32_t slot = obj_hash(key) & (obj->map_capacity - 1);
+    while (obj->map_keys[slot] != UINT64_MAX) {
+        if (obj->map_keys[slot] == key) {
+            return obj->map_vertices[slot];
+        }
+        slot = (slot + 1) & (obj->map_capacity - 1);
+    }
+
+    uint32_t capacity = obj->vertex_capacity;  // Both arrays grow together
+    obj->vertex_position = (uint32_t*)obj_grow(obj->vertex_position, &capacity,
+                                               obj->vertex_count, sizeof(uint32_t));
+    obj->vertex_normal = (uint32_t*)obj_grow(obj->vertex_normal, &obj->vertex_capacity,
+                                             obj->vertex_count, sizeof(uint32_t));
+    obj->vertex_position[obj->vertex_count] = position;
+    obj->vertex_normal[obj->vertex_count] = normal;
+
+    obj->map_keys[slot] = key;
+    obj->map_vertices[slot] = obj->vertex_count;
+    return obj->vertex_count++;
+}
+
+static void obj_push_index(ObjLoader* obj, uint32_t vertex) {
+    obj->indices = (uint32_t*)obj_grow(obj->indices, &obj->index_capacity,
+                                       obj->index_count, sizeof(uint32_t));
+    obj->indices[obj->index_count++] = vertex;
+}
+
+// Face corners "p", "p/t", "p//n" or "p/t/n", 1-based or negative (counted
+// back from the last element read so far); polygons become triangle fans
+static bool obj_parse_face(ObjLoader* obj, char* s) {
+    uint32_t first = 0, prev = 0, corners = 0;
+
+    for (;;) {
+        while (*s == ' ' || *s == '\t') s++;
+        if (*s == '\0' || *s == '\n' || *s == '\r' || *s == '#') {
+            break;
+        }
+
+        char* end;
+        long p = strtol(s, &end, 10);
+        if (end == s) {
+            return false;
+        }
+        s = end;
+
+        long n = 0;
+        if (*s == '/') {
+            strtol(++s, &end, 10);  // Texture coordinate, unused
+            s = end;
+            if (*s == '/') {
+                n = strtol(++s, &end, 10);
+                if (end == s) {
+                    return false;
+                }
+                s = end;
+            }
+        }
+
+        if (p < 0) p += (long)obj->position_count + 1;
+        if (n < 0) n += (long)obj->normal_count + 1;
+        if (p < 1 || p > (long)obj->position_count || n < 0 || n > (long)obj->normal_count) {
+            return false;
+        }
+
+        uint32_t vertex = obj_vertex(obj, (uint32_t)(p - 1), n ? (uint32_t)(n - 1) : OBJ_NO_NORMAL);
+        if (corners == 0) {
+            first = vertex;
+        } else if (corners >= 2) {
+            obj_push_index(obj, first);
+            obj_push_index(obj, prev);
+            obj_push_index(obj, vertex);
+        }
+        prev = vertex;
+        corners++;
+    }
+
+    return corners >= 3;
+}
+
+static bool obj_parse_vec3(char* s, Vec3* v) {
+    return sscanf(s, "%f %f %f", &v->x, &v->y, &v->z) == 3;
+}
+
+ObjMesh* obj_load(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Failed to open mesh file: %s\n", path);
+        return NULL;
+    }
+
+    ObjLoader obj;
+    memset(&obj, 0, sizeof(obj));
+    char line[OBJ_LINE_MAX];
+    uint32_t line_number = 0;
+    bool ok = true;
+
+    while (ok && fgets(line, sizeof(line), f)) {
+        line_number++;
+        char* s = line;
+        while (*s == ' ' || *s == '\t') s++;
+
+        if (s[0] == 'v' && (s[1] == ' ' || s[1] == '\t')) {
+            obj.positions = (Vec3*)obj_grow(obj.positions, &obj.position_capacity,
+                                            obj.position_count, sizeof(Vec3));
+            ok = obj_parse_vec3(s + 2, &obj.positions[obj.position_count++]);
+        } else if (s[0] == 'v' && s[1] == 'n' && (s[2] == ' ' || s[2] == '\t')) {
+            obj.normals = (Vec3*)obj_grow(obj.normals, &obj.normal_capacity,
+                                          obj.normal_count, sizeof(Vec3));
+            ok = obj_parse_vec3(s + 3, &obj.normals[obj.normal_count++]);
+        } else if (s[0] == 'f' && (s[1] == ' ' || s[1] == '\t')) {
+            ok = obj_parse_face(&obj, s + 2);
+        }
+    }
+    fclose(f);
+
+    if (!ok) {
+        fprintf(stderr, "Invalid mesh file %s (line %u)\n", path, line_number);
+    } else if (obj.index_count == 0) {
+        fprintf(stderr, "No faces in mesh file: %s\n", path);
+        ok = false;
+    }
+
+    ObjMesh* mesh = NULL;
+    if (ok) {
+        mesh = (ObjMesh*)calloc(1, sizeof(ObjMesh));
+        mesh->vertex_count = obj.vertex_count;
+        mesh->tri_count = obj.index_count / 3;
+        mesh->indices = obj.indices;
+        obj.indices = NULL;
+
+        mesh->positions = (Vec3*)malloc(obj.vertex_count * sizeof(Vec3));
+        bool all_normals = obj.normal_count > 0;
+        for (uint32_t i = 0; i < obj.vertex_count; i++) {
+            mesh->positions[i] = obj.positions[obj.vertex_position[i]];
+            all_normals = all_normals && obj.vertex_normal[i] != OBJ_NO_NORMAL;
+        }
+
+        // Smooth shading only if every corner has a normal
+        if (all_normals) {
+            mesh->normals = (Vec3*)malloc(obj.vertex_count * sizeof(Vec3));
+            for (uint32_t i = 0; i < obj.vertex_count; i++) {
+                mesh->normals[i] = obj.normals[obj.vertex_normal[i]];
+            }
+        }
+    }
+
+    free(obj.positions);
+    free(obj.normals);
+    free(obj.vertex_position);
+    free(obj.vertex_normal);
+    free(obj.map_keys);
+    free(obj.map_vertices);
+    free(obj.indices);
+    return mesh;
+}
+
+void obj_destroy(ObjMesh* obj) {
+    if (obj) {
+        free(obj->positions);
+        free(obj->normals);
+        free(obj->indices);
+        free(obj);
+    }
+}
@@ -0,0 +1,535 @@
+// pread and fileno are POSIX, not C11
+#define _POSIX_C_SOURCE 200809L
+
+#include "ooc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+// Spread the lower 10 bits of v so there are two zero bits between each
+static uint32_t morton_expand(uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+typedef struct {
+    uint32_t code;
+    uint32_t index;
+} MortonKey;
+
+static int compare_morton(const void* a, const void* b) {
+    uint32_t ca = ((const MortonKey*)a)->code;
+    uint32_t cb = ((const MortonKey*)b)->code;
+    return (ca > cb) - (ca < cb);
+}
+
+// Order of count primitives along a Morton curve over their bounds
+static MortonKey* ooc_morton_order(const Primitive* primitives, uint32_t count) {
+    AABB bounds = aabb_empty();
+    for (uint32_t i = 0; i < count; i++) {
+        bounds = aabb_union(bounds, primitives[i].bounds);
+    }
+    Vec3 extent = vec3_sub(bounds.max, bounds.min);
+
+    MortonKey* keys = (MortonKey*)malloc(count * sizeof(MortonKey));
+    for (uint32_t i = 0; i < count; i++) {
+        Vec3 c = aabb_center(primitives[i].bounds);
+        uint32_t qx = extent.x > 0.0f ? (uint32_t)((c.x - bounds.min.x) / extent.x * 1023.0f) : 0;
+        uint32_t qy = extent.y > 0.0f ? (uint32_t)((c.y - bounds.min.y) / extent.y * 1023.0f) : 0;
+        uint32_t qz = extent.z > 0.0f ? (uint32_t)((c.z - bounds.min.z) / extent.z * 1023.0f) : 0;
+        keys[i].code = (morton_expand(qx) << 2) | (morton_expand(qy) << 1) | morton_expand(qz);
+        keys[i].index = i;
+    }
+    qsort(keys, count, sizeof(MortonKey), compare_morton);
+    return keys;
+}
+
+static bool material_equal(const Material* a, const Material* b) {
+    return a->type == b->type &&
+           a->albedo.x == b->albedo.x && a->albedo.y == b->albedo.y && a->albedo.z == b->albedo.z &&
+           a->roughness == b->roughness && a->ior == b->ior &&
+           a->emission.x == b->emission.x && a->emission.y == b->emission.y &&
+           a->emission.z == b->emission.z &&
+           a->blend_type1 == b->blend_type1 && a->blend_type2 == b->blend_type2 &&
+           a->albedo2.x == b->albedo2.x && a->albedo2.y == b->albedo2.y &&
+           a->albedo2.z == b->albedo2.z &&
+           a->roughness2 == b->roughness2 && a->ior2 == b->ior2 &&
+           a->blend_mode == b->blend_mode &&
+           a->blend_min == b->blend_min && a->blend_max == b->blend_max;
+}
+
+// Find or insert a material in the resident table
+static uint32_t ooc_intern_material(OOCStore* store, const Material* mat, uint32_t* capacity) {
+    // Neighbouring primitives usually share a material, so check the newest first
+    for (uint32_t i = store->material_count; i-- > 0;) {
+        if (material_equal(&store->materials[i], mat)) {
+            return i;
+        }
+    }
+
+    if (store->material_count >= *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        store->materials = (Material*)realloc(store->materials, *capacity * sizeof(Material));
+    }
+    store->materials[store->material_count] = *mat;
+    return store->material_count++;
+}
+
+// Build one chunk's BVH and append it to the file
+static bool ooc_write_chunk(OOCStore* store, OOCChunkInfo* info, Primitive* prims,
+                            uint32_t count, uint32_t* material_capacity) {
+    BVH* bvh = bvh_create(prims, count);  // Reorders prims into leaf order
+
+    info->prim_count = count;
+    info->node_count = bvh->node_count;
+    info->bounds = bvh->root->bounds;
+    info->type_mask = bvh->type_mask;
+    info->file_offset = (uint64_t)ftell(store->file);
+
+    uint32_t* material_ids = (uint32_t*)malloc(count * sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++) {
+        material_ids[i] = ooc_intern_material(store, &prims[i].material, material_capacity);
+    }
+
+    // Child pointers are stored as node indices and fixed up on load
+    BVHNode* nodes = (BVHNode*)malloc(bvh->node_count * sizeof(BVHNode));
+    memcpy(nodes, bvh->nodes, bvh->node_count * sizeof(BVHNode));
+    for (uint32_t i = 0; i < bvh->node_count; i++) {
+        if (!nodes[i].is_leaf) {
+            nodes[i].left = (BVHNode*)(uintptr_t)(bvh->nodes[i].left - bvh->nodes);
+            nodes[i].right = (BVHNode*)(uintptr_t)(bvh->nodes[i].right - bvh->nodes);
+        }
+    }
+
+    bool ok = fwrite(prims, sizeof(Primitive), count, store->file) == count &&
+              fwrite(material_ids, sizeof(uint32_t), count, store->file) == count &&
+              fwrite(nodes, sizeof(BVHNode), bvh->node_count, store->file) == bvh->node_count;
+
+    if (count > store->max_chunk_prims) store->max_chunk_prims = count;
+    if (bvh->node_count > store->max_chunk_nodes) store->max_chunk_nodes = bvh->node_count;
+
+    free(nodes);
+    free(material_ids);
+    bvh_destroy(bvh);
+    return ok;
+}
+
+// Read exactly size bytes at offset
+static bool ooc_pread(int fd, void* buffer, size_t size, uint64_t offset, int* error) {
+    char* p = (char*)buffer;
+    while (size > 0) {
+        ssize_t n = pread(fd, p, size, (off_t)offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            *error = n < 0 ? errno : 0;  // 0: the file ends early
+            return false;
+        }
+        p += n;
+        size -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return true;
+}
+
+// Read a chunk into a slot the caller has claimed. Runs without the store
+// lock; pread lets several threads page in chunks at once.
+static bool ooc_load_chunk(OOCStore* store, OOCCacheSlot* slot, uint32_t chunk_idx, int* error) {
+    const OOCChunkInfo* info = &store->chunks[chunk_idx];
+    int fd = fileno(store->file);
+    size_t prim_bytes = info->prim_count * sizeof(Primitive);
+    size_t id_bytes = info->prim_count * sizeof(uint32_t);
+
+    if (!ooc_pread(fd, slot->bvh.primitives, prim_bytes, info->file_offset, error) ||
+        !ooc_pread(fd, slot->material_ids, id_bytes, info->file_offset + prim_bytes, error) ||
+        !ooc_pread(fd, slot->bvh.nodes, info->node_count * sizeof(BVHNode),
+                   info->file_offset + prim_bytes + id_bytes, error)) {
+        return false;
+    }
+
+    BVHNode* nodes = slot->bvh.nodes;
+    for (uint32_t i = 0; i < info->node_count; i++) {
+        if (!nodes[i].is_leaf) {
+            nodes[i].left = &nodes[(uintptr_t)nodes[i].left];
+            nodes[i].right = &nodes[(uintptr_t)nodes[i].right];
+        }
+    }
+
+    slot->bvh.root = &nodes[0];
+    slot->bvh.prim_count = info->prim_count;
+    slot->bvh.node_count = info->node_count;
+    slot->bvh.type_mask = info->type_mask;
+    slot->hit_fn = bvh_select_kernel(&slot->bvh);
+    return true;
+}
+
+OOCWriter* ooc_writer_create(const char* path, uint32_t chunk_size, uint32_t cache_chunks) {
+    if (chunk_size == 0 || cache_chunks == 0) {
+        return NULL;
+    }
+
+    FILE* file = fopen(path, "w+b");
+    if (!file) {
+        fprintf(stderr, "Failed to create geometry chunk file: %s\n", path);
+        return NULL;
+    }
+
+    OOCStore* store = (OOCStore*)calloc(1, sizeof(OOCStore));
+    store->file = file;
+    store->path = (char*)malloc(strlen(path) + 1);
+    strcpy(store->path, path);
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_cond_init(&store->changed, NULL);
+
+    OOCWriter* writer = (OOCWriter*)calloc(1, sizeof(OOCWriter));
+    writer->store = store;
+    writer->chunk_size = chunk_size;
+    writer->cache_chunks = cache_chunks;
+    writer->staged = (Primitive*)malloc((size_t)chunk_size * OOC_WRITER_WINDOW * sizeof(Primitive));
+    writer->chunk_prims = (Primitive*)malloc(chunk_size * sizeof(Primitive));
+    return writer;
+}
+
+// Sort the staged primitives along their own Morton curve and write them
+// out as chunks
+static void ooc_writer_flush(OOCWriter* writer) {
+    OOCStore* store = writer->store;
+    MortonKey* keys = ooc_morton_order(writer->staged, writer->staged_count);
+
+    for (uint32_t first = 0; first < writer->staged_count && !writer->failed;
+         first += writer->chunk_size) {
+        uint32_t n = writer->staged_count - first;
+        if (n > writer->chunk_size) n = writer->chunk_size;
+        for (uint32_t i = 0; i < n; i++) {
+            writer->chunk_prims[i] = writer->staged[keys[first + i].index];
+        }
+
+        if (store->chunk_count >= writer->chunk_capacity) {
+            writer->chunk_capacity = writer->chunk_capacity ? writer->chunk_capacity * 2 : 64;
+            store->chunks = (OOCChunkInfo*)realloc(store->chunks,
+                                                   writer->chunk_capacity * sizeof(OOCChunkInfo));
+        }
+        writer->failed = !ooc_write_chunk(store, &store->chunks[store->chunk_count++],
+                                          writer->chunk_prims, n, &writer->material_capacity);
+    }
+
+    free(keys);
+    writer->staged_count = 0;
+}
+
+void ooc_writer_add(OOCWriter* writer, const Primitive* prim) {
+    if (writer->failed) {
+        return;
+    }
+    writer->staged[writer->staged_count++] = *prim;
+    if (writer->staged_count == writer->chunk_size * OOC_WRITER_WINDOW) {
+        ooc_writer_flush(writer);
+    }
+}
+
+void ooc_writer_destroy(OOCWriter* writer) {
+    if (writer) {
+        ooc_store_destroy(writer->store);
+        free(writer->staged);
+        free(writer->chunk_prims);
+        free(writer);
+    }
+}
+
+OOCStore* ooc_writer_finish(OOCWriter* writer) {
+    if (writer->staged_count > 0 && !writer->failed) {
+        ooc_writer_flush(writer);
+    }
+
+    OOCStore* store = writer->store;
+    uint32_t cache_chunks = writer->cache_chunks;
+    bool failed = writer->failed;
+    writer->store = NULL;
+    ooc_writer_destroy(writer);
+
+    if (failed || fflush(store->file) != 0) {
+        fprintf(stderr, "Failed to write geometry chunk file: %s\n", store->path);
+        ooc_store_destroy(store);
+        return NULL;
+    }
+    if (store->chunk_count == 0) {
+        fprintf(stderr, "No geometry for chunk file: %s\n", store->path);
+        ooc_store_destroy(store);
+        return NULL;
+    }
+
+    // Top-level BVH: one proxy primitive per chunk, only bounds are used
+    store->top_proxies = (Primitive*)calloc(store->chunk_count, sizeof(Primitive));
+    for (uint32_t c = 0; c < store->chunk_count; c++) {
+        store->top_proxies[c].type = PRIMITIVE_SPHERE;
+        store->top_proxies[c].bounds = store->chunks[c].bounds;
+    }
+    store->top = bvh_create(store->top_proxies, store->chunk_count);
+
+    // Allocate cache slots sized for the largest chunk
+    store->slot_count = cache_chunks;
+    store->slots = (OOCCacheSlot*)calloc(cache_chunks, sizeof(OOCCacheSlot));
+    for (uint32_t s = 0; s < cache_chunks; s++) {
+        OOCCacheSlot* slot = &store->slots[s];
+        slot->bvh.primitives = (Primitive*)malloc(store->max_chunk_prims * sizeof(Primitive));
+        slot->bvh.nodes = (BVHNode*)malloc(store->max_chunk_nodes * sizeof(BVHNode));
+        slot->material_ids = (uint32_t*)malloc(store->max_chunk_prims * sizeof(uint32_t));
+        atomic_init(&slot->chunk_idx, -1);
+        atomic_init(&slot->pin_count, 0);
+        atomic_init(&slot->last_used, 0);
+    }
+
+    store->chunk_slot = (atomic_int*)malloc(store->chunk_count * sizeof(atomic_int));
+    for (uint32_t c = 0; c < store->chunk_count; c++) {
+        atomic_init(&store->chunk_slot[c], -1);
+    }
+
+    return store;
+}
+
+OOCStore* ooc_store_create(const Primitive* primitives, uint32_t count, const char* path,
+                           uint32_t chunk_size, uint32_t cache_chunks) {
+    if (count == 0) {
+        return NULL;
+    }
+
+    OOCWriter* writer = ooc_writer_create(path, chunk_size, cache_chunks);
+    if (!writer) {
+        return NULL;
+    }
+
+    MortonKey* keys = ooc_morton_order(primitives, count);
+    for (uint32_t i = 0; i < count; i++) {
+        ooc_writer_add(writer, &primitives[keys[i].index]);
+    }
+    free(keys);
+
+    return ooc_writer_finish(writer);
+}
+
+void ooc_store_destroy(OOCStore* store) {
+    if (store) {
+        if (store->slots) {
+            for (uint32_t s = 0; s < store->slot_count; s++) {
+                free(store->slots[s].bvh.primitives);
+                free(store->slots[s].bvh.nodes);
+                free(store->slots[s].material_ids);
+            }
+            free(store->slots);
+        }
+        if (store->top) bvh_destroy(store->top);
+        free(store->top_proxies);
+        free(store->chunk_slot);
+        free(store->chunks);
+        free(store->materials);
+        if (store->file) {
+            fclose(store->file);
+            remove(store->path);
+        }
+        free(store->path);
+        pthread_mutex_destroy(&store->lock);
+        pthread_cond_destroy(&store->changed);
+        free(store);
+    }
+}
+
+static void ooc_release(OOCStore* store, OOCCacheSlot* slot) {
+    // The last pin out wakes threads waiting for a slot to evict
+    if (atomic_fetch_sub(&slot->pin_count, 1) == 1 && atomic_load(&store->waiters) > 0) {
+        pthread_mutex_lock(&store->lock);
+        pthread_cond_broadcast(&store->changed);
+        pthread_mutex_unlock(&store->lock);
+    }
+}
+
+// Pin slot if it is not loading and holds chunk_idx (no lock needed)
+static bool ooc_try_pin(OOCStore* store, OOCCacheSlot* slot, uint32_t chunk_idx) {
+    uint32_t pins = atomic_fetch_add(&slot->pin_count, 1);
+    if (!(pins & OOC_SLOT_LOADING) && atomic_load(&slot->chunk_idx) == (int)chunk_idx) {
+        return true;
+    }
+    ooc_release(store, slot);
+    return false;
+}
+
+// Claim the least recently used unpinned slot for loading (caller holds the
+// lock). Returns NULL if every slot is pinned or loading.
+static OOCCacheSlot* ooc_claim_lru(OOCStore* store) {
+    for (;;) {
+        OOCCacheSlot* lru = NULL;
+        uint64_t lru_used = 0;
+        for (uint32_t s = 0; s < store->slot_count; s++) {
+            OOCCacheSlot* candidate = &store->slots[s];
+            uint64_t used = atomic_load_explicit(&candidate->last_used, memory_order_relaxed);
+            if (atomic_load(&candidate->pin_count) == 0 && (!lru || used < lru_used)) {
+                lru = candidate;
+                lru_used = used;
+            }
+        }
+        if (!lru) {
+            return NULL;
+        }
+
+        // Fails if a thread pinned the slot since the scan
+        uint32_t unpinned = 0;
+        if (atomic_compare_exchange_strong(&lru->pin_count, &unpinned, OOC_SLOT_LOADING)) {
+            return lru;
+        }
+    }
+}
+
+// Pin a chunk in the cache, paging it in if needed. Waits while every slot
+// is pinned. Returns NULL only if the chunk could not be read.
+static OOCCacheSlot* ooc_acquire(OOCStore* store, uint32_t chunk_idx) {
+    int32_t resident = atomic_load(&store->chunk_slot[chunk_idx]);
+    if (resident >= 0 && ooc_try_pin(store, &store->slots[resident], chunk_idx)) {
+        OOCCacheSlot* slot = &store->slots[resident];
+        atomic_fetch_add_explicit(&store->hits, 1, memory_order_relaxed);
+        atomic_store_explicit(&slot->last_used,
+                              atomic_load_explicit(&store->clock, memory_order_relaxed),
+                              memory_order_relaxed);
+        return slot;
+    }
+
+    OOCCacheSlot* slot = NULL;
+    bool found = false;
+
+    // Registered before looking at the slots so ooc_release cannot miss us
+    pthread_mutex_lock(&store->lock);
+    atomic_fetch_add(&store->waiters, 1);
+    for (;;) {
+        resident = atomic_load(&store->chunk_slot[chunk_idx]);
+        if (resident >= 0) {
+            slot = &store->slots[resident];
+            if (atomic_load(&slot->pin_count) & OOC_SLOT_LOADING) {
+                // Another thread is reading this chunk in
+                pthread_cond_wait(&store->changed, &store->lock);
+                continue;
+            }
+            // Slots are only claimed under the lock, so this pin holds
+            atomic_fetch_add(&slot->pin_count, 1);
+            found = true;
+            break;
+        }
+
+        slot = ooc_claim_lru(store);
+        if (slot) {
+            break;
+        }
+        pthread_cond_wait(&store->changed, &store->lock);
+    }
+    atomic_fetch_sub(&store->waiters, 1);
+
+    if (found) {
+        atomic_fetch_add_explicit(&store->hits, 1, memory_order_relaxed);
+        atomic_store(&slot->last_used, atomic_load(&store->clock));
+        pthread_mutex_unlock(&store->lock);
+        return slot;
+    }
+
+    int32_t evicted = atomic_load(&slot->chunk_idx);
+    if (evicted >= 0) {
+        atomic_store(&store->chunk_slot[evicted], -1);
+        atomic_fetch_add_explicit(&store->evictions, 1, memory_order_relaxed);
+    }
+    atomic_store(&slot->chunk_idx, (int)chunk_idx);
+    atomic_store(&store->chunk_slot[chunk_idx], (int)(slot - store->slots));
+    atomic_fetch_add_explicit(&store->misses, 1, memory_order_relaxed);
+    uint64_t now = atomic_fetch_add(&store->clock, 1) + 1;
+    pthread_mutex_unlock(&store->lock);
+
+    int error = 0;
+    bool ok = ooc_load_chunk(store, slot, chunk_idx, &error);
+
+    pthread_mutex_lock(&store->lock);
+    if (ok) {
+        atomic_store(&slot->last_used, now);
+        atomic_fetch_sub(&slot->pin_count, OOC_SLOT_LOADING - 1);  // Keep our pin
+    } else {
+        atomic_store(&store->chunk_slot[chunk_idx], -1);
+        atomic_store(&slot->chunk_idx, -1);
+        atomic_store(&slot->last_used, 0);
+        atomic_fetch_sub(&slot->pin_count, OOC_SLOT_LOADING);
+        if (atomic_fetch_add(&store->read_errors, 1) == 0) {
+            fprintf(stderr, "Failed to read geometry chunk %u from %s: %s\n", chunk_idx,
+                    store->path, error ? strerror(error) : "unexpected end of file");
+        }
+    }
+    pthread_cond_broadcast(&store->changed);
+    pthread_mutex_unlock(&store->lock);
+
+    return ok ? slot : NULL;
+}
+
+bool ooc_store_hit(OOCStore* store, const Ray* ray, float t_min, float t_max,
+                   HitRecord* rec) {
+    const BVH* top = store->top;
+    BVHNode* stack[64];
+    int stack_ptr = 0;
+
+    bool hit_anything = false;
+    float closest_so_far = t_max;
+
+    stack[stack_ptr++] = top->root;
+
+    while (stack_ptr > 0) {
+        BVHNode* node = stack[--stack_ptr];
+
+        if (!aabb_hit(&node->bounds, ray, t_min, closest_so_far)) {
+            continue;
+        }
+
+        if (!node->is_leaf) {
+            stack[stack_ptr++] = node->left;
+            stack[stack_ptr++] = node->right;
+            continue;
+        }
+
+        for (uint32_t i = 0; i < node->prim_count; i++) {
+            uint32_t pos = node->first_prim_idx + i;
+            if (!aabb_hit(&top->primitives[pos].bounds, ray, t_min, closest_so_far)) {
+                continue;
+            }
+
+            // NULL only after a read error, which is counted and reported
+            OOCCacheSlot* slot = ooc_acquire(store, top->indices[pos]);
+            if (!slot) {
+                continue;
+            }
+
+            if (slot->hit_fn(&slot->bvh, ray, t_min, closest_so_far, rec)) {
+                // The primitive and its material live in the slot, which may
+                // be evicted once released; redirect to the resident table
+                uint32_t local_idx = (uint32_t)(rec->prim - slot->bvh.primitives);
+                rec->material = &store->materials[slot->material_ids[local_idx]];
+                rec->prim = NULL;
+
+                hit_anything = true;
+                closest_so_far = rec->t;
+            }
+
+            ooc_release(store, slot);
+        }
+    }
+
+    return hit_anything;
+}
+
+void ooc_store_get_stats(OOCStore* store, OOCStats* stats) {
+    stats->hits = atomic_load(&store->hits);
+    stats->misses = atomic_load(&store->misses);
+    stats->evictions = atomic_load(&store->evictions);
+    stats->read_errors = atomic_load(&store->read_errors);
+}
+
+void ooc_store_reset_stats(OOCStore* store) {
+    atomic_store(&store->hits, 0);
+    atomic_store(&store->misses, 0);
+    atomic_store(&store->evictions, 0);
+    atomic_store(&store->read_errors, 0);
+}
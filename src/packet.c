@@ -0,0 +1,316 @@
+#include "packet.h"
+#include <float.h>
+#include <math.h>
+
+// Branch-free min/max: fminf/fmaxf are libm calls unless NaN semantics are
+// relaxed, which is far too slow for the per-node tests below
+static inline float packet_min(float a, float b) { return a < b ? a : b; }
+static inline float packet_max(float a, float b) { return a > b ? a : b; }
+
+// Keep inverse directions finite so interval products never produce NaN
+static inline float safe_inverse(float d) {
+    if (fabsf(d) < 1e-20f) {
+        d = signbit(d) ? -1e-20f : 1e-20f;
+    }
+    return 1.0f / d;
+}
+
+bool packet_init(RayPacket* packet, const Ray rays[PACKET_SIZE],
+                 const bool active[PACKET_SIZE]) {
+    bool first = true;
+    bool negative[3] = {false, false, false};
+
+    for (int a = 0; a < 3; a++) {
+        packet->o_min[a] = packet->inv_min[a] = FLT_MAX;
+        packet->o_max[a] = packet->inv_max[a] = -FLT_MAX;
+    }
+
+    for (uint32_t lane = 0; lane < PACKET_SIZE; lane++) {
+        const Ray* r = &rays[lane];
+        packet->ox[lane] = r->origin.x;
+        packet->oy[lane] = r->origin.y;
+        packet->oz[lane] = r->origin.z;
+        packet->dx[lane] = r->direction.x;
+        packet->dy[lane] = r->direction.y;
+        packet->dz[lane] = r->direction.z;
+        packet->inv_dx[lane] = safe_inverse(r->direction.x);
+        packet->inv_dy[lane] = safe_inverse(r->direction.y);
+        packet->inv_dz[lane] = safe_inverse(r->direction.z);
+        packet->t_max[lane] = FLT_MAX;
+        packet->active[lane] = active[lane];
+
+        if (!active[lane]) continue;
+
+        float o[3] = {packet->ox[lane], packet->oy[lane], packet->oz[lane]};
+        float inv[3] = {packet->inv_dx[lane], packet->inv_dy[lane], packet->inv_dz[lane]};
+        for (int a = 0; a < 3; a++) {
+            // All lanes must travel in the same direction along each axis
+            if (first) {
+                negative[a] = inv[a] < 0.0f;
+            } else if ((inv[a] < 0.0f) != negative[a]) {
+                return false;
+            }
+            packet->o_min[a] = packet_min(packet->o_min[a], o[a]);
+            packet->o_max[a] = packet_max(packet->o_max[a], o[a]);
+            packet->inv_min[a] = packet_min(packet->inv_min[a], inv[a]);
+            packet->inv_max[a] = packet_max(packet->inv_max[a], inv[a]);
+        }
+        first = false;
+    }
+
+    return true;
+}
+
+// Conservative test: true if no ray of the packet can hit the box.
+// The entry/exit distances of all rays are bounded with interval arithmetic
+// over the origin and inverse-direction ranges of the packet.
+static bool packet_culled(const RayPacket* p, const AABB* box, float t_min, float t_max) {
+    float near_lo = t_min;
+    float far_hi = t_max;
+
+    for (int a = 0; a < 3; a++) {
+        float bmin = ((const float*)&box->min)[a];
+        float bmax = ((const float*)&box->max)[a];
+        bool negative = p->inv_max[a] < 0.0f;
+        float near_plane = negative ? bmax : bmin;
+        float far_plane = negative ? bmin : bmax;
+
+        // [near_plane - o_max, near_plane - o_min] * [inv_min, inv_max]
+        float n0 = (near_plane - p->o_max[a]) * p->inv_min[a];
+        float n1 = (near_plane - p->o_max[a]) * p->inv_max[a];
+        float n2 = (near_plane - p->o_min[a]) * p->inv_min[a];
+        float n3 = (near_plane - p->o_min[a]) * p->inv_max[a];
+        float f0 = (far_plane - p->o_max[a]) * p->inv_min[a];
+        float f1 = (far_plane - p->o_max[a]) * p->inv_max[a];
+        float f2 = (far_plane - p->o_min[a]) * p->inv_min[a];
+        float f3 = (far_plane - p->o_min[a]) * p->inv_max[a];
+
+        near_lo = packet_max(near_lo, packet_min(packet_min(n0, n1), packet_min(n2, n3)));
+        far_hi = packet_min(far_hi, packet_max(packet_max(f0, f1), packet_max(f2, f3)));
+    }
+
+    return near_lo > far_hi;
+}
+
+// Per-lane slab test; returns the number of lanes that hit the box.
+// Lane masks are ints rather than bools: byte-sized masks next to float
+// lanes keep GCC from vectorizing these loops.
+static uint32_t packet_box_mask(const RayPacket* p, const AABB* box, float t_min,
+                                int mask[PACKET_SIZE]) {
+    uint32_t count = 0;
+
+    #pragma omp simd reduction(+:count)
+    for (uint32_t lane = 0; lane < PACKET_SIZE; lane++) {
+        float tx0 = (box->min.x - p->ox[lane]) * p->inv_dx[lane];
+        float tx1 = (box->max.x - p->ox[lane]) * p->inv_dx[lane];
+        float ty0 = (box->min.y - p->oy[lane]) * p->inv_dy[lane];
+        float ty1 = (box->max.y - p->oy[lane]) * p->inv_dy[lane];
+        float tz0 = (box->min.z - p->oz[lane]) * p->inv_dz[lane];
+        float tz1 = (box->max.z - p->oz[lane]) * p->inv_dz[lane];
+
+        float t_near = packet_max(packet_max(packet_min(tx0, tx1), packet_min(ty0, ty1)), packet_max(packet_min(tz0, tz1), t_min));
+        float t_far = packet_min(packet_min(packet_max(tx0, tx1), packet_max(ty0, ty1)), packet_min(packet_max(tz0, tz1), p->t_max[lane]));
+
+        mask[lane] = p->active[lane] & (t_near < t_far);
+        count += mask[lane];
+    }
+
+    return count;
+}
+
+static inline Ray packet_lane_ray(const RayPacket* p, uint32_t lane) {
+    Ray r;
+    r.origin = vec3_create(p->ox[lane], p->oy[lane], p->oz[lane]);
+    r.direction = vec3_create(p->dx[lane], p->dy[lane], p->dz[lane]);
+    return r;
+}
+
+// Finalize a lane whose SIMD test found a closer hit
+static inline void packet_accept(RayPacket* p, uint32_t lane, const Primitive* prim,
+                                 float t_min, HitRecord recs[PACKET_SIZE],
+                                 bool hit[PACKET_SIZE]) {
+    Ray ray = packet_lane_ray(p, lane);
+    if (primitive_hit(prim, &ray, t_min, p->t_max[lane], &recs[lane])) {
+        p->t_max[lane] = recs[lane].t;
+        hit[lane] = true;
+    }
+}
+
+// Vectorized ray-sphere filter for all lanes of the mask; lanes that pass are
+// finalized with the scalar sphere_hit
+static void packet_test_sphere(RayPacket* p, const Primitive* prim, const int mask[PACKET_SIZE],
+                               float t_min, HitRecord recs[PACKET_SIZE], bool hit[PACKET_SIZE]) {
+    const Sphere* s = &prim->sphere;
+    int candidate[PACKET_SIZE];
+
+    #pragma omp simd
+    for (uint32_t lane = 0; lane < PACKET_SIZE; lane++) {
+        float ocx = p->ox[lane] - s->center.x;
+        float ocy = p->oy[lane] - s->center.y;
+        float ocz = p->oz[lane] - s->center.z;
+        float a = p->dx[lane] * p->dx[lane] + p->dy[lane] * p->dy[lane] + p->dz[lane] * p->dz[lane];
+        float half_b = ocx * p->dx[lane] + ocy * p->dy[lane] + ocz * p->dz[lane];
+        float c = ocx * ocx + ocy * ocy + ocz * ocz - s->radius * s->radius;
+        float disc = half_b * half_b - a * c;
+
+        // Roots t0 <= t1 overlap [t_min, t_max] iff t1 >= t_min and t0 <= t_max;
+        // both are rearranged to compare disc against squares (no sqrt)
+        float r1 = a * t_min + half_b;
+        float r0 = -half_b - a * p->t_max[lane];
+        int far_ok = (r1 <= 0.0f) | (disc >= r1 * r1);
+        int near_ok = (r0 <= 0.0f) | (disc >= r0 * r0);
+        candidate[lane] = mask[lane] & (disc >= 0.0f) & far_ok & near_ok;
+    }
+
+    for (uint32_t lane = 0; lane < PACKET_SIZE; lane++) {
+        if (candidate[lane]) {
+            packet_accept(p, lane, prim, t_min, recs, hit);
+        }
+    }
+}
+
+// Vectorized Möller-Trumbore filter for all lanes of the mask
+static void packet_test_triangle(RayPacket* p, const Primitive* prim, const int mask[PACKET_SIZE],
+                                 float t_min, HitRecord recs[PACKET_SIZE], bool hit[PACKET_SIZE]) {
+    const Triangle* tri = &prim->triangle;
+    Vec3 e1 = vec3_sub(tri->v1, tri->v0);
+    Vec3 e2 = vec3_sub(tri->v2, tri->v0);
+    int candidate[PACKET_SIZE];
+
+    #pragma omp simd
+    for (uint32_t lane = 0; lane < PACKET_SIZE; lane++) {
+        float hx = p->dy[lane] * e2.z - p->dz[lane] * e2.y;
+        float hy = p->dz[lane] * e2.x - p->dx[lane] * e2.z;
+        float hz = p->dx[lane] * e2.y - p->dy[lane] * e2.x;
+        float a = e1.x * hx + e1.y * hy + e1.z * hz;
+        float f = 1.0f / a;
+        float sx = p->ox[lane] - tri->v0.x;
+        float sy = p->oy[lane] - tri->v0.y;
+        float sz = p->oz[lane] - tri->v0.z;
+        float u = f * (sx * hx + sy * hy + sz * hz);
+        float qx = sy * e1.z - sz * e1.y;
+        float qy = sz * e1.x - sx * e1.z;
+        float qz = sx * e1.y - sy * e1.x;
+        float v = f * (p->dx[lane] * qx + p->dy[lane] * qy + p->dz[lane] * qz);
+        float t = f * (e2.x * qx + e2.y * qy + e2.z * qz);
+        // Bitwise ands keep the loop branch-free so it vectorizes
+        candidate[lane] = mask[lane] & (fabsf(a) >= 0.0000001f) &
+                          (u >= 0.0f) & (u <= 1.0f) & (v >= 0.0f) & (u + v <= 1.0f) &
+                          (t >= t_min) & (t <= p->t_max[lane]);
+    }
+
+    for (uint32_t lane = 0; lane < PACKET_SIZE; lane++) {
+        if (candidate[lane]) {
+            packet_accept(p, lane, prim, t_min, recs, hit);
+        }
+    }
+}
+
+static void packet_test_leaf(const BVH* bvh, const BVHNode* node, RayPacket* p,
+                             const int mask[PACKET_SIZE], float t_min,
+                             HitRecord recs[PACKET_SIZE], bool hit[PACKET_SIZE]) {
+    uint32_t first = node->first_prim_idx;
+    uint32_t spheres_end = first + node->sphere_count;
+    uint32_t triangles_end = spheres_end + node->triangle_count;
+    uint32_t end = first + node->prim_count;
+
+    for (uint32_t i = first; i < spheres_end; i++) {
+        packet_test_sphere(p, &bvh->primitives[i], mask, t_min, recs, hit);
+    }
+    for (uint32_t i = spheres_end; i < triangles_end; i++) {
+        packet_test_triangle(p, &bvh->primitives[i], mask, t_min, recs, hit);
+    }
+    // Meshes traverse their own face BVH; keep them scalar
+    for (uint32_t i = triangles_end; i < end; i++) {
+        for (uint32_t lane = 0; lane < PACKET_SIZE; lane++) {
+            if (mask[lane]) {
+                packet_accept(p, lane, &bvh->primitives[i], t_min, recs, hit);
+            }
+        }
+    }
+}
+
+// Single-ray traversal of one subtree for a lane that left the packet
+static void packet_trace_lane(const BVH* bvh, const BVHNode* root, RayPacket* p, uint32_t lane,
+                              float t_min, HitRecord recs[PACKET_SIZE], bool hit[PACKET_SIZE]) {
+    const BVHNode* stack[64];
+    int stack_ptr = 0;
+    Ray ray = packet_lane_ray(p, lane);
+
+    stack[stack_ptr++] = root;
+
+    while (stack_ptr > 0) {
+        const BVHNode* node = stack[--stack_ptr];
+
+        if (!aabb_hit(&node->bounds, &ray, t_min, p->t_max[lane])) {
+            continue;
+        }
+
+        if (node->is_leaf) {
+            for (uint32_t i = 0; i < node->prim_count; i++) {
+                const Primitive* prim = &bvh->primitives[node->first_prim_idx + i];
+                if (primitive_hit(prim, &ray, t_min, p->t_max[lane], &recs[lane])) {
+                    p->t_max[lane] = recs[lane].t;
+                    hit[lane] = true;
+                }
+            }
+        } else {
+            stack[stack_ptr++] = node->left;
+            stack[stack_ptr++] = node->right;
+        }
+    }
+}
+
+void packet_trace(const BVH* bvh, RayPacket* packet, float t_min,
+                  HitRecord recs[PACKET_SIZE], bool hit[PACKET_SIZE]) {
+    const BVHNode* stack[64];
+    int stack_ptr = 0;
+
+    for (uint32_t lane = 0; lane < PACKET_SIZE; lane++) {
+        hit[lane] = false;
+    }
+
+    if (bvh->root) {
+        stack[stack_ptr++] = bvh->root;
+    }
+
+    while (stack_ptr > 0) {
+        const BVHNode* node = stack[--stack_ptr];
+
+        // Largest remaining t_max of the packet bounds the frustum test
+        float t_max = 0.0f;
+        for (uint32_t lane = 0; lane < PACKET_SIZE; lane++) {
+            if (packet->active[lane]) t_max = packet_max(t_max, packet->t_max[lane]);
+        }
+
+        if (packet_culled(packet, &node->bounds, t_min, t_max)) {
+            continue;
+        }
+
+        int mask[PACKET_SIZE];
+        uint32_t count = packet_box_mask(packet, &node->bounds, t_min, mask);
+        if (count == 0) {
+            continue;
+        }
+
+        if (count <= PACKET_FALLBACK_LANES) {
+            for (uint32_t lane = 0; lane < PACKET_SIZE; lane++) {
+                if (mask[lane]) {
+                    packet_trace_lane(bvh, node, packet, lane, t_min, recs, hit);
+                }
+            }
+        } else if (node->is_leaf) {
+            packet_test_leaf(bvh, node, packet, mask, t_min, recs, hit);
+        } else {
+            stack[stack_ptr++] = node->left;
+            stack[stack_ptr++] = node->right;
+        }
+    }
+
+    for (uint32_t lane = 0; lane < PACKET_SIZE; lane++) {
+        if (hit[lane]) {
+            Ray ray = packet_lane_ray(packet, lane);
+            hit_record_finalize(&recs[lane], &ray);
+        }
+    }
+}
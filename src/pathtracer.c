@@ -1,8 +1,13 @@
 #include "pathtracer.h"
+#include "packet.h"
+#include "raster.h"
+#include "tiles.h"
+#include "pool.h"
+#include "obj.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#include <omp.h>
+#include <pthread.h>
 #include <float.h>
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -15,6 +20,20 @@ void set_progress_callback(progress_callback_t callback) {
     g_progress_callback = callback;
 }
 
+progress_callback_t get_progress_callback(void) {
+    return g_progress_callback;
+}
+
+static pthread_mutex_t g_progress_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void render_progress(float progress) {
+    if (g_progress_callback) {
+        pthread_mutex_lock(&g_progress_lock);
+        g_progress_callback(progress);
+        pthread_mutex_unlock(&g_progress_lock);
+    }
+}
+
 // Scene creation and management
 Scene* scene_create(void) {
     Scene* scene = (Scene*)calloc(1, sizeof(Scene));
@@ -31,34 +50,199 @@ void scene_destroy(Scene* scene) {
         if (scene->bvh) {
             bvh_destroy(scene->bvh);
         }
+        if (scene->ooc) {
+            ooc_store_destroy(scene->ooc);
+        }
+        ooc_writer_destroy(scene->ooc_writer);
+        light_list_destroy(scene->lights);
+        envmap_destroy(scene->environment);
+        photon_map_destroy(scene->caustics);
+        for (uint32_t i = 0; i < scene->mesh_count; i++) {
+            mesh_destroy(scene->meshes[i]);
+        }
+        free(scene->meshes);
         free(scene->primitives);
         free(scene);
     }
 }
 
-static void scene_grow_if_needed(Scene* scene) {
+// Append a primitive, or stream it to the chunk file while one is open.
+// Emitters always stay in memory for the light list.
+static void scene_push(Scene* scene, Primitive prim) {
+    if (scene->ooc_writer && !primitive_is_light(&prim)) {
+        ooc_writer_add(scene->ooc_writer, &prim);
+        return;
+    }
     if (scene->prim_count >= scene->prim_capacity) {
         scene->prim_capacity *= 2;
         scene->primitives = (Primitive*)realloc(scene->primitives,
                                                 scene->prim_capacity * sizeof(Primitive));
     }
+    scene->primitives[scene->prim_count++] = prim;
 }
 
 void scene_add_sphere(Scene* scene, Vec3 center, float radius, Material mat) {
-    scene_grow_if_needed(scene);
-    scene->primitives[scene->prim_count++] = primitive_sphere(center, radius, mat);
+    scene_push(scene, primitive_sphere(center, radius, mat));
 }
 
 void scene_add_triangle(Scene* scene, Vec3 v0, Vec3 v1, Vec3 v2, Material mat) {
-    scene_grow_if_needed(scene);
-    scene->primitives[scene->prim_count++] = primitive_triangle(v0, v1, v2, mat);
+    scene_push(scene, primitive_triangle(v0, v1, v2, mat));
+}
+
+void scene_add_mesh(Scene* scene, const Vec3* positions, const Vec3* normals,
+                    uint32_t vertex_count, const uint32_t* indices, uint32_t tri_count,
+                    Material mat, bool compact) {
+    // Emitters stay plain triangles: the light list samples them face by face
+    if (!compact || mat.type == MATERIAL_EMISSIVE) {
+        for (uint32_t i = 0; i < tri_count; i++) {
+            scene_add_triangle(scene, positions[indices[3 * i]], positions[indices[3 * i + 1]],
+                               positions[indices[3 * i + 2]], mat);
+        }
+        return;
+    }
+
+    Mesh* mesh = mesh_create(positions, normals, vertex_count, indices, tri_count);
+    if (!mesh) {
+        return;
+    }
+    scene->meshes = (Mesh**)realloc(scene->meshes, (scene->mesh_count + 1) * sizeof(Mesh*));
+    scene->meshes[scene->mesh_count++] = mesh;
+
+    scene_push(scene, primitive_mesh(mesh, mat));
+}
+
+// Swap the emitters to the front of the primitive array; returns how many
+// there are
+static uint32_t scene_partition_lights(Scene* scene) {
+    uint32_t light_count = 0;
+    for (uint32_t i = 0; i < scene->prim_count; i++) {
+        if (primitive_is_light(&scene->primitives[i])) {
+            Primitive prim = scene->primitives[i];
+            scene->primitives[i] = scene->primitives[light_count];
+            scene->primitives[light_count++] = prim;
+        }
+    }
+    return light_count;
+}
+
+// Render from store instead of the in-memory primitives. The first
+// light_count primitives are the emitters, which stay resident; the rest
+// are released.
+static void scene_use_store(Scene* scene, OOCStore* store, uint32_t light_count) {
+    if (scene->ooc) {
+        ooc_store_destroy(scene->ooc);
+    }
+    scene->ooc = store;
+
+    scene->prim_count = light_count;
+    scene->prim_capacity = light_count > 128 ? light_count : 128;
+    scene->primitives = (Primitive*)realloc(scene->primitives,
+                                            scene->prim_capacity * sizeof(Primitive));
 }
 
 void scene_build_bvh(Scene* scene) {
+    // Streamed geometry is complete; its chunk store replaces the BVH for
+    // everything but the emitters, which were kept in memory
+    if (scene->ooc_writer) {
+        OOCStore* store = ooc_writer_finish(scene->ooc_writer);
+        scene->ooc_writer = NULL;
+        if (store) {
+            scene_use_store(scene, store, scene->prim_count);
+        }
+    }
+
     if (scene->bvh) {
         bvh_destroy(scene->bvh);
+        scene->bvh = NULL;
+    }
+    // Out of core, the BVH only covers the resident emitters
+    if (!scene->ooc || scene->prim_count > 0) {
+        scene->bvh = bvh_create(scene->primitives, scene->prim_count);
+        scene->bvh_hit_fn = bvh_select_kernel(scene->bvh);
+    }
+
+    // Lights point into the primitive array, which the BVH build reorders
+    light_list_destroy(scene->lights);
+    scene->lights = light_list_build(scene->primitives, scene->prim_count);
+}
+
+bool scene_build_out_of_core(Scene* scene, const char* path, uint32_t chunk_size,
+                             uint32_t cache_chunks) {
+    uint32_t light_count = scene_partition_lights(scene);
+    OOCStore* store = ooc_store_create(scene->primitives + light_count,
+                                       scene->prim_count - light_count, path,
+                                       chunk_size, cache_chunks);
+    if (!store) {
+        // The partition moved primitives under the BVH and the light list
+        if (scene->bvh) {
+            scene_build_bvh(scene);
+        }
+        return false;
+    }
+    scene_use_store(scene, store, light_count);
+    scene_build_bvh(scene);
+    return true;
+}
+
+bool scene_begin_out_of_core(Scene* scene, const char* path, uint32_t chunk_size,
+                             uint32_t cache_chunks) {
+    if (scene->ooc || scene->ooc_writer) {
+        fprintf(stderr, "Scene geometry is already out of core\n");
+        return false;
+    }
+
+    OOCWriter* writer = ooc_writer_create(path, chunk_size, cache_chunks);
+    if (!writer) {
+        return false;
+    }
+
+    // Primitives added so far go first; all but the emitters are released
+    // by scene_build_bvh
+    uint32_t light_count = scene_partition_lights(scene);
+    for (uint32_t i = light_count; i < scene->prim_count; i++) {
+        ooc_writer_add(writer, &scene->primitives[i]);
+    }
+    scene->prim_count = light_count;
+    scene->ooc_writer = writer;
+    return true;
+}
+
+bool scene_load_environment(Scene* scene, const char* path) {
+    EnvMap* env = envmap_load(path);
+    if (!env) {
+        return false;
+    }
+    envmap_destroy(scene->environment);
+    scene->environment = env;
+    return true;
+}
+
+bool scene_load_obj(Scene* scene, const char* path, Vec3 base, float size, Material mat,
+                    bool compact) {
+    ObjMesh* obj = obj_load(path);
+    if (!obj) {
+        return false;
+    }
+
+    // Scale the longest side of the bounding box to size and stand the
+    // model on base, centered in x and z
+    AABB box = aabb_empty();
+    for (uint32_t i = 0; i < obj->vertex_count; i++) {
+        box = aabb_expand(box, obj->positions[i]);
+    }
+    Vec3 extent = vec3_sub(box.max, box.min);
+    float longest = fmaxf(extent.x, fmaxf(extent.y, extent.z));
+    float scale = longest > 0.0f ? size / longest : 1.0f;
+    Vec3 anchor = vec3_create(0.5f * (box.min.x + box.max.x), box.min.y,
+                              0.5f * (box.min.z + box.max.z));
+    for (uint32_t i = 0; i < obj->vertex_count; i++) {
+        obj->positions[i] = vec3_add(base, vec3_scale(vec3_sub(obj->positions[i], anchor), scale));
     }
-    scene->bvh = bvh_create(scene->primitives, scene->prim_count);
+
+    scene_add_mesh(scene, obj->positions, obj->normals, obj->vertex_count, obj->indices,
+                   obj->tri_count, mat, compact);
+    obj_destroy(obj);
+    return true;
 }
 
 // Image management
@@ -67,26 +251,34 @@ Image* image_create(uint32_t width, uint32_t height) {
     img->width = width;
     img->height = height;
     img->pixels = (Vec3*)calloc(width * height, sizeof(Vec3));
+    img->albedo = NULL;
+    img->normal = NULL;
+    img->depth = NULL;
     return img;
 }
 
 void image_destroy(Image* img) {
     if (img) {
         free(img->pixels);
+        free(img->albedo);
+        free(img->normal);
+        free(img->depth);
         free(img);
     }
 }
 
-void image_save_bmp(const Image* img, const char* filename) {
-    // Allocate RGB buffer (3 bytes per pixel)
-    unsigned char* rgb_data = (unsigned char*)malloc(img->width * img->height * 3);
-    if (!rgb_data) {
-        fprintf(stderr, "Failed to allocate memory for BMP conversion\n");
-        return;
-    }
+// Tone map rows [begin, end) of an image into 8-bit RGB
+typedef struct {
+    const Image* img;
+    unsigned char* rgb_data;
+} BmpConvert;
+
+static void bmp_convert_rows(void* arg, uint32_t begin, uint32_t end) {
+    const BmpConvert* c = (const BmpConvert*)arg;
+    const Image* img = c->img;
+    unsigned char* rgb_data = c->rgb_data;
 
-    // Convert Vec3 HDR pixels to RGB bytes
-    for (uint32_t j = 0; j < img->height; j++) {
+    for (uint32_t j = begin; j < end; j++) {
         for (uint32_t i = 0; i < img->width; i++) {
             Vec3 color = img->pixels[j * img->width + i];
 
@@ -103,6 +295,21 @@ void image_save_bmp(const Image* img, const char* filename) {
             rgb_data[idx + 2] = (unsigned char)(color.z * 255.0f);
         }
     }
+}
+
+void image_save_bmp(const Image* img, const char* filename) {
+    // Allocate RGB buffer (3 bytes per pixel)
+    unsigned char* rgb_data = (unsigned char*)malloc(img->width * img->height * 3);
+    if (!rgb_data) {
+        fprintf(stderr, "Failed to allocate memory for BMP conversion\n");
+        return;
+    }
+
+    // Convert Vec3 HDR pixels to RGB bytes, a few rows per task
+    BmpConvert convert = { img, rgb_data };
+    ThreadPool* pool = pool_default();
+    pool_parallel_for(pool, pool_thread_count(pool) + 1, POOL_PRIORITY_HIGH, img->height, 8,
+                      bmp_convert_rows, &convert);
 
     // Write BMP file
     int result = stbi_write_bmp(filename, img->width, img->height, 3, rgb_data);
@@ -131,13 +338,21 @@ Vec3 aces_tonemap(Vec3 color) {
 }
 
 // Hit test for scene
-static bool scene_hit(const Scene* scene, const Ray* ray, float t_min, float t_max,
-                     HitRecord* rec) {
-    if (scene->bvh) {
-        return bvh_hit(scene->bvh, ray, t_min, t_max, rec);
+bool scene_hit(const Scene* scene, const Ray* ray, float t_min, float t_max,
+               HitRecord* rec) {
+    bool hit_anything = false;
+
+    if (scene->ooc) {
+        hit_anything = ooc_store_hit(scene->ooc, ray, t_min, t_max, rec);
+        // Resident emitters
+        if (scene->bvh && scene->bvh_hit_fn(scene->bvh, ray, t_min,
+                                            hit_anything ? rec->t : t_max, rec)) {
+            hit_anything = true;
+        }
+    } else if (scene->bvh) {
+        hit_anything = scene->bvh_hit_fn(scene->bvh, ray, t_min, t_max, rec);
     } else {
         // Brute force if no BVH
-        bool hit_anything = false;
         float closest_so_far = t_max;
 
         for (uint32_t i = 0; i < scene->prim_count; i++) {
@@ -146,82 +361,615 @@ static bool scene_hit(const Scene* scene, const Ray* ray, float t_min, float t_m
                 closest_so_far = rec->t;
             }
         }
+    }
 
-        return hit_anything;
+    if (hit_anything) {
+        hit_record_finalize(rec, ray);
     }
+    return hit_anything;
 }
 
-// Main path tracing function
-Vec3 trace_ray(const Scene* scene, const Ray* ray, RNG* rng,
-               uint32_t depth, uint32_t max_depth) {
-    // Russian roulette termination after certain depth
-    const uint32_t RUSSIAN_ROULETTE_DEPTH = 5;
-    
-    if (depth >= max_depth) {
+// Path length histogram and statistics of the last render_parallel call
+static uint64_t g_path_histogram[PATH_LENGTH_BINS];
+static RenderStats g_render_stats;
+
+void render_get_stats(RenderStats* stats) {
+    *stats = g_render_stats;
+}
+
+void render_report_stats(float samples_per_pixel, float error, uint32_t passes) {
+    g_render_stats.samples_per_pixel = samples_per_pixel;
+    g_render_stats.error = error;
+    g_render_stats.passes = passes;
+}
+
+void render_get_path_histogram(uint64_t histogram[PATH_LENGTH_BINS]) {
+    memcpy(histogram, g_path_histogram, sizeof(g_path_histogram));
+}
+
+static pthread_mutex_t g_path_histogram_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void render_merge_path_histogram(const uint64_t histogram[PATH_LENGTH_BINS]) {
+    pthread_mutex_lock(&g_path_histogram_lock);
+    for (uint32_t b = 0; b < PATH_LENGTH_BINS; b++) {
+        g_path_histogram[b] += histogram[b];
+    }
+    pthread_mutex_unlock(&g_path_histogram_lock);
+}
+
+// Solid-angle pdf of the bounce at a hit: the BSDF's own, mixed with the
+// guiding distribution guide_tree if there is one
+static inline float scatter_pdf(const BSDF* bsdf, Vec3 wo, const DTree* guide_tree, Vec3 wi) {
+    float pdf = bsdf_pdf(bsdf, wo, wi);
+    if (guide_tree) {
+        pdf = GUIDE_BSDF_FRACTION * pdf + (1.0f - GUIDE_BSDF_FRACTION) * dtree_pdf(guide_tree, wi);
+    }
+    return pdf;
+}
+
+// BSDF times cosine toward wi at a light-sampled hit, and through pdf the
+// solid-angle pdf of the bounce that would have drawn wi
+static inline Vec3 surface_eval(const BSDF* bsdf, Vec3 wo, const DTree* guide_tree, Vec3 wi,
+                                float* pdf) {
+    *pdf = scatter_pdf(bsdf, wo, guide_tree, wi);
+    return vec3_scale(bsdf_eval(bsdf, wo, wi), fmaxf(vec3_dot(bsdf->normal, wi), 0.0f));
+}
+
+// The BounceSamples of a bounce of trace_path are drawn up front in a fixed
+// order, so every bounce of every sample reads the same sampler dimensions
+// for the same purpose whichever of them it ends up using.
+#define PATH_CAMERA_DIMENSIONS 4  // Pixel jitter and lens
+
+static inline void bounce_samples_draw(Sampler* sampler, BounceSamples* u) {
+    u->light_select = sampler_1d(sampler);
+    sampler_2d(sampler, &u->light[0], &u->light[1]);
+    sampler_2d(sampler, &u->env[0], &u->env[1]);
+    u->lobe = sampler_1d(sampler);
+    sampler_2d(sampler, &u->bsdf[0], &u->bsdf[1]);
+}
+
+// One emitter sample from the light tree
+static Vec3 sample_emitter(const Scene* scene, const HitRecord* rec, const BSDF* bsdf,
+                           Vec3 wo, const DTree* guide_tree, const BounceSamples* u) {
+    LightSample ls;
+    if (!scene->lights || !light_list_sample(scene->lights, rec->point, rec->normal,
+                                             u->light_select, u->light[0], u->light[1], &ls)) {
         return vec3_create(0, 0, 0);
     }
-    
-    // Apply Russian roulette for paths beyond certain depth
-    if (depth >= RUSSIAN_ROULETTE_DEPTH) {
-        float survival_probability = 0.8f;
-        if (rng_float(rng) > survival_probability) {
-            return vec3_create(0, 0, 0);
-        }
+
+    Vec3 to_light = vec3_sub(ls.point, rec->point);
+    float dist2 = vec3_length_squared(to_light);
+    float dist = sqrtf(dist2);
+    Vec3 wi = vec3_div(to_light, dist);
+
+    float cos_surface = vec3_dot(rec->normal, wi);
+    float cos_light = fabsf(vec3_dot(ls.normal, wi));
+    if (cos_surface <= 0.0f || cos_light <= 1e-6f) {
+        return vec3_create(0, 0, 0);
     }
-    
-    HitRecord rec;
 
-    // Test intersection with scene
-    if (!scene_hit(scene, ray, 0.001f, FLT_MAX, &rec)) {
-        // Return background/sky color
-        return scene->ambient_light;
+    // Shadow ray, stopping just short of the light itself
+    Ray shadow = ray_create(rec->point, wi);
+    HitRecord occluder;
+    if (scene_hit(scene, &shadow, 0.001f, dist * 0.999f, &occluder)) {
+        return vec3_create(0, 0, 0);
     }
 
-    // Handle emissive materials (light sources)
-    if (rec.material->type == MATERIAL_EMISSIVE) {
-        return rec.material->emission;
+    float light_pdf = ls.pdf_area * dist2 / cos_light;
+    float bsdf_pdf;
+    Vec3 f_cos = surface_eval(bsdf, wo, guide_tree, wi, &bsdf_pdf);
+    float weight = mis_power_heuristic(light_pdf, bsdf_pdf);
+    return vec3_scale(vec3_mul(f_cos, ls.emission), weight / light_pdf);
+}
+
+// One direction importance sampled from the environment map
+static Vec3 sample_environment(const Scene* scene, const HitRecord* rec, const BSDF* bsdf,
+                               Vec3 wo, const DTree* guide_tree, const BounceSamples* u) {
+    Vec3 wi, radiance;
+    float env_pdf;
+    if (!envmap_sample(scene->environment, u->env[0], u->env[1], &wi, &radiance, &env_pdf)) {
+        return vec3_create(0, 0, 0);
     }
 
-    // Scatter ray based on material
-    Vec3 attenuation;
-    Ray scattered;
+    float cos_surface = vec3_dot(rec->normal, wi);
+    if (cos_surface <= 0.0f) {
+        return vec3_create(0, 0, 0);
+    }
 
-    // Try to scatter the ray
-    if (!material_scatter(rec.material, ray, &rec, &attenuation, &scattered, rng)) {
-        // Material absorbed the ray
+    Ray shadow = ray_create(rec->point, wi);
+    HitRecord occluder;
+    if (scene_hit(scene, &shadow, 0.001f, FLT_MAX, &occluder)) {
         return vec3_create(0, 0, 0);
     }
-    
-    // Recursively trace the scattered ray
-    Vec3 scattered_color = trace_ray(scene, &scattered, rng, depth + 1, max_depth);
-    
-    // Multiply by attenuation (material color)
-    return vec3_mul(attenuation, scattered_color);
+
+    float bsdf_pdf;
+    Vec3 f_cos = surface_eval(bsdf, wo, guide_tree, wi, &bsdf_pdf);
+    float weight = mis_power_heuristic(env_pdf, bsdf_pdf);
+    return vec3_scale(vec3_mul(f_cos, radiance), weight / env_pdf);
 }
 
-// Multi-threaded rendering with OpenMP
-void render_parallel(const Scene* scene, const Camera* camera,
-                    const RenderSettings* settings, Image* output) {
-    uint32_t total_pixels = output->width * output->height;
+static Vec3 sample_direct_light_guided(const Scene* scene, const HitRecord* rec,
+                                       const BSDF* bsdf, Vec3 wo, const DTree* guide_tree,
+                                       const BounceSamples* u) {
+    Vec3 direct = sample_emitter(scene, rec, bsdf, wo, guide_tree, u);
+    if (scene->environment) {
+        direct = vec3_add(direct, sample_environment(scene, rec, bsdf, wo, guide_tree, u));
+    }
+    return direct;
+}
+
+Vec3 sample_direct_light(const Scene* scene, const HitRecord* rec, const BSDF* bsdf, Vec3 wo,
+                         const BounceSamples* u) {
+    return sample_direct_light_guided(scene, rec, bsdf, wo, NULL, u);
+}
 
-    // Set number of threads
-    omp_set_num_threads(settings->num_threads);
+float environment_mis_weight(const Scene* scene, const Ray* ray, float bsdf_pdf) {
+    if (bsdf_pdf <= 0.0f || !scene->environment) {
+        return 1.0f;
+    }
+    return mis_power_heuristic(bsdf_pdf, envmap_pdf(scene->environment, ray->direction));
+}
 
-    // Shared counter for progress tracking
-    uint32_t pixels_done = 0;
+float emitter_mis_weight(const Scene* scene, const Ray* ray, const HitRecord* rec,
+                         float bsdf_pdf, Vec3 prev_normal) {
+    if (bsdf_pdf <= 0.0f || !scene->lights || scene->lights->count == 0) {
+        return 1.0f;
+    }
 
-    #pragma omp parallel
-    {
-        RNG rng;
-        rng_init(&rng, 42 + omp_get_thread_num() * 1000);
+    float dir_len = vec3_length(ray->direction);
+    float dist = rec->t * dir_len;
+    float cos_light = fabsf(vec3_dot(rec->normal, ray->direction)) / dir_len;
+    if (cos_light <= 1e-6f) {
+        return 1.0f;
+    }
 
-        #pragma omp for schedule(dynamic, 16) nowait
-        for (uint32_t pixel_idx = 0; pixel_idx < total_pixels; pixel_idx++) {
+    float pdf_area = light_list_pdf_area(scene->lights, rec->prim, ray->origin, prev_normal);
+    float light_pdf = pdf_area * dist * dist / cos_light;
+    return mis_power_heuristic(bsdf_pdf, light_pdf);
+}
+
+// Diffuse vertex of a guided path; radiance collects what arrives from dir (divided by the throughput up to and including this bounce)
+#define GUIDE_MAX_VERTICES 32
+typedef struct {
+    GuideLeaf* leaf;
+    Vec3 dir;
+    Vec3 throughput;
+    Vec3 radiance;
+    float pdf;
+} GuideVertex;
+
+static inline float guide_luminance(Vec3 c) {
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+// Diffuse vertex whose outgoing radiance goes into the radiance cache
+#define CACHE_MAX_VERTICES 32
+typedef struct {
+    Vec3 point;
+    Vec3 normal;
+    Vec3 albedo;
+    Vec3 throughput;
+    Vec3 radiance;
+} CacheVertex;
+
+// Vertices that collect the radiance reaching them after they were added
+typedef struct {
+    GuideVertex guided[GUIDE_MAX_VERTICES];
+    uint32_t guided_count;
+    CacheVertex cached[CACHE_MAX_VERTICES];
+    uint32_t cached_count;
+} PathVertices;
+
+static inline Vec3 vec3_div_throughput(Vec3 c, Vec3 t) {
+    return vec3_create(t.x > 0.0f ? c.x / t.x : 0.0f,
+                       t.y > 0.0f ? c.y / t.y : 0.0f,
+                       t.z > 0.0f ? c.z / t.z : 0.0f);
+}
+
+// Add a contribution to the path radiance and to the radiance of the guided
+// and cached vertices recorded so far
+static inline void path_add(Vec3* radiance, Vec3 contribution, PathVertices* vertices) {
+    *radiance = vec3_add(*radiance, contribution);
+    for (uint32_t k = 0; k < vertices->guided_count; k++) {
+        GuideVertex* v = &vertices->guided[k];
+        v->radiance = vec3_add(v->radiance, vec3_div_throughput(contribution, v->throughput));
+    }
+    for (uint32_t k = 0; k < vertices->cached_count; k++) {
+        CacheVertex* v = &vertices->cached[k];
+        v->radiance = vec3_add(v->radiance, vec3_div_throughput(contribution, v->throughput));
+    }
+}
+
+// Diffuse bounce drawn from the mixture of BSDF sampling and the guiding
+// distribution. Returns false if the direction is useless.
+static bool guided_scatter(const HitRecord* rec, const BSDF* bsdf, Vec3 wo,
+                           const DTree* guide_tree, const BounceSamples* u, RNG* rng,
+                           Vec3* attenuation, Ray* scattered, float* pdf) {
+    Vec3 dir;
+    if (rng_float(rng) < GUIDE_BSDF_FRACTION) {
+        Vec3 weight;
+        if (!bsdf_sample(bsdf, wo, u->lobe, u->bsdf[0], u->bsdf[1], &dir, &weight, pdf)) {
+            return false;
+        }
+    } else {
+        float guide_pdf;
+        dir = dtree_sample(guide_tree, u->bsdf[0], u->bsdf[1], &guide_pdf);
+    }
+
+    Vec3 f_cos = surface_eval(bsdf, wo, guide_tree, dir, pdf);
+    if (*pdf <= 0.0f || f_cos.x + f_cos.y + f_cos.z <= 0.0f) {
+        return false;
+    }
+
+    *attenuation = vec3_div(f_cos, *pdf);
+    *scattered = ray_create(rec->point, dir);
+    return true;
+}
+
+// Iterative path tracer. Radiance is accumulated along the path while the
+// path throughput (product of attenuations) is carried forward; Russian
+// roulette survival is proportional to that throughput and survivors are
+// divided by the survival probability, which keeps the estimator unbiased.
+// With use_nee, diffuse hits also sample a light directly and emitters hit
+// by the following bounce are weighted by MIS so nothing is counted twice.
+// With a guide, diffuse bounces are drawn from guided_scatter and every
+// diffuse vertex reports the radiance that reached it back to the guide.
+// With a caustic photon map, diffuse hits add its density estimate and light
+// reached through specular bounces after a diffuse one is not counted again.
+// Rough metals are light-sampled like diffuse hits, with their GGX lobe in
+// the MIS weights, unless they sit on such a caustic path.
+// With a radiance cache, every diffuse vertex records the radiance it sent
+// back along the path, and the path ends at the first diffuse hit after
+// cache->diffuse_depth diffuse bounces whose cell can answer for it.
+// Light and BSDF samples come from sampler, bounce by bounce (BounceSamples);
+// Russian roulette, the guide mixture choice and the cache jitter use its rng.
+Vec3 trace_path(const Scene* scene, const Ray* ray, const HitRecord* primary,
+                Sampler* sampler, uint32_t depth, uint32_t max_depth, bool use_nee,
+                Guide* guide, RadianceCache* cache, uint32_t* path_length) {
+    Vec3 radiance = vec3_create(0, 0, 0);
+    Vec3 throughput = vec3_create(1, 1, 1);
+    Ray current = *ray;
+    float bsdf_pdf = 0.0f;  // pdf of the last light-sampled bounce, 0 otherwise
+    Vec3 prev_normal = vec3_create(0, 0, 0);
+    PathVertices vertices;
+    vertices.guided_count = 0;
+    vertices.cached_count = 0;
+    uint32_t diffuse_bounces = 0;
+    const PhotonMap* caustics = scene->caustics;
+    bool seen_diffuse = false;
+    bool caustic_tail = false;  // Last bounce specular, with a diffuse one before it
+
+    use_nee = use_nee && scene_has_direct_lights(scene);
+
+    for (; depth < max_depth; depth++) {
+        HitRecord rec;
+
+        if (primary) {
+            rec = *primary;
+            primary = NULL;
+        } else if (!scene_hit(scene, &current, 0.001f, FLT_MAX, &rec)) {
+            // Background/sky color
+            float weight = use_nee ? environment_mis_weight(scene, &current, bsdf_pdf) : 1.0f;
+            Vec3 background = scene_background(scene, current.direction);
+            path_add(&radiance, vec3_scale(vec3_mul(throughput, background), weight),
+                     &vertices);
+            break;
+        }
+
+        // Handle emissive materials (light sources)
+        if (rec.material->type == MATERIAL_EMISSIVE) {
+            if (caustic_tail) {
+                break;  // Already in the caustic photon map
+            }
+            float weight = use_nee ? emitter_mis_weight(scene, &current, &rec, bsdf_pdf, prev_normal)
+                                   : 1.0f;
+            path_add(&radiance, vec3_scale(vec3_mul(throughput, rec.material->emission), weight),
+                     &vertices);
+            break;
+        }
+
+        BSDF bsdf = material_bsdf(rec.material, &rec);
+        Vec3 wo = vec3_scale(vec3_normalize(current.direction), -1.0f);
+        BounceSamples u;
+        sampler_set_dimension(sampler, PATH_CAMERA_DIMENSIONS + depth * PATH_BOUNCE_DIMENSIONS);
+        bounce_samples_draw(sampler, &u);
+        bool diffuse = bsdf.type == BSDF_LAMBERTIAN;
+        bool light_sampled = use_nee && !bsdf_is_delta(&bsdf) &&
+                             (diffuse || !(caustics && seen_diffuse));
+        GuideLeaf* guide_leaf = diffuse && guide ? guide_lookup(guide, rec.point) : NULL;
+        const DTree* guide_tree = guide_leaf && dtree_usable(&guide_leaf->sampling) ?
+                                  &guide_leaf->sampling : NULL;
+
+        // End the path in the radiance cache, or have it record this vertex
+        if (cache && diffuse) {
+            Vec3 cached;
+            float j1 = rng_float(&sampler->rng);
+            float j2 = rng_float(&sampler->rng);
+            float j3 = rng_float(&sampler->rng);
+            if (diffuse_bounces >= cache->diffuse_depth &&
+                radiance_cache_lookup(cache, rec.point, rec.normal, j1, j2, j3, &cached)) {
+                path_add(&radiance, vec3_mul(throughput, vec3_mul(bsdf.albedo, cached)),
+                         &vertices);
+                break;
+            }
+            if (vertices.cached_count < CACHE_MAX_VERTICES) {
+                CacheVertex* v = &vertices.cached[vertices.cached_count++];
+                v->point = rec.point;
+                v->normal = rec.normal;
+                v->albedo = bsdf.albedo;
+                v->throughput = throughput;
+                v->radiance = vec3_create(0, 0, 0);
+            }
+        }
+
+        // Direct lighting at diffuse and rough metal surfaces
+        if (light_sampled) {
+            Vec3 direct = sample_direct_light_guided(scene, &rec, &bsdf, wo, guide_tree, &u);
+            path_add(&radiance, vec3_mul(throughput, direct), &vertices);
+        }
+
+        // Caustics: flux density times the Lambertian BRDF
+        if (diffuse && caustics) {
+            Vec3 flux = photon_map_estimate(caustics, rec.point, rec.normal);
+            path_add(&radiance, vec3_mul(throughput, vec3_scale(vec3_mul(bsdf.albedo, flux),
+                                                                1.0f / (float)M_PI)),
+                     &vertices);
+        }
+
+        // Scatter ray based on material
+        Vec3 attenuation;
+        Ray scattered;
+
+        if (guide_tree) {
+            if (!guided_scatter(&rec, &bsdf, wo, guide_tree, &u, &sampler->rng, &attenuation,
+                                &scattered, &bsdf_pdf)) {
+                break;
+            }
+        } else {
+            Vec3 wi;
+            if (!bsdf_sample(&bsdf, wo, u.lobe, u.bsdf[0], u.bsdf[1], &wi, &attenuation,
+                             &bsdf_pdf)) {
+                // Material absorbed the ray
+                break;
+            }
+            scattered = ray_create(rec.point, wi);
+        }
+        if (!light_sampled) {
+            bsdf_pdf = 0.0f;  // No light sample here to share the next emitter with
+        }
+
+        throughput = vec3_mul(throughput, attenuation);
+        current = scattered;
+        prev_normal = rec.normal;
+        if (caustics) {
+            caustic_tail = seen_diffuse && !diffuse;
+            seen_diffuse = seen_diffuse || diffuse;
+        }
+
+        diffuse_bounces += diffuse;
+
+        if (guide_leaf && vertices.guided_count < GUIDE_MAX_VERTICES) {
+            GuideVertex* v = &vertices.guided[vertices.guided_count++];
+            v->leaf = guide_leaf;
+            v->dir = vec3_normalize(scattered.direction);
+            v->throughput = throughput;
+            v->radiance = vec3_create(0, 0, 0);
+            v->pdf = bsdf_pdf;
+        }
+
+        // Russian roulette based on remaining path throughput
+        if (depth + 1 >= RUSSIAN_ROULETTE_DEPTH &&
+            !path_russian_roulette(&throughput, rng_float(&sampler->rng))) {
+            depth++;
+            break;
+        }
+    }
+
+    for (uint32_t k = 0; k < vertices.guided_count; k++) {
+        const GuideVertex* v = &vertices.guided[k];
+        if (v->pdf > 0.0f) {
+            guide_record(v->leaf, v->dir, guide_luminance(v->radiance) / v->pdf);
+        }
+    }
+    for (uint32_t k = 0; k < vertices.cached_count; k++) {
+        const CacheVertex* v = &vertices.cached[k];
+        radiance_cache_record(cache, v->point, v->normal,
+                              vec3_div_throughput(v->radiance, v->albedo));
+    }
+
+    if (path_length) {
+        *path_length = depth;
+    }
+    return radiance;
+}
+
+// Main path tracing function
+Vec3 trace_ray(const Scene* scene, const Ray* ray, RNG* rng,
+               uint32_t depth, uint32_t max_depth) {
+    Sampler sampler = sampler_independent(rng);
+    return trace_path(scene, ray, NULL, &sampler, depth, max_depth, false, NULL, NULL, NULL);
+}
+
+Ray primary_ray(const Camera* camera, uint32_t width, uint32_t height,
+                uint32_t i, uint32_t j, Sampler* sampler) {
+    float du, dv, lens_u1, lens_u2;
+    sampler_2d(sampler, &du, &dv);
+    sampler_2d(sampler, &lens_u1, &lens_u2);
+    float u = (i + du) / (float)(width - 1);
+    float v = (j + dv) / (float)(height - 1);
+
+    // Flip v for correct orientation
+    v = 1.0f - v;
+
+    return camera_get_ray(camera, u, v, lens_u1, lens_u2);
+}
+
+static inline void record_path_length(uint64_t histogram[PATH_LENGTH_BINS], uint32_t length) {
+    histogram[length < PATH_LENGTH_BINS ? length : PATH_LENGTH_BINS - 1]++;
+}
+
+// Packet rendering: camera rays of each PACKET_TILE x PACKET_TILE tile are
+// traced through the BVH together, then every path continues on its own
+typedef struct {
+    const Scene* scene;
+    const Camera* camera;
+    const RenderSettings* settings;
+    Image* output;
+    uint32_t tiles_x;
+    uint32_t total_pixels;
+    atomic_uint pixels_done;
+    PoolRange tiles;
+} PacketRender;
+
+static void render_packets_thread(void* arg, uint32_t rank) {
+    (void)rank;
+    PacketRender* r = (PacketRender*)arg;
+    const Scene* scene = r->scene;
+    const Camera* camera = r->camera;
+    const RenderSettings* settings = r->settings;
+    Image* output = r->output;
+    uint32_t tiles_x = r->tiles_x;
+
+    Sampler sampler;
+    sampler_init(&sampler, settings->sampler, settings->samples_per_pixel, settings->seed);
+    uint64_t path_histogram[PATH_LENGTH_BINS] = {0};
+
+    uint32_t tile, end;
+    while (pool_range_next(&r->tiles, &tile, &end)) {
+        if (settings->cancel_flag && *settings->cancel_flag) {
+            continue;
+        }
+
+        uint32_t x0 = (tile % tiles_x) * PACKET_TILE;
+        uint32_t y0 = (tile / tiles_x) * PACKET_TILE;
+        bool active[PACKET_SIZE];
+        Vec3 colors[PACKET_SIZE];
+        uint32_t active_count = 0;
+
+        for (uint32_t lane = 0; lane < PACKET_SIZE; lane++) {
+            uint32_t i = x0 + lane % PACKET_TILE;
+            uint32_t j = y0 + lane / PACKET_TILE;
+            active[lane] = i < output->width && j < output->height;
+            active_count += active[lane];
+            colors[lane] = vec3_create(0, 0, 0);
+        }
+
+        for (uint32_t s = 0; s < settings->samples_per_pixel; s++) {
+            if (settings->cancel_flag && *settings->cancel_flag) {
+                break;
+            }
+
+            Ray rays[PACKET_SIZE];
+            for (uint32_t lane = 0; lane < PACKET_SIZE; lane++) {
+                uint32_t i = x0 + lane % PACKET_TILE;
+                uint32_t j = y0 + lane / PACKET_TILE;
+                if (active[lane]) {
+                    sampler_start(&sampler, j * output->width + i, s);
+                    rays[lane] = primary_ray(camera, output->width, output->height,
+                                             i, j, &sampler);
+                } else {
+                    rays[lane] = rays[0];
+                }
+            }
+
+            RayPacket packet;
+            HitRecord recs[PACKET_SIZE];
+            bool hit[PACKET_SIZE];
+            bool coherent = packet_init(&packet, rays, active);
+            if (coherent) {
+                packet_trace(scene->bvh, &packet, 0.001f, recs, hit);
+            }
+
+            for (uint32_t lane = 0; lane < PACKET_SIZE; lane++) {
+                if (!active[lane]) continue;
+
+                uint32_t path_length = 0;
+                Vec3 sample_color;
+                sampler_start(&sampler, (y0 + lane / PACKET_TILE) * output->width +
+                                        x0 + lane % PACKET_TILE, s);
+                if (!coherent) {
+                    // Mixed direction signs: trace this sample ray by ray
+                    sample_color = trace_path(scene, &rays[lane], NULL, &sampler, 0,
+                                              settings->max_depth, settings->use_nee,
+                                              NULL, NULL, &path_length);
+                } else if (hit[lane]) {
+                    sample_color = trace_path(scene, &rays[lane], &recs[lane], &sampler, 0,
+                                              settings->max_depth, settings->use_nee,
+                                              NULL, NULL, &path_length);
+                } else {
+                    sample_color = settings->max_depth > 0 ?
+                                   scene_background(scene, rays[lane].direction) :
+                                   vec3_create(0, 0, 0);
+                }
+                colors[lane] = vec3_add(colors[lane], sample_color);
+                record_path_length(path_histogram, path_length);
+            }
+        }
+
+        for (uint32_t lane = 0; lane < PACKET_SIZE; lane++) {
+            if (!active[lane]) continue;
+            uint32_t pixel_idx = (y0 + lane / PACKET_TILE) * output->width + x0 + lane % PACKET_TILE;
+            output->pixels[pixel_idx] = vec3_div(colors[lane], (float)settings->samples_per_pixel);
+        }
+
+        if (g_progress_callback) {
+            uint32_t current_done = atomic_fetch_add(&r->pixels_done, active_count) + active_count;
+            render_progress((float)current_done / r->total_pixels);
+        }
+    }
+
+    render_merge_path_histogram(path_histogram);
+}
+
+static void render_packets(const Scene* scene, const Camera* camera,
+                           const RenderSettings* settings, Image* output) {
+    uint32_t tiles_x = (output->width + PACKET_TILE - 1) / PACKET_TILE;
+    uint32_t tiles_y = (output->height + PACKET_TILE - 1) / PACKET_TILE;
+
+    PacketRender r = { scene, camera, settings, output, tiles_x,
+                       output->width * output->height, 0, { 0 } };
+    pool_range_init(&r.tiles, tiles_x * tiles_y, 1);
+    pool_run(pool_default(), settings->num_threads, POOL_PRIORITY_NORMAL,
+             render_packets_thread, &r);
+}
+
+// Path tracer over tiles, one tile per work unit
+typedef struct {
+    const Scene* scene;
+    const Camera* camera;
+    const RenderSettings* settings;
+    Image* output;
+    const TileOrder* order;
+    uint32_t total_pixels;
+    atomic_uint pixels_done;  // Shared counter for progress tracking
+    PoolRange tiles;
+} TileRender;
+
+static void render_tiles_thread(void* arg, uint32_t rank) {
+    (void)rank;
+    TileRender* r = (TileRender*)arg;
+    const Scene* scene = r->scene;
+    const Camera* camera = r->camera;
+    const RenderSettings* settings = r->settings;
+    Image* output = r->output;
+    const TileOrder* order = r->order;
+
+    Sampler sampler;
+    sampler_init(&sampler, settings->sampler, settings->samples_per_pixel, settings->seed);
+
+    // Thread-local path length histogram, merged after the pixel loop
+    uint64_t path_histogram[PATH_LENGTH_BINS] = {0};
+
+    // One tile per work unit, tiles and their pixels in Hilbert order
+    uint32_t tile, end;
+    while (pool_range_next(&r->tiles, &tile, &end)) {
+        for (uint32_t k = order->tile_start[tile]; k < order->tile_start[tile + 1]; k++) {
             // Check cancel flag early - skip processing if cancelled
             if (settings->cancel_flag && *settings->cancel_flag) {
-                continue;  // Skip this pixel
+                break;  // Skip the rest of this tile
             }
 
+            uint32_t pixel_idx = order->pixels[k];
             uint32_t i = pixel_idx % output->width;
             uint32_t j = pixel_idx / output->width;
 
@@ -234,15 +982,14 @@ void render_parallel(const Scene* scene, const Camera* camera,
                     break;  // OK to break from inner loop
                 }
 
-                float u = (i + rng_float(&rng)) / (float)(output->width - 1);
-                float v = (j + rng_float(&rng)) / (float)(output->height - 1);
-
-                // Flip v for correct orientation
-                v = 1.0f - v;
-
-                Ray ray = camera_get_ray(camera, u, v, &rng);
-                Vec3 sample_color = trace_ray(scene, &ray, &rng, 0, settings->max_depth);
+                sampler_start(&sampler, pixel_idx, s);
+                Ray ray = primary_ray(camera, output->width, output->height, i, j, &sampler);
+                uint32_t path_length;
+                Vec3 sample_color = trace_path(scene, &ray, NULL, &sampler, 0,
+                                               settings->max_depth, settings->use_nee, NULL,
+                                               NULL, &path_length);
                 color = vec3_add(color, sample_color);
+                record_path_length(path_histogram, path_length);
             }
 
             // Average samples
@@ -251,18 +998,106 @@ void render_parallel(const Scene* scene, const Camera* camera,
 
             // Update progress every pixel (with atomic increment for thread safety)
             if (g_progress_callback) {
-                uint32_t current_done;
-                #pragma omp atomic capture
-                current_done = ++pixels_done;
+                uint32_t current_done = atomic_fetch_add(&r->pixels_done, 1) + 1;
 
                 // Only call callback every 1000 pixels to reduce overhead
                 if (current_done % 1000 == 0) {
-                    #pragma omp critical
-                    {
-                        g_progress_callback((float)current_done / total_pixels);
-                    }
+                    render_progress((float)current_done / r->total_pixels);
                 }
             }
         }
     }
-}
\ No newline at end of file
+
+    render_merge_path_histogram(path_histogram);
+}
+
+// Multi-threaded rendering on the shared thread pool
+static void render_dispatch(const Scene* scene, const Camera* camera,
+                            const RenderSettings* settings, Image* output) {
+    if (settings->integrator == INTEGRATOR_WAVEFRONT) {
+        render_wavefront(scene, camera, settings, output);
+        return;
+    }
+
+    // Reservoir resampling draws its candidates from the light list
+    if (settings->integrator == INTEGRATOR_RESTIR && scene_has_direct_lights(scene)) {
+        render_restir(scene, camera, settings, output);
+        return;
+    }
+
+    // Light paths start on the light list, and emitters hit out of core
+    // have no primitive to look their pdf up by
+    if (settings->integrator == INTEGRATOR_BDPT && scene_has_direct_lights(scene) &&
+        !scene->ooc) {
+        render_bdpt(scene, camera, settings, output);
+        return;
+    }
+
+    if (settings->use_guiding) {
+        render_guided(scene, camera, settings, output);
+        return;
+    }
+
+    if (settings->radiance_cache > 0) {
+        render_cached(scene, camera, settings, output);
+        return;
+    }
+
+    if (settings->adaptive_threshold > 0.0f || settings->time_budget > 0.0f ||
+        settings->target_error > 0.0f) {
+        render_adaptive(scene, camera, settings, output);
+        return;
+    }
+
+    // Depth of field and out-of-core scenes are ray cast
+    if (settings->use_raster && raster_supported(scene, camera)) {
+        render_raster(scene, camera, settings, output);
+        return;
+    }
+
+    // Packets need an in-memory BVH
+    if (settings->use_packets && scene->bvh && !scene->ooc) {
+        render_packets(scene, camera, settings, output);
+        return;
+    }
+
+    TileOrder* order = tile_order_create(output->width, output->height, settings->tile_size);
+    if (!order) {
+        return;
+    }
+
+    TileRender r = { scene, camera, settings, output, order,
+                     output->width * output->height, 0, { 0 } };
+    pool_range_init(&r.tiles, order->tile_count, 1);
+    pool_run(pool_default(), settings->num_threads, POOL_PRIORITY_NORMAL,
+             render_tiles_thread, &r);
+
+    tile_order_destroy(order);
+}
+
+void render_parallel(const Scene* scene, const Camera* camera,
+                    const RenderSettings* settings, Image* output) {
+    memset(g_path_histogram, 0, sizeof(g_path_histogram));
+    render_report_stats((float)settings->samples_per_pixel, -1.0f, 1);
+
+    if (scene->ooc) {
+        ooc_store_reset_stats(scene->ooc);
+    }
+
+    double start = pool_wtime();
+    render_dispatch(scene, camera, settings, output);
+    if (settings->denoise && !(settings->cancel_flag && *settings->cancel_flag)) {
+        render_features(scene, camera, settings, output);
+        denoise_image(output);
+    }
+    g_render_stats.seconds = pool_wtime() - start;
+
+    if (scene->ooc) {
+        OOCStats ooc_stats;
+        ooc_store_get_stats(scene->ooc, &ooc_stats);
+        if (ooc_stats.read_errors > 0) {
+            fprintf(stderr, "Image is incomplete: %llu geometry chunk reads failed\n",
+                    (unsigned long long)ooc_stats.read_errors);
+        }
+    }
+}
@@ -0,0 +1,314 @@
+#include "pathtracer.h"
+#include "photon.h"
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define PHOTON_BUILD_GRAIN 1024  // Photons per task when shooting and bucketing
+
+static inline uint32_t photon_bucket(int32_t x, int32_t y, int32_t z, uint32_t table_size) {
+    uint32_t h = (uint32_t)x * 73856093u ^ (uint32_t)y * 19349663u ^ (uint32_t)z * 83492791u;
+    return h & (table_size - 1);
+}
+
+static inline int32_t photon_cell(float x, float inv_cell_size) {
+    return (int32_t)floorf(x * inv_cell_size);
+}
+
+typedef struct {
+    PhotonMap* map;
+    uint32_t* buckets;
+    atomic_uint* counts;  // Photons per bucket, at bucket + 1
+} PhotonBucketJob;
+
+static void photon_bucket_range(void* arg, uint32_t begin, uint32_t end) {
+    PhotonBucketJob* job = (PhotonBucketJob*)arg;
+    PhotonMap* map = job->map;
+    for (uint32_t i = begin; i < end; i++) {
+        Vec3 p = map->photons[i].position;
+        job->buckets[i] = photon_bucket(photon_cell(p.x, map->inv_cell_size),
+                                        photon_cell(p.y, map->inv_cell_size),
+                                        photon_cell(p.z, map->inv_cell_size), map->table_size);
+        atomic_fetch_add_explicit(&job->counts[job->buckets[i] + 1], 1, memory_order_relaxed);
+    }
+}
+
+// Sort map->photons into the buckets of a grid for the given gather radius
+static void photon_map_bucket(PhotonMap* map, float radius) {
+    uint32_t count = map->count;
+    map->radius = radius;
+    map->inv_cell_size = 0.5f / radius;
+
+    // Counting sort by bucket: count, prefix sum, scatter
+    uint32_t* buckets = (uint32_t*)malloc((count > 0 ? count : 1) * sizeof(uint32_t));
+    atomic_uint* counts = (atomic_uint*)calloc(map->table_size + 1, sizeof(atomic_uint));
+    PhotonBucketJob job = { map, buckets, counts };
+    ThreadPool* pool = pool_default();
+    pool_parallel_for(pool, pool_thread_count(pool) + 1, POOL_PRIORITY_HIGH, count,
+                      PHOTON_BUILD_GRAIN, photon_bucket_range, &job);
+
+    map->bucket_start[0] = 0;
+    for (uint32_t b = 0; b < map->table_size; b++) {
+        map->bucket_start[b + 1] = map->bucket_start[b] + atomic_load(&counts[b + 1]);
+    }
+    free(counts);
+
+    Photon* sorted = (Photon*)malloc((count > 0 ? count : 1) * sizeof(Photon));
+    uint32_t* cursor = (uint32_t*)malloc(map->table_size * sizeof(uint32_t));
+    memcpy(cursor, map->bucket_start, map->table_size * sizeof(uint32_t));
+    // Serial, so photons keep their order within a bucket and gathers sum
+    // them the same way every time
+    for (uint32_t i = 0; i < count; i++) {
+        sorted[cursor[buckets[i]]++] = map->photons[i];
+    }
+
+    free(cursor);
+    free(buckets);
+    free(map->photons);
+    map->photons = sorted;
+}
+
+// Photons within the gather radius of p arriving on the side of n: summed
+// power, and their number through count
+static Vec3 photon_gather(const PhotonMap* map, Vec3 p, Vec3 n, uint32_t* count) {
+    Vec3 flux = vec3_create(0, 0, 0);
+    *count = 0;
+    if (map->count == 0) {
+        return flux;
+    }
+
+    // The gather sphere overlaps two cells along each axis
+    int32_t x0 = photon_cell(p.x - map->radius, map->inv_cell_size);
+    int32_t y0 = photon_cell(p.y - map->radius, map->inv_cell_size);
+    int32_t z0 = photon_cell(p.z - map->radius, map->inv_cell_size);
+    uint32_t visited[8];
+    uint32_t visited_count = 0;
+    float r2 = map->radius * map->radius;
+
+    for (int32_t dz = 0; dz < 2; dz++) {
+        for (int32_t dy = 0; dy < 2; dy++) {
+            for (int32_t dx = 0; dx < 2; dx++) {
+                uint32_t b = photon_bucket(x0 + dx, y0 + dy, z0 + dz, map->table_size);
+
+                // Different cells may share a bucket; gather each bucket once
+                bool seen = false;
+                for (uint32_t k = 0; k < visited_count; k++) {
+                    seen |= visited[k] == b;
+                }
+                if (seen) continue;
+                visited[visited_count++] = b;
+
+                for (uint32_t i = map->bucket_start[b]; i < map->bucket_start[b + 1]; i++) {
+                    const Photon* ph = &map->photons[i];
+                    if (vec3_length_squared(vec3_sub(ph->position, p)) <= r2 &&
+                        vec3_dot(ph->direction, n) < 0.0f) {
+                        flux = vec3_add(flux, ph->power);
+                        (*count)++;
+                    }
+                }
+            }
+        }
+    }
+    return flux;
+}
+
+static int compare_floats(const void* a, const void* b) {
+    float fa = *(const float*)a;
+    float fb = *(const float*)b;
+    return (fa > fb) - (fa < fb);
+}
+
+typedef struct {
+    const PhotonMap* map;
+    float radius;
+    uint32_t samples;
+    float* wanted;
+} PhotonRadiusJob;
+
+static void photon_radius_range(void* arg, uint32_t begin, uint32_t end) {
+    PhotonRadiusJob* job = (PhotonRadiusJob*)arg;
+    const PhotonMap* map = job->map;
+    for (uint32_t k = begin; k < end; k++) {
+        const Photon* ph = &map->photons[(uint64_t)k * map->count / job->samples];
+        uint32_t n;
+        photon_gather(map, ph->position, vec3_scale(ph->direction, -1.0f), &n);
+        // Density n / (pi r^2) wants radius r * sqrt(K / n)
+        job->wanted[k] = job->radius * sqrtf((float)PHOTON_GATHER_COUNT / (n > 0 ? n : 1));
+    }
+}
+
+// Gather radius for about PHOTON_GATHER_COUNT photons where photons are.
+// Starts from the radius of an even spread over the largest face of their
+// bounding box, then takes the median of what the local densities around a
+// subset of photons ask for.
+static float photon_auto_radius(PhotonMap* map) {
+    AABB box = aabb_empty();
+    for (uint32_t i = 0; i < map->count; i++) {
+        box = aabb_expand(box, map->photons[i].position);
+    }
+    Vec3 e = vec3_sub(box.max, box.min);
+    float area = fmaxf(e.x * e.y, fmaxf(e.y * e.z, e.z * e.x));
+    float radius = sqrtf(area * PHOTON_GATHER_COUNT / ((float)M_PI * map->count));
+    if (!(radius > 0.0f)) {
+        return 1e-3f;
+    }
+    photon_map_bucket(map, radius);
+
+    uint32_t samples = map->count < 1024 ? map->count : 1024;
+    float* wanted = (float*)malloc(samples * sizeof(float));
+    PhotonRadiusJob job = { map, radius, samples, wanted };
+    ThreadPool* pool = pool_default();
+    pool_parallel_for(pool, pool_thread_count(pool) + 1, POOL_PRIORITY_HIGH, samples, 16,
+                      photon_radius_range, &job);
+    qsort(wanted, samples, sizeof(float), compare_floats);
+    float median = wanted[samples / 2];
+    free(wanted);
+    return median < radius ? median : radius;
+}
+
+PhotonMap* photon_map_create(Photon* photons, uint32_t count, float radius) {
+    PhotonMap* map = (PhotonMap*)calloc(1, sizeof(PhotonMap));
+    map->photons = photons;
+    map->count = count;
+    map->table_size = 1;
+    while (map->table_size < count) {
+        map->table_size *= 2;
+    }
+    map->bucket_start = (uint32_t*)calloc(map->table_size + 1, sizeof(uint32_t));
+
+    if (!(radius > 0.0f)) {
+        radius = count > 0 ? photon_auto_radius(map) : 1e-3f;
+    }
+    photon_map_bucket(map, radius);
+    return map;
+}
+
+void photon_map_destroy(PhotonMap* map) {
+    if (map) {
+        free(map->photons);
+        free(map->bucket_start);
+        free(map);
+    }
+}
+
+Vec3 photon_map_estimate(const PhotonMap* map, Vec3 p, Vec3 n) {
+    uint32_t count;
+    Vec3 flux = photon_gather(map, p, n, &count);
+    return vec3_div(flux, (float)M_PI * map->radius * map->radius);
+}
+
+// Follow one photon from the lights; returns true (and fills *out) if it
+// reached a diffuse surface after at least one specular bounce
+static bool trace_caustic_photon(const Scene* scene, uint32_t index, uint32_t emitted,
+                                 Photon* out) {
+    RNG rng;
+    rng_init(&rng, rng_stream_seed(index));  // Independent stream per photon
+
+    LightSample ls;
+    if (!light_list_sample_emission(scene->lights, rng_float(&rng), rng_float(&rng),
+                                    rng_float(&rng), &ls)) {
+        return false;
+    }
+
+    // Cosine-weighted emission; two-sided emitters pick a side at random
+    Vec3 normal = ls.normal;
+    float sides = 1.0f;
+    if (!ls.one_sided) {
+        sides = 2.0f;
+        if (rng_float(&rng) < 0.5f) {
+            normal = vec3_scale(normal, -1.0f);
+        }
+    }
+    float u1 = rng_float(&rng);
+    float u2 = rng_float(&rng);
+    Vec3 dir = warp_cosine_hemisphere(normal, u1, u2);
+
+    // Le * cos / (pdf_area * cos / pi), spread over all photons shot
+    Vec3 power = vec3_scale(ls.emission, (float)M_PI * sides / (ls.pdf_area * emitted));
+    Ray ray = ray_create(ls.point, dir);
+    bool specular = false;
+
+    for (uint32_t depth = 0; depth < PHOTON_MAX_DEPTH; depth++) {
+        HitRecord rec;
+        if (!scene_hit(scene, &ray, 0.001f, FLT_MAX, &rec) ||
+            rec.material->type == MATERIAL_EMISSIVE) {
+            return false;
+        }
+
+        BSDF bsdf = material_bsdf(rec.material, &rec);
+        if (bsdf.type == BSDF_LAMBERTIAN) {
+            if (!specular) {
+                return false;
+            }
+            out->position = rec.point;
+            out->direction = vec3_normalize(ray.direction);
+            out->power = power;
+            return true;
+        }
+
+        Vec3 attenuation, wi;
+        float pdf;
+        Vec3 wo = vec3_scale(vec3_normalize(ray.direction), -1.0f);
+        float uc = rng_float(&rng);
+        float u1 = rng_float(&rng);
+        float u2 = rng_float(&rng);
+        if (!bsdf_sample(&bsdf, wo, uc, u1, u2, &wi, &attenuation, &pdf)) {
+            return false;
+        }
+        power = vec3_mul(power, attenuation);
+        ray = ray_create(rec.point, wi);
+        specular = true;
+    }
+    return false;
+}
+
+typedef struct {
+    const Scene* scene;
+    uint32_t photon_count;
+    Photon* shot;
+    bool* stored;
+} CausticShootJob;
+
+static void caustic_shoot_range(void* arg, uint32_t begin, uint32_t end) {
+    CausticShootJob* job = (CausticShootJob*)arg;
+    for (uint32_t i = begin; i < end; i++) {
+        job->stored[i] = trace_caustic_photon(job->scene, i, job->photon_count, &job->shot[i]);
+    }
+}
+
+bool scene_build_caustics(Scene* scene, uint32_t photon_count, float radius) {
+    photon_map_destroy(scene->caustics);
+    scene->caustics = NULL;
+
+    if (!scene->lights || scene->lights->count == 0 || photon_count == 0) {
+        fprintf(stderr, "No emitters to shoot caustic photons from\n");
+        return false;
+    }
+
+    Photon* shot = (Photon*)malloc(photon_count * sizeof(Photon));
+    bool* stored = (bool*)malloc(photon_count * sizeof(bool));
+    if (!shot || !stored) {
+        fprintf(stderr, "Failed to allocate %u photons\n", photon_count);
+        free(shot);
+        free(stored);
+        return false;
+    }
+
+    CausticShootJob job = { scene, photon_count, shot, stored };
+    ThreadPool* pool = pool_default();
+    pool_parallel_for(pool, pool_thread_count(pool) + 1, POOL_PRIORITY_HIGH, photon_count,
+                      PHOTON_BUILD_GRAIN, caustic_shoot_range, &job);
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < photon_count; i++) {
+        if (stored[i]) {
+            shot[count++] = shot[i];
+        }
+    }
+    free(stored);
+
+    scene->caustics = photon_map_create(shot, count, radius);
+    return true;
+}
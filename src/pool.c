@@ -0,0 +1,355 @@
+// clock_gettime and sysconf are POSIX, not C11
+#define _POSIX_C_SOURCE 200809L
+
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define POOL_DEQUE_CAPACITY 64      // Initial slots per deque; grows by doubling
+#define POOL_WAIT_NS 200000         // Recheck for stealable work this often while waiting
+
+typedef struct {
+    PoolTaskFn fn;
+    void* arg;
+    PoolGroup* group;
+} PoolTask;
+
+// Ring buffer: the owner works at the back, thieves take from the front
+typedef struct {
+    PoolTask* tasks;
+    uint32_t head;
+    uint32_t count;
+    uint32_t capacity;
+} PoolDeque;
+
+typedef struct {
+    pthread_mutex_t lock;
+    PoolDeque deques[POOL_PRIORITIES];
+} PoolQueue;
+
+struct ThreadPool {
+    PoolQueue* queues;       // One per worker, then the injection queue
+    pthread_t* threads;
+    uint32_t worker_count;   // Fixed before the first worker starts
+    uint32_t started;        // Workers actually running
+    atomic_uint queued;      // Tasks sitting in any queue
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t wake;
+    bool stopping;
+};
+
+// Worker the current thread is, if it belongs to a pool
+static _Thread_local ThreadPool* tls_pool = NULL;
+static _Thread_local uint32_t tls_worker = 0;
+
+typedef struct {
+    ThreadPool* pool;
+    uint32_t index;
+} PoolWorkerStart;
+
+static void deque_push_back(PoolDeque* d, PoolTask task) {
+    if (d->count == d->capacity) {
+        uint32_t capacity = d->capacity ? d->capacity * 2 : POOL_DEQUE_CAPACITY;
+        PoolTask* tasks = (PoolTask*)malloc(capacity * sizeof(PoolTask));
+        for (uint32_t i = 0; i < d->count; i++) {
+            tasks[i] = d->tasks[(d->head + i) % d->capacity];
+        }
+        free(d->tasks);
+        d->tasks = tasks;
+        d->head = 0;
+        d->capacity = capacity;
+    }
+    d->tasks[(d->head + d->count) % d->capacity] = task;
+    d->count++;
+}
+
+static inline PoolTask deque_pop_back(PoolDeque* d) {
+    d->count--;
+    return d->tasks[(d->head + d->count) % d->capacity];
+}
+
+static inline PoolTask deque_pop_front(PoolDeque* d) {
+    PoolTask task = d->tasks[d->head];
+    d->head = (d->head + 1) % d->capacity;
+    d->count--;
+    return task;
+}
+
+// Take a task from queue q at priority p, from the back if it is our own
+static bool queue_take(PoolQueue* q, uint32_t p, bool own, PoolTask* task) {
+    PoolDeque* d = &q->deques[p];
+    pthread_mutex_lock(&q->lock);
+    bool found = d->count > 0;
+    if (found) {
+        *task = own ? deque_pop_back(d) : deque_pop_front(d);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+// Find the most urgent task no less urgent than max_priority: own deque,
+// then the injection queue, then the other workers' deques
+static bool pool_find_task(ThreadPool* pool, PoolPriority max_priority, PoolTask* task) {
+    bool is_worker = tls_pool == pool;
+    uint32_t self = is_worker ? tls_worker : pool->worker_count;
+    uint32_t queue_count = pool->worker_count + 1;
+
+    if (atomic_load_explicit(&pool->queued, memory_order_relaxed) == 0) {
+        return false;
+    }
+    for (uint32_t p = 0; p <= (uint32_t)max_priority; p++) {
+        bool found = is_worker && queue_take(&pool->queues[self], p, true, task);
+        for (uint32_t k = 0; !found && k < queue_count; k++) {
+            uint32_t victim = (pool->worker_count + k) % queue_count;  // Injection queue first
+            found = victim != self && queue_take(&pool->queues[victim], p, false, task);
+        }
+        if (found) {
+            atomic_fetch_sub(&pool->queued, 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void pool_execute(PoolTask task) {
+    task.fn(task.arg);
+    if (task.group) {
+        // Under the lock, so the waiter cannot destroy the group before we
+        // are done with it (see pool_wait)
+        pthread_mutex_lock(&task.group->lock);
+        if (atomic_fetch_sub(&task.group->pending, 1) == 1) {
+            pthread_cond_broadcast(&task.group->done);
+        }
+        pthread_mutex_unlock(&task.group->lock);
+    }
+}
+
+static void* pool_worker_main(void* arg) {
+    PoolWorkerStart start = *(PoolWorkerStart*)arg;
+    free(arg);
+    ThreadPool* pool = start.pool;
+    tls_pool = pool;
+    tls_worker = start.index;
+
+    for (;;) {
+        PoolTask task;
+        if (pool_find_task(pool, POOL_PRIORITY_LOW, &task)) {
+            pool_execute(task);
+            continue;
+        }
+        pthread_mutex_lock(&pool->sleep_lock);
+        while (atomic_load(&pool->queued) == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->wake, &pool->sleep_lock);
+        }
+        bool stop = pool->stopping && atomic_load(&pool->queued) == 0;
+        pthread_mutex_unlock(&pool->sleep_lock);
+        if (stop) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+ThreadPool* pool_create(uint32_t thread_count) {
+    if (thread_count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+
+    ThreadPool* pool = (ThreadPool*)calloc(1, sizeof(ThreadPool));
+    pool->worker_count = thread_count;
+    pool->queues = (PoolQueue*)calloc(thread_count + 1, sizeof(PoolQueue));
+    pool->threads = (pthread_t*)calloc(thread_count, sizeof(pthread_t));
+    atomic_init(&pool->queued, 0);
+    pthread_mutex_init(&pool->sleep_lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    for (uint32_t i = 0; i <= thread_count; i++) {
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+    }
+
+    for (uint32_t i = 0; i < thread_count; i++) {
+        PoolWorkerStart* start = (PoolWorkerStart*)malloc(sizeof(PoolWorkerStart));
+        start->pool = pool;
+        start->index = i;
+        if (pthread_create(&pool->threads[i], NULL, pool_worker_main, start) != 0) {
+            // The missing workers' deques stay empty; their work is stolen
+            fprintf(stderr, "pool_create: could only start %u of %u threads\n", i, thread_count);
+            free(start);
+            break;
+        }
+        pool->started++;
+    }
+    return pool;
+}
+
+void pool_destroy(ThreadPool* pool) {
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->sleep_lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->sleep_lock);
+    for (uint32_t i = 0; i < pool->started; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    for (uint32_t i = 0; i <= pool->worker_count; i++) {
+        for (uint32_t p = 0; p < POOL_PRIORITIES; p++) {
+            free(pool->queues[i].deques[p].tasks);
+        }
+        pthread_mutex_destroy(&pool->queues[i].lock);
+    }
+    pthread_mutex_destroy(&pool->sleep_lock);
+    pthread_cond_destroy(&pool->wake);
+    free(pool->queues);
+    free(pool->threads);
+    free(pool);
+}
+
+static ThreadPool* g_default_pool = NULL;
+static pthread_once_t g_default_once = PTHREAD_ONCE_INIT;
+
+static void pool_default_create(void) {
+    g_default_pool = pool_create(0);
+}
+
+ThreadPool* pool_default(void) {
+    pthread_once(&g_default_once, pool_default_create);
+    return g_default_pool;
+}
+
+uint32_t pool_thread_count(const ThreadPool* pool) {
+    return pool->started;
+}
+
+double pool_wtime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+void pool_group_init(PoolGroup* group, PoolPriority priority) {
+    atomic_init(&group->pending, 0);
+    group->priority = priority;
+    pthread_mutex_init(&group->lock, NULL);
+    pthread_cond_init(&group->done, NULL);
+}
+
+void pool_group_destroy(PoolGroup* group) {
+    pthread_mutex_destroy(&group->lock);
+    pthread_cond_destroy(&group->done);
+}
+
+void pool_submit(ThreadPool* pool, PoolGroup* group, PoolPriority priority,
+                 PoolTaskFn fn, void* arg) {
+    PoolTask task = { fn, arg, group };
+    if (group) {
+        atomic_fetch_add(&group->pending, 1);
+    }
+
+    // Own deque for workers of this pool, the injection queue for everyone else
+    PoolQueue* q = &pool->queues[tls_pool == pool ? tls_worker : pool->worker_count];
+    atomic_fetch_add(&pool->queued, 1);
+    pthread_mutex_lock(&q->lock);
+    deque_push_back(&q->deques[priority], task);
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_lock(&pool->sleep_lock);
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->sleep_lock);
+}
+
+void pool_wait(ThreadPool* pool, PoolGroup* group) {
+    while (atomic_load(&group->pending) > 0) {
+        PoolTask task;
+        if (pool_find_task(pool, group->priority, &task)) {
+            pool_execute(task);
+            continue;
+        }
+
+        // Nothing to help with: sleep until the group is done, waking now
+        // and then in case the tasks still running queue more work
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += POOL_WAIT_NS;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&group->lock);
+        if (atomic_load(&group->pending) > 0) {
+            pthread_cond_timedwait(&group->done, &group->lock, &deadline);
+        }
+        pthread_mutex_unlock(&group->lock);
+    }
+
+    // The last task lets go of the lock after its count reaches zero
+    pthread_mutex_lock(&group->lock);
+    pthread_mutex_unlock(&group->lock);
+}
+
+typedef struct {
+    void (*fn)(void* arg, uint32_t rank);
+    void* arg;
+    uint32_t rank;
+} PoolRunTask;
+
+static void pool_run_task(void* arg) {
+    PoolRunTask* task = (PoolRunTask*)arg;
+    task->fn(task->arg, task->rank);
+}
+
+void pool_run(ThreadPool* pool, uint32_t thread_count, PoolPriority priority,
+              void (*fn)(void* arg, uint32_t rank), void* arg) {
+    // The caller takes part, so one more than the workers can be busy
+    uint32_t count = thread_count < pool->started + 1 ? thread_count : pool->started + 1;
+    if (count <= 1) {
+        fn(arg, 0);
+        return;
+    }
+
+    PoolGroup group;
+    pool_group_init(&group, priority);
+    PoolRunTask* tasks = (PoolRunTask*)malloc(count * sizeof(PoolRunTask));
+    for (uint32_t r = 1; r < count; r++) {
+        tasks[r].fn = fn;
+        tasks[r].arg = arg;
+        tasks[r].rank = r;
+        pool_submit(pool, &group, priority, pool_run_task, &tasks[r]);
+    }
+    fn(arg, 0);
+    pool_wait(pool, &group);
+    free(tasks);
+    pool_group_destroy(&group);
+}
+
+typedef struct {
+    void (*fn)(void* arg, uint32_t begin, uint32_t end);
+    void* arg;
+    PoolRange range;
+} PoolForLoop;
+
+static void pool_for_body(void* arg, uint32_t rank) {
+    (void)rank;
+    PoolForLoop* loop = (PoolForLoop*)arg;
+    uint32_t begin, end;
+    while (pool_range_next(&loop->range, &begin, &end)) {
+        loop->fn(loop->arg, begin, end);
+    }
+}
+
+void pool_parallel_for(ThreadPool* pool, uint32_t thread_count, PoolPriority priority,
+                       uint32_t count, uint32_t grain,
+                       void (*fn)(void* arg, uint32_t begin, uint32_t end), void* arg) {
+    PoolForLoop loop;
+    loop.fn = fn;
+    loop.arg = arg;
+    pool_range_init(&loop.range, count, grain);
+    // No more threads than chunks
+    uint32_t chunks = (count + loop.range.grain - 1) / loop.range.grain;
+    pool_run(pool, thread_count < chunks ? thread_count : chunks, priority, pool_for_body, &loop);
+}
@@ -1,4 +1,5 @@
 #include "primitive.h"
+#include "bvh.h"
 #include <math.h>
 
 // Ray-sphere intersection
@@ -39,18 +40,21 @@ bool sphere_hit(const Sphere* sphere, const Ray* ray, float t_min, float t_max,
     // Determine if ray hit front or back face
     rec->front_face = vec3_dot(ray->direction, outward_normal) < 0;
     rec->normal = rec->front_face ? outward_normal : vec3_scale(outward_normal, -1.0f);
+    rec->mesh = NULL;
     
     return true;
 }
 
-// Ray-triangle intersection (Möller-Trumbore algorithm)
-bool triangle_hit(const Triangle* triangle, const Ray* ray, float t_min, float t_max,
-                  HitRecord* rec) {
+// Möller-Trumbore core shared by plain and mesh triangles.
+// Returns t and the barycentric coordinates (u, v) of the hit.
+static inline bool triangle_intersect(Vec3 v0, Vec3 v1, Vec3 v2, const Ray* ray,
+                                      float t_min, float t_max,
+                                      float* t_out, float* u_out, float* v_out) {
     const float EPSILON = 0.0000001f;
 
     // Compute edge vectors
-    Vec3 edge1 = vec3_sub(triangle->v1, triangle->v0);
-    Vec3 edge2 = vec3_sub(triangle->v2, triangle->v0);
+    Vec3 edge1 = vec3_sub(v1, v0);
+    Vec3 edge2 = vec3_sub(v2, v0);
     
     // Compute h = ray.direction × edge2
     Vec3 h = vec3_cross(ray->direction, edge2);
@@ -62,7 +66,7 @@ bool triangle_hit(const Triangle* triangle, const Ray* ray, float t_min, float t
     }
     
     float f = 1.0f / a;
-    Vec3 s = vec3_sub(ray->origin, triangle->v0);
+    Vec3 s = vec3_sub(ray->origin, v0);
     
     // Compute barycentric coordinate u
     float u = f * vec3_dot(s, h);
@@ -86,6 +90,21 @@ bool triangle_hit(const Triangle* triangle, const Ray* ray, float t_min, float t
     if (t < t_min || t > t_max) {
         return false;
     }
+
+    *t_out = t;
+    *u_out = u;
+    *v_out = v;
+    return true;
+}
+
+// Ray-triangle intersection (Möller-Trumbore algorithm)
+bool triangle_hit(const Triangle* triangle, const Ray* ray, float t_min, float t_max,
+                  HitRecord* rec) {
+    float t, u, v;
+    if (!triangle_intersect(triangle->v0, triangle->v1, triangle->v2, ray,
+                            t_min, t_max, &t, &u, &v)) {
+        return false;
+    }
     
     // Fill hit record
     rec->t = t;
@@ -95,10 +114,95 @@ bool triangle_hit(const Triangle* triangle, const Ray* ray, float t_min, float t
     Vec3 outward_normal = triangle->normal;
     rec->front_face = vec3_dot(ray->direction, outward_normal) < 0;
     rec->normal = rec->front_face ? outward_normal : vec3_scale(outward_normal, -1.0f);
+    rec->mesh = NULL;
     
     return true;
 }
 
+// Ray-mesh-triangle intersection: vertices are dequantized on the fly; the
+// rest of the record waits for mesh_hit_finalize
+bool mesh_face_hit(const Mesh* mesh, uint32_t tri_idx, const Ray* ray, float t_min, float t_max,
+                   HitRecord* rec) {
+    const uint32_t* idx = &mesh->indices[3 * tri_idx];
+    float t, u, v;
+    if (!triangle_intersect(mesh_position(mesh, idx[0]), mesh_position(mesh, idx[1]),
+                            mesh_position(mesh, idx[2]), ray, t_min, t_max, &t, &u, &v)) {
+        return false;
+    }
+
+    rec->t = t;
+    rec->mesh = mesh;
+    rec->tri_idx = tri_idx;
+    rec->u = u;
+    rec->v = v;
+    return true;
+}
+
+// Closest triangle through the mesh's face BVH
+bool mesh_hit(const Mesh* mesh, const Ray* ray, float t_min, float t_max, HitRecord* rec) {
+    const BVHNode* stack[64];
+    int stack_ptr = 0;
+
+    bool hit_anything = false;
+    float closest_so_far = t_max;
+
+    stack[stack_ptr++] = mesh->nodes;
+
+    while (stack_ptr > 0) {
+        const BVHNode* node = stack[--stack_ptr];
+
+        if (!aabb_hit(&node->bounds, ray, t_min, closest_so_far)) {
+            continue;
+        }
+
+        if (!node->is_leaf) {
+            stack[stack_ptr++] = node->left;
+            stack[stack_ptr++] = node->right;
+            continue;
+        }
+
+        for (uint32_t i = node->first_prim_idx; i < node->first_prim_idx + node->prim_count; i++) {
+            if (mesh_face_hit(mesh, i, ray, t_min, closest_so_far, rec)) {
+                hit_anything = true;
+                closest_so_far = rec->t;
+            }
+        }
+    }
+
+    return hit_anything;
+}
+
+void mesh_hit_finalize(HitRecord* rec, const Ray* ray) {
+    const Mesh* mesh = rec->mesh;
+    const uint32_t* idx = &mesh->indices[3 * rec->tri_idx];
+    Vec3 p0 = mesh_position(mesh, idx[0]);
+    Vec3 p1 = mesh_position(mesh, idx[1]);
+    Vec3 p2 = mesh_position(mesh, idx[2]);
+
+    rec->point = ray_at(*ray, rec->t);
+
+    // Face orientation comes from the geometric normal
+    Vec3 geometric_normal = vec3_normalize(vec3_cross(vec3_sub(p1, p0), vec3_sub(p2, p0)));
+    rec->front_face = vec3_dot(ray->direction, geometric_normal) < 0;
+
+    // Shading normal: interpolate decoded vertex normals if present
+    Vec3 outward_normal = geometric_normal;
+    if (mesh->normals) {
+        Vec3 n0 = oct_decode(mesh->normals[idx[0]]);
+        Vec3 n1 = oct_decode(mesh->normals[idx[1]]);
+        Vec3 n2 = oct_decode(mesh->normals[idx[2]]);
+        outward_normal = vec3_normalize(vec3_add(
+            vec3_add(vec3_scale(n0, 1.0f - rec->u - rec->v), vec3_scale(n1, rec->u)),
+            vec3_scale(n2, rec->v)
+        ));
+        // Keep the shading normal on the same side as the winding order
+        if (vec3_dot(outward_normal, geometric_normal) < 0.0f) {
+            outward_normal = vec3_scale(outward_normal, -1.0f);
+        }
+    }
+    rec->normal = rec->front_face ? outward_normal : vec3_scale(outward_normal, -1.0f);
+}
+
 // Generic primitive hit test
 bool primitive_hit(const Primitive* prim, const Ray* ray, float t_min, float t_max,
                    HitRecord* rec) {
@@ -111,12 +215,16 @@ bool primitive_hit(const Primitive* prim, const Ray* ray, float t_min, float t_m
         case PRIMITIVE_TRIANGLE:
             hit = triangle_hit(&prim->triangle, ray, t_min, t_max, rec);
             break;
+        case PRIMITIVE_MESH:
+            hit = mesh_hit(prim->mesh, ray, t_min, t_max, rec);
+            break;
         default:
             return false;
     }
 
     if (hit) {
         rec->material = &prim->material;
+        rec->prim = prim;
     }
 
     return hit;
@@ -0,0 +1,272 @@
+#include "pathtracer.h"
+#include "radcache.h"
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+RadianceCache* radiance_cache_create(const Camera* camera, uint32_t width,
+                                     uint32_t diffuse_depth) {
+    RadianceCache* cache = (RadianceCache*)calloc(1, sizeof(RadianceCache));
+    cache->entries = (RadianceCacheEntry*)calloc(RADIANCE_CACHE_SIZE, sizeof(RadianceCacheEntry));
+    if (!cache->entries) {
+        fprintf(stderr, "radiance_cache_create: out of memory\n");
+        free(cache);
+        return NULL;
+    }
+    cache->origin = camera->origin;
+    // Pixel width at unit distance, measured at the image center
+    Vec3 center = vec3_add(camera->lower_left_corner,
+                           vec3_scale(vec3_add(camera->horizontal, camera->vertical), 0.5f));
+    float distance = vec3_length(vec3_sub(center, camera->origin));
+    cache->pixel_angle = vec3_length(camera->horizontal) / (width > 1 ? width - 1 : 1) / distance;
+    cache->diffuse_depth = diffuse_depth;
+    return cache;
+}
+
+void radiance_cache_destroy(RadianceCache* cache) {
+    if (cache) {
+        free(cache->entries);
+        free(cache);
+    }
+}
+
+// Cell width at p: a power of two near RADIANCE_CACHE_CELL_PIXELS pixels
+static inline int32_t radiance_cache_level(const RadianceCache* cache, Vec3 p) {
+    float size = vec3_length(vec3_sub(p, cache->origin)) * cache->pixel_angle *
+                 RADIANCE_CACHE_CELL_PIXELS;
+    return (int32_t)ceilf(log2f(fmaxf(size, 1e-6f)));
+}
+
+// Octahedral bin of a unit normal
+static inline uint32_t radiance_cache_normal_bin(Vec3 n) {
+    float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    float x = n.x / l1;
+    float y = n.y / l1;
+    if (n.z < 0.0f) {
+        float fx = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float fy = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = fx;
+        y = fy;
+    }
+    uint32_t bx = (uint32_t)fminf((x * 0.5f + 0.5f) * RADIANCE_CACHE_NORMAL_BINS,
+                                  RADIANCE_CACHE_NORMAL_BINS - 1);
+    uint32_t by = (uint32_t)fminf((y * 0.5f + 0.5f) * RADIANCE_CACHE_NORMAL_BINS,
+                                  RADIANCE_CACHE_NORMAL_BINS - 1);
+    return by * RADIANCE_CACHE_NORMAL_BINS + bx;
+}
+
+// Key of the cell at level containing p: level, normal bin and 18 bits of
+// each cell coordinate (far away cells may alias, which only blurs more)
+static inline uint64_t radiance_cache_key(int32_t level, Vec3 p, Vec3 n) {
+    float inv_cell = ldexpf(1.0f, -level);
+    uint64_t x = (uint64_t)(int64_t)floorf(p.x * inv_cell) & 0x3FFFF;
+    uint64_t y = (uint64_t)(int64_t)floorf(p.y * inv_cell) & 0x3FFFF;
+    uint64_t z = (uint64_t)(int64_t)floorf(p.z * inv_cell) & 0x3FFFF;
+    uint64_t key = (uint64_t)((level + 32) & 63) << 58 |
+                   (uint64_t)radiance_cache_normal_bin(n) << 54 | x << 36 | y << 18 | z;
+    return key != 0 ? key : 1;
+}
+
+// First probe for key; every key bit reaches the slot (MurmurHash3 finalizer)
+static inline uint32_t radiance_cache_slot(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDull;
+    key ^= key >> 33;
+    key *= 0xC4CEB9FE1A85EC53ull;
+    key ^= key >> 33;
+    return (uint32_t)key & (RADIANCE_CACHE_SIZE - 1);
+}
+
+void radiance_cache_record(RadianceCache* cache, Vec3 p, Vec3 n, Vec3 value) {
+    uint64_t key = radiance_cache_key(radiance_cache_level(cache, p), p, n);
+    uint32_t slot = radiance_cache_slot(key);
+
+    for (uint32_t k = 0; k < RADIANCE_CACHE_PROBES; k++) {
+        RadianceCacheEntry* e = &cache->entries[(slot + k) & (RADIANCE_CACHE_SIZE - 1)];
+        uint64_t stored = atomic_load_explicit(&e->key, memory_order_relaxed);
+
+        // Claim an empty slot, unless another thread got there first (stored
+        // then holds its key)
+        if (stored == 0 && atomic_compare_exchange_strong(&e->key, &stored, key)) {
+            stored = key;
+        }
+        if (stored != key) {
+            continue;
+        }
+
+        float c[3] = { value.x, value.y, value.z };
+        for (int i = 0; i < 3; i++) {
+            uint64_t fixed = (uint64_t)(fminf(fmaxf(c[i], 0.0f), RADIANCE_CACHE_MAX_VALUE) *
+                                        RADIANCE_CACHE_FIXED_POINT + 0.5f);
+            atomic_fetch_add_explicit(&e->sum[i], fixed, memory_order_relaxed);
+        }
+        atomic_fetch_add_explicit(&e->count, 1, memory_order_relaxed);
+        return;
+    }
+
+    atomic_fetch_add_explicit(&cache->dropped, 1, memory_order_relaxed);
+}
+
+bool radiance_cache_lookup(const RadianceCache* cache, Vec3 p, Vec3 n,
+                           float u1, float u2, float u3, Vec3* value) {
+    int32_t level = radiance_cache_level(cache, p);
+    float cell = ldexpf(1.0f, level);
+    Vec3 q = vec3_add(p, vec3_scale(vec3_create(u1 - 0.5f, u2 - 0.5f, u3 - 0.5f), cell));
+    uint64_t key = radiance_cache_key(level, q, n);
+    uint32_t slot = radiance_cache_slot(key);
+
+    for (uint32_t k = 0; k < RADIANCE_CACHE_PROBES; k++) {
+        const RadianceCacheEntry* e = &cache->entries[(slot + k) & (RADIANCE_CACHE_SIZE - 1)];
+        uint64_t stored = atomic_load_explicit(&e->key, memory_order_relaxed);
+
+        if (stored == 0) {
+            return false;
+        }
+        if (stored == key) {
+            if (e->frozen_count < RADIANCE_CACHE_MIN_SAMPLES) {
+                return false;
+            }
+            *value = e->radiance;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void radiance_cache_update_range(void* arg, uint32_t begin, uint32_t end) {
+    RadianceCache* cache = (RadianceCache*)arg;
+    for (uint32_t k = begin; k < end; k++) {
+        RadianceCacheEntry* e = &cache->entries[k];
+        // Between passes, so nothing records concurrently
+        uint32_t count = atomic_load_explicit(&e->count, memory_order_relaxed);
+        if (count > e->frozen_count) {
+            float scale = 1.0f / (RADIANCE_CACHE_FIXED_POINT * count);
+            e->radiance = vec3_create(
+                atomic_load_explicit(&e->sum[0], memory_order_relaxed) * scale,
+                atomic_load_explicit(&e->sum[1], memory_order_relaxed) * scale,
+                atomic_load_explicit(&e->sum[2], memory_order_relaxed) * scale);
+            e->frozen_count = count;
+        }
+    }
+}
+
+void radiance_cache_update(RadianceCache* cache) {
+    ThreadPool* pool = pool_default();
+    pool_parallel_for(pool, pool_thread_count(pool) + 1, POOL_PRIORITY_NORMAL,
+                      RADIANCE_CACHE_SIZE, RADIANCE_CACHE_SIZE / 64,
+                      radiance_cache_update_range, cache);
+}
+
+// One pass of render_cached: count more samples for every pixel
+typedef struct {
+    const Scene* scene;
+    const Camera* camera;
+    const RenderSettings* settings;
+    RadianceCache* cache;
+    Vec3* sums;
+    uint32_t width, height;
+    uint32_t samples_done;
+    uint32_t count;
+    PoolRange pixels;
+} CachedPass;
+
+static void render_cached_thread(void* arg, uint32_t rank) {
+    (void)rank;
+    CachedPass* r = (CachedPass*)arg;
+    const Scene* scene = r->scene;
+    const Camera* camera = r->camera;
+    const RenderSettings* settings = r->settings;
+    RadianceCache* cache = r->cache;
+    Vec3* sums = r->sums;
+    uint32_t width = r->width;
+    uint32_t height = r->height;
+    uint32_t spp = settings->samples_per_pixel;
+    uint32_t samples_done = r->samples_done;
+    uint32_t count = r->count;
+
+    Sampler sampler;
+    sampler_init(&sampler, settings->sampler, spp, settings->seed);
+    uint64_t path_histogram[PATH_LENGTH_BINS] = {0};
+
+    uint32_t begin, end;
+    while (pool_range_next(&r->pixels, &begin, &end)) {
+        for (uint32_t p = begin; p < end; p++) {
+            if (settings->cancel_flag && *settings->cancel_flag) {
+                continue;
+            }
+
+            uint32_t i = p % width;
+            uint32_t j = p / width;
+
+            for (uint32_t s = 0; s < count; s++) {
+                sampler_start(&sampler, p, samples_done + s);
+                Ray ray = primary_ray(camera, width, height, i, j, &sampler);
+
+                uint32_t path_length;
+                Vec3 color = trace_path(scene, &ray, NULL, &sampler, 0, settings->max_depth,
+                                        settings->use_nee, NULL, cache, &path_length);
+                sums[p] = vec3_add(sums[p], color);
+                path_histogram[path_length < PATH_LENGTH_BINS ? path_length
+                                                              : PATH_LENGTH_BINS - 1]++;
+            }
+        }
+    }
+
+    render_merge_path_histogram(path_histogram);
+}
+
+// Passes of 1, 2, 4, ... samples per pixel (the last one takes whatever is
+// left of samples_per_pixel), each ending paths in what the previous ones
+// recorded
+void render_cached(const Scene* scene, const Camera* camera,
+                   const RenderSettings* settings, Image* output) {
+    uint32_t width = output->width;
+    uint32_t height = output->height;
+    uint32_t total_pixels = width * height;
+    uint32_t spp = settings->samples_per_pixel;
+
+    RadianceCache* cache = radiance_cache_create(camera, width, settings->radiance_cache);
+    if (!cache) {
+        return;
+    }
+    Vec3* sums = (Vec3*)calloc(total_pixels, sizeof(Vec3));
+    progress_callback_t progress = get_progress_callback();
+    uint32_t samples_done = 0;
+    uint32_t pass_samples = 1;
+
+    while (samples_done < spp) {
+        if (settings->cancel_flag && *settings->cancel_flag) {
+            break;
+        }
+
+        uint32_t count = spp - samples_done < pass_samples ? spp - samples_done : pass_samples;
+
+        CachedPass pass = { scene, camera, settings, cache, sums, width, height,
+                            samples_done, count, { 0 } };
+        pool_range_init(&pass.pixels, total_pixels, 16);
+        pool_run(pool_default(), settings->num_threads, POOL_PRIORITY_NORMAL,
+                 render_cached_thread, &pass);
+
+        samples_done += count;
+        radiance_cache_update(cache);
+        pass_samples *= 2;
+
+        if (progress) {
+            progress((float)samples_done / spp);
+        }
+    }
+
+    uint32_t dropped = atomic_load(&cache->dropped);
+    if (dropped > 0) {
+        fprintf(stderr, "render_cached: radiance cache full, %u records dropped\n", dropped);
+    }
+
+    float inv = samples_done > 0 ? 1.0f / samples_done : 0.0f;
+    for (uint32_t p = 0; p < total_pixels; p++) {
+        output->pixels[p] = vec3_scale(sums[p], inv);
+    }
+
+    free(sums);
+    radiance_cache_destroy(cache);
+}
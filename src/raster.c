@@ -0,0 +1,405 @@
+#include "raster.h"
+#include "pool.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <float.h>
+
+bool raster_supported(const Scene* scene, const Camera* camera) {
+    if (camera->lens_radius > 0.0f || scene->ooc || scene->prim_count == 0) {
+        return false;
+    }
+    uint32_t cast = 0;
+    for (uint32_t i = 0; i < scene->prim_count; i++) {
+        cast += scene->primitives[i].type == PRIMITIVE_SPHERE;
+    }
+    return cast <= RASTER_MAX_CAST_PRIMITIVES && cast < scene->prim_count;
+}
+
+// Vertices of a triangle primitive, or of one face of a mesh primitive
+static void primitive_vertices(const Primitive* prim, uint32_t face, Vec3 v[3]) {
+    if (prim->type == PRIMITIVE_TRIANGLE) {
+        v[0] = prim->triangle.v0;
+        v[1] = prim->triangle.v1;
+        v[2] = prim->triangle.v2;
+    } else {
+        const uint32_t* idx = &prim->mesh->indices[3 * face];
+        v[0] = mesh_position(prim->mesh, idx[0]);
+        v[1] = mesh_position(prim->mesh, idx[1]);
+        v[2] = mesh_position(prim->mesh, idx[2]);
+    }
+}
+
+// Film position (s, t) a point projects to; false if it is not in front of
+// the camera
+static bool raster_project(const Rasterizer* raster, Vec3 p, float* s, float* t) {
+    Vec3 q = vec3_sub(p, raster->origin);
+    Vec3 st = vec3_cross(raster->film_s, raster->film_t);
+    float det = vec3_dot(raster->film_base, st);
+    // Solve q = alpha * (film_base + s * film_s + t * film_t) by Cramer's rule
+    float alpha = vec3_dot(q, st) / det;
+    if (!(alpha > 1e-6f)) {
+        return false;
+    }
+    *s = vec3_dot(raster->film_base, vec3_cross(q, raster->film_t)) / det / alpha;
+    *t = vec3_dot(raster->film_base, vec3_cross(raster->film_s, q)) / det / alpha;
+    return true;
+}
+
+static inline Vec3 edge_function(const Rasterizer* raster, Vec3 n) {
+    return vec3_create(vec3_dot(n, raster->film_base), vec3_dot(n, raster->film_s),
+                       vec3_dot(n, raster->film_t));
+}
+
+// Edge functions and pixel bounds of one triangle; false if it is degenerate
+// or off screen
+static bool raster_setup(const Rasterizer* raster, const Primitive* prim, RasterTriangle* tri) {
+    Vec3 v[3];
+    primitive_vertices(prim, tri->face, v);
+    Vec3 a = vec3_sub(v[0], raster->origin);
+    Vec3 b = vec3_sub(v[1], raster->origin);
+    Vec3 c = vec3_sub(v[2], raster->origin);
+
+    Vec3 n0 = vec3_cross(b, c);
+    Vec3 n1 = vec3_cross(c, a);
+    Vec3 n2 = vec3_cross(a, b);
+    if (vec3_length_squared(vec3_add(vec3_add(n0, n1), n2)) == 0.0f) {
+        return false;
+    }
+    tri->e0 = edge_function(raster, n0);
+    tri->e1 = edge_function(raster, n1);
+    tri->e2 = edge_function(raster, n2);
+    tri->volume = vec3_dot(a, n0);
+
+    // Film bounds; a vertex behind the camera can put the triangle anywhere
+    float s_min = 0.0f, s_max = 1.0f, t_min = 0.0f, t_max = 1.0f;
+    bool projected = true;
+    for (int k = 0; k < 3 && projected; k++) {
+        float s, t;
+        projected = raster_project(raster, v[k], &s, &t);
+        if (projected) {
+            s_min = k == 0 ? s : fminf(s_min, s);
+            s_max = k == 0 ? s : fmaxf(s_max, s);
+            t_min = k == 0 ? t : fminf(t_min, t);
+            t_max = k == 0 ? t : fmaxf(t_max, t);
+        }
+    }
+    if (!projected) {
+        s_min = t_min = 0.0f;
+        s_max = t_max = 1.0f;
+    }
+
+    // Pixel (i, j) samples s in [i, i + 1) / (width - 1) and
+    // t in (1 - (j + 1) / (height - 1), 1 - j / (height - 1)]
+    float w = (float)(raster->width - 1);
+    float h = (float)(raster->height - 1);
+    float x0 = floorf(fmaxf(s_min * w, -1.0f)) - 1.0f;
+    float x1 = floorf(fminf(s_max * w, (float)raster->width));
+    float y0 = floorf(fmaxf((1.0f - t_max) * h, -1.0f)) - 1.0f;
+    float y1 = floorf(fminf((1.0f - t_min) * h, (float)raster->height));
+    if (x1 < 0.0f || y1 < 0.0f || x0 > w || y0 > h) {
+        return false;
+    }
+    tri->x0 = (uint32_t)fmaxf(x0, 0.0f);
+    tri->y0 = (uint32_t)fmaxf(y0, 0.0f);
+    tri->x1 = (uint32_t)fminf(x1, w);
+    tri->y1 = (uint32_t)fminf(y1, h);
+    return true;
+}
+
+Rasterizer* rasterizer_create(const Scene* scene, const Camera* camera,
+                              uint32_t width, uint32_t height) {
+    if (!raster_supported(scene, camera) || width < 2 || height < 2) {
+        fprintf(stderr, "rasterizer_create: scene or camera cannot be rasterized\n");
+        return NULL;
+    }
+
+    Rasterizer* raster = (Rasterizer*)calloc(1, sizeof(Rasterizer));
+    raster->scene = scene;
+    raster->origin = camera->origin;
+    raster->film_base = vec3_sub(camera->lower_left_corner, camera->origin);
+    raster->film_s = camera->horizontal;
+    raster->film_t = camera->vertical;
+    raster->width = width;
+    raster->height = height;
+    raster->tiles_x = (width + RASTER_TILE - 1) / RASTER_TILE;
+    raster->tiles_y = (height + RASTER_TILE - 1) / RASTER_TILE;
+    // Meshes are rasterized face by face
+    uint32_t max_triangles = 0;
+    for (uint32_t i = 0; i < scene->prim_count; i++) {
+        const Primitive* prim = &scene->primitives[i];
+        max_triangles += prim->type == PRIMITIVE_MESH ? prim->mesh->tri_count : 1;
+    }
+    raster->triangles = (RasterTriangle*)malloc(max_triangles * sizeof(RasterTriangle));
+    raster->cast = (uint32_t*)malloc(scene->prim_count * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < scene->prim_count; i++) {
+        const Primitive* prim = &scene->primitives[i];
+        if (prim->type == PRIMITIVE_SPHERE) {
+            raster->cast[raster->cast_count++] = i;
+            continue;
+        }
+        uint32_t faces = prim->type == PRIMITIVE_MESH ? prim->mesh->tri_count : 1;
+        for (uint32_t f = 0; f < faces; f++) {
+            RasterTriangle* tri = &raster->triangles[raster->triangle_count];
+            tri->prim = i;
+            tri->face = f;
+            raster->triangle_count += raster_setup(raster, prim, tri);
+        }
+    }
+
+    // Bin by tile: count, prefix sum, fill
+    uint32_t tile_count = raster->tiles_x * raster->tiles_y;
+    raster->bin_start = (uint32_t*)calloc(tile_count + 1, sizeof(uint32_t));
+    for (uint32_t k = 0; k < raster->triangle_count; k++) {
+        const RasterTriangle* tri = &raster->triangles[k];
+        for (uint32_t ty = tri->y0 / RASTER_TILE; ty <= tri->y1 / RASTER_TILE; ty++) {
+            for (uint32_t tx = tri->x0 / RASTER_TILE; tx <= tri->x1 / RASTER_TILE; tx++) {
+                raster->bin_start[ty * raster->tiles_x + tx + 1]++;
+            }
+        }
+    }
+    for (uint32_t t = 0; t < tile_count; t++) {
+        raster->bin_start[t + 1] += raster->bin_start[t];
+    }
+    raster->bins = (uint32_t*)malloc((raster->bin_start[tile_count] + 1) * sizeof(uint32_t));
+    uint32_t* fill = (uint32_t*)malloc(tile_count * sizeof(uint32_t));
+    for (uint32_t t = 0; t < tile_count; t++) {
+        fill[t] = raster->bin_start[t];
+    }
+    for (uint32_t k = 0; k < raster->triangle_count; k++) {
+        const RasterTriangle* tri = &raster->triangles[k];
+        for (uint32_t ty = tri->y0 / RASTER_TILE; ty <= tri->y1 / RASTER_TILE; ty++) {
+            for (uint32_t tx = tri->x0 / RASTER_TILE; tx <= tri->x1 / RASTER_TILE; tx++) {
+                raster->bins[fill[ty * raster->tiles_x + tx]++] = k;
+            }
+        }
+    }
+    free(fill);
+    return raster;
+}
+
+void rasterizer_destroy(Rasterizer* raster) {
+    if (raster) {
+        free(raster->triangles);
+        free(raster->cast);
+        free(raster->bin_start);
+        free(raster->bins);
+        free(raster);
+    }
+}
+
+void raster_tile(const Rasterizer* raster, uint32_t tile, const float* film_s,
+                 const float* film_t, RasterSample* vis) {
+    uint32_t x0 = (tile % raster->tiles_x) * RASTER_TILE;
+    uint32_t y0 = (tile / raster->tiles_x) * RASTER_TILE;
+    uint32_t x1 = x0 + RASTER_TILE - 1 < raster->width - 1 ? x0 + RASTER_TILE - 1 : raster->width - 1;
+    uint32_t y1 = y0 + RASTER_TILE - 1 < raster->height - 1 ? y0 + RASTER_TILE - 1 : raster->height - 1;
+    float nearest[RASTER_TILE * RASTER_TILE];
+
+    for (uint32_t k = 0; k < RASTER_TILE * RASTER_TILE; k++) {
+        vis[k].prim = RASTER_NO_HIT;
+        nearest[k] = FLT_MAX;
+    }
+
+    for (uint32_t b = raster->bin_start[tile]; b < raster->bin_start[tile + 1]; b++) {
+        const RasterTriangle* tri = &raster->triangles[raster->bins[b]];
+        uint32_t xs = tri->x0 > x0 ? tri->x0 : x0;
+        uint32_t xe = tri->x1 < x1 ? tri->x1 : x1;
+        uint32_t ys = tri->y0 > y0 ? tri->y0 : y0;
+        uint32_t ye = tri->y1 < y1 ? tri->y1 : y1;
+
+        for (uint32_t y = ys; y <= ye; y++) {
+            for (uint32_t x = xs; x <= xe; x++) {
+                uint32_t k = (y - y0) * RASTER_TILE + (x - x0);
+                float s = film_s[k];
+                float t = film_t[k];
+                float w0 = tri->e0.x + s * tri->e0.y + t * tri->e0.z;
+                float w1 = tri->e1.x + s * tri->e1.y + t * tri->e1.z;
+                float w2 = tri->e2.x + s * tri->e2.y + t * tri->e2.z;
+                float sum = w0 + w1 + w2;
+                // Inside when all three weights share the sign of their sum
+                // (either winding), in front when the depth is positive
+                float depth = tri->volume / sum;
+                if (w0 * sum >= 0.0f && w1 * sum >= 0.0f && w2 * sum >= 0.0f &&
+                    depth > 0.0f && depth < nearest[k]) {
+                    nearest[k] = depth;
+                    vis[k].prim = tri->prim;
+                    vis[k].face = tri->face;
+                    vis[k].b1 = w1 / sum;
+                    vis[k].b2 = w2 / sum;
+                }
+            }
+        }
+    }
+
+    // Depth so far is in units of the unnormalized film direction
+    for (uint32_t y = y0; y <= y1; y++) {
+        for (uint32_t x = x0; x <= x1; x++) {
+            uint32_t k = (y - y0) * RASTER_TILE + (x - x0);
+            if (vis[k].prim != RASTER_NO_HIT) {
+                Vec3 d = vec3_add(raster->film_base,
+                                  vec3_add(vec3_scale(raster->film_s, film_s[k]),
+                                           vec3_scale(raster->film_t, film_t[k])));
+                vis[k].depth = nearest[k] * vec3_length(d);
+            }
+        }
+    }
+}
+
+bool raster_primary_hit(const Rasterizer* raster, const Ray* ray, const RasterSample* sample,
+                        HitRecord* rec) {
+    const Scene* scene = raster->scene;
+    float t_max = FLT_MAX;
+    bool hit = false;
+
+    if (sample->prim != RASTER_NO_HIT) {
+        const Primitive* prim = &scene->primitives[sample->prim];
+        bool exact = prim->type == PRIMITIVE_MESH ?
+                     mesh_face_hit(prim->mesh, sample->face, ray, 0.001f, FLT_MAX, rec) :
+                     primitive_hit(prim, ray, 0.001f, FLT_MAX, rec);
+        if (!exact) {
+            // Rounding on an edge, or closer than the ray's t_min
+            return scene_hit(scene, ray, 0.001f, FLT_MAX, rec);
+        }
+        rec->material = &prim->material;
+        rec->prim = prim;
+        hit = true;
+        t_max = rec->t;
+    }
+    for (uint32_t c = 0; c < raster->cast_count; c++) {
+        if (primitive_hit(&scene->primitives[raster->cast[c]], ray, 0.001f, t_max, rec)) {
+            hit = true;
+            t_max = rec->t;
+        }
+    }
+    if (hit) {
+        hit_record_finalize(rec, ray);
+    }
+    return hit;
+}
+
+// Tiles of the screen grid handed out to the threads of render_raster
+typedef struct {
+    const Scene* scene;
+    const Camera* camera;
+    const RenderSettings* settings;
+    Image* output;
+    const Rasterizer* raster;
+    progress_callback_t progress;
+    uint32_t total_pixels;
+    atomic_uint pixels_done;
+    PoolRange tiles;
+} RasterRender;
+
+static void render_raster_thread(void* arg, uint32_t rank) {
+    (void)rank;
+    RasterRender* r = (RasterRender*)arg;
+    const Scene* scene = r->scene;
+    const Camera* camera = r->camera;
+    const RenderSettings* settings = r->settings;
+    Image* output = r->output;
+    const Rasterizer* raster = r->raster;
+    progress_callback_t progress = r->progress;
+    uint32_t width = output->width;
+    uint32_t height = output->height;
+
+    Sampler sampler;
+    sampler_init(&sampler, settings->sampler, settings->samples_per_pixel, settings->seed);
+    uint64_t path_histogram[PATH_LENGTH_BINS] = {0};
+    float film_s[RASTER_TILE * RASTER_TILE];
+    float film_t[RASTER_TILE * RASTER_TILE];
+    RasterSample vis[RASTER_TILE * RASTER_TILE];
+    Vec3 colors[RASTER_TILE * RASTER_TILE];
+
+    uint32_t tile, end;
+    while (pool_range_next(&r->tiles, &tile, &end)) {
+        if (settings->cancel_flag && *settings->cancel_flag) {
+            continue;
+        }
+
+        uint32_t x0 = (tile % raster->tiles_x) * RASTER_TILE;
+        uint32_t y0 = (tile / raster->tiles_x) * RASTER_TILE;
+        uint32_t x1 = x0 + RASTER_TILE < width ? x0 + RASTER_TILE : width;
+        uint32_t y1 = y0 + RASTER_TILE < height ? y0 + RASTER_TILE : height;
+        for (uint32_t k = 0; k < RASTER_TILE * RASTER_TILE; k++) {
+            colors[k] = vec3_create(0, 0, 0);
+        }
+
+        for (uint32_t s = 0; s < settings->samples_per_pixel; s++) {
+            if (settings->cancel_flag && *settings->cancel_flag) {
+                break;
+            }
+
+            // Film positions of this sample, as primary_ray will jitter them
+            for (uint32_t j = y0; j < y1; j++) {
+                for (uint32_t i = x0; i < x1; i++) {
+                    uint32_t k = (j - y0) * RASTER_TILE + (i - x0);
+                    float du, dv;
+                    sampler_start(&sampler, j * width + i, s);
+                    sampler_2d(&sampler, &du, &dv);
+                    film_s[k] = (i + du) / (float)(width - 1);
+                    film_t[k] = 1.0f - (j + dv) / (float)(height - 1);
+                }
+            }
+            raster_tile(raster, tile, film_s, film_t, vis);
+
+            for (uint32_t j = y0; j < y1; j++) {
+                for (uint32_t i = x0; i < x1; i++) {
+                    uint32_t k = (j - y0) * RASTER_TILE + (i - x0);
+                    sampler_start(&sampler, j * width + i, s);
+                    Ray ray = primary_ray(camera, width, height, i, j, &sampler);
+
+                    HitRecord rec;
+                    uint32_t path_length = 0;
+                    Vec3 sample_color;
+                    if (raster_primary_hit(raster, &ray, &vis[k], &rec)) {
+                        sample_color = trace_path(scene, &ray, &rec, &sampler, 0,
+                                                  settings->max_depth, settings->use_nee,
+                                                  NULL, NULL, &path_length);
+                    } else {
+                        sample_color = settings->max_depth > 0 ?
+                                       scene_background(scene, ray.direction) :
+                                       vec3_create(0, 0, 0);
+                    }
+                    colors[k] = vec3_add(colors[k], sample_color);
+                    path_histogram[path_length < PATH_LENGTH_BINS ? path_length
+                                                                  : PATH_LENGTH_BINS - 1]++;
+                }
+            }
+        }
+
+        for (uint32_t j = y0; j < y1; j++) {
+            for (uint32_t i = x0; i < x1; i++) {
+                output->pixels[j * width + i] =
+                    vec3_div(colors[(j - y0) * RASTER_TILE + (i - x0)],
+                             (float)settings->samples_per_pixel);
+            }
+        }
+
+        if (progress) {
+            uint32_t tile_pixels = (x1 - x0) * (y1 - y0);
+            uint32_t current_done = atomic_fetch_add(&r->pixels_done, tile_pixels) + tile_pixels;
+            render_progress((float)current_done / r->total_pixels);
+        }
+    }
+
+    render_merge_path_histogram(path_histogram);
+}
+
+void render_raster(const Scene* scene, const Camera* camera,
+                   const RenderSettings* settings, Image* output) {
+    uint32_t width = output->width;
+    uint32_t height = output->height;
+    Rasterizer* raster = rasterizer_create(scene, camera, width, height);
+    if (!raster) {
+        return;
+    }
+
+    RasterRender r = { scene, camera, settings, output, raster, get_progress_callback(),
+                       width * height, 0, { 0 } };
+    pool_range_init(&r.tiles, raster->tiles_x * raster->tiles_y, 1);
+    pool_run(pool_default(), settings->num_threads, POOL_PRIORITY_NORMAL,
+             render_raster_thread, &r);
+
+    rasterizer_destroy(raster);
+}
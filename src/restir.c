@@ -0,0 +1,375 @@
+#include "pathtracer.h"
+#include "pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+
+// ReSTIR-style direct lighting (reservoir-based spatiotemporal importance
+// resampling). Every progressive pass traces one camera ray per pixel. At
+// diffuse hits RESTIR_CANDIDATES light samples are streamed through a
+// weighted reservoir whose target is the unshadowed contribution; the
+// survivor is checked with a shadow ray and merged with the pixel's reservoir
+// from the previous pass (temporal reuse), then with a few neighbouring
+// pixels' reservoirs (spatial reuse). The final sample is shaded after a
+// second shadow ray, so reused samples never leak light through occluders.
+// Camera hits on non-diffuse materials fall back to the path tracer, and an
+// environment map is sampled directly alongside the reservoirs.
+
+#define RESTIR_CANDIDATES 16
+#define RESTIR_SPATIAL_NEIGHBORS 4
+#define RESTIR_SPATIAL_RADIUS 16.0f
+#define RESTIR_TEMPORAL_M_CAP 20.0f   // History limit, in multiples of fresh candidates
+#define RESTIR_GRAIN 64               // Pixels per task of either stage
+
+// Diffuse camera hit of one pixel
+typedef struct {
+    Vec3 point;
+    Vec3 normal;
+    Vec3 albedo;
+    float depth;         // Camera ray hit distance, < 0 if there is no diffuse hit
+} RestirSurface;
+
+typedef struct {
+    LightSample y;       // Selected light sample
+    float w_sum;         // Sum of resampling weights seen so far
+    float M;             // Number of candidates represented
+    float W;             // Contribution weight of y (acts as 1 / pdf)
+} Reservoir;
+
+// RNG stream for spatial reuse at a pixel in a pass; camera samples and
+// initial candidates use the sampler's
+static inline uint64_t restir_spatial_seed(uint32_t seed, uint32_t pixel, uint32_t pass) {
+    return rng_stream_seed(rng_stream_seed(~(uint64_t)seed) ^ ((uint64_t)pass << 32 | pixel));
+}
+
+static inline float luminance(Vec3 c) {
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+// Unshadowed contribution of light sample y at surface s (area measure)
+static Vec3 restir_contribution(const RestirSurface* s, const LightSample* y) {
+    Vec3 to_light = vec3_sub(y->point, s->point);
+    float dist2 = vec3_length_squared(to_light);
+    if (dist2 <= 0.0f) {
+        return vec3_create(0, 0, 0);
+    }
+    Vec3 wi = vec3_div(to_light, sqrtf(dist2));
+
+    float cos_surface = vec3_dot(s->normal, wi);
+    float cos_light = y->one_sided ? -vec3_dot(y->normal, wi) : fabsf(vec3_dot(y->normal, wi));
+    if (cos_surface <= 0.0f || cos_light <= 0.0f) {
+        return vec3_create(0, 0, 0);
+    }
+
+    // Lambertian BSDF times both cosines over squared distance
+    float geometry = cos_surface * cos_light / ((float)M_PI * dist2);
+    return vec3_scale(vec3_mul(s->albedo, y->emission), geometry);
+}
+
+static inline float restir_target(const RestirSurface* s, const LightSample* y) {
+    return luminance(restir_contribution(s, y));
+}
+
+static bool restir_visible(const Scene* scene, const RestirSurface* s, const LightSample* y) {
+    Vec3 to_light = vec3_sub(y->point, s->point);
+    float dist = vec3_length(to_light);
+    Ray shadow = ray_create(s->point, vec3_div(to_light, dist));
+    HitRecord occluder;
+    return !scene_hit(scene, &shadow, 0.001f, dist * 0.999f, &occluder);
+}
+
+static inline void reservoir_update(Reservoir* r, const LightSample* y, float w, RNG* rng) {
+    r->w_sum += w;
+    r->M += 1.0f;
+    if (w > 0.0f && rng_float(rng) * r->w_sum < w) {
+        r->y = *y;
+    }
+}
+
+static inline void reservoir_finalize(Reservoir* r, const RestirSurface* s) {
+    float target = r->w_sum > 0.0f ? restir_target(s, &r->y) : 0.0f;
+    r->W = target > 0.0f && r->M > 0.0f ? r->w_sum / (r->M * target) : 0.0f;
+}
+
+// Combine reservoirs res[i] built at surfaces surf[i] into one reservoir for
+// surf[0]. Each reused sample is weighted by the generalized balance
+// heuristic M_i p_i(y) / sum_j M_j p_j(y) rather than by its M alone; that
+// stays stable when the target functions of neighbouring surfaces differ a
+// lot (e.g. small lights close to a floor).
+static Reservoir reservoir_combine(const Scene* scene, const Reservoir* const res[],
+                                   const RestirSurface* const surf[], uint32_t count, RNG* rng) {
+    Reservoir out;
+    memset(&out, 0, sizeof(out));
+
+    for (uint32_t i = 0; i < count; i++) {
+        out.M += res[i]->M;
+        if (res[i]->W <= 0.0f) {
+            continue;
+        }
+
+        const LightSample* y = &res[i]->y;
+        float denom = 0.0f;
+        for (uint32_t j = 0; j < count; j++) {
+            denom += res[j]->M * restir_target(surf[j], y);
+        }
+        float mis = denom > 0.0f ? res[i]->M * restir_target(surf[i], y) / denom : 0.0f;
+        float w = mis * restir_target(surf[0], y) * res[i]->W;
+
+        // Reused samples were validated where they came from, not here
+        if (i > 0 && w > 0.0f && !restir_visible(scene, surf[0], y)) {
+            w = 0.0f;
+        }
+
+        out.w_sum += w;
+        if (w > 0.0f && rng_float(rng) * out.w_sum < w) {
+            out.y = *y;
+        }
+    }
+
+    // MIS weights already sum to one, so W is not divided by M
+    float target = out.w_sum > 0.0f ? restir_target(surf[0], &out.y) : 0.0f;
+    out.W = target > 0.0f ? out.w_sum / target : 0.0f;
+    return out;
+}
+
+// Reuse is only valid between surfaces with similar geometry
+static inline bool restir_similar(const RestirSurface* a, const RestirSurface* b) {
+    return b->depth > 0.0f && vec3_dot(a->normal, b->normal) > 0.9f &&
+           fabsf(a->depth - b->depth) < 0.1f * a->depth;
+}
+
+// Buffers and parameters of one pass of render_restir
+typedef struct {
+    const Scene* scene;
+    const Camera* camera;
+    const RenderSettings* settings;
+    uint32_t width, height;
+    uint32_t passes, pass;
+    RestirSurface* surfaces;
+    const RestirSurface* prev_surfaces;
+    Reservoir* initial;
+    Reservoir* reused;
+    const Reservoir* history;
+    Vec3* sums;
+} RestirPass;
+
+static void restir_initial(void* arg, uint32_t begin, uint32_t end) {
+    const RestirPass* job = (const RestirPass*)arg;
+    const Scene* scene = job->scene;
+    const Camera* camera = job->camera;
+    const RenderSettings* settings = job->settings;
+    uint32_t width = job->width;
+    uint32_t height = job->height;
+    uint32_t passes = job->passes;
+    uint32_t pass = job->pass;
+    RestirSurface* surfaces = job->surfaces;
+    const RestirSurface* prev_surfaces = job->prev_surfaces;
+    Reservoir* initial = job->initial;
+    const Reservoir* history = job->history;
+    Vec3* sums = job->sums;
+
+    for (uint32_t p = begin; p < end; p++) {
+        // One camera sample per pass; reservoirs draw from its rng
+        Sampler sampler;
+        sampler_init(&sampler, settings->sampler, passes, settings->seed);
+        sampler_start(&sampler, p, pass);
+        RNG* rng = &sampler.rng;
+
+        uint32_t i = p % width;
+        uint32_t j = p / width;
+        Ray ray = primary_ray(camera, width, height, i, j, &sampler);
+
+        RestirSurface* s = &surfaces[p];
+        Reservoir* r = &initial[p];
+        memset(r, 0, sizeof(Reservoir));
+        s->depth = -1.0f;
+
+        HitRecord rec;
+        if (settings->max_depth == 0) {
+            continue;
+        }
+        if (!scene_hit(scene, &ray, 0.001f, FLT_MAX, &rec)) {
+            sums[p] = vec3_add(sums[p], scene_background(scene, ray.direction));
+            continue;
+        }
+        if (rec.material->type == MATERIAL_EMISSIVE) {
+            sums[p] = vec3_add(sums[p], rec.material->emission);
+            continue;
+        }
+        BSDF bsdf = material_bsdf(rec.material, &rec);
+        if (bsdf.type != BSDF_LAMBERTIAN) {
+            Vec3 color = trace_path(scene, &ray, &rec, &sampler, 0, settings->max_depth,
+                                    true, NULL, NULL, NULL);
+            sums[p] = vec3_add(sums[p], color);
+            continue;
+        }
+
+        s->albedo = bsdf.albedo;
+        s->point = rec.point;
+        s->normal = rec.normal;
+        s->depth = rec.t * vec3_length(ray.direction);
+
+        // The environment is not part of the reservoirs: one importance
+        // sample of it per pass (no BSDF sampling here, so no MIS)
+        Vec3 wi, env_radiance;
+        float env_pdf;
+        float u1, u2;
+        sampler_2d(&sampler, &u1, &u2);
+        if (scene->environment &&
+            envmap_sample(scene->environment, u1, u2, &wi, &env_radiance, &env_pdf) &&
+            vec3_dot(s->normal, wi) > 0.0f) {
+            Ray shadow = ray_create(s->point, wi);
+            HitRecord occluder;
+            if (!scene_hit(scene, &shadow, 0.001f, FLT_MAX, &occluder)) {
+                float f_cos = vec3_dot(s->normal, wi) / (float)M_PI;
+                sums[p] = vec3_add(sums[p], vec3_scale(vec3_mul(s->albedo, env_radiance),
+                                                       f_cos / env_pdf));
+            }
+        }
+
+        // Resampled importance sampling over fresh light candidates
+        for (uint32_t c = 0; c < RESTIR_CANDIDATES; c++) {
+            LightSample ls;
+            if (scene->lights &&
+                light_list_sample(scene->lights, s->point, s->normal, rng_float(rng),
+                                  rng_float(rng), rng_float(rng), &ls)) {
+                reservoir_update(r, &ls, restir_target(s, &ls) / ls.pdf_area, rng);
+            } else {
+                r->M += 1.0f;
+            }
+        }
+        reservoir_finalize(r, s);
+
+        // Occluded samples must not spread to neighbours or later passes
+        if (r->W > 0.0f && !restir_visible(scene, s, &r->y)) {
+            r->w_sum = 0.0f;
+            r->W = 0.0f;
+        }
+
+        if (restir_similar(s, &prev_surfaces[p])) {
+            Reservoir h = history[p];
+            float cap = RESTIR_TEMPORAL_M_CAP * RESTIR_CANDIDATES;
+            if (h.M > cap) {
+                h.M = cap;
+            }
+            const Reservoir* res[2] = { r, &h };
+            const RestirSurface* surf[2] = { s, &prev_surfaces[p] };
+            *r = reservoir_combine(scene, res, surf, 2, rng);
+        }
+    }
+}
+
+static void restir_spatial(void* arg, uint32_t begin, uint32_t end) {
+    const RestirPass* job = (const RestirPass*)arg;
+    const Scene* scene = job->scene;
+    const RenderSettings* settings = job->settings;
+    uint32_t width = job->width;
+    uint32_t height = job->height;
+    uint32_t pass = job->pass;
+    const RestirSurface* surfaces = job->surfaces;
+    const Reservoir* initial = job->initial;
+    Reservoir* reused = job->reused;
+    Vec3* sums = job->sums;
+
+    for (uint32_t p = begin; p < end; p++) {
+        const RestirSurface* s = &surfaces[p];
+        Reservoir r = initial[p];
+
+        if (s->depth > 0.0f) {
+            RNG rng;
+            rng_init(&rng, restir_spatial_seed(settings->seed, p, pass));
+
+            int i = (int)(p % width);
+            int j = (int)(p / width);
+            const Reservoir* res[RESTIR_SPATIAL_NEIGHBORS + 1] = { &initial[p] };
+            const RestirSurface* surf[RESTIR_SPATIAL_NEIGHBORS + 1] = { s };
+            uint32_t count = 1;
+            for (uint32_t k = 0; k < RESTIR_SPATIAL_NEIGHBORS; k++) {
+                float u1 = rng_float(&rng);
+                float u2 = rng_float(&rng);
+                Vec3 offset = vec3_scale(warp_concentric_disk(u1, u2), RESTIR_SPATIAL_RADIUS);
+                int ni = i + (int)offset.x;
+                int nj = j + (int)offset.y;
+                if (ni < 0 || nj < 0 || ni >= (int)width || nj >= (int)height) continue;
+
+                uint32_t np = (uint32_t)nj * width + (uint32_t)ni;
+                if (np == p || !restir_similar(s, &surfaces[np])) continue;
+                res[count] = &initial[np];
+                surf[count] = &surfaces[np];
+                count++;
+            }
+            r = reservoir_combine(scene, res, surf, count, &rng);
+
+            if (r.W > 0.0f) {
+                Vec3 direct = vec3_scale(restir_contribution(s, &r.y), r.W);
+                sums[p] = vec3_add(sums[p], direct);
+            }
+        }
+        reused[p] = r;
+    }
+}
+
+void render_restir(const Scene* scene, const Camera* camera,
+                   const RenderSettings* settings, Image* output) {
+    uint32_t width = output->width;
+    uint32_t height = output->height;
+    uint32_t total_pixels = width * height;
+    uint32_t passes = settings->samples_per_pixel;
+
+    RestirSurface* surfaces = (RestirSurface*)malloc(total_pixels * sizeof(RestirSurface));
+    RestirSurface* prev_surfaces = (RestirSurface*)malloc(total_pixels * sizeof(RestirSurface));
+    Reservoir* initial = (Reservoir*)malloc(total_pixels * sizeof(Reservoir));
+    Reservoir* reused = (Reservoir*)malloc(total_pixels * sizeof(Reservoir));
+    Reservoir* history = (Reservoir*)calloc(total_pixels, sizeof(Reservoir));
+    Vec3* sums = (Vec3*)calloc(total_pixels, sizeof(Vec3));
+
+    for (uint32_t p = 0; p < total_pixels; p++) {
+        prev_surfaces[p].depth = -1.0f;
+    }
+
+    progress_callback_t progress = get_progress_callback();
+    uint32_t passes_done = 0;
+    ThreadPool* pool = pool_default();
+
+    for (uint32_t pass = 0; pass < passes; pass++) {
+        if (settings->cancel_flag && *settings->cancel_flag) {
+            break;
+        }
+
+        RestirPass job = { scene, camera, settings, width, height, passes, pass,
+                           surfaces, prev_surfaces, initial, reused, history, sums };
+
+        // Stage 1: camera rays, initial candidates, visibility, temporal reuse
+        pool_parallel_for(pool, settings->num_threads, POOL_PRIORITY_NORMAL, total_pixels,
+                          RESTIR_GRAIN, restir_initial, &job);
+
+        // Stage 2: spatial reuse and shading
+        pool_parallel_for(pool, settings->num_threads, POOL_PRIORITY_NORMAL, total_pixels,
+                          RESTIR_GRAIN, restir_spatial, &job);
+
+        // This pass becomes the history of the next one
+        Reservoir* tmp_reservoirs = history;
+        history = reused;
+        reused = tmp_reservoirs;
+        RestirSurface* tmp_surfaces = prev_surfaces;
+        prev_surfaces = surfaces;
+        surfaces = tmp_surfaces;
+
+        passes_done++;
+        if (progress) {
+            progress((float)passes_done / passes);
+        }
+    }
+
+    for (uint32_t p = 0; p < total_pixels; p++) {
+        output->pixels[p] = passes_done > 0 ? vec3_div(sums[p], (float)passes_done)
+                                            : vec3_create(0, 0, 0);
+    }
+
+    free(surfaces);
+    free(prev_surfaces);
+    free(initial);
+    free(reused);
+    free(history);
+    free(sums);
+}
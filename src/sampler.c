@@ -0,0 +1,200 @@
+#include "sampler.h"
+
+// Stratified and Sobol values are pure functions of (seed, pixel, sample,
+// dimension): no tables and no per-pixel state, so any thread can produce any
+// sample. Both treat each 1D or 2D request as its own small point set over
+// the samples of the pixel and decorrelate the sets by hashing, rather than
+// using one high-dimensional sequence (Burley, "Practical Hash-based Owen
+// Scrambling", 2020).
+
+// 32-bit integer hash (lowbias32)
+static inline uint32_t sampler_hash(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+// Top 24 bits as a float in [0, 1)
+static inline float sampler_to_float(uint32_t x) {
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+// Seed shared by every value of one dimension of one pixel
+static inline uint32_t sampler_dimension_seed(const Sampler* sampler) {
+    return sampler_hash(sampler->pixel_seed ^ (sampler->dimension * 0x9e3779b9U));
+}
+
+void sampler_init(Sampler* sampler, SamplerType type, uint32_t samples_per_pixel,
+                  uint32_t seed) {
+    sampler->type = type;
+    sampler->samples_per_pixel = samples_per_pixel > 0 ? samples_per_pixel : 1;
+    sampler->seed = sampler_hash(seed);
+    sampler->stream_base = rng_stream_seed(seed);
+    sampler_start(sampler, 0, 0);
+}
+
+void sampler_start(Sampler* sampler, uint32_t pixel, uint32_t sample_index) {
+    sampler->pixel = pixel;
+    sampler->pixel_seed = sampler_hash(sampler->seed ^ sampler_hash(pixel));
+    sampler->sample_index = sample_index;
+    sampler->sample_key = rng_stream_seed(sampler->stream_base ^
+                                          ((uint64_t)pixel << 32 | sample_index));
+    sampler->dimension = 0;
+    // Independent values use sample_key itself; the RNG runs on another stream
+    rng_init(&sampler->rng, rng_stream_seed(~sampler->sample_key));
+}
+
+// ---- Stratified ----
+
+// Element i of a pseudo-random permutation of [0, n) chosen by seed
+// (Kensler, "Correlated Multi-Jittered Sampling", 2013)
+static uint32_t sampler_permute(uint32_t i, uint32_t n, uint32_t seed) {
+    uint32_t w = n - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= seed;
+        i *= 0xe170893dU;
+        i ^= seed >> 16;
+        i ^= (i & w) >> 4;
+        i ^= seed >> 8;
+        i *= 0x0929eb3fU;
+        i ^= seed >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | seed >> 27;
+        i *= 0x6935fa69U;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303U;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3U;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3dfU;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= n);
+    return (i + seed) % n;
+}
+
+// Each block of samples_per_pixel samples visits every stratum once, in an
+// order shuffled per pixel, dimension and block; progressive renders that
+// run past the count start a new block.
+static inline uint32_t stratified_seed(const Sampler* sampler) {
+    uint32_t block = sampler->sample_index / sampler->samples_per_pixel;
+    return sampler_hash(sampler_dimension_seed(sampler) + block);
+}
+
+static float stratified_1d(const Sampler* sampler) {
+    uint32_t n = sampler->samples_per_pixel;
+    uint32_t seed = stratified_seed(sampler);
+    uint32_t i = sampler->sample_index % n;
+    uint32_t stratum = sampler_permute(i, n, seed);
+    float jitter = sampler_to_float(sampler_hash(seed ^ sampler_hash(i)));
+    return fminf((stratum + jitter) / n, 0x1.fffffep-1f);
+}
+
+// An nx by ny grid with nx * ny >= samples_per_pixel; when the count is not a
+// square some cells stay empty
+static void stratified_2d(const Sampler* sampler, float* u1, float* u2) {
+    uint32_t n = sampler->samples_per_pixel;
+    uint32_t nx = (uint32_t)sqrtf((float)n);
+    nx = nx > 0 ? nx : 1;
+    uint32_t ny = (n + nx - 1) / nx;
+    uint32_t seed = stratified_seed(sampler);
+    uint32_t i = sampler->sample_index % n;
+    uint32_t cell = sampler_permute(i, nx * ny, seed);
+    uint32_t h = sampler_hash(seed ^ sampler_hash(i));
+    *u1 = fminf((cell % nx + sampler_to_float(h)) / nx, 0x1.fffffep-1f);
+    *u2 = fminf((cell / nx + sampler_to_float(sampler_hash(h))) / ny, 0x1.fffffep-1f);
+}
+
+// ---- Owen-scrambled Sobol ----
+
+static inline uint32_t reverse_bits(uint32_t x) {
+    x = __builtin_bswap32(x);
+    x = ((x & 0x0f0f0f0fU) << 4) | ((x & 0xf0f0f0f0U) >> 4);
+    x = ((x & 0x33333333U) << 2) | ((x & 0xccccccccU) >> 2);
+    x = ((x & 0x55555555U) << 1) | ((x & 0xaaaaaaaaU) >> 1);
+    return x;
+}
+
+// Random permutation of bit-reversed x in which each bit flips depending only
+// on the bits below it (Laine and Karras, "Stratified Sampling for Stochastic
+// Transparency", 2011)
+static inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cU;
+    x ^= x * 0xb82f1e52U;
+    x ^= x * 0xc7afe638U;
+    x ^= x * 0x8d22f6e6U;
+    return x;
+}
+
+// Owen scrambling: flip each bit depending on all the bits above it
+static inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// The first two Sobol dimensions are van der Corput (the bit-reversed index)
+// and its (0,2) partner. The second one's generator matrix is Pascal's
+// triangle mod 2, so index bit i reaches output bit j (counted from the top)
+// when j's bits are a subset of i's (Lucas' theorem); a superset sum over the
+// five bit-position bits builds it without a loop. Both are returned
+// bit-reversed, which is what nested_uniform_scramble works on.
+static inline uint32_t sobol_0_reversed(uint32_t index) {
+    return index;
+}
+
+static inline uint32_t sobol_1_reversed(uint32_t index) {
+    uint32_t x = index;
+    x ^= (x >> 1) & 0x55555555U;
+    x ^= (x >> 2) & 0x33333333U;
+    x ^= (x >> 4) & 0x0f0f0f0fU;
+    x ^= (x >> 8) & 0x00ff00ffU;
+    x ^= (x >> 16) & 0x0000ffffU;
+    return x;
+}
+
+// Scrambling the sample index shuffles the order per pixel and dimension
+// while keeping every power-of-two prefix well distributed; scrambling the
+// values decorrelates dimensions and pixels. The bit reversals around
+// nested_uniform_scramble are folded into the Sobol dimensions.
+static inline uint32_t sobol_shuffled_index(const Sampler* sampler, uint32_t seed) {
+    return nested_uniform_scramble(sampler->sample_index, seed);
+}
+
+static float sobol_1d(const Sampler* sampler) {
+    uint32_t seed = sampler_dimension_seed(sampler);
+    uint32_t index = sobol_shuffled_index(sampler, seed);
+    uint32_t x = laine_karras_permutation(sobol_0_reversed(index),
+                                          sampler_hash(seed ^ 0x1b873593U));
+    return sampler_to_float(reverse_bits(x));
+}
+
+static void sobol_2d(const Sampler* sampler, float* u1, float* u2) {
+    uint32_t seed = sampler_dimension_seed(sampler);
+    uint32_t index = sobol_shuffled_index(sampler, seed);
+    uint32_t x = laine_karras_permutation(sobol_0_reversed(index),
+                                          sampler_hash(seed ^ 0x1b873593U));
+    uint32_t y = laine_karras_permutation(sobol_1_reversed(index),
+                                          sampler_hash(seed ^ 0xcc9e2d51U));
+    *u1 = sampler_to_float(reverse_bits(x));
+    *u2 = sampler_to_float(reverse_bits(y));
+}
+
+float sampler_hashed_1d(const Sampler* sampler) {
+    return sampler->type == SAMPLER_SOBOL ? sobol_1d(sampler) : stratified_1d(sampler);
+}
+
+void sampler_hashed_2d(const Sampler* sampler, float* u1, float* u2) {
+    if (sampler->type == SAMPLER_SOBOL) {
+        sobol_2d(sampler, u1, u2);
+    } else {
+        stratified_2d(sampler, u1, u2);
+    }
+}
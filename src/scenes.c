@@ -1,6 +1,7 @@
 #include "scenes.h"
 #include "random.h"
 #include <math.h>
+#include <stdlib.h>
 
 // Create Cornell Box scene
 Scene* create_cornell_box(void) {
@@ -342,4 +343,74 @@ Scene* create_material_blend(void) {
     scene->ambient_light = vec3_create(0.3f, 0.35f, 0.4f);
 
     return scene;
-}
\ No newline at end of file
+}
+// Create an empty stage for meshes: ground and an area light above the origin
+Scene* create_mesh_stage(void) {
+    Scene* scene = scene_create();
+
+    Material ground = material_lambertian(vec3_create(0.5f, 0.5f, 0.5f));
+    Material light = material_emissive(vec3_scale(vec3_create(1.0f, 0.95f, 0.9f), 12.0f));
+
+    // Ground quad
+    float g = 20.0f;
+    scene_add_triangle(scene,
+        vec3_create(-g, 0, -g), vec3_create(-g, 0, g), vec3_create(g, 0, g), ground);
+    scene_add_triangle(scene,
+        vec3_create(-g, 0, -g), vec3_create(g, 0, g), vec3_create(g, 0, -g), ground);
+
+    // Area light facing down
+    float l = 1.0f, h = 4.0f;
+    scene_add_triangle(scene,
+        vec3_create(-l, h, -l), vec3_create(l, h, l), vec3_create(-l, h, l), light);
+    scene_add_triangle(scene,
+        vec3_create(-l, h, -l), vec3_create(l, h, -l), vec3_create(l, h, l), light);
+
+    scene->ambient_light = vec3_create(0.05f, 0.05f, 0.06f);
+
+    return scene;
+}
+
+// Create mesh showcase scene: a smooth-shaded torus stored as a compact mesh
+Scene* create_mesh_showcase(void) {
+    Scene* scene = create_mesh_stage();
+
+    const uint32_t rings = 96, sides = 48;
+    const float major = 0.8f, minor = 0.3f;
+    uint32_t vertex_count = rings * sides;
+    Vec3* positions = (Vec3*)malloc(vertex_count * sizeof(Vec3));
+    Vec3* normals = (Vec3*)malloc(vertex_count * sizeof(Vec3));
+    uint32_t* indices = (uint32_t*)malloc(6 * vertex_count * sizeof(uint32_t));
+
+    // Lying on the ground around the y axis
+    for (uint32_t i = 0; i < rings; i++) {
+        float theta = 2.0f * (float)M_PI * i / rings;
+        for (uint32_t j = 0; j < sides; j++) {
+            float phi = 2.0f * (float)M_PI * j / sides;
+            Vec3 n = vec3_create(cosf(phi) * cosf(theta), sinf(phi), cosf(phi) * sinf(theta));
+            Vec3 center = vec3_create(major * cosf(theta), minor, major * sinf(theta));
+            positions[i * sides + j] = vec3_add(center, vec3_scale(n, minor));
+            normals[i * sides + j] = n;
+        }
+    }
+
+    uint32_t* idx = indices;
+    for (uint32_t i = 0; i < rings; i++) {
+        uint32_t i1 = (i + 1) % rings;
+        for (uint32_t j = 0; j < sides; j++) {
+            uint32_t j1 = (j + 1) % sides;
+            uint32_t a = i * sides + j, b = i1 * sides + j;
+            uint32_t c = i1 * sides + j1, d = i * sides + j1;
+            *idx++ = a; *idx++ = d; *idx++ = c;
+            *idx++ = a; *idx++ = c; *idx++ = b;
+        }
+    }
+
+    Material gold = material_metal(vec3_create(1.0f, 0.85f, 0.57f), 0.15f);
+    scene_add_mesh(scene, positions, normals, vertex_count, indices, 2 * vertex_count, gold, true);
+
+    free(positions);
+    free(normals);
+    free(indices);
+
+    return scene;
+}
@@ -0,0 +1,86 @@
+#include "tiles.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+void hilbert_point(uint32_t n, uint32_t d, uint32_t* x, uint32_t* y) {
+    uint32_t rx, ry;
+    *x = *y = 0;
+    for (uint32_t s = 1; s < n; s *= 2) {
+        rx = 1 & (d / 2);
+        ry = 1 & (d ^ rx);
+        // Rotate the quadrant so the curve enters and leaves it at the right corners
+        if (ry == 0) {
+            if (rx == 1) {
+                *x = s - 1 - *x;
+                *y = s - 1 - *y;
+            }
+            uint32_t t = *x;
+            *x = *y;
+            *y = t;
+        }
+        *x += s * rx;
+        *y += s * ry;
+        d /= 4;
+    }
+}
+
+static inline uint32_t next_power_of_two(uint32_t v) {
+    uint32_t n = 1;
+    while (n < v) {
+        n *= 2;
+    }
+    return n;
+}
+
+TileOrder* tile_order_create(uint32_t width, uint32_t height, uint32_t tile_size) {
+    if (tile_size == 0) {
+        tile_size = RENDER_TILE_SIZE;
+    }
+    uint32_t tiles_x = (width + tile_size - 1) / tile_size;
+    uint32_t tiles_y = (height + tile_size - 1) / tile_size;
+
+    TileOrder* order = (TileOrder*)calloc(1, sizeof(TileOrder));
+    if (order) {
+        order->pixels = (uint32_t*)malloc((size_t)width * height * sizeof(uint32_t));
+        order->tile_start = (uint32_t*)malloc(((size_t)tiles_x * tiles_y + 1) * sizeof(uint32_t));
+    }
+    if (!order || !order->pixels || !order->tile_start) {
+        fprintf(stderr, "tile_order_create: out of memory\n");
+        tile_order_destroy(order);
+        return NULL;
+    }
+
+    uint32_t grid = next_power_of_two(tiles_x > tiles_y ? tiles_x : tiles_y);
+    uint32_t cells = next_power_of_two(tile_size);
+    uint32_t count = 0;
+
+    for (uint32_t d = 0; d < grid * grid; d++) {
+        uint32_t tx, ty;
+        hilbert_point(grid, d, &tx, &ty);
+        if (tx >= tiles_x || ty >= tiles_y) {
+            continue;
+        }
+        order->tile_start[order->tile_count++] = count;
+
+        uint32_t x0 = tx * tile_size;
+        uint32_t y0 = ty * tile_size;
+        for (uint32_t e = 0; e < cells * cells; e++) {
+            uint32_t px, py;
+            hilbert_point(cells, e, &px, &py);
+            if (px >= tile_size || py >= tile_size || x0 + px >= width || y0 + py >= height) {
+                continue;
+            }
+            order->pixels[count++] = (y0 + py) * width + x0 + px;
+        }
+    }
+    order->tile_start[order->tile_count] = count;
+    return order;
+}
+
+void tile_order_destroy(TileOrder* order) {
+    if (order) {
+        free(order->pixels);
+        free(order->tile_start);
+        free(order);
+    }
+}
@@ -0,0 +1,345 @@
+#include "pathtracer.h"
+#include "pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+
+// Wavefront path tracing.
+// Instead of following one sample depth-first, each thread keeps a batch of
+// paths in SoA form and runs every path through one stage at a time:
+//   generate -> extend (closest hit) -> sort by material -> draw -> shade -> compact
+// Each stage runs a tight loop over the whole batch, so the code and data it
+// touches stay hot in cache.
+
+#define WAVEFRONT_BATCH 4096
+#define MATERIAL_TYPE_COUNT (MATERIAL_BLEND + 1)
+
+// Random values per path and bounce: a BounceSamples, then Russian roulette
+#define WAVEFRONT_DIMENSIONS (PATH_BOUNCE_DIMENSIONS + 1)
+
+typedef struct {
+    // Current ray per path
+    float ox[WAVEFRONT_BATCH], oy[WAVEFRONT_BATCH], oz[WAVEFRONT_BATCH];
+    float dx[WAVEFRONT_BATCH], dy[WAVEFRONT_BATCH], dz[WAVEFRONT_BATCH];
+
+    // Path throughput and accumulated radiance
+    float tr[WAVEFRONT_BATCH], tg[WAVEFRONT_BATCH], tb[WAVEFRONT_BATCH];
+    float lr[WAVEFRONT_BATCH], lg[WAVEFRONT_BATCH], lb[WAVEFRONT_BATCH];
+
+    // Solid-angle pdf and shading normal of the last diffuse bounce (for MIS)
+    float bsdf_pdf[WAVEFRONT_BATCH];
+    float nx[WAVEFRONT_BATCH], ny[WAVEFRONT_BATCH], nz[WAVEFRONT_BATCH];
+
+    // Pixel (relative to the batch's first pixel) each path belongs to
+    uint32_t pixel[WAVEFRONT_BATCH];
+
+    // Random stream of each path, keyed by its pixel and sample; path k is
+    // lane k % RNG_BATCH_LANES of rng[k / RNG_BATCH_LANES]
+    RNGBatch rng[WAVEFRONT_BATCH / RNG_BATCH_LANES];
+
+    // This bounce's random values, one row per dimension
+    float u[WAVEFRONT_DIMENSIONS][WAVEFRONT_BATCH];
+
+    // Closest hit of the current extension ray
+    HitRecord hits[WAVEFRONT_BATCH];
+
+    // Indices of live paths, and the same indices grouped by material
+    uint32_t active[WAVEFRONT_BATCH];
+    uint32_t sorted[WAVEFRONT_BATCH];
+    bool alive[WAVEFRONT_BATCH];
+    uint32_t count;          // Paths generated in this batch
+    uint32_t active_count;
+} WavefrontBatch;
+
+static inline Ray wavefront_ray(const WavefrontBatch* b, uint32_t k) {
+    Ray r;
+    r.origin = vec3_create(b->ox[k], b->oy[k], b->oz[k]);
+    r.direction = vec3_create(b->dx[k], b->dy[k], b->dz[k]);
+    return r;
+}
+
+static inline void wavefront_set_ray(WavefrontBatch* b, uint32_t k, const Ray* r) {
+    b->ox[k] = r->origin.x;    b->oy[k] = r->origin.y;    b->oz[k] = r->origin.z;
+    b->dx[k] = r->direction.x; b->dy[k] = r->direction.y; b->dz[k] = r->direction.z;
+}
+
+static inline void wavefront_add_radiance(WavefrontBatch* b, uint32_t k, Vec3 emitted) {
+    b->lr[k] += b->tr[k] * emitted.x;
+    b->lg[k] += b->tg[k] * emitted.y;
+    b->lb[k] += b->tb[k] * emitted.z;
+}
+
+// Stage 1: camera rays for samples [first_sample, first_sample + samples) of
+// pixels [first_pixel, first_pixel + pixels)
+static void wavefront_generate(WavefrontBatch* b, const Camera* camera, const Image* output,
+                               uint32_t first_pixel, uint32_t pixels, uint32_t first_sample,
+                               uint32_t samples, Sampler* sampler) {
+    uint32_t k = 0;
+    for (uint32_t p = 0; p < pixels; p++) {
+        uint32_t pixel_idx = first_pixel + p;
+        uint32_t i = pixel_idx % output->width;
+        uint32_t j = pixel_idx / output->width;
+
+        for (uint32_t s = 0; s < samples; s++, k++) {
+            sampler_start(sampler, pixel_idx, first_sample + s);
+            Ray ray = primary_ray(camera, output->width, output->height, i, j, sampler);
+            rng_batch_seed(&b->rng[k / RNG_BATCH_LANES], k % RNG_BATCH_LANES,
+                           ~sampler->sample_key);
+
+            wavefront_set_ray(b, k, &ray);
+            b->tr[k] = b->tg[k] = b->tb[k] = 1.0f;
+            b->lr[k] = b->lg[k] = b->lb[k] = 0.0f;
+            b->bsdf_pdf[k] = 0.0f;
+            b->pixel[k] = p;
+            b->active[k] = k;
+        }
+    }
+    b->count = k;
+    b->active_count = k;
+}
+
+// Path length histogram bin for a path that ended after the given bounces
+static inline uint32_t wavefront_length_bin(uint32_t bounces) {
+    return bounces < PATH_LENGTH_BINS ? bounces : PATH_LENGTH_BINS - 1;
+}
+
+// Stage 2: closest hit for every live path; misses and lights finish here
+static void wavefront_extend(WavefrontBatch* b, const Scene* scene, uint32_t depth,
+                             bool use_nee, uint64_t histogram[PATH_LENGTH_BINS]) {
+    for (uint32_t a = 0; a < b->active_count; a++) {
+        uint32_t k = b->active[a];
+        Ray ray = wavefront_ray(b, k);
+        HitRecord* rec = &b->hits[k];
+
+        if (!scene_hit(scene, &ray, 0.001f, FLT_MAX, rec)) {
+            float weight = use_nee ? environment_mis_weight(scene, &ray, b->bsdf_pdf[k]) : 1.0f;
+            wavefront_add_radiance(b, k, vec3_scale(scene_background(scene, ray.direction), weight));
+            b->alive[k] = false;
+            histogram[wavefront_length_bin(depth)]++;
+        } else if (rec->material->type == MATERIAL_EMISSIVE) {
+            Vec3 prev_normal = vec3_create(b->nx[k], b->ny[k], b->nz[k]);
+            float weight = use_nee ? emitter_mis_weight(scene, &ray, rec, b->bsdf_pdf[k], prev_normal)
+                                   : 1.0f;
+            wavefront_add_radiance(b, k, vec3_scale(rec->material->emission, weight));
+            b->alive[k] = false;
+            histogram[wavefront_length_bin(depth)]++;
+        } else {
+            b->alive[k] = true;
+        }
+    }
+}
+
+// Stage 3: counting sort of the surviving paths by material type
+static uint32_t wavefront_sort(WavefrontBatch* b) {
+    uint32_t offsets[MATERIAL_TYPE_COUNT + 1] = {0};
+
+    for (uint32_t a = 0; a < b->active_count; a++) {
+        uint32_t k = b->active[a];
+        if (b->alive[k]) {
+            offsets[b->hits[k].material->type + 1]++;
+        }
+    }
+    for (uint32_t t = 0; t < MATERIAL_TYPE_COUNT; t++) {
+        offsets[t + 1] += offsets[t];
+    }
+
+    uint32_t shade_count = offsets[MATERIAL_TYPE_COUNT];
+    for (uint32_t a = 0; a < b->active_count; a++) {
+        uint32_t k = b->active[a];
+        if (b->alive[k]) {
+            b->sorted[offsets[b->hits[k].material->type]++] = k;
+        }
+    }
+    return shade_count;
+}
+
+// Stage 4: the random values of this bounce, a group of lanes at a time for
+// every group that still holds a live path. The other lanes of such a group
+// draw too; whatever they are, a live path always gets the next values of
+// its own stream.
+static void wavefront_draw(WavefrontBatch* b) {
+    uint32_t last = UINT32_MAX;
+    for (uint32_t a = 0; a < b->active_count; a++) {
+        uint32_t g = b->active[a] / RNG_BATCH_LANES;
+        if (g == last) {
+            continue;
+        }
+        last = g;
+        for (uint32_t d = 0; d < WAVEFRONT_DIMENSIONS; d++) {
+            rng_batch_floats(&b->rng[g], &b->u[d][g * RNG_BATCH_LANES]);
+        }
+    }
+}
+
+// Stage 5: direct lighting, scatter, update throughput and apply Russian roulette
+static void wavefront_shade(WavefrontBatch* b, const Scene* scene, uint32_t shade_count,
+                            uint32_t depth, bool use_nee,
+                            uint64_t histogram[PATH_LENGTH_BINS]) {
+    for (uint32_t a = 0; a < shade_count; a++) {
+        uint32_t k = b->sorted[a];
+        BounceSamples u;
+        u.light_select = b->u[0][k];
+        u.light[0] = b->u[1][k];
+        u.light[1] = b->u[2][k];
+        u.env[0] = b->u[3][k];
+        u.env[1] = b->u[4][k];
+        u.lobe = b->u[5][k];
+        u.bsdf[0] = b->u[6][k];
+        u.bsdf[1] = b->u[7][k];
+        const HitRecord* rec = &b->hits[k];
+        Ray ray = wavefront_ray(b, k);
+        Vec3 attenuation;
+        Vec3 wi;
+        float pdf;
+
+        BSDF bsdf = material_bsdf(rec->material, rec);
+        Vec3 wo = vec3_scale(vec3_normalize(ray.direction), -1.0f);
+        if (use_nee && !bsdf_is_delta(&bsdf)) {
+            wavefront_add_radiance(b, k, sample_direct_light(scene, rec, &bsdf, wo, &u));
+        }
+
+        if (!bsdf_sample(&bsdf, wo, u.lobe, u.bsdf[0], u.bsdf[1], &wi, &attenuation, &pdf)) {
+            b->alive[k] = false;
+            histogram[wavefront_length_bin(depth)]++;
+            continue;
+        }
+        Ray scattered = ray_create(rec->point, wi);
+
+        Vec3 throughput = vec3_mul(vec3_create(b->tr[k], b->tg[k], b->tb[k]), attenuation);
+        if (depth + 1 >= RUSSIAN_ROULETTE_DEPTH &&
+            !path_russian_roulette(&throughput, b->u[PATH_BOUNCE_DIMENSIONS][k])) {
+            b->alive[k] = false;
+            histogram[wavefront_length_bin(depth + 1)]++;
+            continue;
+        }
+
+        b->tr[k] = throughput.x;
+        b->tg[k] = throughput.y;
+        b->tb[k] = throughput.z;
+        b->bsdf_pdf[k] = pdf;
+        b->nx[k] = rec->normal.x;
+        b->ny[k] = rec->normal.y;
+        b->nz[k] = rec->normal.z;
+        wavefront_set_ray(b, k, &scattered);
+    }
+}
+
+// Stage 6: drop finished paths from the active list (order preserved)
+static void wavefront_compact(WavefrontBatch* b) {
+    uint32_t live = 0;
+    for (uint32_t a = 0; a < b->active_count; a++) {
+        uint32_t k = b->active[a];
+        if (b->alive[k]) {
+            b->active[live++] = k;
+        }
+    }
+    b->active_count = live;
+}
+
+typedef struct {
+    const Scene* scene;
+    const Camera* camera;
+    const RenderSettings* settings;
+    Image* output;
+    progress_callback_t progress;
+    uint32_t spp;
+    uint32_t pixels_per_batch;
+    uint32_t samples_per_pass;
+    bool use_nee;
+    atomic_uint pixels_done;
+    PoolRange batches;
+} WavefrontRender;
+
+static void render_wavefront_thread(void* arg, uint32_t rank) {
+    (void)rank;
+    WavefrontRender* r = (WavefrontRender*)arg;
+    const Scene* scene = r->scene;
+    const Camera* camera = r->camera;
+    const RenderSettings* settings = r->settings;
+    Image* output = r->output;
+    progress_callback_t progress = r->progress;
+    uint32_t total_pixels = output->width * output->height;
+    uint32_t spp = r->spp;
+    uint32_t pixels_per_batch = r->pixels_per_batch;
+    uint32_t samples_per_pass = r->samples_per_pass;
+    bool use_nee = r->use_nee;
+
+    Sampler sampler;
+    sampler_init(&sampler, settings->sampler, spp, settings->seed);
+
+    WavefrontBatch* b = (WavefrontBatch*)malloc(sizeof(WavefrontBatch));
+    Vec3* sums = (Vec3*)malloc(pixels_per_batch * sizeof(Vec3));
+    uint64_t path_histogram[PATH_LENGTH_BINS] = {0};
+
+    uint32_t batch, end;
+    while (pool_range_next(&r->batches, &batch, &end)) {
+        if (settings->cancel_flag && *settings->cancel_flag) {
+            continue;
+        }
+
+        uint32_t first_pixel = batch * pixels_per_batch;
+        uint32_t pixels = total_pixels - first_pixel < pixels_per_batch ?
+                          total_pixels - first_pixel : pixels_per_batch;
+
+        for (uint32_t p = 0; p < pixels; p++) {
+            sums[p] = vec3_create(0, 0, 0);
+        }
+
+        for (uint32_t first_sample = 0; first_sample < spp; first_sample += samples_per_pass) {
+            uint32_t samples = spp - first_sample < samples_per_pass ?
+                               spp - first_sample : samples_per_pass;
+
+            wavefront_generate(b, camera, output, first_pixel, pixels, first_sample, samples,
+                               &sampler);
+
+            uint32_t depth = 0;
+            for (; depth < settings->max_depth && b->active_count > 0; depth++) {
+                wavefront_extend(b, scene, depth, use_nee, path_histogram);
+                uint32_t shade_count = wavefront_sort(b);
+                wavefront_draw(b);
+                wavefront_shade(b, scene, shade_count, depth, use_nee, path_histogram);
+                wavefront_compact(b);
+            }
+            // Paths still alive were cut off at max_depth
+            path_histogram[wavefront_length_bin(depth)] += b->active_count;
+
+            for (uint32_t k = 0; k < b->count; k++) {
+                Vec3* sum = &sums[b->pixel[k]];
+                *sum = vec3_add(*sum, vec3_create(b->lr[k], b->lg[k], b->lb[k]));
+            }
+        }
+
+        for (uint32_t p = 0; p < pixels; p++) {
+            output->pixels[first_pixel + p] = vec3_div(sums[p], (float)spp);
+        }
+
+        if (progress) {
+            uint32_t current_done = atomic_fetch_add(&r->pixels_done, pixels) + pixels;
+            render_progress((float)current_done / total_pixels);
+        }
+    }
+
+    render_merge_path_histogram(path_histogram);
+    free(sums);
+    free(b);
+}
+
+void render_wavefront(const Scene* scene, const Camera* camera,
+                      const RenderSettings* settings, Image* output) {
+    uint32_t total_pixels = output->width * output->height;
+    uint32_t spp = settings->samples_per_pixel > 0 ? settings->samples_per_pixel : 1;
+
+    // Whole pixels per batch; very high spp is split into several passes
+    uint32_t pixels_per_batch = spp < WAVEFRONT_BATCH ? WAVEFRONT_BATCH / spp : 1;
+    uint32_t samples_per_pass = spp < WAVEFRONT_BATCH ? spp : WAVEFRONT_BATCH;
+    uint32_t batch_count = (total_pixels + pixels_per_batch - 1) / pixels_per_batch;
+
+    progress_callback_t progress = get_progress_callback();
+    bool use_nee = settings->use_nee && scene_has_direct_lights(scene);
+
+    WavefrontRender r = { scene, camera, settings, output, progress, spp, pixels_per_batch,
+                          samples_per_pass, use_nee, 0, { 0 } };
+    pool_range_init(&r.batches, batch_count, 1);
+    pool_run(pool_default(), settings->num_threads, POOL_PRIORITY_NORMAL,
+             render_wavefront_thread, &r);
+}